@@ -12,11 +12,18 @@
 
 namespace FallbackLayer
 {
+    using namespace DirectX;
+
+#define AABB_Min_Padding 0.001f
+
     struct BVH
     {
         std::vector<AABBNode>   m_nodes;
         std::vector<float> m_triangles;
         std::vector<PrimitiveMetaData> m_metadata;
+
+        // Peak size of the temporary allocations of the build
+        UINT64 m_scratchSize;
     };
 
     static
@@ -40,13 +47,42 @@ namespace FallbackLayer
         return v & 0x00ffffff;
     }
 
+    //
+    // Primitive bounds as separate min, max and centroid arrays, so the builder can
+    // load any one of them as a whole vector
+    //
+    struct PrimitiveBounds
+    {
+        std::vector<XMFLOAT4A> boxMin;      // w is unused
+        std::vector<XMFLOAT4A> boxMax;
+        std::vector<XMFLOAT4A> centroid;
+
+        float GetCentroid(UINT32 primitive, UINT32 dimension) const
+        {
+            return (&centroid[primitive].x)[dimension];
+        }
+
+        void SetBox(UINT32 primitive, FXMVECTOR primitiveMin, FXMVECTOR primitiveMax)
+        {
+            XMStoreFloat4A(&boxMin[primitive], primitiveMin);
+            XMStoreFloat4A(&boxMax[primitive], primitiveMax);
+            XMStoreFloat4A(&centroid[primitive], XMVectorMultiply(XMVectorAdd(primitiveMax, primitiveMin), g_XMOneHalf));
+        }
+
+        size_t GetCapacityInBytes() const
+        {
+            return (boxMin.capacity() + boxMax.capacity() + centroid.capacity()) * sizeof(XMFLOAT4A);
+        }
+    };
+
     static
         void ComputeBox(
             AABB& overallBox,
-            const std::vector<AABB>& boxes,
-            const std::vector<PrimitiveMetaData>& metadata)
+            const PrimitiveBounds& bounds,
+            const UINT32* pPrimitiveIndices,
+            UINT32 numTris)
     {
-        if (metadata.empty())
+        if (numTris == 0)
         {
             overallBox.max.x = overallBox.min.x = 0;
             overallBox.max.y = overallBox.min.y = 0;
@@ -54,17 +90,20 @@ namespace FallbackLayer
             return;
         }
 
-        overallBox = boxes[metadata[0].PrimitiveIndex];
+        XMVECTOR boxMin = XMLoadFloat4A(&bounds.boxMin[pPrimitiveIndices[0]]);
+        XMVECTOR boxMax = XMLoadFloat4A(&bounds.boxMax[pPrimitiveIndices[0]]);
 
-        const UINT32 numTris = (UINT32)metadata.size();
         for (UINT32 i = 1; i < numTris; ++i)
         {
-            const UINT32 triId = metadata[i].PrimitiveIndex;
-            assert(triId < boxes.size());
-            const AABB& newBox = boxes[triId];
+            const UINT32 triId = pPrimitiveIndices[i];
+            assert(triId < bounds.boxMin.size());
 
-            AddExtentToBox(overallBox, newBox);
+            boxMin = XMVectorMin(boxMin, XMLoadFloat4A(&bounds.boxMin[triId]));
+            boxMax = XMVectorMax(boxMax, XMLoadFloat4A(&bounds.boxMax[triId]));
         }
+
+        XMStoreFloat3((XMFLOAT3*)overallBox.minArr, boxMin);
+        XMStoreFloat3((XMFLOAT3*)overallBox.maxArr, boxMax);
     }
 
     //
@@ -117,14 +156,15 @@ namespace FallbackLayer
     }
 
     static
-        UINT32 BuildBVHAddNode(
+        void BuildBVHAddNode(
             BVH& bvh,
+            UINT32 nodeIndex,
             const AABB& box,
             UINT32 maxDimension)
     {
         UNREFERENCED_PARAMETER(maxDimension);
         assert(maxDimension < 3);
-        const UINT32 nodeIndex = (UINT32)bvh.m_nodes.size();
+        assert(nodeIndex < bvh.m_nodes.size());
 
         float cX = (box.max.x + box.min.x) * 0.5f;
         float cY = (box.max.y + box.min.y) * 0.5f;
@@ -137,7 +177,7 @@ namespace FallbackLayer
         float dY = max(box.max.y - cY, cY - box.min.y);
         float dZ = max(box.max.z - cZ, cZ - box.min.z);
 
-        AABBNode packedBox;
+        AABBNode& packedBox = bvh.m_nodes[nodeIndex];
         packedBox.center[0] = cX;
         packedBox.center[1] = cY;
         packedBox.center[2] = cZ;
@@ -146,210 +186,254 @@ namespace FallbackLayer
         packedBox.halfDim[2] = dZ;
         packedBox.nodeAllBits = 0;
 
-        bvh.m_nodes.push_back(packedBox);
-
-        assert(bvh.m_nodes.size() - 1 == nodeIndex);
-
         bvh.m_nodes[nodeIndex].internalNode.separatingAxis = 0;
-
-        return nodeIndex;
     }
 
+    //
+    // Leaves reference their range of the partitioned primitive array directly
+    //
+
     static
-        UINT32 BuildBVHAddLeaf(
+        void BuildBVHAddLeaf(
             BVH& bvh,
+            UINT32 nodeIndex,
             const AABB& box,
-            const std::vector<PrimitiveMetaData>& metadata)
+            UINT32 firstTriangleId,
+            UINT32 numTris)
     {
-        const UINT32 nodeIndex = BuildBVHAddNode(bvh, box, 0);
+        BuildBVHAddNode(bvh, nodeIndex, box, 0);
 
         bvh.m_nodes[nodeIndex].nodeAllBits = 0;
         bvh.m_nodes[nodeIndex].leaf = true;
 
-        const UINT32 idIndex = (UINT32)bvh.m_metadata.size();
-
-        std::copy(metadata.begin(), metadata.end(), std::back_inserter(bvh.m_metadata));
+        assert(numTris < 128);
+        assert(firstTriangleId < (1 << 24));
 
-        assert(metadata.size() < 128);
-        assert(idIndex < (1 << 24));
+        bvh.m_nodes[nodeIndex].leafNode.firstTriangleId = firstTriangleId;
+        bvh.m_nodes[nodeIndex].leafNode.numTriangleIds = numTris;
+        bvh.m_nodes[nodeIndex].numTriangles = numTris;
+    }
 
-        bvh.m_nodes[nodeIndex].leafNode.firstTriangleId = idIndex;
-        bvh.m_nodes[nodeIndex].leafNode.numTriangleIds = (UINT32)metadata.size();
+    static
+        float ComputeBoxSurfaceArea(
+            const AABB& box)
+    {
+        const float dims[3] =
+        {
+            box.max.x - box.min.x,
+            box.max.y - box.min.y,
+            box.max.z - box.min.z
+        };
 
-        return nodeIndex;
+        return 2 * (dims[0] * dims[1] + dims[0] * dims[2] + dims[1] * dims[2]);
     }
 
     //
-    // Sort min to max by centroid
+    // A feeble attempt at a SAH builder
+    //
+    // Each primitive is binned on all three axes in one pass, and bin bounds are kept
+    // as vectors. Binning is separate from plane selection, so slices of a node can be
+    // binned on separate threads and merged. Merging is exact, so the result does
+    // not depend on the number of slices.
+    //
+    // More bins find better planes but cost more per node. The count is a template
+    // parameter, so each supported count compiles to fixed-size loops.
     //
 
-    static
-        void SortByCentroid(
-            std::vector<PrimitiveMetaData>& metadata,
-            const std::vector<AABB>& boxes,
-            UINT32 maxDimension)
+    static const UINT DEFAULT_NUM_SAH_BINS = 64;
+
+    template <UINT NumBins>
+    struct SahBins
     {
-        struct TriPosition
+        XMVECTOR    boxMin[3][NumBins];
+        XMVECTOR    boxMax[3][NumBins];
+        UINT        numTriangles[3][NumBins];
+    };
+
+    template <UINT NumBins>
+    struct SahBinMapping
+    {
+        XMVECTOR    rangeMin;
+        XMVECTOR    inverseExtents;     // 0 for flat axes, which are not split
+
+        void Init(const AABB& nodeBox)
         {
-            float   pos;
-            UINT32  id;
-        };
+            const XMVECTOR boxMin = XMLoadFloat3((const XMFLOAT3*)nodeBox.minArr);
+            const XMVECTOR extents = XMVectorSubtract(XMLoadFloat3((const XMFLOAT3*)nodeBox.maxArr), boxMin);
 
-        std::vector<TriPosition> sortTris(metadata.size());
+            rangeMin = boxMin;
+            inverseExtents = XMVectorSelect(XMVectorReciprocal(extents), XMVectorZero(), XMVectorEqual(extents, XMVectorZero()));
+        }
 
-        for (UINT32 i = 0; i < metadata.size(); ++i)
+        bool IsFlat(UINT dimension) const
         {
-            const UINT32 triId = metadata[i].PrimitiveIndex;
-            const AABB& box = boxes[triId];
+            return XMVectorGetByIndex(inverseExtents, dimension) == 0;
+        }
 
-            const float boxCenter = (box.maxArr[maxDimension] + box.minArr[maxDimension]) / 2;
+        // Bins of a primitive on the x, y and z axes
+        XMVECTOR GetBinIndices(FXMVECTOR centroid) const
+        {
+            const XMVECTOR bin = XMVectorScale(XMVectorMultiply(XMVectorSubtract(centroid, rangeMin), inverseExtents), (float)NumBins);
 
-            sortTris[i].pos = boxCenter;
-            sortTris[i].id = metadata[i].PrimitiveIndex;
+            return XMConvertVectorFloatToInt(XMVectorClamp(bin, XMVectorZero(), XMVectorReplicate(NumBins - 1.f)), 0);
         }
 
-        // Split the list into left and right sublists
-        std::sort(sortTris.begin(), sortTris.end(), [](auto&& a, auto&& b) -> bool { return a.pos < b.pos; });
+        UINT GetBinIndex(const PrimitiveBounds& bounds, UINT32 primitive, UINT dimension) const
+        {
+            return XMVectorGetIntByIndex(GetBinIndices(XMLoadFloat4A(&bounds.centroid[primitive])), dimension);
+        }
 
-        // Update the output
-        for (UINT32 i = 0; i < metadata.size(); ++i)
+        // Bin of a position rather than a centroid, for spatial splits
+        UINT GetPositionBinIndex(float position, UINT dimension) const
         {
-            metadata[i].PrimitiveIndex = sortTris[i].id;
+            const float bin = (position - XMVectorGetByIndex(rangeMin, dimension)) *
+                XMVectorGetByIndex(inverseExtents, dimension) * NumBins;
+            return (UINT)std::min(std::max(bin, 0.0f), NumBins - 1.0f);
         }
-    }
 
+        // The plane between a bin and the next one up
+        float GetBinPlane(UINT bin, UINT dimension) const
+        {
+            return XMVectorGetByIndex(rangeMin, dimension) +
+                (bin + 1) / (NumBins * XMVectorGetByIndex(inverseExtents, dimension));
+        }
+    };
 
     static
         float ComputeBoxSurfaceArea(
-            const AABB& box)
+            FXMVECTOR boxMin,
+            FXMVECTOR boxMax)
     {
-        const float dims[3] =
+        const XMVECTOR dims = XMVectorSubtract(boxMax, boxMin);
+
+        // x * y, y * z, z * x, summed in the same order as the scalar version
+        const XMVECTOR products = XMVectorMultiply(dims, XMVectorSwizzle<XM_SWIZZLE_Y, XM_SWIZZLE_Z, XM_SWIZZLE_X, XM_SWIZZLE_W>(dims));
+        return 2 * (XMVectorGetX(products) + XMVectorGetZ(products) + XMVectorGetY(products));
+    }
+
+    template <UINT NumBins>
+    static
+        void BinTriangles(
+            SahBins<NumBins>& sahBins,
+            const SahBinMapping<NumBins>& mapping,
+            const PrimitiveBounds& bounds,
+            const UINT32* pPrimitiveIndices,
+            UINT32 numTris)
+    {
+        // Init boxes
+        const XMVECTOR inverseMax = XMVectorReplicate(10e10f);
+        for (UINT i = 0; i < 3; ++i)
         {
-            box.max.x - box.min.x,
-            box.max.y - box.min.y,
-            box.max.z - box.min.z
-        };
+            for (UINT j = 0; j < NumBins; ++j)
+            {
+                sahBins.boxMin[i][j] = inverseMax;
+                sahBins.boxMax[i][j] = XMVectorNegate(inverseMax);
+                sahBins.numTriangles[i][j] = 0;
+            }
+        }
 
-        return 2 * (dims[0] * dims[1] + dims[0] * dims[2] + dims[1] * dims[2]);
+        // Place triangles into the buckets. Flat axes all land in the first bin.
+        for (UINT32 j = 0; j < numTris; ++j)
+        {
+            const UINT32 triId = pPrimitiveIndices[j];
+            const XMVECTOR triMin = XMLoadFloat4A(&bounds.boxMin[triId]);
+            const XMVECTOR triMax = XMLoadFloat4A(&bounds.boxMax[triId]);
+
+            UINT binIndices[4];
+            XMStoreInt4(binIndices, mapping.GetBinIndices(XMLoadFloat4A(&bounds.centroid[triId])));
+
+            for (UINT i = 0; i < 3; ++i)
+            {
+                const UINT binIndex = binIndices[i];
+                sahBins.boxMin[i][binIndex] = XMVectorMin(sahBins.boxMin[i][binIndex], triMin);
+                sahBins.boxMax[i][binIndex] = XMVectorMax(sahBins.boxMax[i][binIndex], triMax);
+                sahBins.numTriangles[i][binIndex]++;
+            }
+        }
     }
 
+    template <UINT NumBins>
     static
-        void InitBoxToInverseMax(
-            AABB& box)
+        void MergeSahBins(
+            SahBins<NumBins>& sahBins,
+            const SahBins<NumBins>& otherBins)
     {
-        box.max.x = box.max.y = box.max.z = -10e10f;//FLT_MAX;
-        box.min.x = box.min.y = box.min.z = 10e10f;//FLT_MAX;
+        for (UINT i = 0; i < 3; ++i)
+        {
+            for (UINT j = 0; j < NumBins; ++j)
+            {
+                sahBins.boxMin[i][j] = XMVectorMin(sahBins.boxMin[i][j], otherBins.boxMin[i][j]);
+                sahBins.boxMax[i][j] = XMVectorMax(sahBins.boxMax[i][j], otherBins.boxMax[i][j]);
+                sahBins.numTriangles[i][j] += otherBins.numTriangles[i][j];
+            }
+        }
     }
 
     //
-    // A feeble attempt at a SAH builder
+    // Returns the number of primitives left of the plane with the best score,
+    // or 0 when no plane separates them. One backward sweep gets the area right of
+    // every plane, and the forward sweep grows the left box while scoring.
     //
 
+    template <UINT NumBins>
     static
-        void SahSplit(
-            std::vector<PrimitiveMetaData>& metadata,
-            UINT32& maxDimension,
-            UINT32& numTrisInLeftNode,
+        UINT32 FindSahSplit(
+            const SahBins<NumBins>& sahBins,
+            const SahBinMapping<NumBins>& mapping,
+            UINT32 numTris,
             const AABB& nodeBox,
-            const std::vector<AABB>& boxes)
+            UINT32& maxDimension,
+            UINT& bestBin)
     {
-        static const UINT NUM_SAH_BINS = 64;
-
-        struct SahBin
-        {
-            AABB    box;
-            UINT    numTriangles;
-        };
-
-        // NOTE: use vector if this blows out the stack?
-        SahBin  sahBins[3][NUM_SAH_BINS];
-
         // For the score to be meaningful it seems we need to normalize it to something
         const float normalizeToParent = 1.f / ComputeBoxSurfaceArea(nodeBox);
 
-        const UINT numTris = (UINT)metadata.size();
-
         float bestSah = FLT_MAX;
+        UINT32 numTrisInLeftNode = 0;
+        bestBin = 0;
         maxDimension = 0;
-        //numTrisInLeftNode = triangleIds.size() / 2;
 
         // Compute SAH score per axis
         for (UINT i = 0; i < 3; ++i)
         {
-            const float extents = nodeBox.maxArr[i] - nodeBox.minArr[i];
-            if (extents == 0)
+            if (mapping.IsFlat(i))
                 continue;
 
-            const float rangeMin = nodeBox.minArr[i];
-
-            const float inverseExtents = 1.f / extents;
-
-            // Init boxes
-            for (UINT j = 0; j < NUM_SAH_BINS; ++j)
-            {
-                sahBins[i][j].numTriangles = 0;
-                InitBoxToInverseMax(sahBins[i][j].box);
-            }
-
-            // Place triangles into the buckets
-            for (UINT j = 0; j < metadata.size(); ++j)
-            {
-                const UINT triId = metadata[j].PrimitiveIndex;
-
-                const AABB& triBox = boxes[triId];
-
-                const float centroid = (triBox.maxArr[i] + triBox.minArr[i]) * 0.5f;
-
-                const UINT binIndex = std::min(NUM_SAH_BINS - 1,
-                    UINT(NUM_SAH_BINS * ((centroid - rangeMin) * inverseExtents)));
-
-                sahBins[i][binIndex].numTriangles++;
-                AddExtentToBox(sahBins[i][binIndex].box, triBox);
-            }
+            // Area of the bins from j up
+            float rightAreas[NumBins];
+            XMVECTOR rightMin = sahBins.boxMin[i][NumBins - 1];
+            XMVECTOR rightMax = sahBins.boxMax[i][NumBins - 1];
+            rightAreas[NumBins - 1] = ComputeBoxSurfaceArea(rightMin, rightMax);
 
-            // Make sure we caught all of them once
-            UINT testTris = 0;
-            for (UINT j = 0; j < NUM_SAH_BINS; ++j)
+            for (UINT j = NumBins - 2; j > 0; --j)
             {
-                testTris += sahBins[i][j].numTriangles;
+                rightMin = XMVectorMin(rightMin, sahBins.boxMin[i][j]);
+                rightMax = XMVectorMax(rightMax, sahBins.boxMax[i][j]);
+                rightAreas[j] = ComputeBoxSurfaceArea(rightMin, rightMax);
             }
-            assert(testTris == numTris);
-
-            // Precompute left and right boxes with counts to be able to test plane positionings
-
-            AABB leftBoxes[NUM_SAH_BINS];
-            AABB rightBoxes[NUM_SAH_BINS];
 
-            for (UINT j = 0; j < NUM_SAH_BINS; ++j)
-            {
-                const UINT rightIdx = NUM_SAH_BINS - j - 1;
-
-                rightBoxes[rightIdx] = sahBins[i][rightIdx].box;
-                leftBoxes[j] = sahBins[i][j].box;
-
-                if (j > 0)
-                {
-                    AddExtentToBox(leftBoxes[j], leftBoxes[j - 1]);
-                    AddExtentToBox(rightBoxes[rightIdx], rightBoxes[rightIdx + 1]);
-                }
-            }
+            XMVECTOR leftMin = sahBins.boxMin[i][0];
+            XMVECTOR leftMax = sahBins.boxMax[i][0];
 
             UINT numTrianglesOnLeft = 0;
             UINT numTrianglesOnRight = numTris;
 
             // Find the plane with the best score
-            for (UINT j = 0; j < NUM_SAH_BINS - 1; ++j)
+            for (UINT j = 0; j < NumBins - 1; ++j)
             {
-                if (!sahBins[i][j].numTriangles)
+                leftMin = XMVectorMin(leftMin, sahBins.boxMin[i][j]);
+                leftMax = XMVectorMax(leftMax, sahBins.boxMax[i][j]);
+
+                if (!sahBins.numTriangles[i][j])
                 {
                     continue;
                 }
 
-                numTrianglesOnLeft += sahBins[i][j].numTriangles;
-                numTrianglesOnRight -= sahBins[i][j].numTriangles;
+                numTrianglesOnLeft += sahBins.numTriangles[i][j];
+                numTrianglesOnRight -= sahBins.numTriangles[i][j];
 
-                const float sah = (numTrianglesOnLeft * ComputeBoxSurfaceArea(leftBoxes[j]) +
-                    numTrianglesOnRight * ComputeBoxSurfaceArea(rightBoxes[j + 1])) *
+                const float sah = (numTrianglesOnLeft * ComputeBoxSurfaceArea(leftMin, leftMax) +
+                    numTrianglesOnRight * rightAreas[j + 1]) *
                     normalizeToParent;
 
                 assert(!_isnan(sah));
@@ -357,320 +441,2633 @@ namespace FallbackLayer
                 if (sah < bestSah)
                 {
                     bestSah = sah;
+                    bestBin = j;
                     maxDimension = i;
                     numTrisInLeftNode = numTrianglesOnLeft;
                 }
             }
-        }
 
-        //
-        // Split the set to try to get a balanced tree
-        //
+            // Make sure we caught all of them once
+            assert(numTrianglesOnRight == sahBins.numTriangles[i][NumBins - 1]);
+        }
 
-        SortByCentroid(metadata, boxes, maxDimension);
+        return numTrisInLeftNode < numTris ? numTrisInLeftNode : 0;
     }
 
     //
-    // It's a good idea to do a breadth-first build because then nodes from the same level
-    // get adjacent memory locations. It does take a lot of memory though.
-    //
-    // "Uniform BVH"
-    // -- both children are valid for all internal nodes
-    // -- left child's index is +1 of the parent index, right child's index is stored
-    //    in the packed AABB structure.
-    // -- there could be a varaible number of triangles in leaves
+    // Split the set to try to get a balanced tree
     //
+
     static
-        void BuildBVH(
-            BVH& bvh,
-            const std::vector<AABB>& boxes,
-            const std::vector<PrimitiveMetaData>& primitiveMetaData,
-            UINT32 maxTrisInLeaf)
+        UINT32 MedianSplit(
+            UINT32* pPrimitiveIndices,
+            UINT32 numTris,
+            UINT32& maxDimension,
+            const AABB& nodeBox,
+            const PrimitiveBounds& bounds)
     {
-        //
-        // These are huge so use pointers
-        //
-        struct StackItem
+        maxDimension = 0;
+        for (UINT i = 1; i < 3; ++i)
         {
-            std::vector<PrimitiveMetaData> primitiveMetaData;
-            UINT32              parentIndex;
-            UINT                right : 1;
-            UINT                axis : 2;
-        };
-
-        std::deque<StackItem*>   fifoLefts;
-        std::deque<StackItem*>   fifoRights;
-
-        StackItem* temp = new StackItem;
-        temp->parentIndex = (UINT)-1;
-        temp->primitiveMetaData = primitiveMetaData;
-        temp->right = false;
-        temp->axis = 0;
-        fifoRights.push_back(temp);
+            if (nodeBox.maxArr[i] - nodeBox.minArr[i] > nodeBox.maxArr[maxDimension] - nodeBox.minArr[maxDimension])
+                maxDimension = i;
+        }
 
-        while (!fifoLefts.empty() || !fifoRights.empty())
+        // Ties are broken by index so that the halves do not depend on the order of the range
+        const UINT32 numTrisInLeftNode = numTris / 2;
+        std::nth_element(pPrimitiveIndices, pPrimitiveIndices + numTrisInLeftNode, pPrimitiveIndices + numTris,
+            [&](UINT32 a, UINT32 b)
         {
-            // Uniform BVH pops the first left node
-            StackItem* item = nullptr;
-
-            if (!fifoRights.empty())
-            {
-                item = fifoRights.back();
-                fifoRights.pop_back();
-            }
-
-            if (!item)
-            {
-                item = fifoLefts.back();
-                fifoLefts.pop_back();
-            }
-
-            //
-            // Compute overall bounding box
-            //
-            AABB nodeBox;
-            ComputeBox(nodeBox, boxes, item->primitiveMetaData);
-
-            const UINT32 numTrianglesInNode = (UINT32)item->primitiveMetaData.size();
-            const UINT32 parentIndex = item->parentIndex;
-
-            UINT32 thisNodeIndex;
-
-            // Leaf or internal node?
-            if (numTrianglesInNode <= maxTrisInLeaf)
-            {
-                thisNodeIndex = BuildBVHAddLeaf(bvh, nodeBox, item->primitiveMetaData);
-            }
-            else
-            {
-                //
-                // Find separating plane. Use Median for speed.
-                // SAH is better but also more expensive to build.
-                //
-
-                UINT splitDimension;
-                UINT leftChildNumNodes;
+            const float centroidA = bounds.GetCentroid(a, maxDimension);
+            const float centroidB = bounds.GetCentroid(b, maxDimension);
+            return centroidA < centroidB || (centroidA == centroidB && a < b);
+        });
 
-                SahSplit(item->primitiveMetaData,
-                    splitDimension,
-                    leftChildNumNodes,
-                    nodeBox,
-                    boxes);
+        return numTrisInLeftNode;
+    }
 
-                assert(leftChildNumNodes <= item->primitiveMetaData.size());
+    //
+    // Partitions the primitive range in place and returns the number of primitives
+    // on the left side, falling back to the median when no plane separates them.
+    //
 
-                // Try to balance by using the median if SAH failed
-                if ((leftChildNumNodes == 0 ||
-                    leftChildNumNodes == item->primitiveMetaData.size()) &&
-                    item->primitiveMetaData.size() > MAX_TRIS_IN_LEAF)
-                {
-                    leftChildNumNodes = (UINT)item->primitiveMetaData.size() / 2;
-                }
+    template <UINT NumBins>
+    static
+        UINT32 SahSplit(
+            UINT32* pPrimitiveIndices,
+            UINT32 numTris,
+            UINT32& maxDimension,
+            const AABB& nodeBox,
+            const PrimitiveBounds& bounds)
+    {
+        SahBinMapping<NumBins> mapping;
+        mapping.Init(nodeBox);
 
-                const UINT32 rightChildNumNodes = (UINT32)item->primitiveMetaData.size() - leftChildNumNodes;
+        SahBins<NumBins> sahBins;
+        BinTriangles(sahBins, mapping, bounds, pPrimitiveIndices, numTris);
 
+        UINT bestBin;
+        const UINT32 numTrisInLeftNode = FindSahSplit(sahBins, mapping, numTris, nodeBox, maxDimension, bestBin);
+        if (numTrisInLeftNode == 0)
+        {
+            return MedianSplit(pPrimitiveIndices, numTris, maxDimension, nodeBox, bounds);
+        }
 
-                //
-                // "Recurse"
-                //
+        // Bins are monotonic in the centroid, so this is the same split as sorting
+        UINT32* const pMiddle = std::partition(pPrimitiveIndices, pPrimitiveIndices + numTris,
+            [&](UINT32 triId) { return mapping.GetBinIndex(bounds, triId, maxDimension) <= bestBin; });
+        UNREFERENCED_PARAMETER(pMiddle);
+        assert(pMiddle - pPrimitiveIndices == numTrisInLeftNode);
 
-                thisNodeIndex = BuildBVHAddNode(bvh, nodeBox, splitDimension);
+        return numTrisInLeftNode;
+    }
 
-                StackItem* leftItem = new StackItem;
-                leftItem->parentIndex = thisNodeIndex;
-                leftItem->primitiveMetaData.resize(leftChildNumNodes);
-                leftItem->right = false;
-                leftItem->axis = splitDimension;
-                for (UINT32 i = 0; i < leftChildNumNodes; ++i)
-                {
-                    leftItem->primitiveMetaData[i] = item->primitiveMetaData[i];
-                }
+    //
+    // Nodes near the root are too few to keep the threads busy, so each one is split
+    // with all threads instead: every thread bins a slice of the range, and the
+    // partition scatters the slices through pScratch.
+    //
 
-                StackItem* rightItem = new StackItem;
-                rightItem->parentIndex = thisNodeIndex;
-                rightItem->primitiveMetaData.resize(rightChildNumNodes);
-                rightItem->right = true;
-                rightItem->axis = splitDimension;
-                for (UINT32 i = 0; i < rightChildNumNodes; ++i)
-                {
-                    rightItem->primitiveMetaData[i] = item->primitiveMetaData[i + leftChildNumNodes];
-                }
+    static
+        void ComputeBoxParallel(
+            AABB& overallBox,
+            const PrimitiveBounds& bounds,
+            const UINT32* pPrimitiveIndices,
+            UINT32 numTris,
+            CpuTaskPool& taskPool)
+    {
+        const UINT numSlices = taskPool.GetNumThreads();
+        const UINT32 sliceSize = (numTris + numSlices - 1) / numSlices;
 
-                fifoLefts.push_back(leftItem);
-                fifoRights.push_back(rightItem);
-            }
+        std::vector<AABB> sliceBoxes(numSlices);
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
+        {
+            const UINT32 begin = std::min(slice * sliceSize, numTris);
+            const UINT32 end = std::min(begin + sliceSize, numTris);
+            ComputeBox(sliceBoxes[slice], bounds, pPrimitiveIndices + begin, end - begin);
+        });
 
-            // Update child link of the parent
-            if (parentIndex != -1)
+        overallBox = sliceBoxes[0];
+        for (UINT slice = 1; slice < numSlices; ++slice)
+        {
+            if (slice * sliceSize < numTris)
             {
-                if (!item->right)
-                {
-                    bvh.m_nodes[parentIndex].internalNode.leftNodeIndex = thisNodeIndex;
-                    bvh.m_nodes[parentIndex].rightNodeIndex = parentIndex + 1;
-                }
+                AddExtentToBox(overallBox, sliceBoxes[slice]);
             }
-
-            // Free the item after use
-            delete item;
         }
     }
 
-    void BuildUniformBVH(
-        _In_  UINT NumElements,
-        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
-        BVH &bvh)
+    template <UINT NumBins>
+    static
+        UINT32 SahSplitParallel(
+            UINT32* pPrimitiveIndices,
+            UINT32 numTris,
+            UINT32& maxDimension,
+            const AABB& nodeBox,
+            const PrimitiveBounds& bounds,
+            CpuTaskPool& taskPool,
+            UINT32* pScratch)
     {
-        using namespace DirectX;
-        //
-        // Compute number of triangles
-        //
+        const UINT numSlices = taskPool.GetNumThreads();
+        const UINT32 sliceSize = (numTris + numSlices - 1) / numSlices;
+        const auto getSliceBegin = [&](UINT slice) { return std::min(slice * sliceSize, numTris); };
 
-        UINT    totalNumberOfTriangles = 0;
+        SahBinMapping<NumBins> mapping;
+        mapping.Init(nodeBox);
 
-        for (UINT i = 0; i < NumElements; ++i)
+        std::vector<SahBins<NumBins>> sliceBins(numSlices);
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
         {
-            auto &geometry = pGeometries[i];
-            if (geometry.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
-            {
-                totalNumberOfTriangles += GetPrimitiveCountFromGeometryDesc(geometry);
-            }
-            else
-            {
-                throw - 1; // Intersection shaders not supported yet
-            }
+            const UINT32 begin = getSliceBegin(slice);
+            BinTriangles(sliceBins[slice], mapping, bounds, pPrimitiveIndices + begin, getSliceBegin(slice + 1) - begin);
+        });
 
+        for (UINT slice = 1; slice < numSlices; ++slice)
+        {
+            MergeSahBins(sliceBins[0], sliceBins[slice]);
         }
 
-        //
-        // Create AABBs
-        //
+        UINT bestBin;
+        const UINT32 numTrisInLeftNode = FindSahSplit(sliceBins[0], mapping, numTris, nodeBox, maxDimension, bestBin);
+        if (numTrisInLeftNode == 0)
+        {
+            return MedianSplit(pPrimitiveIndices, numTris, maxDimension, nodeBox, bounds);
+        }
 
-        std::vector<AABB> boxes;
-        boxes.resize(totalNumberOfTriangles);
+        const auto isLeft = [&](UINT32 triId) { return mapping.GetBinIndex(bounds, triId, maxDimension) <= bestBin; };
 
-        std::vector<PrimitiveMetaData> primitiveMetaData;
-        primitiveMetaData.resize(totalNumberOfTriangles);
+        // Count per slice, then every slice knows where its primitives go on either side
+        std::vector<UINT32> sliceNumLeft(numSlices);
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
+        {
+            sliceNumLeft[slice] = (UINT32)std::count_if(pPrimitiveIndices + getSliceBegin(slice),
+                pPrimitiveIndices + getSliceBegin(slice + 1), isLeft);
+        });
 
-        std::vector<float>  triangleVertices;
-        triangleVertices.resize(totalNumberOfTriangles * 9);
+        std::vector<UINT32> sliceLeftOffsets(numSlices);
+        UINT32 numLeft = 0;
+        for (UINT slice = 0; slice < numSlices; ++slice)
+        {
+            sliceLeftOffsets[slice] = numLeft;
+            numLeft += sliceNumLeft[slice];
+        }
+        assert(numLeft == numTrisInLeftNode);
 
-        UINT triangleIndex = 0;
-        for (UINT i = 0; i < NumElements; ++i)
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
         {
-            auto &geometry = pGeometries[i];
-            if (geometry.Type != D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            const UINT32 begin = getSliceBegin(slice);
+            UINT32 left = sliceLeftOffsets[slice];
+            UINT32 right = numLeft + begin - sliceLeftOffsets[slice];
+            for (UINT32 i = begin; i < getSliceBegin(slice + 1); ++i)
             {
-                throw - 1; // Intersection shaders not supported yet
+                const UINT32 triId = pPrimitiveIndices[i];
+                pScratch[isLeft(triId) ? left++ : right++] = triId;
             }
+        });
 
-            auto &triangles = geometry.Triangles;
-            if (GetPrimitiveCountFromGeometryDesc(geometry) == 0)
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
+        {
+            const UINT32 begin = getSliceBegin(slice);
+            std::copy(pScratch + begin, pScratch + getSliceBegin(slice + 1), pPrimitiveIndices + begin);
+        });
 
-            {
-                continue;
-            }
+        return numTrisInLeftNode;
+    }
 
-            // 
-            const UINT64 vertexStrideDwords = triangles.VertexBuffer.StrideInBytes / 4;
-            const UINT numTris = GetPrimitiveCountFromGeometryDesc(geometry);
+    //
+    // Primitive range of a pending node, and the node index it was given by its parent
+    //
 
-            float *pVertexData = (float *)geometry.Triangles.VertexBuffer.StartAddress;
-            float *pIndexData = (float *)geometry.Triangles.IndexBuffer;
+    struct BuildItem
+    {
+        UINT32              begin;
+        UINT32              end;
+        UINT32              nodeIndex;
+    };
 
-            const float* pVertices = (float*)(pVertexData);
-            const UINT16* pIndices = (UINT16*)(pIndexData);
+    //
+    // "Uniform BVH"
+    // -- both children are valid for all internal nodes
+    // -- right child's index is +1 of the parent index, both child indices are stored
+    //    in the packed AABB structure.
+    // -- there could be a varaible number of triangles in leaves
+    //
+    // Nodes are laid out depth-first, right child first, so the subtree of a node with
+    // n primitives takes the 2n - 1 indices after it when leaves have one primitive.
+    // Indices only depend on the split, which lets independent subtrees be built on
+    // separate threads without any coordination. Leaves holding more primitives leave
+    // the rest of their subtree range unused.
+    //
 
-            for (UINT j = 0; j < numTris; ++j)
-            {
-                const UINT16 i0 = pIndices[j * 3 + 0];
-                const UINT16 i1 = pIndices[j * 3 + 1];
-                const UINT16 i2 = pIndices[j * 3 + 2];
+    static
+        void BuildBVHNode(
+            BVH& bvh,
+            const BuildItem& item,
+            const AABB& nodeBox,
+            UINT32 splitDimension,
+            UINT32 leftChildNumNodes,
+            BuildItem children[2])
+    {
+        assert(leftChildNumNodes > 0 && leftChildNumNodes < item.end - item.begin);
 
-                const float* v0 = &pVertices[i0 * vertexStrideDwords];
-                const float* v1 = &pVertices[i1 * vertexStrideDwords];
-                const float* v2 = &pVertices[i2 * vertexStrideDwords];
+        BuildBVHAddNode(bvh, item.nodeIndex, nodeBox, splitDimension);
 
-                float* pTriVerts = &triangleVertices[triangleIndex * 9];
+        const UINT32 middle = item.begin + leftChildNumNodes;
+        const UINT32 rightNodeIndex = item.nodeIndex + 1;
+        const UINT32 leftNodeIndex = rightNodeIndex + 2 * (item.end - middle) - 1;
 
-                pTriVerts[0] = v0[0];
-                pTriVerts[1] = v0[1];
-                pTriVerts[2] = v0[2];
+        bvh.m_nodes[item.nodeIndex].rightNodeIndex = rightNodeIndex;
+        bvh.m_nodes[item.nodeIndex].internalNode.leftNodeIndex = leftNodeIndex;
 
-                pTriVerts[3] = v1[0];
-                pTriVerts[4] = v1[1];
-                pTriVerts[5] = v1[2];
+        children[0] = { item.begin, middle, leftNodeIndex };
+        children[1] = { middle, item.end, rightNodeIndex };
+    }
 
-                pTriVerts[6] = v2[0];
-                pTriVerts[7] = v2[1];
-                pTriVerts[8] = v2[2];
+    //
+    // Builds the subtree of one item on the calling thread
+    //
 
-                AABB& box = boxes[triangleIndex];
-                for (UINT k = 0; k < 3; ++k)
-                {
-#define AABB_Min_Padding 0.001f
-                    box.minArr[k] = std::min(v2[k], std::min(v0[k], v1[k]));
-                    box.maxArr[k] = std::max(v2[k], std::max(v0[k], v1[k])) + AABB_Min_Padding;
+    template <UINT NumBins>
+    static
+        void BuildBVHSubtree(
+            BVH& bvh,
+            UINT32* pPrimitiveIndices,
+            const PrimitiveBounds& bounds,
+            const BuildItem& root,
+            UINT32 maxTrisInLeaf)
+    {
+        std::vector<BuildItem> stack;
+        stack.push_back(root);
 
-                    if (_isnan(box.minArr[k]) ||
-                        _isnan(box.maxArr[k]))
-                    {
-                        box.minArr[k] = 0;
-                        box.maxArr[k] = 0;
-                    }
-                }
+        while (!stack.empty())
+        {
+            const BuildItem item = stack.back();
+            stack.pop_back();
 
-                // Create out internal triangle indices.
-                PrimitiveMetaData metadata;
+            UINT32* const pNodePrimitiveIndices = pPrimitiveIndices + item.begin;
+            const UINT32 numTrianglesInNode = item.end - item.begin;
+
+            //
+            // Compute overall bounding box
+            //
+            AABB nodeBox;
+            ComputeBox(nodeBox, bounds, pNodePrimitiveIndices, numTrianglesInNode);
+
+            // Leaf or internal node?
+            if (numTrianglesInNode <= maxTrisInLeaf)
+            {
+                BuildBVHAddLeaf(bvh, item.nodeIndex, nodeBox, item.begin, numTrianglesInNode);
+                continue;
+            }
+
+            //
+            // Find separating plane. SAH with a median fallback, which also balances
+            // the nodes SAH cannot split.
+            //
+
+            UINT splitDimension;
+            const UINT32 leftChildNumNodes = SahSplit<NumBins>(pNodePrimitiveIndices,
+                numTrianglesInNode,
+                splitDimension,
+                nodeBox,
+                bounds);
+
+            //
+            // "Recurse"
+            //
+
+            BuildItem children[2];
+            BuildBVHNode(bvh, item, nodeBox, splitDimension, leftChildNumNodes, children);
+            stack.push_back(children[0]);
+            stack.push_back(children[1]);
+        }
+    }
+
+    //
+    // Nodes split one shared array of primitive indices in place, so pending nodes
+    // are only ranges of it, and leaves point into it directly.
+    //
+    // The top of the tree is split level by level. While a level has fewer nodes
+    // than threads, each node is split with all of them; after that, the nodes of a
+    // level are split one per thread. Once nodes are small enough, their subtrees are
+    // built as independent tasks, largest first.
+    //
+
+    template <UINT NumBins>
+    static
+        void BuildBVH(
+            BVH& bvh,
+            const PrimitiveBounds& bounds,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            UINT32 maxTrisInLeaf,
+            CpuTaskPool& taskPool)
+    {
+        static const UINT32 MIN_SUBTREE_SIZE = 4096;
+        static const UINT32 SUBTREES_PER_THREAD = 16;
+
+        // Primitives are numbered in the order of their bounds and metadata
+        const UINT32 numPrimitives = (UINT32)primitiveMetaData.size();
+        std::vector<UINT32> primitiveIndices(numPrimitives);
+        for (UINT32 i = 0; i < numPrimitives; ++i)
+        {
+            primitiveIndices[i] = i;
+        }
+
+        bvh.m_nodes.resize(std::max(2 * numPrimitives, 2u) - 1);
+
+        const UINT numThreads = taskPool.GetNumThreads();
+        const UINT32 subtreeSize = std::max(MIN_SUBTREE_SIZE, numPrimitives / (numThreads * SUBTREES_PER_THREAD));
+
+        std::vector<BuildItem> subtrees;
+        std::vector<BuildItem> level;
+        std::vector<UINT32> scratch;
+        level.push_back({ 0, numPrimitives, 0 });
+
+        while (numThreads > 1 && !level.empty())
+        {
+            std::vector<BuildItem> largeItems;
+            for (const BuildItem& item : level)
+            {
+                if (item.end - item.begin > subtreeSize)
+                {
+                    largeItems.push_back(item);
+                }
+                else
+                {
+                    subtrees.push_back(item);
+                }
+            }
+
+            // Leaves are never in this level since subtreeSize is above maxTrisInLeaf
+            level.resize(2 * largeItems.size());
+            if (largeItems.size() < numThreads)
+            {
+                scratch.resize(numPrimitives);
+                for (size_t i = 0; i < largeItems.size(); ++i)
+                {
+                    const BuildItem& item = largeItems[i];
+                    UINT32* const pNodePrimitiveIndices = primitiveIndices.data() + item.begin;
+                    const UINT32 numTrianglesInNode = item.end - item.begin;
+
+                    AABB nodeBox;
+                    ComputeBoxParallel(nodeBox, bounds, pNodePrimitiveIndices, numTrianglesInNode, taskPool);
+
+                    UINT splitDimension;
+                    const UINT32 leftChildNumNodes = SahSplitParallel<NumBins>(pNodePrimitiveIndices,
+                        numTrianglesInNode,
+                        splitDimension,
+                        nodeBox,
+                        bounds,
+                        taskPool,
+                        scratch.data() + item.begin);
+
+                    BuildBVHNode(bvh, item, nodeBox, splitDimension, leftChildNumNodes, &level[2 * i]);
+                }
+            }
+            else
+            {
+                taskPool.ParallelFor((UINT)largeItems.size(), [&](UINT i)
+                {
+                    const BuildItem& item = largeItems[i];
+                    UINT32* const pNodePrimitiveIndices = primitiveIndices.data() + item.begin;
+                    const UINT32 numTrianglesInNode = item.end - item.begin;
+
+                    AABB nodeBox;
+                    ComputeBox(nodeBox, bounds, pNodePrimitiveIndices, numTrianglesInNode);
+
+                    UINT splitDimension;
+                    const UINT32 leftChildNumNodes = SahSplit<NumBins>(pNodePrimitiveIndices,
+                        numTrianglesInNode,
+                        splitDimension,
+                        nodeBox,
+                        bounds);
+
+                    BuildBVHNode(bvh, item, nodeBox, splitDimension, leftChildNumNodes, &level[2 * i]);
+                });
+            }
+        }
+
+        if (numThreads > 1)
+        {
+            // Largest first, so the small ones fill in at the end
+            std::sort(subtrees.begin(), subtrees.end(),
+                [](const BuildItem& a, const BuildItem& b) { return a.end - a.begin > b.end - b.begin; });
+
+            taskPool.ParallelFor((UINT)subtrees.size(), [&](UINT i)
+            {
+                BuildBVHSubtree<NumBins>(bvh, primitiveIndices.data(), bounds, subtrees[i], maxTrisInLeaf);
+            });
+        }
+        else
+        {
+            BuildBVHSubtree<NumBins>(bvh, primitiveIndices.data(), bounds, level[0], maxTrisInLeaf);
+        }
+
+        // Leaves are in build order within the partitioned array
+        bvh.m_metadata.resize(numPrimitives);
+        taskPool.ParallelFor(numThreads, [&](UINT slice)
+        {
+            const UINT32 sliceSize = (numPrimitives + numThreads - 1) / numThreads;
+            const UINT32 end = std::min((slice + 1) * sliceSize, numPrimitives);
+            for (UINT32 i = std::min(slice * sliceSize, numPrimitives); i < end; ++i)
+            {
+                bvh.m_metadata[i] = primitiveMetaData[primitiveIndices[i]];
+            }
+        });
+
+        bvh.m_scratchSize = (primitiveIndices.capacity() + scratch.capacity()) * sizeof(UINT32);
+    }
+
+    //
+    // Spatial split BVH (Stich et al. 2009). Long, thin triangles have boxes that
+    // overlap a lot however they are grouped, so besides the object split above,
+    // nodes also try splitting space at the bin planes. A triangle straddling the
+    // plane is then referenced from both children, each reference with the box of
+    // the part of the triangle on its side.
+    //
+    // Spatial splits are only tried where the children of the object split
+    // overlap by more than a small fraction of the root, and only while the
+    // references stay within the budget. Each node hands what is left of its budget
+    // to its children in proportion to their references, so the first subtrees
+    // built do not use up all of it. References of geometries that ask for no
+    // duplicate any-hit invocations are never split.
+    //
+    // New references are appended to arrays shared by the whole tree, so this build
+    // runs on one thread, and the two children of a node are added next to each
+    // other as it is split.
+    //
+
+    static const float SPATIAL_SPLIT_OVERLAP_THRESHOLD = 1e-5f;
+
+    // Every reference is clipped into each bin it spans, so spatial splits are
+    // binned more coarsely than object splits
+    static const UINT NUM_SPATIAL_SPLIT_BINS = 16;
+
+    static
+        UINT32 GetMaxNumReferences(
+            UINT32 numPrimitives,
+            float spatialSplitBudget)
+    {
+        // Node indices are 24 bits, and a binary tree has 2n - 1 nodes
+        const double maxNumReferences = numPrimitives * (1.0 + std::max(spatialSplitBudget, 0.0f));
+        return std::max(numPrimitives, (UINT32)std::min(maxNumReferences, (double)(1 << 23)));
+    }
+
+    //
+    // Box of the part of a triangle between two planes on one axis, or false when
+    // the triangle does not reach between them
+    //
+
+    static
+        bool ClipTriangleToSlab(
+            const float* pTriangle,
+            UINT dimension,
+            float slabMin,
+            float slabMax,
+            XMVECTOR& clipMin,
+            XMVECTOR& clipMax)
+    {
+        clipMin = XMVectorReplicate(FLT_MAX);
+        clipMax = XMVectorReplicate(-FLT_MAX);
+        bool isEmpty = true;
+
+        for (UINT i = 0; i < 3; ++i)
+        {
+            const XMVECTOR v0 = XMLoadFloat3((const XMFLOAT3*)&pTriangle[i * 3]);
+            const XMVECTOR v1 = XMLoadFloat3((const XMFLOAT3*)&pTriangle[((i + 1) % 3) * 3]);
+            const float p0 = XMVectorGetByIndex(v0, dimension);
+            const float p1 = XMVectorGetByIndex(v1, dimension);
+
+            if (p0 >= slabMin && p0 <= slabMax)
+            {
+                clipMin = XMVectorMin(clipMin, v0);
+                clipMax = XMVectorMax(clipMax, v0);
+                isEmpty = false;
+            }
+
+            // Where the edge crosses either plane
+            const float planes[2] = { slabMin, slabMax };
+            for (UINT j = 0; j < 2; ++j)
+            {
+                if ((p0 < planes[j] && planes[j] < p1) || (p1 < planes[j] && planes[j] < p0))
+                {
+                    const XMVECTOR crossing = XMVectorSetByIndex(
+                        XMVectorLerp(v0, v1, (planes[j] - p0) / (p1 - p0)), planes[j], dimension);
+                    clipMin = XMVectorMin(clipMin, crossing);
+                    clipMax = XMVectorMax(clipMax, crossing);
+                    isEmpty = false;
+                }
+            }
+        }
+
+        return !isEmpty;
+    }
+
+    //
+    // The clipped part of a reference, padded like the primitive boxes and kept
+    // within the box of the reference
+    //
+
+    static
+        bool ClipReference(
+            const float* pTriangle,
+            FXMVECTOR referenceMin,
+            FXMVECTOR referenceMax,
+            UINT dimension,
+            float slabMin,
+            float slabMax,
+            XMVECTOR& partMin,
+            XMVECTOR& partMax)
+    {
+        XMVECTOR clipMin, clipMax;
+        if (!ClipTriangleToSlab(pTriangle, dimension, slabMin, slabMax, clipMin, clipMax))
+        {
+            return false;
+        }
+
+        partMin = XMVectorMax(clipMin, referenceMin);
+        partMax = XMVectorMin(XMVectorAdd(clipMax, XMVectorReplicate(AABB_Min_Padding)), referenceMax);
+        return XMVector3LessOrEqual(partMin, partMax);
+    }
+
+    static
+        float ComputeOverlapSurfaceArea(
+            FXMVECTOR boxMinA,
+            FXMVECTOR boxMaxA,
+            FXMVECTOR boxMinB,
+            FXMVECTOR boxMaxB)
+    {
+        const XMVECTOR overlapMin = XMVectorMax(boxMinA, boxMinB);
+        const XMVECTOR overlapMax = XMVectorMax(XMVectorMin(boxMaxA, boxMaxB), overlapMin);
+        return ComputeBoxSurfaceArea(overlapMin, overlapMax);
+    }
+
+    //
+    // With one triangle per leaf, a child with n references also gets n - 1 nodes
+    // below it, so splits are compared by the cost of whole subtrees, taking every
+    // node in them to be as large as the child. Counting only the triangles would
+    // favor cutting small nodes in two, which leaves each reference needing a node
+    // of its own on both sides.
+    //
+
+    static
+        float ComputeSubtreeCost(
+            FXMVECTOR leftMin,
+            FXMVECTOR leftMax,
+            FXMVECTOR rightMin,
+            GXMVECTOR rightMax,
+            UINT32 numLeft,
+            UINT32 numRight)
+    {
+        return ComputeBoxSurfaceArea(leftMin, leftMax) * (2 * numLeft - 1) +
+            ComputeBoxSurfaceArea(rightMin, rightMax) * (2 * numRight - 1);
+    }
+
+    //
+    // References are primitives, or the parts of them left by spatial splits. Each
+    // reference is in exactly one pending node, so splitting one shrinks its box in
+    // place for the left side and adds a reference for the right side.
+    //
+
+    struct SpatialSplitReferences
+    {
+        PrimitiveBounds                         bounds;
+        std::vector<UINT32>                     primitives;
+        const std::vector<float>*               pTriangleVertices;
+        const std::vector<PrimitiveMetaData>*   pPrimitiveMetaData;
+        UINT32                                  maxNumReferences;
+
+        const float* GetTriangle(UINT32 reference) const
+        {
+            return &(*pTriangleVertices)[primitives[reference] * 9];
+        }
+
+        bool CanSplit(UINT32 reference) const
+        {
+            return !((*pPrimitiveMetaData)[primitives[reference]].GeometryFlags &
+                D3D12_RAYTRACING_GEOMETRY_FLAG_NO_DUPLICATE_ANYHIT_INVOCATION);
+        }
+
+        UINT32 GetNumReferences() const
+        {
+            return (UINT32)primitives.size();
+        }
+    };
+
+    template <UINT NumBins>
+    struct SpatialBins
+    {
+        XMVECTOR    boxMin[NumBins];
+        XMVECTOR    boxMax[NumBins];
+        UINT        numEntries[NumBins];    // references starting in the bin
+        UINT        numExits[NumBins];      // references ending in the bin
+    };
+
+    struct SpatialSplit
+    {
+        float       cost;                   // of the subtrees, not normalized
+        UINT        dimension;
+        float       plane;
+        UINT        bin;                    // last bin left of the plane
+        UINT32      numLeft;
+        UINT32      numRight;
+        XMVECTOR    leftMin;
+        XMVECTOR    leftMax;
+        XMVECTOR    rightMin;
+        XMVECTOR    rightMax;
+    };
+
+    //
+    // Bins the parts of every reference on one axis. Rather than clipping the
+    // triangle to every bin, each vertex goes to its own bin and each point where
+    // an edge crosses a plane goes to the bins on both sides of it, which bounds
+    // the part of the triangle in each bin. A reference that cannot be split lands
+    // whole in the bin of its centroid.
+    //
+
+    template <UINT NumBins>
+    static
+        void BinReferenceParts(
+            SpatialBins<NumBins>& spatialBins,
+            const SahBinMapping<NumBins>& mapping,
+            const SpatialSplitReferences& references,
+            const std::vector<UINT32>& nodeReferences,
+            UINT dimension)
+    {
+        const XMVECTOR inverseMax = XMVectorReplicate(10e10f);
+        for (UINT j = 0; j < NumBins; ++j)
+        {
+            spatialBins.boxMin[j] = inverseMax;
+            spatialBins.boxMax[j] = XMVectorNegate(inverseMax);
+            spatialBins.numEntries[j] = 0;
+            spatialBins.numExits[j] = 0;
+        }
+
+        XMVECTOR partMins[NumBins];
+        XMVECTOR partMaxs[NumBins];
+        for (UINT32 reference : nodeReferences)
+        {
+            const XMVECTOR referenceMin = XMLoadFloat4A(&references.bounds.boxMin[reference]);
+            const XMVECTOR referenceMax = XMLoadFloat4A(&references.bounds.boxMax[reference]);
+
+            UINT firstBin = mapping.GetPositionBinIndex(XMVectorGetByIndex(referenceMin, dimension), dimension);
+            UINT lastBin = mapping.GetPositionBinIndex(XMVectorGetByIndex(referenceMax, dimension), dimension);
+            if (!references.CanSplit(reference))
+            {
+                firstBin = lastBin = mapping.GetBinIndex(references.bounds, reference, dimension);
+            }
+
+            if (firstBin == lastBin)
+            {
+                spatialBins.boxMin[firstBin] = XMVectorMin(spatialBins.boxMin[firstBin], referenceMin);
+                spatialBins.boxMax[firstBin] = XMVectorMax(spatialBins.boxMax[firstBin], referenceMax);
+                spatialBins.numEntries[firstBin]++;
+                spatialBins.numExits[firstBin]++;
+                continue;
+            }
+
+            for (UINT j = firstBin; j <= lastBin; ++j)
+            {
+                partMins[j] = inverseMax;
+                partMaxs[j] = XMVectorNegate(inverseMax);
+            }
+
+            // Earlier splits may have cut the reference, so the ends of the triangle
+            // past it are kept in its outer bins and clipped off below
+            const float* pTriangle = references.GetTriangle(reference);
+            for (UINT i = 0; i < 3; ++i)
+            {
+                const XMVECTOR v0 = XMLoadFloat3((const XMFLOAT3*)&pTriangle[i * 3]);
+                const XMVECTOR v1 = XMLoadFloat3((const XMFLOAT3*)&pTriangle[((i + 1) % 3) * 3]);
+                const float p0 = pTriangle[i * 3 + dimension];
+                const float p1 = pTriangle[((i + 1) % 3) * 3 + dimension];
+                const UINT bin0 = std::min(std::max(mapping.GetPositionBinIndex(p0, dimension), firstBin), lastBin);
+                const UINT bin1 = std::min(std::max(mapping.GetPositionBinIndex(p1, dimension), firstBin), lastBin);
+
+                partMins[bin0] = XMVectorMin(partMins[bin0], v0);
+                partMaxs[bin0] = XMVectorMax(partMaxs[bin0], v0);
+
+                for (UINT j = std::min(bin0, bin1); j < std::max(bin0, bin1); ++j)
+                {
+                    const float plane = mapping.GetBinPlane(j, dimension);
+                    const XMVECTOR crossing = XMVectorSetByIndex(
+                        XMVectorLerp(v0, v1, (plane - p0) / (p1 - p0)), plane, dimension);
+                    partMins[j] = XMVectorMin(partMins[j], crossing);
+                    partMaxs[j] = XMVectorMax(partMaxs[j], crossing);
+                    partMins[j + 1] = XMVectorMin(partMins[j + 1], crossing);
+                    partMaxs[j + 1] = XMVectorMax(partMaxs[j + 1], crossing);
+                }
+            }
+
+            UINT entryBin = NumBins;
+            UINT exitBin = 0;
+            for (UINT j = firstBin; j <= lastBin; ++j)
+            {
+                const XMVECTOR partMin = XMVectorMax(partMins[j], referenceMin);
+                const XMVECTOR partMax = XMVectorMin(XMVectorAdd(partMaxs[j], XMVectorReplicate(AABB_Min_Padding)), referenceMax);
+                if (XMVector3LessOrEqual(partMin, partMax))
+                {
+                    spatialBins.boxMin[j] = XMVectorMin(spatialBins.boxMin[j], partMin);
+                    spatialBins.boxMax[j] = XMVectorMax(spatialBins.boxMax[j], partMax);
+                    entryBin = std::min(entryBin, j);
+                    exitBin = std::max(exitBin, j);
+                }
+            }
+
+            // Only the padding reaches past the triangle, so it goes in whole
+            if (entryBin > exitBin)
+            {
+                entryBin = exitBin = firstBin;
+                spatialBins.boxMin[firstBin] = XMVectorMin(spatialBins.boxMin[firstBin], referenceMin);
+                spatialBins.boxMax[firstBin] = XMVectorMax(spatialBins.boxMax[firstBin], referenceMax);
+            }
+            spatialBins.numEntries[entryBin]++;
+            spatialBins.numExits[exitBin]++;
+        }
+    }
+
+    //
+    // Best spatial split on any axis, by the cost of the subtrees. A plane may
+    // leave every reference on both sides, as long as it cuts them smaller.
+    //
+
+    template <UINT NumBins>
+    static
+        bool FindSpatialSplit(
+            const SahBinMapping<NumBins>& mapping,
+            const SpatialSplitReferences& references,
+            const std::vector<UINT32>& nodeReferences,
+            const AABB& nodeBox,
+            SpatialSplit& bestSplit)
+    {
+        const UINT32 numReferences = (UINT32)nodeReferences.size();
+
+        bestSplit.cost = FLT_MAX;
+        bestSplit.dimension = 0;
+        bestSplit.plane = 0;
+        bestSplit.bin = 0;
+        SpatialBins<NumBins> spatialBins;
+        for (UINT i = 0; i < 3; ++i)
+        {
+            if (mapping.IsFlat(i))
+                continue;
+
+            BinReferenceParts(spatialBins, mapping, references, nodeReferences, i);
+
+            XMVECTOR rightMins[NumBins];
+            XMVECTOR rightMaxs[NumBins];
+            rightMins[NumBins - 1] = spatialBins.boxMin[NumBins - 1];
+            rightMaxs[NumBins - 1] = spatialBins.boxMax[NumBins - 1];
+            for (UINT j = NumBins - 2; j > 0; --j)
+            {
+                rightMins[j] = XMVectorMin(rightMins[j + 1], spatialBins.boxMin[j]);
+                rightMaxs[j] = XMVectorMax(rightMaxs[j + 1], spatialBins.boxMax[j]);
+            }
+
+            XMVECTOR leftMin = spatialBins.boxMin[0];
+            XMVECTOR leftMax = spatialBins.boxMax[0];
+            UINT32 numLeft = 0;
+            UINT32 numRight = numReferences;
+            for (UINT j = 0; j < NumBins - 1; ++j)
+            {
+                leftMin = XMVectorMin(leftMin, spatialBins.boxMin[j]);
+                leftMax = XMVectorMax(leftMax, spatialBins.boxMax[j]);
+                numLeft += spatialBins.numEntries[j];
+                numRight -= spatialBins.numExits[j];
+
+                if (numLeft == 0 || numRight == 0)
+                {
+                    continue;
+                }
+
+                const float cost = ComputeSubtreeCost(leftMin, leftMax, rightMins[j + 1], rightMaxs[j + 1], numLeft, numRight);
+                if (cost < bestSplit.cost)
+                {
+                    bestSplit.cost = cost;
+                    bestSplit.dimension = i;
+                    bestSplit.plane = mapping.GetBinPlane(j, i);
+                    bestSplit.bin = j;
+                    bestSplit.numLeft = numLeft;
+                    bestSplit.numRight = numRight;
+                    bestSplit.leftMin = leftMin;
+                    bestSplit.leftMax = leftMax;
+                    bestSplit.rightMin = rightMins[j + 1];
+                    bestSplit.rightMax = rightMaxs[j + 1];
+                }
+            }
+        }
+
+        return bestSplit.cost < FLT_MAX;
+    }
+
+    //
+    // Sorts the references of a node to the sides of a spatial split. A reference
+    // across the plane stays whole on one side when that scores better than
+    // splitting it (reference unsplitting), or when the node may not have more than
+    // maxNumReferences across both sides. New references are only added once
+    // neither side is known to be empty, and false is returned otherwise.
+    //
+    // A side holding every reference of the node means some were split, so each
+    // such split uses up budget and the build still ends.
+    //
+
+    template <UINT NumBins>
+    static
+        bool PartitionSpatialSplit(
+            SpatialSplitReferences& references,
+            const SahBinMapping<NumBins>& mapping,
+            const std::vector<UINT32>& nodeReferences,
+            const SpatialSplit& split,
+            UINT32 maxNumReferences,
+            std::vector<UINT32>& leftReferences,
+            std::vector<UINT32>& rightReferences)
+    {
+        struct ReferenceSplit
+        {
+            UINT32      reference;
+            XMVECTOR    leftMin;
+            XMVECTOR    leftMax;
+            XMVECTOR    rightMin;
+            XMVECTOR    rightMax;
+        };
+        std::vector<ReferenceSplit> referenceSplits;
+
+        XMVECTOR leftMin = split.leftMin;
+        XMVECTOR leftMax = split.leftMax;
+        XMVECTOR rightMin = split.rightMin;
+        XMVECTOR rightMax = split.rightMax;
+        UINT32 numLeft = split.numLeft;
+        UINT32 numRight = split.numRight;
+        const UINT dimension = split.dimension;
+
+        for (UINT32 reference : nodeReferences)
+        {
+            const XMVECTOR referenceMin = XMLoadFloat4A(&references.bounds.boxMin[reference]);
+            const XMVECTOR referenceMax = XMLoadFloat4A(&references.bounds.boxMax[reference]);
+
+            if (!references.CanSplit(reference))
+            {
+                const bool isLeft = mapping.GetBinIndex(references.bounds, reference, dimension) <= split.bin;
+                (isLeft ? leftReferences : rightReferences).push_back(reference);
+                continue;
+            }
+
+            if (mapping.GetPositionBinIndex(XMVectorGetByIndex(referenceMax, dimension), dimension) <= split.bin)
+            {
+                leftReferences.push_back(reference);
+                continue;
+            }
+            if (mapping.GetPositionBinIndex(XMVectorGetByIndex(referenceMin, dimension), dimension) > split.bin)
+            {
+                rightReferences.push_back(reference);
+                continue;
+            }
+
+            ReferenceSplit referenceSplit;
+            referenceSplit.reference = reference;
+            const float* pTriangle = references.GetTriangle(reference);
+            const bool hasLeftPart = ClipReference(pTriangle, referenceMin, referenceMax,
+                dimension, -FLT_MAX, split.plane, referenceSplit.leftMin, referenceSplit.leftMax);
+            const bool hasRightPart = ClipReference(pTriangle, referenceMin, referenceMax,
+                dimension, split.plane, FLT_MAX, referenceSplit.rightMin, referenceSplit.rightMax);
+            if (!hasLeftPart || !hasRightPart)
+            {
+                (hasLeftPart ? leftReferences : rightReferences).push_back(reference);
+                continue;
+            }
+
+            // Cost of splitting, and of keeping the whole reference on either side,
+            // which is only possible while the other side keeps a reference
+            const float splitCost = ComputeSubtreeCost(leftMin, leftMax, rightMin, rightMax, numLeft, numRight);
+            const bool canKeepLeft = numRight > 1;
+            const bool canKeepRight = numLeft > 1;
+            const float leftCost = canKeepLeft ? ComputeSubtreeCost(XMVectorMin(leftMin, referenceMin), XMVectorMax(leftMax, referenceMax),
+                rightMin, rightMax, numLeft, numRight - 1) : FLT_MAX;
+            const float rightCost = canKeepRight ? ComputeSubtreeCost(leftMin, leftMax,
+                XMVectorMin(rightMin, referenceMin), XMVectorMax(rightMax, referenceMax), numLeft - 1, numRight) : FLT_MAX;
+
+            const bool isWithinBudget =
+                nodeReferences.size() + referenceSplits.size() < maxNumReferences;
+            if (canKeepLeft && (leftCost < splitCost || !isWithinBudget) && (leftCost <= rightCost || !canKeepRight))
+            {
+                leftReferences.push_back(reference);
+                leftMin = XMVectorMin(leftMin, referenceMin);
+                leftMax = XMVectorMax(leftMax, referenceMax);
+                numRight--;
+            }
+            else if (canKeepRight && (rightCost < splitCost || !isWithinBudget))
+            {
+                rightReferences.push_back(reference);
+                rightMin = XMVectorMin(rightMin, referenceMin);
+                rightMax = XMVectorMax(rightMax, referenceMax);
+                numLeft--;
+            }
+            else if (isWithinBudget)
+            {
+                referenceSplits.push_back(referenceSplit);
+            }
+            else
+            {
+                (references.bounds.GetCentroid(reference, dimension) <= split.plane ?
+                    leftReferences : rightReferences).push_back(reference);
+            }
+        }
+
+        if (leftReferences.size() + referenceSplits.size() == 0 ||
+            rightReferences.size() + referenceSplits.size() == 0)
+        {
+            leftReferences.clear();
+            rightReferences.clear();
+            return false;
+        }
+
+        for (const ReferenceSplit& referenceSplit : referenceSplits)
+        {
+            references.bounds.SetBox(referenceSplit.reference, referenceSplit.leftMin, referenceSplit.leftMax);
+            leftReferences.push_back(referenceSplit.reference);
+
+            rightReferences.push_back(references.GetNumReferences());
+            references.primitives.push_back(references.primitives[referenceSplit.reference]);
+            references.bounds.boxMin.push_back(XMFLOAT4A());
+            references.bounds.boxMax.push_back(XMFLOAT4A());
+            references.bounds.centroid.push_back(XMFLOAT4A());
+            references.bounds.SetBox(rightReferences.back(), referenceSplit.rightMin, referenceSplit.rightMax);
+        }
+
+        return true;
+    }
+
+    //
+    // Pending node of the spatial split build with its own list of references, and
+    // how many its subtree may have once split
+    //
+
+    struct SpatialSplitItem
+    {
+        std::vector<UINT32> references;
+        UINT32              nodeIndex;
+        UINT32              maxNumReferences;
+    };
+
+    template <UINT NumBins>
+    static
+        void BuildSpatialSplitBVH(
+            BVH& bvh,
+            const PrimitiveBounds& bounds,
+            const std::vector<float>& triangleVertices,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            UINT32 maxTrisInLeaf,
+            float spatialSplitBudget)
+    {
+        const UINT32 numPrimitives = (UINT32)primitiveMetaData.size();
+
+        SpatialSplitReferences references;
+        references.bounds = bounds;
+        references.primitives.resize(numPrimitives);
+        references.pTriangleVertices = &triangleVertices;
+        references.pPrimitiveMetaData = &primitiveMetaData;
+        references.maxNumReferences = GetMaxNumReferences(numPrimitives, spatialSplitBudget);
+        references.bounds.boxMin.reserve(references.maxNumReferences);
+        references.bounds.boxMax.reserve(references.maxNumReferences);
+        references.bounds.centroid.reserve(references.maxNumReferences);
+        references.primitives.reserve(references.maxNumReferences);
+
+        std::vector<SpatialSplitItem> stack(1);
+        stack[0].references.resize(numPrimitives);
+        for (UINT32 i = 0; i < numPrimitives; ++i)
+        {
+            references.primitives[i] = i;
+            stack[0].references[i] = i;
+        }
+        stack[0].nodeIndex = 0;
+        stack[0].maxNumReferences = references.maxNumReferences;
+
+        bvh.m_nodes.reserve(std::max(2 * references.maxNumReferences, 2u) - 1);
+        bvh.m_nodes.resize(1);
+        bvh.m_metadata.clear();
+        bvh.m_metadata.reserve(references.maxNumReferences);
+
+        float rootArea = 0;
+        size_t maxStackSize = 0;
+        while (!stack.empty())
+        {
+            SpatialSplitItem item = std::move(stack.back());
+            stack.pop_back();
+
+            std::vector<UINT32>& nodeReferences = item.references;
+            const UINT32 numReferences = (UINT32)nodeReferences.size();
+
+            AABB nodeBox;
+            ComputeBox(nodeBox, references.bounds, nodeReferences.data(), numReferences);
+            if (item.nodeIndex == 0)
+            {
+                rootArea = ComputeBoxSurfaceArea(nodeBox);
+            }
+
+            // Leaves take the next slots of the output primitives
+            if (numReferences <= maxTrisInLeaf)
+            {
+                BuildBVHAddLeaf(bvh, item.nodeIndex, nodeBox, (UINT32)bvh.m_metadata.size(), numReferences);
+                for (UINT32 reference : nodeReferences)
+                {
+                    bvh.m_metadata.push_back(primitiveMetaData[references.primitives[reference]]);
+                }
+                continue;
+            }
+
+            //
+            // Object split, and how much its children overlap
+            //
+
+            SahBinMapping<NumBins> mapping;
+            mapping.Init(nodeBox);
+
+            SahBins<NumBins> sahBins;
+            BinTriangles(sahBins, mapping, references.bounds, nodeReferences.data(), numReferences);
+
+            UINT splitDimension;
+            UINT bestBin;
+            const UINT32 numObjectLeft = FindSahSplit(sahBins, mapping, numReferences, nodeBox, splitDimension, bestBin);
+
+            // Without an object split the references are split at the median, and
+            // both halves are taken to fill the node
+            const XMVECTOR nodeMin = XMLoadFloat3((const XMFLOAT3*)nodeBox.minArr);
+            const XMVECTOR nodeMax = XMLoadFloat3((const XMFLOAT3*)nodeBox.maxArr);
+            float overlapArea = ComputeBoxSurfaceArea(nodeMin, nodeMax);
+            float objectCost = ComputeSubtreeCost(nodeMin, nodeMax, nodeMin, nodeMax, numReferences / 2, numReferences - numReferences / 2);
+            if (numObjectLeft != 0)
+            {
+                XMVECTOR leftMin = sahBins.boxMin[splitDimension][0];
+                XMVECTOR leftMax = sahBins.boxMax[splitDimension][0];
+                XMVECTOR rightMin = sahBins.boxMin[splitDimension][NumBins - 1];
+                XMVECTOR rightMax = sahBins.boxMax[splitDimension][NumBins - 1];
+                for (UINT j = 0; j < NumBins; ++j)
+                {
+                    if (j <= bestBin)
+                    {
+                        leftMin = XMVectorMin(leftMin, sahBins.boxMin[splitDimension][j]);
+                        leftMax = XMVectorMax(leftMax, sahBins.boxMax[splitDimension][j]);
+                    }
+                    else
+                    {
+                        rightMin = XMVectorMin(rightMin, sahBins.boxMin[splitDimension][j]);
+                        rightMax = XMVectorMax(rightMax, sahBins.boxMax[splitDimension][j]);
+                    }
+                }
+                overlapArea = ComputeOverlapSurfaceArea(leftMin, leftMax, rightMin, rightMax);
+                objectCost = ComputeSubtreeCost(leftMin, leftMax, rightMin, rightMax, numObjectLeft, numReferences - numObjectLeft);
+            }
+
+            //
+            // Spatial split, where the overlap is worth it and the budget allows
+            //
+
+            std::vector<UINT32> leftReferences;
+            std::vector<UINT32> rightReferences;
+
+            SahBinMapping<NUM_SPATIAL_SPLIT_BINS> spatialMapping;
+            spatialMapping.Init(nodeBox);
+
+            SpatialSplit spatialSplit;
+            if (overlapArea > SPATIAL_SPLIT_OVERLAP_THRESHOLD * rootArea &&
+                numReferences < item.maxNumReferences &&
+                FindSpatialSplit(spatialMapping, references, nodeReferences, nodeBox, spatialSplit) &&
+                spatialSplit.cost < objectCost &&
+                PartitionSpatialSplit(references, spatialMapping, nodeReferences, spatialSplit, item.maxNumReferences,
+                    leftReferences, rightReferences))
+            {
+                splitDimension = spatialSplit.dimension;
+            }
+            else
+            {
+                UINT32 numLeft;
+                if (numObjectLeft != 0)
+                {
+                    numLeft = (UINT32)(std::partition(nodeReferences.begin(), nodeReferences.end(),
+                        [&](UINT32 reference) { return mapping.GetBinIndex(references.bounds, reference, splitDimension) <= bestBin; }) -
+                        nodeReferences.begin());
+                    assert(numLeft == numObjectLeft);
+                }
+                else
+                {
+                    numLeft = MedianSplit(nodeReferences.data(), numReferences, splitDimension, nodeBox, references.bounds);
+                }
+
+                leftReferences.assign(nodeReferences.begin(), nodeReferences.begin() + numLeft);
+                rightReferences.assign(nodeReferences.begin() + numLeft, nodeReferences.end());
+            }
+
+            //
+            // "Recurse", left first so the leaves come out in order
+            //
+
+            BuildBVHAddNode(bvh, item.nodeIndex, nodeBox, splitDimension);
+
+            const UINT32 leftNodeIndex = (UINT32)bvh.m_nodes.size();
+            bvh.m_nodes.resize(leftNodeIndex + 2);
+            bvh.m_nodes[item.nodeIndex].internalNode.leftNodeIndex = leftNodeIndex;
+            bvh.m_nodes[item.nodeIndex].rightNodeIndex = leftNodeIndex + 1;
+
+            // The rest of the budget goes to the children in proportion to their references
+            const UINT32 numLeftReferences = (UINT32)leftReferences.size();
+            const UINT32 numRightReferences = (UINT32)rightReferences.size();
+            const UINT32 budgetLeft = item.maxNumReferences - numLeftReferences - numRightReferences;
+            const UINT32 leftBudget = (UINT32)((UINT64)budgetLeft * numLeftReferences / (numLeftReferences + numRightReferences));
+
+            nodeReferences.clear();
+            nodeReferences.shrink_to_fit();
+            stack.push_back({ std::move(rightReferences), leftNodeIndex + 1, item.maxNumReferences - numLeftReferences - leftBudget });
+            stack.push_back({ std::move(leftReferences), leftNodeIndex, numLeftReferences + leftBudget });
+            maxStackSize = std::max(maxStackSize, stack.size());
+        }
+
+        // Pending nodes hold every reference once, and the node being split holds its own twice
+        bvh.m_scratchSize = references.bounds.GetCapacityInBytes() +
+            references.primitives.capacity() * 3 * sizeof(UINT32) +
+            maxStackSize * sizeof(SpatialSplitItem);
+    }
+
+    //
+    // Linear BVH, built in the same stages as the GPU builder: the scene box, Morton
+    // codes of the centroids within it, a radix sort of the codes, a hierarchy split
+    // where the sorted codes first differ (Karras 2012), and boxes computed bottom-up.
+    // This builds several times faster than the SAH build, but the tree is worse.
+    //
+    // As on the GPU, the n - 1 internal nodes come first, with the root at 0, followed
+    // by the leaves in sorted order.
+    //
+
+    static
+        int CountLeadingZeroes(
+            UINT32 num)
+    {
+        assert(num != 0);
+        unsigned long highestBit;
+        _BitScanReverse(&highestBit, num);
+        return 31 - (int)highestBit;
+    }
+
+    // Spreads the low 10 bits of v out to every third bit
+    static
+        UINT32 ExpandMortonCodeBits(
+            UINT32 v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    //
+    // 10 bits per axis, interleaved as y, x, z from the lowest bit like
+    // CalculateMortonCodes.hlsli
+    //
+
+    static
+        UINT32 CalculateMortonCode(
+            FXMVECTOR centroid,
+            FXMVECTOR sceneMin,
+            FXMVECTOR inverseSceneDimension)
+    {
+        const XMVECTOR unitCoord = XMVectorMultiply(XMVectorSubtract(centroid, sceneMin), inverseSceneDimension);
+        const XMVECTOR coord = XMVectorClamp(XMVectorScale(unitCoord, 1024.0f), XMVectorZero(), XMVectorReplicate(1023.0f));
+
+        UINT coords[4];
+        XMStoreInt4(coords, XMConvertVectorFloatToInt(coord, 0));
+
+        return ExpandMortonCodeBits(coords[1]) |
+            (ExpandMortonCodeBits(coords[0]) << 1) |
+            (ExpandMortonCodeBits(coords[2]) << 2);
+    }
+
+    static
+        int GetLongestCommonPrefix(
+            const UINT32* pMortonCodes,
+            UINT32 numElements,
+            int indexA,
+            int indexB)
+    {
+        if (indexB < 0 || indexB >= (int)numElements)
+        {
+            return -1;
+        }
+
+        // Equal codes fall back to the indices, so every pair still has a unique prefix
+        const UINT32 mortonCodeA = pMortonCodes[indexA];
+        const UINT32 mortonCodeB = pMortonCodes[indexB];
+        if (mortonCodeA != mortonCodeB)
+        {
+            return CountLeadingZeroes(mortonCodeA ^ mortonCodeB);
+        }
+        else
+        {
+            return 32 + CountLeadingZeroes(indexA ^ indexB);
+        }
+    }
+
+    //
+    // Karras 2012: finds the range of leaves under an internal node, and the split
+    // within it. Mirrors BuildBVHSplits.hlsli.
+    //
+
+    static
+        void GenerateHierarchy(
+            const UINT32* pMortonCodes,
+            UINT32 numElements,
+            int idx,
+            UINT32& leftNodeIndex,
+            UINT32& rightNodeIndex)
+    {
+        // Determine range
+        const int d = GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + 1) -
+            GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx - 1) > 0 ? 1 : -1;
+        const int minPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx - d);
+
+        int maxLength = 2;
+        while (GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + maxLength * d) > minPrefix)
+        {
+            maxLength *= 4;
+        }
+
+        int length = 0;
+        for (int t = maxLength / 2; t > 0; t /= 2)
+        {
+            if (GetLongestCommonPrefix(pMortonCodes, numElements, idx, idx + (length + t) * d) > minPrefix)
+            {
+                length = length + t;
+            }
+        }
+
+        const int j = idx + length * d;
+        const int first = std::min(idx, j);
+        const int last = std::max(idx, j);
+
+        // Find split
+        const int commonPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, first, last);
+        int split = first;
+        int step = last - first;
+        do
+        {
+            step = (step + 1) >> 1;
+            const int newSplit = split + step;
+
+            if (newSplit < last)
+            {
+                const int splitPrefix = GetLongestCommonPrefix(pMortonCodes, numElements, first, newSplit);
+                if (splitPrefix > commonPrefix)
+                    split = newSplit;
+            }
+        } while (step > 1);
+
+        const UINT32 leafNodeOffset = numElements - 1;
+        leftNodeIndex = split == first ? leafNodeOffset + split : split;
+        rightNodeIndex = split + 1 == last ? leafNodeOffset + split + 1 : split + 1;
+    }
+
+    static
+        void BuildLinearBVH(
+            BVH& bvh,
+            const PrimitiveBounds& bounds,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            CpuTaskPool& taskPool)
+    {
+        static const UINT32 ELEMENTS_PER_TASK = 1 << 14;
+
+        const UINT32 numElements = (UINT32)primitiveMetaData.size();
+        const UINT32 numInternalNodes = std::max(numElements, 1u) - 1;
+        const UINT32 numNodes = numInternalNodes + std::max(numElements, 1u);
+        const UINT numTasks = (numElements + ELEMENTS_PER_TASK - 1) / ELEMENTS_PER_TASK;
+
+        bvh.m_nodes.resize(numNodes);
+        bvh.m_metadata.resize(numElements);
+
+        if (numElements <= 1)
+        {
+            const UINT32 primitiveIndex = 0;
+            AABB box;
+            ComputeBox(box, bounds, &primitiveIndex, numElements);
+            BuildBVHAddLeaf(bvh, 0, box, 0, numElements);
+            bvh.m_metadata.assign(primitiveMetaData.begin(), primitiveMetaData.end());
+            bvh.m_scratchSize = 0;
+            return;
+        }
+
+        //
+        // Scene AABB
+        //
+        std::vector<AABB> taskBoxes(numTasks);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 begin = task * ELEMENTS_PER_TASK;
+            const UINT32 end = std::min(begin + ELEMENTS_PER_TASK, numElements);
+
+            XMVECTOR boxMin = XMLoadFloat4A(&bounds.boxMin[begin]);
+            XMVECTOR boxMax = XMLoadFloat4A(&bounds.boxMax[begin]);
+            for (UINT32 i = begin + 1; i < end; ++i)
+            {
+                boxMin = XMVectorMin(boxMin, XMLoadFloat4A(&bounds.boxMin[i]));
+                boxMax = XMVectorMax(boxMax, XMLoadFloat4A(&bounds.boxMax[i]));
+            }
+
+            XMStoreFloat3((XMFLOAT3*)taskBoxes[task].minArr, boxMin);
+            XMStoreFloat3((XMFLOAT3*)taskBoxes[task].maxArr, boxMax);
+        });
+
+        AABB sceneBox = taskBoxes[0];
+        for (UINT task = 1; task < numTasks; ++task)
+        {
+            AddExtentToBox(sceneBox, taskBoxes[task]);
+        }
+
+        //
+        // Morton codes. Unlike the GPU pass, every axis is normalized by the
+        // longest scene extent so flat scenes don't spend a third of the
+        // splits on their thin axis.
+        //
+        const float epsilon = 0.00001f;
+        const XMVECTOR sceneMin = XMLoadFloat3((const XMFLOAT3*)sceneBox.minArr);
+        const XMVECTOR sceneExtent = XMVectorSubtract(XMLoadFloat3((const XMFLOAT3*)sceneBox.maxArr), sceneMin);
+        const float sceneDimension = std::max(epsilon, std::max(XMVectorGetX(sceneExtent),
+            std::max(XMVectorGetY(sceneExtent), XMVectorGetZ(sceneExtent))));
+        const XMVECTOR inverseSceneDimension = XMVectorReplicate(1.0f / sceneDimension);
+
+        std::vector<UINT32> mortonCodes(numElements);
+        std::vector<UINT32> sortedIndices(numElements);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * ELEMENTS_PER_TASK, numElements);
+            for (UINT32 i = task * ELEMENTS_PER_TASK; i < end; ++i)
+            {
+                mortonCodes[i] = CalculateMortonCode(XMLoadFloat4A(&bounds.centroid[i]), sceneMin, inverseSceneDimension);
+                sortedIndices[i] = i;
+            }
+        });
+
+        //
+        // Sort. Morton codes only use 30 bits, which 11-bit digits cover in 3 passes.
+        //
+        {
+            std::vector<UINT32> keysScratch(numElements);
+            std::vector<UINT32> valuesScratch(numElements);
+            RadixSort(mortonCodes.data(), sortedIndices.data(), keysScratch.data(), valuesScratch.data(), numElements, taskPool, 11);
+            bvh.m_scratchSize = (keysScratch.capacity() + valuesScratch.capacity()) * sizeof(UINT32);
+        }
+
+        //
+        // Hierarchy
+        //
+        std::vector<UINT32> childIndices(2 * numInternalNodes);
+        std::vector<UINT32> parentIndices(numNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * ELEMENTS_PER_TASK, numInternalNodes);
+            for (UINT32 i = task * ELEMENTS_PER_TASK; i < end; ++i)
+            {
+                UINT32& leftNodeIndex = childIndices[2 * i];
+                UINT32& rightNodeIndex = childIndices[2 * i + 1];
+                GenerateHierarchy(mortonCodes.data(), numElements, (int)i, leftNodeIndex, rightNodeIndex);
+
+                parentIndices[leftNodeIndex] = i;
+                parentIndices[rightNodeIndex] = i;
+            }
+        });
+
+        //
+        // AABBs, from every leaf up. The second child to finish computes the parent.
+        //
+        std::vector<AABB> nodeBoxes(numNodes);
+        std::vector<std::atomic<UINT>> childNodesProcessedCounters(numInternalNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * ELEMENTS_PER_TASK, numElements);
+            for (UINT32 leafIndex = task * ELEMENTS_PER_TASK; leafIndex < end; ++leafIndex)
+            {
+                UINT32 nodeIndex = numInternalNodes + leafIndex;
+                ComputeBox(nodeBoxes[nodeIndex], bounds, &sortedIndices[leafIndex], 1);
+                BuildBVHAddLeaf(bvh, nodeIndex, nodeBoxes[nodeIndex], leafIndex, 1);
+                bvh.m_metadata[leafIndex] = primitiveMetaData[sortedIndices[leafIndex]];
+
+                while (nodeIndex != 0)
+                {
+                    const UINT32 parentIndex = parentIndices[nodeIndex];
+                    if (childNodesProcessedCounters[parentIndex]++ == 0)
+                    {
+                        break;
+                    }
+
+                    nodeIndex = parentIndex;
+                    const UINT32 leftNodeIndex = childIndices[2 * nodeIndex];
+                    const UINT32 rightNodeIndex = childIndices[2 * nodeIndex + 1];
+
+                    nodeBoxes[nodeIndex] = nodeBoxes[leftNodeIndex];
+                    AddExtentToBox(nodeBoxes[nodeIndex], nodeBoxes[rightNodeIndex]);
+
+                    BuildBVHAddNode(bvh, nodeIndex, nodeBoxes[nodeIndex], 0);
+                    bvh.m_nodes[nodeIndex].internalNode.leftNodeIndex = leftNodeIndex;
+                    bvh.m_nodes[nodeIndex].rightNodeIndex = rightNodeIndex;
+                }
+            }
+        });
+
+        bvh.m_scratchSize = std::max(bvh.m_scratchSize,
+            (childIndices.capacity() + parentIndices.capacity() + numInternalNodes) * sizeof(UINT32) +
+            nodeBoxes.capacity() * sizeof(AABB));
+        bvh.m_scratchSize += (mortonCodes.capacity() + sortedIndices.capacity()) * sizeof(UINT32);
+    }
+
+    static const UINT TRIANGLES_PER_GATHER = 1 << 16;
+
+    //
+    // Triangles of a geometry handed to one task when gathering
+    //
+
+    struct GatherItem
+    {
+        UINT    geometryIndex;
+        UINT    firstTriangle;      // within the geometry
+        UINT    numTriangles;
+        UINT    outputIndex;        // within all geometries
+    };
+
+    template <UINT NumBins>
+    static
+        void BuildSahBVH(
+            BVH& bvh,
+            const PrimitiveBounds& bounds,
+            const std::vector<float>& triangleVertices,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            float spatialSplitBudget,
+            CpuTaskPool& taskPool)
+    {
+        if (spatialSplitBudget > 0)
+        {
+            BuildSpatialSplitBVH<NumBins>(bvh, bounds, triangleVertices, primitiveMetaData, MAX_TRIS_IN_LEAF, spatialSplitBudget);
+        }
+        else
+        {
+            BuildBVH<NumBins>(bvh, bounds, primitiveMetaData, MAX_TRIS_IN_LEAF, taskPool);
+        }
+    }
+
+    //
+    // Treelet reordering, after Karras and Aila 2013 and TreeletReorder.hlsl
+    //
+    // A treelet grows from a node by repeatedly expanding its largest leaf until it
+    // has 7 leaves, which may be whole subtrees. The cheapest binary tree over those
+    // leaves is found by dynamic programming over every subset of them, and replaces
+    // the treelet using the same internal nodes. Leaves keep their primitives, so
+    // this runs on the output of any of the builders above.
+    //
+
+    static const UINT FULL_TREELET_SIZE = 7;
+    static const UINT NUM_TREELET_SUBSETS = 1 << FULL_TREELET_SIZE;
+
+    // Same as the GPU pass
+    static const float COST_OF_RAY_BOX_INTERSECTION = 1.2f;
+    static const float COST_OF_RAY_TRIANGLE_INTERSECTION = 1.0f;
+
+    // Below this many triangles, a subtree is reordered within the task of an ancestor
+    static const UINT MIN_TRIANGLES_PER_TREELET_TASK = 4 * 1024;
+
+    static
+        void LoadNodeBox(
+            const AABBNode& node,
+            XMVECTOR& boxMin,
+            XMVECTOR& boxMax)
+    {
+        const XMVECTOR center = XMLoadFloat3((const XMFLOAT3*)node.center);
+        const XMVECTOR halfDim = XMLoadFloat3((const XMFLOAT3*)node.halfDim);
+        boxMin = XMVectorSubtract(center, halfDim);
+        boxMax = XMVectorAdd(center, halfDim);
+    }
+
+    static
+        void BuildBVHSetInternalNode(
+            BVH& bvh,
+            UINT32 nodeIndex,
+            FXMVECTOR boxMin,
+            FXMVECTOR boxMax,
+            UINT32 leftNodeIndex,
+            UINT32 rightNodeIndex)
+    {
+        AABB box;
+        XMStoreFloat3((XMFLOAT3*)box.minArr, boxMin);
+        XMStoreFloat3((XMFLOAT3*)box.maxArr, boxMax);
+
+        BuildBVHAddNode(bvh, nodeIndex, box, 0);
+        bvh.m_nodes[nodeIndex].internalNode.leftNodeIndex = leftNodeIndex;
+        bvh.m_nodes[nodeIndex].rightNodeIndex = rightNodeIndex;
+    }
+
+    //
+    // SAH cost of every subtree, without normalizing by the root box, and the number
+    // of primitives in it. Every leaf walks up until it reaches a node whose other
+    // child isn't done yet, as in the linear build.
+    //
+
+    static
+        void ComputeTreeletCosts(
+            const BVH& bvh,
+            std::vector<float>& nodeCosts,
+            std::vector<UINT32>& nodeSizes,
+            CpuTaskPool& taskPool)
+    {
+        static const UINT NODES_PER_TASK = 16 * 1024;
+
+        const UINT32 numNodes = (UINT32)bvh.m_nodes.size();
+        const UINT numTasks = (numNodes + NODES_PER_TASK - 1) / NODES_PER_TASK;
+
+        std::vector<UINT32> parentIndices(numNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * NODES_PER_TASK, numNodes);
+            for (UINT32 i = task * NODES_PER_TASK; i < end; ++i)
+            {
+                const AABBNode& node = bvh.m_nodes[i];
+                if (!node.leaf)
+                {
+                    parentIndices[node.internalNode.leftNodeIndex] = i;
+                    parentIndices[node.rightNodeIndex] = i;
+                }
+            }
+        });
+
+        std::vector<std::atomic<UINT>> childNodesProcessedCounters(numNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * NODES_PER_TASK, numNodes);
+            for (UINT32 i = task * NODES_PER_TASK; i < end; ++i)
+            {
+                const AABBNode& leaf = bvh.m_nodes[i];
+                if (!leaf.leaf)
+                {
+                    continue;
+                }
+
+                XMVECTOR boxMin, boxMax;
+                LoadNodeBox(leaf, boxMin, boxMax);
+                nodeCosts[i] = COST_OF_RAY_TRIANGLE_INTERSECTION * ComputeBoxSurfaceArea(boxMin, boxMax) * leaf.leafNode.numTriangleIds;
+                nodeSizes[i] = leaf.leafNode.numTriangleIds;
+
+                UINT32 nodeIndex = i;
+                while (nodeIndex != 0)
+                {
+                    nodeIndex = parentIndices[nodeIndex];
+                    if (childNodesProcessedCounters[nodeIndex]++ == 0)
+                    {
+                        break;
+                    }
+
+                    const AABBNode& node = bvh.m_nodes[nodeIndex];
+                    LoadNodeBox(node, boxMin, boxMax);
+                    nodeCosts[nodeIndex] = COST_OF_RAY_BOX_INTERSECTION * ComputeBoxSurfaceArea(boxMin, boxMax) +
+                        nodeCosts[node.internalNode.leftNodeIndex] + nodeCosts[node.rightNodeIndex];
+                    nodeSizes[nodeIndex] = nodeSizes[node.internalNode.leftNodeIndex] + nodeSizes[node.rightNodeIndex];
+                }
+            }
+        });
+    }
+
+    static
+        void ReorderTreelet(
+            BVH& bvh,
+            UINT32 rootIndex,
+            std::vector<float>& nodeCosts,
+            std::vector<UINT32>& nodeSizes)
+    {
+        //
+        // Form the treelet
+        //
+
+        UINT32 leaves[FULL_TREELET_SIZE];
+        UINT32 internalNodes[FULL_TREELET_SIZE - 1];
+        XMVECTOR subsetMin[NUM_TREELET_SUBSETS];
+        XMVECTOR subsetMax[NUM_TREELET_SUBSETS];
+        float leafAreas[FULL_TREELET_SIZE];
+
+        const AABBNode& root = bvh.m_nodes[rootIndex];
+        leaves[0] = root.internalNode.leftNodeIndex;
+        leaves[1] = root.rightNodeIndex;
+        internalNodes[0] = rootIndex;
+        UINT numLeaves = 2;
+        UINT numInternalNodes = 1;
+        for (UINT i = 0; i < numLeaves; ++i)
+        {
+            LoadNodeBox(bvh.m_nodes[leaves[i]], subsetMin[1 << i], subsetMax[1 << i]);
+            leafAreas[i] = ComputeBoxSurfaceArea(subsetMin[1 << i], subsetMax[1 << i]);
+        }
+
+        while (numLeaves < FULL_TREELET_SIZE)
+        {
+            int largestLeaf = -1;
+            for (UINT i = 0; i < numLeaves; ++i)
+            {
+                if (!bvh.m_nodes[leaves[i]].leaf && (largestLeaf < 0 || leafAreas[i] > leafAreas[largestLeaf]))
+                {
+                    largestLeaf = (int)i;
+                }
+            }
+
+            if (largestLeaf < 0)
+            {
+                break;
+            }
+
+            const AABBNode& node = bvh.m_nodes[leaves[largestLeaf]];
+            internalNodes[numInternalNodes++] = leaves[largestLeaf];
+            leaves[largestLeaf] = node.internalNode.leftNodeIndex;
+            leaves[numLeaves] = node.rightNodeIndex;
+
+            const UINT newLeaves[] = { (UINT)largestLeaf, numLeaves };
+            for (UINT i : newLeaves)
+            {
+                LoadNodeBox(bvh.m_nodes[leaves[i]], subsetMin[1 << i], subsetMax[1 << i]);
+                leafAreas[i] = ComputeBoxSurfaceArea(subsetMin[1 << i], subsetMax[1 << i]);
+            }
+            ++numLeaves;
+        }
+
+        // Two leaves can only be joined one way
+        if (numLeaves < 3)
+        {
+            return;
+        }
+
+        //
+        // Find the cheapest partition of every subset. Proper subsets of a subset
+        // have smaller bitmasks, so they're always done first.
+        //
+
+        float optimalCosts[NUM_TREELET_SUBSETS];
+        UINT8 optimalPartitions[NUM_TREELET_SUBSETS];
+        UINT32 subsetSizes[NUM_TREELET_SUBSETS];
+
+        const UINT fullTreelet = (1 << numLeaves) - 1;
+        for (UINT i = 0; i < numLeaves; ++i)
+        {
+            optimalCosts[1 << i] = nodeCosts[leaves[i]];
+            subsetSizes[1 << i] = nodeSizes[leaves[i]];
+        }
+
+        for (UINT subset = 3; subset <= fullTreelet; ++subset)
+        {
+            const UINT lowestLeaf = subset & (0 - subset);
+            const UINT otherLeaves = subset ^ lowestLeaf;
+            if (otherLeaves == 0)
+            {
+                continue;
+            }
+
+            subsetMin[subset] = XMVectorMin(subsetMin[lowestLeaf], subsetMin[otherLeaves]);
+            subsetMax[subset] = XMVectorMax(subsetMax[lowestLeaf], subsetMax[otherLeaves]);
+            subsetSizes[subset] = subsetSizes[lowestLeaf] + subsetSizes[otherLeaves];
+
+            // Keeping the lowest leaf on the right visits every split once
+            float lowestCost = FLT_MAX;
+            UINT bestPartition = otherLeaves;
+            for (UINT partition = otherLeaves; partition != 0; partition = (partition - 1) & otherLeaves)
+            {
+                const float cost = optimalCosts[partition] + optimalCosts[subset ^ partition];
+                if (cost < lowestCost)
+                {
+                    lowestCost = cost;
+                    bestPartition = partition;
+                }
+            }
+
+            optimalCosts[subset] = COST_OF_RAY_BOX_INTERSECTION * ComputeBoxSurfaceArea(subsetMin[subset], subsetMax[subset]) + lowestCost;
+            optimalPartitions[subset] = (UINT8)bestPartition;
+        }
+
+        if (!(optimalCosts[fullTreelet] < nodeCosts[rootIndex]))
+        {
+            return;
+        }
+
+        //
+        // Reform the treelet top-down, handing out its internal nodes in order
+        //
+
+        UINT stack[FULL_TREELET_SIZE] = { fullTreelet };
+        UINT32 stackNodes[FULL_TREELET_SIZE] = { rootIndex };
+        UINT stackSize = 1;
+        UINT nextInternalNode = 1;
+        while (stackSize > 0)
+        {
+            --stackSize;
+            const UINT subset = stack[stackSize];
+            const UINT32 nodeIndex = stackNodes[stackSize];
+
+            const UINT childSubsets[] = { optimalPartitions[subset], subset ^ optimalPartitions[subset] };
+            UINT32 childIndices[2];
+            for (UINT child = 0; child < 2; ++child)
+            {
+                const UINT childSubset = childSubsets[child];
+                if ((childSubset & (childSubset - 1)) == 0)
+                {
+                    UINT leaf = 0;
+                    while ((1u << leaf) != childSubset)
+                    {
+                        ++leaf;
+                    }
+                    childIndices[child] = leaves[leaf];
+                }
+                else
+                {
+                    childIndices[child] = internalNodes[nextInternalNode++];
+                    stack[stackSize] = childSubset;
+                    stackNodes[stackSize] = childIndices[child];
+                    ++stackSize;
+                }
+            }
+
+            BuildBVHSetInternalNode(bvh, nodeIndex, subsetMin[subset], subsetMax[subset], childIndices[0], childIndices[1]);
+            nodeCosts[nodeIndex] = optimalCosts[subset];
+            nodeSizes[nodeIndex] = subsetSizes[subset];
+        }
+        assert(nextInternalNode == numInternalNodes);
+    }
+
+    //
+    // Each pass reorders the treelet of every node with enough primitives below it,
+    // children before parents. As on the GPU, that minimum starts at a full treelet
+    // and doubles every pass, so later passes only revisit the top of the tree.
+    //
+    // Subtrees of the top nodes are reordered on separate threads, and the top nodes
+    // after them. A treelet only reuses nodes from the subtree of its root, so the
+    // result doesn't depend on the number of threads.
+    //
+
+    static
+        void ReorderTreelets(
+            BVH& bvh,
+            UINT numPasses,
+            CpuTaskPool& taskPool)
+    {
+        const UINT32 numNodes = (UINT32)bvh.m_nodes.size();
+        if (numPasses == 0 || numNodes < 5)
+        {
+            return;
+        }
+
+        std::vector<float> nodeCosts(numNodes);
+        std::vector<UINT32> nodeSizes(numNodes);
+        ComputeTreeletCosts(bvh, nodeCosts, nodeSizes, taskPool);
+
+        const UINT32 maxTrianglesPerTask = std::max(nodeSizes[0] / (4 * taskPool.GetNumThreads()), MIN_TRIANGLES_PER_TREELET_TASK);
+
+        // Nodes in pre-order, so going backwards visits children before parents
+        std::vector<UINT32> topNodes;
+        std::vector<UINT32> taskRoots;
+        std::vector<UINT32> nodeStack;
+        std::vector<std::vector<UINT32>> taskNodes(taskPool.GetNumThreads());
+        for (UINT pass = 0; pass < numPasses; ++pass)
+        {
+            const UINT32 minTrianglesPerTreelet = FULL_TREELET_SIZE << pass;
+            if (minTrianglesPerTreelet > nodeSizes[0])
+            {
+                break;
+            }
+
+            const auto isTreeletRoot = [&](UINT32 nodeIndex)
+            {
+                return !bvh.m_nodes[nodeIndex].leaf && nodeSizes[nodeIndex] >= minTrianglesPerTreelet;
+            };
+
+            topNodes.clear();
+            taskRoots.clear();
+            nodeStack.assign(1, 0);
+            while (!nodeStack.empty())
+            {
+                const UINT32 nodeIndex = nodeStack.back();
+                nodeStack.pop_back();
+                if (!isTreeletRoot(nodeIndex))
+                {
+                    continue;
+                }
+
+                if (nodeSizes[nodeIndex] <= maxTrianglesPerTask)
+                {
+                    taskRoots.push_back(nodeIndex);
+                    continue;
+                }
+
+                topNodes.push_back(nodeIndex);
+                nodeStack.push_back(bvh.m_nodes[nodeIndex].rightNodeIndex);
+                nodeStack.push_back(bvh.m_nodes[nodeIndex].internalNode.leftNodeIndex);
+            }
+
+            std::atomic<UINT> nextTaskRoot(0);
+            taskPool.ParallelFor(taskPool.GetNumThreads(), [&](UINT thread)
+            {
+                std::vector<UINT32>& nodes = taskNodes[thread];
+                for (UINT task = nextTaskRoot++; task < taskRoots.size(); task = nextTaskRoot++)
+                {
+                    nodes.assign(1, taskRoots[task]);
+                    for (size_t i = 0; i < nodes.size(); ++i)
+                    {
+                        const AABBNode& node = bvh.m_nodes[nodes[i]];
+                        const UINT32 children[] = { node.internalNode.leftNodeIndex, node.rightNodeIndex };
+                        for (UINT32 child : children)
+                        {
+                            if (isTreeletRoot(child))
+                            {
+                                nodes.push_back(child);
+                            }
+                        }
+                    }
+
+                    for (size_t i = nodes.size(); i > 0; --i)
+                    {
+                        ReorderTreelet(bvh, nodes[i - 1], nodeCosts, nodeSizes);
+                    }
+                }
+            });
+
+            for (size_t i = topNodes.size(); i > 0; --i)
+            {
+                ReorderTreelet(bvh, topNodes[i - 1], nodeCosts, nodeSizes);
+            }
+        }
+
+        size_t taskNodesSize = 0;
+        for (const std::vector<UINT32>& nodes : taskNodes)
+        {
+            taskNodesSize += nodes.capacity();
+        }
+        bvh.m_scratchSize = std::max(bvh.m_scratchSize,
+            nodeCosts.capacity() * sizeof(float) + (2 * numNodes + nodeSizes.capacity() + topNodes.capacity() +
+                taskRoots.capacity() + nodeStack.capacity() + taskNodesSize) * sizeof(UINT32));
+    }
+
+    //
+    // Triangle gather kernels, specialized at compile time on the index and vertex
+    // formats so the loop over the triangles of a geometry doesn't branch on them
+    //
+
+    template <DXGI_FORMAT IndexFormat>
+    struct IndexFetch;
+
+    template <>
+    struct IndexFetch<DXGI_FORMAT_R16_UINT>
+    {
+        static UINT Load(const void* pIndices, UINT index)
+        {
+            return ((const UINT16*)pIndices)[index];
+        }
+    };
+
+    template <>
+    struct IndexFetch<DXGI_FORMAT_R32_UINT>
+    {
+        static UINT Load(const void* pIndices, UINT index)
+        {
+            return ((const UINT32*)pIndices)[index];
+        }
+    };
+
+    // Without an index buffer the vertices themselves are a triangle list
+    template <>
+    struct IndexFetch<DXGI_FORMAT_UNKNOWN>
+    {
+        static UINT Load(const void*, UINT index)
+        {
+            return index;
+        }
+    };
+
+    // Vertices load with w = 0
+    template <DXGI_FORMAT VertexFormat>
+    struct VertexFetch;
+
+    template <>
+    struct VertexFetch<DXGI_FORMAT_R32G32B32_FLOAT>
+    {
+        static XMVECTOR Load(const BYTE* pVertex)
+        {
+            return XMLoadFloat3((const XMFLOAT3*)pVertex);
+        }
+    };
+
+    template <>
+    struct VertexFetch<DXGI_FORMAT_R16G16B16A16_FLOAT>
+    {
+        static XMVECTOR Load(const BYTE* pVertex)
+        {
+            const USHORT* pHalves = (const USHORT*)pVertex;
+            return XMVectorSet(Fp16ToFp32(pHalves[0]), Fp16ToFp32(pHalves[1]), Fp16ToFp32(pHalves[2]), 0.0f);
+        }
+    };
+
+    // 2D vertices lie on the z = 0 plane
+    template <>
+    struct VertexFetch<DXGI_FORMAT_R32G32_FLOAT>
+    {
+        static XMVECTOR Load(const BYTE* pVertex)
+        {
+            return XMLoadFloat2((const XMFLOAT2*)pVertex);
+        }
+    };
+
+    //
+    // Loads a range of triangles of a geometry as 3 x 3 floats each, and stores
+    // their padded boxes and centroids at the same output indices. Coordinates
+    // that are NaN in any vertex collapse to 0 in the box.
+    //
+
+    template <DXGI_FORMAT IndexFormat, DXGI_FORMAT VertexFormat>
+    static
+        void GatherTriangles(
+            const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& triangles,
+            UINT firstTriangle,
+            UINT numTriangles,
+            UINT outputIndex,
+            float* pTriangleVertices,
+            PrimitiveBounds& bounds)
+    {
+        const BYTE* pVertices = (const BYTE*)triangles.VertexBuffer.StartAddress;
+        const UINT64 vertexStride = triangles.VertexBuffer.StrideInBytes;
+        const void* pIndices = (const void*)triangles.IndexBuffer;
+        const XMVECTOR padding = XMVectorSet(AABB_Min_Padding, AABB_Min_Padding, AABB_Min_Padding, 0.0f);
+
+        for (UINT i = 0; i < numTriangles; ++i)
+        {
+            const UINT firstIndex = (firstTriangle + i) * 3;
+            const XMVECTOR v0 = VertexFetch<VertexFormat>::Load(pVertices + IndexFetch<IndexFormat>::Load(pIndices, firstIndex + 0) * vertexStride);
+            const XMVECTOR v1 = VertexFetch<VertexFormat>::Load(pVertices + IndexFetch<IndexFormat>::Load(pIndices, firstIndex + 1) * vertexStride);
+            const XMVECTOR v2 = VertexFetch<VertexFormat>::Load(pVertices + IndexFetch<IndexFormat>::Load(pIndices, firstIndex + 2) * vertexStride);
+
+            XMFLOAT3* pTriVerts = (XMFLOAT3*)&pTriangleVertices[(outputIndex + i) * 9];
+            XMStoreFloat3(pTriVerts + 0, v0);
+            XMStoreFloat3(pTriVerts + 1, v1);
+            XMStoreFloat3(pTriVerts + 2, v2);
+
+            const XMVECTOR isNaN = XMVectorOrInt(XMVectorIsNaN(v0), XMVectorOrInt(XMVectorIsNaN(v1), XMVectorIsNaN(v2)));
+            const XMVECTOR triMin = XMVectorMin(v0, XMVectorMin(v1, v2));
+            const XMVECTOR triMax = XMVectorAdd(XMVectorMax(v0, XMVectorMax(v1, v2)), padding);
+            bounds.SetBox(outputIndex + i,
+                XMVectorSelect(triMin, XMVectorZero(), isNaN),
+                XMVectorSelect(triMax, XMVectorZero(), isNaN));
+        }
+    }
+
+    typedef void (*TriangleGatherFunction)(
+        const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& triangles,
+        UINT firstTriangle,
+        UINT numTriangles,
+        UINT outputIndex,
+        float* pTriangleVertices,
+        PrimitiveBounds& bounds);
+
+    template <DXGI_FORMAT IndexFormat>
+    static
+        TriangleGatherFunction GetTriangleGatherFunction(
+            DXGI_FORMAT vertexFormat)
+    {
+        switch (vertexFormat)
+        {
+        case DXGI_FORMAT_R32G32B32_FLOAT:
+        case DXGI_FORMAT_R32G32B32A32_FLOAT:    // w is ignored
+            return GatherTriangles<IndexFormat, DXGI_FORMAT_R32G32B32_FLOAT>;
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+            return GatherTriangles<IndexFormat, DXGI_FORMAT_R16G16B16A16_FLOAT>;
+        case DXGI_FORMAT_R32G32_FLOAT:
+            return GatherTriangles<IndexFormat, DXGI_FORMAT_R32G32_FLOAT>;
+        default:
+            ThrowFailure(E_NOTIMPL, L"Unsupported vertex buffer format provided");
+            return nullptr;
+        }
+    }
+
+    //
+    // Picks the gather kernel of a geometry once, rather than per triangle
+    //
+
+    static
+        TriangleGatherFunction GetTriangleGatherFunction(
+            const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC& triangles)
+    {
+        switch (triangles.IndexFormat)
+        {
+        case DXGI_FORMAT_R16_UINT:
+            return GetTriangleGatherFunction<DXGI_FORMAT_R16_UINT>(triangles.VertexFormat);
+        case DXGI_FORMAT_R32_UINT:
+            return GetTriangleGatherFunction<DXGI_FORMAT_R32_UINT>(triangles.VertexFormat);
+        case DXGI_FORMAT_UNKNOWN:
+            return GetTriangleGatherFunction<DXGI_FORMAT_UNKNOWN>(triangles.VertexFormat);
+        default:
+            ThrowFailure(E_NOTIMPL, L"Unsupported index buffer format provided");
+            return nullptr;
+        }
+    }
+
+    //
+    // Gathers the triangles of all geometries in parallel, in order, along with
+    // their bounds and metadata
+    //
+
+    static
+        void GatherGeometries(
+            UINT NumElements,
+            const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
+            PrimitiveBounds& bounds,
+            std::vector<float>& triangleVertices,
+            std::vector<PrimitiveMetaData>& primitiveMetaData,
+            CpuTaskPool &taskPool)
+    {
+        //
+        // Compute number of triangles, and split them into tasks
+        //
+
+        UINT    totalNumberOfTriangles = 0;
+        std::vector<GatherItem> gatherItems;
+        std::vector<TriangleGatherFunction> gatherFunctions(NumElements);
+
+        for (UINT i = 0; i < NumElements; ++i)
+        {
+            auto &geometry = pGeometries[i];
+            if (geometry.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            {
+                const UINT numTris = GetPrimitiveCountFromGeometryDesc(geometry);
+                for (UINT j = 0; j < numTris; j += TRIANGLES_PER_GATHER)
+                {
+                    gatherItems.push_back({ i, j, std::min(TRIANGLES_PER_GATHER, numTris - j), totalNumberOfTriangles + j });
+                }
+
+                gatherFunctions[i] = GetTriangleGatherFunction(geometry.Triangles);
+                totalNumberOfTriangles += numTris;
+            }
+            else
+            {
+                throw - 1; // Intersection shaders not supported yet
+            }
+
+        }
+
+        // Node indices are 24 bits, and a binary tree has 2n - 1 nodes
+        if (totalNumberOfTriangles > (1 << 23))
+        {
+            ThrowFailure(E_INVALIDARG, L"Too many triangles for the node indices of the CPU builder");
+        }
+
+        //
+        // Create AABBs
+        //
+
+        bounds.boxMin.resize(totalNumberOfTriangles);
+        bounds.boxMax.resize(totalNumberOfTriangles);
+        bounds.centroid.resize(totalNumberOfTriangles);
+        primitiveMetaData.resize(totalNumberOfTriangles);
+        triangleVertices.resize(totalNumberOfTriangles * 9);
+
+        taskPool.ParallelFor((UINT)gatherItems.size(), [&](UINT itemIndex)
+        {
+            const GatherItem& item = gatherItems[itemIndex];
+            const UINT i = item.geometryIndex;
+            auto &geometry = pGeometries[i];
+
+            gatherFunctions[i](geometry.Triangles, item.firstTriangle, item.numTriangles, item.outputIndex,
+                triangleVertices.data(), bounds);
+
+            // Create out internal triangle indices.
+            for (UINT triangleIndex = item.outputIndex; triangleIndex < item.outputIndex + item.numTriangles; ++triangleIndex)
+            {
+                PrimitiveMetaData metadata;
                 metadata.GeometryContributionToHitGroupIndex = i;
                 metadata.PrimitiveIndex = triangleIndex;
                 metadata.GeometryFlags = geometry.Flags;
                 primitiveMetaData[triangleIndex] = metadata;
+            }
+        });
+    }
+
+    //
+    // Only the SAH build makes spatial splits. Refits can't clip the parts of split
+    // triangles again, so structures that allow updates don't split them either.
+    //
+
+    static
+        float GetSpatialSplitBudget(
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+            const CpuBuildOptions *pOptions)
+    {
+        const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS objectSplitFlags =
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD |
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+        return pOptions && !(pDesc->Inputs.Flags & objectSplitFlags) ? pOptions->SpatialSplitBudget : 0.0f;
+    }
+
+    //
+    // The tree over the primitive boxes, from the builder the flags pick. Vertices are
+    // only read by spatial splits.
+    //
 
-                // Next triangle
-                triangleIndex++;
+    static
+        void BuildTree(
+            BVH& bvh,
+            const PrimitiveBounds& bounds,
+            const std::vector<float>& triangleVertices,
+            const std::vector<PrimitiveMetaData>& primitiveMetaData,
+            D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags,
+            UINT numSahBins,
+            float spatialSplitBudget,
+            UINT numTreeletPasses,
+            CpuTaskPool& taskPool)
+    {
+        if (buildFlags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD)
+        {
+            BuildLinearBVH(bvh, bounds, primitiveMetaData, taskPool);
+        }
+        else
+        {
+            switch (numSahBins)
+            {
+            case 8:
+                BuildSahBVH<8>(bvh, bounds, triangleVertices, primitiveMetaData, spatialSplitBudget, taskPool);
+                break;
+            case 16:
+                BuildSahBVH<16>(bvh, bounds, triangleVertices, primitiveMetaData, spatialSplitBudget, taskPool);
+                break;
+            case 32:
+                BuildSahBVH<32>(bvh, bounds, triangleVertices, primitiveMetaData, spatialSplitBudget, taskPool);
+                break;
+            case 64:
+                BuildSahBVH<64>(bvh, bounds, triangleVertices, primitiveMetaData, spatialSplitBudget, taskPool);
+                break;
+            default:
+                ThrowFailure(E_INVALIDARG, L"The CPU builder supports 8, 16, 32 or 64 SAH bins");
             }
         }
 
+        ReorderTreelets(bvh, numTreeletPasses, taskPool);
+    }
+
+    void BuildUniformBVH(
+        _In_  UINT NumElements,
+        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags,
+        UINT numSahBins,
+        float spatialSplitBudget,
+        UINT numTreeletPasses,
+        BVH &bvh,
+        CpuTaskPool &taskPool)
+    {
+        PrimitiveBounds bounds;
+        std::vector<PrimitiveMetaData> primitiveMetaData;
+        std::vector<float>  triangleVertices;
+        GatherGeometries(NumElements, pGeometries, bounds, triangleVertices, primitiveMetaData, taskPool);
+
         //
         // Create a BVH
         //
 
-        BuildBVH(bvh, boxes, primitiveMetaData, MAX_TRIS_IN_LEAF);
+        BuildTree(bvh, bounds, triangleVertices, primitiveMetaData, buildFlags, numSahBins, spatialSplitBudget, numTreeletPasses, taskPool);
 
         //
         // Now copy and compress geometry
         //
 
-        // Copy verts
-        const UINT numTris = triangleIndex;
+        // Copy verts, once for every reference when spatial splits duplicate them
+        const UINT numTris = (UINT)bvh.m_metadata.size();
         bvh.m_triangles.resize(numTris * 3 * 3);
-        assert(bvh.m_triangles.size() == triangleVertices.size());
+        assert(bvh.m_triangles.size() >= triangleVertices.size());
         assert(sizeof(bvh.m_triangles[0]) == sizeof(triangleVertices[0]));
 
-        for (UINT i = 0; i < numTris; ++i)
+        taskPool.ParallelFor((numTris + TRIANGLES_PER_GATHER - 1) / TRIANGLES_PER_GATHER, [&](UINT chunk)
+        {
+            const UINT end = std::min((chunk + 1) * TRIANGLES_PER_GATHER, numTris);
+            for (UINT i = chunk * TRIANGLES_PER_GATHER; i < end; ++i)
+            {
+                UINT inputIndex = bvh.m_metadata[i].PrimitiveIndex;
+                float *pInputTriangle = &triangleVertices.data()[inputIndex * 9];
+                float* pOutputTriangle = &bvh.m_triangles[i * 9];
+
+                // Construct three planes and write to pPlanes
+                XMVECTOR V0 = XMVectorSet(pInputTriangle[0], pInputTriangle[1], pInputTriangle[2], 0.0f);
+                XMVECTOR V1 = XMVectorSet(pInputTriangle[3], pInputTriangle[4], pInputTriangle[5], 0.0f);
+                XMVECTOR V2 = XMVectorSet(pInputTriangle[6], pInputTriangle[7], pInputTriangle[8], 0.0f);
+
+                XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 0, V0);
+                XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 1, V1);
+                XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 2, V2);
+            }
+        });
+
+        // Everything above is alive at this point
+        bvh.m_scratchSize += bounds.GetCapacityInBytes() +
+            primitiveMetaData.capacity() * sizeof(PrimitiveMetaData) +
+            triangleVertices.capacity() * sizeof(float) +
+            bvh.m_nodes.capacity() * sizeof(AABBNode) +
+            bvh.m_triangles.capacity() * sizeof(float) +
+            bvh.m_metadata.capacity() * sizeof(PrimitiveMetaData);
+    }
+
+    //
+    // SAH cost of the tree relative to its root box, with unit costs for traversing
+    // a node and intersecting a triangle
+    //
+
+    static
+        float ComputeSahCost(
+            const BVH& bvh,
+            CpuTaskPool& taskPool)
+    {
+        const auto getNodeArea = [](const AABBNode& node)
+        {
+            const float* d = node.halfDim;
+            return 8 * (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]);
+        };
+
+        const UINT numNodes = (UINT)bvh.m_nodes.size();
+        const UINT numSlices = taskPool.GetNumThreads();
+        const UINT sliceSize = (numNodes + numSlices - 1) / numSlices;
+
+        // Summed per slice and then in order, so the cost does not depend on scheduling
+        std::vector<double> sliceCosts(numSlices);
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
+        {
+            double cost = 0;
+            const UINT end = std::min((slice + 1) * sliceSize, numNodes);
+            for (UINT i = std::min(slice * sliceSize, numNodes); i < end; ++i)
+            {
+                const AABBNode& node = bvh.m_nodes[i];
+                cost += getNodeArea(node) * (node.leaf ? node.leafNode.numTriangleIds : 1);
+            }
+            sliceCosts[slice] = cost;
+        });
+
+        double cost = 0;
+        for (UINT slice = 0; slice < numSlices; ++slice)
+        {
+            cost += sliceCosts[slice];
+        }
+
+        const float rootArea = getNodeArea(bvh.m_nodes[0]);
+        return rootArea > 0 ? (float)(cost / rootArea) : 0.0f;
+    }
+
+    //
+    // Summed area of the overlap between the children of every node, relative to
+    // the root box. Rays through an overlap have to visit both children.
+    //
+
+    static
+        float ComputeNodeOverlap(
+            const BVH& bvh,
+            CpuTaskPool& taskPool)
+    {
+        const UINT numNodes = (UINT)bvh.m_nodes.size();
+        const UINT numSlices = taskPool.GetNumThreads();
+        const UINT sliceSize = (numNodes + numSlices - 1) / numSlices;
+
+        std::vector<double> sliceOverlaps(numSlices);
+        taskPool.ParallelFor(numSlices, [&](UINT slice)
+        {
+            double overlap = 0;
+            const UINT end = std::min((slice + 1) * sliceSize, numNodes);
+            for (UINT i = std::min(slice * sliceSize, numNodes); i < end; ++i)
+            {
+                const AABBNode& node = bvh.m_nodes[i];
+                if (node.leaf)
+                {
+                    continue;
+                }
+
+                XMVECTOR leftMin, leftMax, rightMin, rightMax;
+                LoadNodeBox(bvh.m_nodes[node.internalNode.leftNodeIndex], leftMin, leftMax);
+                LoadNodeBox(bvh.m_nodes[node.rightNodeIndex], rightMin, rightMax);
+                overlap += ComputeOverlapSurfaceArea(leftMin, leftMax, rightMin, rightMax);
+            }
+            sliceOverlaps[slice] = overlap;
+        });
+
+        double overlap = 0;
+        for (UINT slice = 0; slice < numSlices; ++slice)
+        {
+            overlap += sliceOverlaps[slice];
+        }
+
+        XMVECTOR rootMin, rootMax;
+        LoadNodeBox(bvh.m_nodes[0], rootMin, rootMax);
+        const float rootArea = ComputeBoxSurfaceArea(rootMin, rootMax);
+        return rootArea > 0 ? (float)(overlap / rootArea) : 0.0f;
+    }
+
+    //
+    // Updates refit the source structure to the new vertices. The tree keeps its
+    // topology, so every leaf box is recomputed from its triangles, and every node
+    // from its children once the second of them is done, as in the linear build.
+    //
+
+    void RefitUniformBVH(
+        _In_  UINT NumElements,
+        _In_reads_opt_(NumElements)  const D3D12_RAYTRACING_GEOMETRY_DESC *pGeometries,
+        _In_  const BYTE *pSourceData,
+        BVH &bvh,
+        CpuTaskPool &taskPool,
+        _Out_opt_ float *pSourceSahCost)
+    {
+        static const UINT NODES_PER_TASK = 16 * 1024;
+
+        const BVHOffsets& offsets = *(const BVHOffsets*)pSourceData;
+        const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+        const UINT32 numTris = (offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive);
+
+        // Gathered in the order of the build, which the metadata indexes
+        PrimitiveBounds bounds;
+        std::vector<PrimitiveMetaData> primitiveMetaData;
+        std::vector<float> triangleVertices;
+        GatherGeometries(NumElements, pGeometries, bounds, triangleVertices, primitiveMetaData, taskPool);
+
+        if (primitiveMetaData.size() != numTris)
+        {
+            ThrowFailure(E_INVALIDARG, L"Updates must keep the triangle count of the source acceleration structure");
+        }
+
+        // The destination may be the source, so work on a copy
+        const AABBNode* pSourceNodes = (const AABBNode*)(pSourceData + offsets.offsetToBoxes);
+        const PrimitiveMetaData* pSourceMetaData = (const PrimitiveMetaData*)(pSourceData + offsets.offsetToPrimitiveMetaData);
+        bvh.m_nodes.assign(pSourceNodes, pSourceNodes + numNodes);
+        bvh.m_metadata.assign(pSourceMetaData, pSourceMetaData + numTris);
+        bvh.m_triangles.resize(numTris * 3 * 3);
+        bvh.m_scratchSize = 0;
+
+        if (pSourceSahCost)
+        {
+            *pSourceSahCost = ComputeSahCost(bvh, taskPool);
+        }
+        if (numTris == 0)
+        {
+            return;
+        }
+
+        const UINT numTasks = (numNodes + NODES_PER_TASK - 1) / NODES_PER_TASK;
+        std::vector<UINT32> parentIndices(numNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * NODES_PER_TASK, numNodes);
+            for (UINT32 i = task * NODES_PER_TASK; i < end; ++i)
+            {
+                const AABBNode& node = bvh.m_nodes[i];
+                if (!node.leaf)
+                {
+                    parentIndices[node.internalNode.leftNodeIndex] = i;
+                    parentIndices[node.rightNodeIndex] = i;
+                }
+            }
+        });
+
+        std::vector<AABB> nodeBoxes(numNodes);
+        std::vector<std::atomic<UINT>> childNodesProcessedCounters(numNodes);
+        taskPool.ParallelFor(numTasks, [&](UINT task)
+        {
+            const UINT32 end = std::min((task + 1) * NODES_PER_TASK, numNodes);
+            for (UINT32 i = task * NODES_PER_TASK; i < end; ++i)
+            {
+                // From the source, as other tasks rewrite internal nodes of the copy
+                const AABBNode& leaf = pSourceNodes[i];
+                if (!leaf.leaf)
+                {
+                    continue;
+                }
+
+                const UINT32 firstTriangleId = leaf.leafNode.firstTriangleId;
+                const UINT32 numTriangleIds = leaf.leafNode.numTriangleIds;
+                const UINT32 firstPrimitive = bvh.m_metadata[firstTriangleId].PrimitiveIndex;
+                XMVECTOR leafMin = XMLoadFloat4A(&bounds.boxMin[firstPrimitive]);
+                XMVECTOR leafMax = XMLoadFloat4A(&bounds.boxMax[firstPrimitive]);
+                for (UINT32 triangleId = firstTriangleId; triangleId < firstTriangleId + numTriangleIds; ++triangleId)
+                {
+                    const UINT32 primitive = bvh.m_metadata[triangleId].PrimitiveIndex;
+                    memcpy(&bvh.m_triangles[triangleId * 9], &triangleVertices[primitive * 9], 9 * sizeof(float));
+                    leafMin = XMVectorMin(leafMin, XMLoadFloat4A(&bounds.boxMin[primitive]));
+                    leafMax = XMVectorMax(leafMax, XMLoadFloat4A(&bounds.boxMax[primitive]));
+                }
+                XMStoreFloat3((XMFLOAT3*)nodeBoxes[i].minArr, leafMin);
+                XMStoreFloat3((XMFLOAT3*)nodeBoxes[i].maxArr, leafMax);
+                BuildBVHAddLeaf(bvh, i, nodeBoxes[i], firstTriangleId, numTriangleIds);
+
+                UINT32 nodeIndex = i;
+                while (nodeIndex != 0)
+                {
+                    nodeIndex = parentIndices[nodeIndex];
+                    if (childNodesProcessedCounters[nodeIndex]++ == 0)
+                    {
+                        break;
+                    }
+
+                    const UINT32 leftNodeIndex = pSourceNodes[nodeIndex].internalNode.leftNodeIndex;
+                    const UINT32 rightNodeIndex = pSourceNodes[nodeIndex].rightNodeIndex;
+
+                    nodeBoxes[nodeIndex] = nodeBoxes[leftNodeIndex];
+                    AddExtentToBox(nodeBoxes[nodeIndex], nodeBoxes[rightNodeIndex]);
+
+                    BuildBVHAddNode(bvh, nodeIndex, nodeBoxes[nodeIndex], 0);
+                    bvh.m_nodes[nodeIndex].internalNode.leftNodeIndex = leftNodeIndex;
+                    bvh.m_nodes[nodeIndex].rightNodeIndex = rightNodeIndex;
+                }
+            }
+        });
+
+        bvh.m_scratchSize = (parentIndices.capacity() + numNodes) * sizeof(UINT32) +
+            nodeBoxes.capacity() * sizeof(AABB) +
+            bounds.GetCapacityInBytes() +
+            primitiveMetaData.capacity() * sizeof(PrimitiveMetaData) +
+            triangleVertices.capacity() * sizeof(float) +
+            bvh.m_nodes.capacity() * sizeof(AABBNode) +
+            bvh.m_triangles.capacity() * sizeof(float) +
+            bvh.m_metadata.capacity() * sizeof(PrimitiveMetaData);
+    }
+
+    //
+    // Top level
+    //
+    // Every instance is a primitive, boxed by the root of its bottom-level structure
+    // in world space. Leaves hold one instance each, so the tree comes from the same
+    // builders as the bottom level.
+    //
+
+    static const UINT INSTANCES_PER_GATHER = 1 << 12;
+
+    static
+        const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC& GetInstanceDesc(
+            const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+            UINT instanceIndex)
+    {
+        if (inputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS)
         {
-            UINT inputIndex = bvh.m_metadata[i].PrimitiveIndex;
-            float *pInputTriangle = &triangleVertices.data()[inputIndex * 9];
-            float* pOutputTriangle = &bvh.m_triangles[i * 9];
+            return *((const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC* const*)inputs.InstanceDescs)[instanceIndex];
+        }
+        return ((const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC*)inputs.InstanceDescs)[instanceIndex];
+    }
+
+    //
+    // The rows of the instance transform, with the translation in w
+    //
+
+    static
+        XMMATRIX LoadInstanceTransform(
+            const FLOAT transform[3][4])
+    {
+        return XMMATRIX(
+            XMLoadFloat4((const XMFLOAT4*)transform[0]),
+            XMLoadFloat4((const XMFLOAT4*)transform[1]),
+            XMLoadFloat4((const XMFLOAT4*)transform[2]),
+            g_XMIdentityR3);
+    }
+
+    //
+    // World space box of an instance. The transformed center is bounded by the half
+    // extents projected through the absolute transform, which is the same box as
+    // transforming all 8 corners.
+    //
+
+    static
+        void TransformBottomLevelBox(
+            const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC& instanceDesc,
+            const BYTE* pBottomLevelData,
+            XMVECTOR& boxMin,
+            XMVECTOR& boxMax)
+    {
+        const BVHOffsets& offsets = *(const BVHOffsets*)pBottomLevelData;
+        const AABBNode& root = *(const AABBNode*)(pBottomLevelData + offsets.offsetToBoxes);
+
+        // Transposed, as DirectXMath transforms row vectors
+        const XMMATRIX objectToWorld = XMMatrixTranspose(LoadInstanceTransform(instanceDesc.Transform));
+        XMMATRIX absoluteObjectToWorld;
+        absoluteObjectToWorld.r[0] = XMVectorAbs(objectToWorld.r[0]);
+        absoluteObjectToWorld.r[1] = XMVectorAbs(objectToWorld.r[1]);
+        absoluteObjectToWorld.r[2] = XMVectorAbs(objectToWorld.r[2]);
+        absoluteObjectToWorld.r[3] = XMVectorZero();
+
+        const XMVECTOR center = XMVector3Transform(XMLoadFloat3((const XMFLOAT3*)root.center), objectToWorld);
+        const XMVECTOR halfDim = XMVector3TransformNormal(XMLoadFloat3((const XMFLOAT3*)root.halfDim), absoluteObjectToWorld);
+        boxMin = XMVectorSubtract(center, halfDim);
+        boxMax = XMVectorAdd(center, halfDim);
+    }
 
-            // Construct three planes and write to pPlanes
-            XMVECTOR V0 = XMVectorSet(pInputTriangle[0], pInputTriangle[1], pInputTriangle[2], 0.0f);
-            XMVECTOR V1 = XMVectorSet(pInputTriangle[3], pInputTriangle[4], pInputTriangle[5], 0.0f);
-            XMVECTOR V2 = XMVectorSet(pInputTriangle[6], pInputTriangle[7], pInputTriangle[8], 0.0f);
+    void BuildTopLevelBVH(
+        const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
+        const void* const* ppBottomLevelData,
+        UINT numSahBins,
+        UINT numTreeletPasses,
+        BVH& bvh,
+        std::vector<BVHMetadata>& instanceMetadata,
+        CpuTaskPool& taskPool)
+    {
+        const UINT numInstances = inputs.NumDescs;
+        for (UINT i = 0; i < numInstances; ++i)
+        {
+            if (ppBottomLevelData[i] == nullptr)
+            {
+                ThrowFailure(E_INVALIDARG, L"Every instance needs the CPU data of its bottom-level structure");
+            }
+        }
 
-            XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 0, V0);
-            XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 1, V1);
-            XMStoreFloat3((XMFLOAT3*)pOutputTriangle + 2, V2);
+        // Node indices are 24 bits, as for triangles
+        if (numInstances > (1 << 23))
+        {
+            ThrowFailure(E_INVALIDARG, L"Too many instances for the node indices of the CPU builder");
         }
+
+        PrimitiveBounds bounds;
+        bounds.boxMin.resize(numInstances);
+        bounds.boxMax.resize(numInstances);
+        bounds.centroid.resize(numInstances);
+        std::vector<PrimitiveMetaData> primitiveMetaData(numInstances);
+
+        taskPool.ParallelFor((numInstances + INSTANCES_PER_GATHER - 1) / INSTANCES_PER_GATHER, [&](UINT chunk)
+        {
+            const UINT end = std::min((chunk + 1) * INSTANCES_PER_GATHER, numInstances);
+            for (UINT i = chunk * INSTANCES_PER_GATHER; i < end; ++i)
+            {
+                XMVECTOR boxMin, boxMax;
+                TransformBottomLevelBox(GetInstanceDesc(inputs, i), (const BYTE*)ppBottomLevelData[i], boxMin, boxMax);
+                bounds.SetBox(i, boxMin, boxMax);
+                primitiveMetaData[i] = { 0, i, 0 };
+            }
+        });
+
+        const std::vector<float> noVertices;
+        BuildTree(bvh, bounds, noVertices, primitiveMetaData, inputs.Flags, numSahBins, 0.0f, numTreeletPasses, taskPool);
+
+        // The instance transform becomes WorldToObject, as the traversal needs it
+        instanceMetadata.resize(numInstances);
+        taskPool.ParallelFor((numInstances + INSTANCES_PER_GATHER - 1) / INSTANCES_PER_GATHER, [&](UINT chunk)
+        {
+            const UINT end = std::min((chunk + 1) * INSTANCES_PER_GATHER, numInstances);
+            for (UINT leafIndex = chunk * INSTANCES_PER_GATHER; leafIndex < end; ++leafIndex)
+            {
+                const UINT instanceIndex = bvh.m_metadata[leafIndex].PrimitiveIndex;
+                const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC& instanceDesc = GetInstanceDesc(inputs, instanceIndex);
+
+                BVHMetadata& metadata = instanceMetadata[leafIndex];
+                metadata.instanceDesc = instanceDesc;
+                metadata.InstanceIndex = instanceIndex;
+                memcpy(metadata.ObjectToWorld, instanceDesc.Transform, sizeof(metadata.ObjectToWorld));
+
+                const XMMATRIX worldToObject = XMMatrixInverse(nullptr, LoadInstanceTransform(instanceDesc.Transform));
+                XMStoreFloat4((XMFLOAT4*)metadata.instanceDesc.Transform[0], worldToObject.r[0]);
+                XMStoreFloat4((XMFLOAT4*)metadata.instanceDesc.Transform[1], worldToObject.r[1]);
+                XMStoreFloat4((XMFLOAT4*)metadata.instanceDesc.Transform[2], worldToObject.r[2]);
+            }
+        });
+
+        bvh.m_scratchSize = bounds.GetCapacityInBytes() +
+            primitiveMetaData.capacity() * sizeof(PrimitiveMetaData) +
+            bvh.m_nodes.capacity() * sizeof(AABBNode) +
+            bvh.m_metadata.capacity() * sizeof(PrimitiveMetaData) +
+            instanceMetadata.capacity() * sizeof(BVHMetadata);
     }
 }
 
 void BuildRaytracingAccelerationStructureOnCpu(
     _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
-    _Out_ void *pData)
+    _Out_ void *pData,
+    _In_opt_ const CpuBuildOptions *pOptions,
+    _Out_opt_ CpuBuildInfo *pBuildInfo)
 {
+    // Below this many triangles per thread, waking threads costs more than it saves
+    static const UINT MIN_TRIANGLES_PER_THREAD = 16 * 1024;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    if (pDesc->Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL)
+    {
+        ThrowFailure(E_INVALIDARG, L"Top-level structures need the CPU data of their bottom levels, use BuildTopLevelAccelerationStructureOnCpu");
+    }
+
+    UINT numTriangles = 0;
+    for (UINT i = 0; i < pDesc->Inputs.NumDescs; ++i)
+    {
+        numTriangles += GetPrimitiveCountFromGeometryDesc(pDesc->Inputs.pGeometryDescs[i]);
+    }
+
+    UINT numThreads = pOptions && pOptions->NumThreads ? pOptions->NumThreads : std::thread::hardware_concurrency();
+    numThreads = std::max(1u, std::min(numThreads, numTriangles / MIN_TRIANGLES_PER_THREAD));
+    FallbackLayer::CpuTaskPool taskPool(numThreads);
+
     FallbackLayer::BVH bvh;
-    FallbackLayer::BuildUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs, bvh);
+    float sourceSahCost = 0;
+    if (pDesc->Inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE)
+    {
+        if (pDesc->SourceAccelerationStructureData == 0)
+        {
+            ThrowFailure(E_INVALIDARG, L"Updates need SourceAccelerationStructureData");
+        }
+
+        FallbackLayer::RefitUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs,
+            (const BYTE *)pDesc->SourceAccelerationStructureData, bvh, taskPool, pBuildInfo ? &sourceSahCost : nullptr);
+    }
+    else
+    {
+        const UINT numSahBins = pOptions && pOptions->NumSahBins ? pOptions->NumSahBins : FallbackLayer::DEFAULT_NUM_SAH_BINS;
+        const float spatialSplitBudget = FallbackLayer::GetSpatialSplitBudget(pDesc, pOptions);
+        const UINT numTreeletPasses = pOptions ? pOptions->NumTreeletPasses : 0;
+        FallbackLayer::BuildUniformBVH(pDesc->Inputs.NumDescs, pDesc->Inputs.pGeometryDescs, pDesc->Inputs.Flags,
+            numSahBins, spatialSplitBudget, numTreeletPasses, bvh, taskPool);
+    }
 
     BYTE* outputData = (BYTE*)pData;
     BVHOffsets offsets;
@@ -678,7 +3075,7 @@ void BuildRaytracingAccelerationStructureOnCpu(
     const UINT sizeofBoxes = (UINT)(bvh.m_nodes.size() * sizeof(*bvh.m_nodes.data()));
     offsets.offsetToVertices = offsets.offsetToBoxes + sizeofBoxes;
     
-    UINT numTriangles = (UINT)bvh.m_triangles.size() / 9;
+    numTriangles = (UINT)bvh.m_triangles.size() / 9;
     const UINT sizeofVertices = numTriangles * sizeof(Primitive);
     offsets.offsetToPrimitiveMetaData = offsets.offsetToVertices + sizeofVertices;
 
@@ -689,11 +3086,174 @@ void BuildRaytracingAccelerationStructureOnCpu(
     memcpy(outputData + offsets.offsetToBoxes, bvh.m_nodes.data(), sizeofBoxes);
 
     Primitive *pPrimitives = (Primitive *)(outputData + offsets.offsetToVertices);
-    for (UINT i = 0; i < numTriangles; i++)
+    taskPool.ParallelFor(numThreads, [&](UINT slice)
     {
-        Triangle *pTriangle = (Triangle *)((BYTE *)bvh.m_triangles.data() + sizeof(Triangle) * i);
-        pPrimitives[i].PrimitiveType = TRIANGLE_TYPE;
-        pPrimitives[i].triangle = *pTriangle;
-    }
+        const UINT sliceSize = (numTriangles + numThreads - 1) / numThreads;
+        const UINT end = std::min((slice + 1) * sliceSize, numTriangles);
+        for (UINT i = std::min(slice * sliceSize, numTriangles); i < end; i++)
+        {
+            Triangle *pTriangle = (Triangle *)((BYTE *)bvh.m_triangles.data() + sizeof(Triangle) * i);
+            pPrimitives[i].PrimitiveType = TRIANGLE_TYPE;
+            pPrimitives[i].triangle = *pTriangle;
+        }
+    });
     memcpy(outputData + offsets.offsetToPrimitiveMetaData, bvh.m_metadata.data(), sizeofMetadata);
+
+    if (pBuildInfo)
+    {
+        pBuildInfo->BuildTimeInSeconds =
+            std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        pBuildInfo->ScratchSizeInBytes = bvh.m_scratchSize;
+        pBuildInfo->NumThreads = numThreads;
+        pBuildInfo->SahCost = FallbackLayer::ComputeSahCost(bvh, taskPool);
+        pBuildInfo->UpdateSahCostRatio = sourceSahCost > 0 ? pBuildInfo->SahCost / sourceSahCost : 1.0f;
+        pBuildInfo->NodeOverlap = FallbackLayer::ComputeNodeOverlap(bvh, taskPool);
+        pBuildInfo->NumPrimitiveReferences = numTriangles;
+    }
+}
+
+void BuildTopLevelAccelerationStructureOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _In_reads_(pDesc->Inputs.NumDescs) const void *const *ppBottomLevelData,
+    _Out_ void *pData,
+    _In_opt_ const CpuBuildOptions *pOptions,
+    _Out_opt_ CpuBuildInfo *pBuildInfo)
+{
+    // Below this many instances per thread, waking threads costs more than it saves
+    static const UINT MIN_INSTANCES_PER_THREAD = 16 * 1024;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    if (pDesc->Inputs.Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL)
+    {
+        ThrowFailure(E_INVALIDARG, L"BuildTopLevelAccelerationStructureOnCpu only builds top-level structures");
+    }
+
+    const UINT numInstances = pDesc->Inputs.NumDescs;
+    UINT numThreads = pOptions && pOptions->NumThreads ? pOptions->NumThreads : std::thread::hardware_concurrency();
+    numThreads = std::max(1u, std::min(numThreads, numInstances / MIN_INSTANCES_PER_THREAD));
+    FallbackLayer::CpuTaskPool taskPool(numThreads);
+
+    FallbackLayer::BVH bvh;
+    std::vector<BVHMetadata> instanceMetadata;
+    if (numInstances == 0)
+    {
+        // A single node, given a box below that the traversal always misses
+        bvh.m_nodes.resize(1);
+        bvh.m_scratchSize = 0;
+    }
+    else
+    {
+        const UINT numSahBins = pOptions && pOptions->NumSahBins ? pOptions->NumSahBins : FallbackLayer::DEFAULT_NUM_SAH_BINS;
+        const UINT numTreeletPasses = pOptions ? pOptions->NumTreeletPasses : 0;
+        FallbackLayer::BuildTopLevelBVH(pDesc->Inputs, ppBottomLevelData, numSahBins, numTreeletPasses,
+            bvh, instanceMetadata, taskPool);
+    }
+
+    // There are no primitives, and the offset after the boxes is where the traversal
+    // finds the instances
+    BYTE* outputData = (BYTE*)pData;
+    BVHOffsets offsets;
+    offsets.offsetToBoxes = sizeof(BVHOffsets);
+    const UINT sizeofBoxes = (UINT)(bvh.m_nodes.size() * sizeof(*bvh.m_nodes.data()));
+    offsets.offsetToVertices = offsets.offsetToBoxes + sizeofBoxes;
+    offsets.offsetToPrimitiveMetaData = offsets.offsetToVertices;
+
+    const UINT sizeofMetadata = (UINT)(instanceMetadata.size() * sizeof(*instanceMetadata.data()));
+    offsets.totalSize = offsets.offsetToPrimitiveMetaData + sizeofMetadata;
+
+    memcpy(outputData, &offsets, sizeof(offsets));
+    memcpy(outputData + offsets.offsetToBoxes, bvh.m_nodes.data(), sizeofBoxes);
+    memcpy(outputData + offsets.offsetToPrimitiveMetaData, instanceMetadata.data(), sizeofMetadata);
+
+    // Leaves as the GPU builder writes them, with the instance in the flags and 1
+    // where bottom-level leaves have their triangle count
+    AABBNode* outputNodes = (AABBNode*)(outputData + offsets.offsetToBoxes);
+    for (size_t i = 0; i < bvh.m_nodes.size(); ++i)
+    {
+        if (outputNodes[i].leaf)
+        {
+            const UINT32 leafIndex = outputNodes[i].leafNode.firstTriangleId;
+            outputNodes[i].nodeAllBits = 0;
+            outputNodes[i].leaf = true;
+            outputNodes[i].leafNode.firstTriangleId = leafIndex;
+            outputNodes[i].numTriangles = 1;
+        }
+    }
+
+    // The zeroed root of no instances is an internal node with itself as both children,
+    // so a ray hitting its box would be traversed forever. An inverted box fails the
+    // ray/box test, which needs the far distance of the slabs to exceed the near one.
+    if (numInstances == 0)
+    {
+        for (UINT axis = 0; axis < 3; ++axis)
+        {
+            outputNodes[0].halfDim[axis] = -FLT_MAX;
+        }
+    }
+
+    if (pBuildInfo)
+    {
+        pBuildInfo->BuildTimeInSeconds =
+            std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        pBuildInfo->ScratchSizeInBytes = bvh.m_scratchSize;
+        pBuildInfo->NumThreads = numThreads;
+        pBuildInfo->SahCost = FallbackLayer::ComputeSahCost(bvh, taskPool);
+        pBuildInfo->UpdateSahCostRatio = 1.0f;
+        pBuildInfo->NodeOverlap = FallbackLayer::ComputeNodeOverlap(bvh, taskPool);
+        pBuildInfo->NumPrimitiveReferences = numInstances;
+    }
+}
+
+UINT64 GetRaytracingAccelerationStructureSizeOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _In_opt_ const CpuBuildOptions *pOptions)
+{
+    if (pDesc->Inputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL)
+    {
+        const UINT64 numInstances = pDesc->Inputs.NumDescs;
+        const UINT64 numNodes = std::max(2 * numInstances, (UINT64)2) - 1;
+        return sizeof(BVHOffsets) + numNodes * sizeof(AABBNode) + numInstances * sizeof(BVHMetadata);
+    }
+
+    UINT numTriangles = 0;
+    for (UINT i = 0; i < pDesc->Inputs.NumDescs; ++i)
+    {
+        numTriangles += GetPrimitiveCountFromGeometryDesc(pDesc->Inputs.pGeometryDescs[i]);
+    }
+
+    const UINT64 numReferences = FallbackLayer::GetMaxNumReferences(numTriangles,
+        FallbackLayer::GetSpatialSplitBudget(pDesc, pOptions));
+    const UINT64 numNodes = std::max(2 * numReferences, (UINT64)2) - 1;
+
+    return sizeof(BVHOffsets) + numNodes * sizeof(AABBNode) + numReferences * (sizeof(Primitive) + sizeof(PrimitiveMetaData));
+}
+
+void EmitRaytracingAccelerationStructureCompactedSizesOnCpu(
+    _In_  UINT NumSourceAccelerationStructures,
+    _In_reads_(NumSourceAccelerationStructures) const void *const *ppSourceData,
+    _Out_writes_(NumSourceAccelerationStructures) UINT64 *pCompactedSizes)
+{
+    // The arrays of a structure follow each other, so its total size is all it uses
+    for (UINT i = 0; i < NumSourceAccelerationStructures; ++i)
+    {
+        pCompactedSizes[i] = ((const BVHOffsets *)ppSourceData[i])->totalSize;
+    }
+}
+
+void CopyRaytracingAccelerationStructureOnCpu(
+    _Out_ void *pDestData,
+    _In_  const void *pSourceData,
+    _In_  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE Mode)
+{
+    if (Mode != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE &&
+        Mode != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT)
+    {
+        ThrowFailure(E_INVALIDARG,
+            L"The only flags supported for CopyRaytracingAccelerationStructureOnCpu are: "
+            L"D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE/D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT");
+    }
+
+    // Offsets are relative to the start of the structure, so the copy needs no fixups
+    memcpy(pDestData, pSourceData, ((const BVHOffsets *)pSourceData)->totalSize);
 }
@@ -0,0 +1,205 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+
+namespace FallbackLayer
+{
+    // Below this many elements per slice the write-combining buffers cost more
+    // to clear and flush than the scattered writes they save
+    static const UINT WRITE_COMBINING_MIN_SLICE_SIZE = 32 * 1024;
+
+    // Each bucket buffers one cache line of keys before writing them out
+    static const UINT WRITE_COMBINING_BUFFER_SIZE_IN_BYTES = 64;
+
+    template <typename KeyType, UINT BitsPerDigit>
+    static
+        void RadixSort(
+            KeyType *pKeys,
+            UINT32 *pValues,
+            KeyType *pKeysScratch,
+            UINT32 *pValuesScratch,
+            UINT numElements,
+            CpuTaskPool &taskPool)
+    {
+        static const UINT NUM_KEY_BITS = sizeof(KeyType) * 8;
+        static const UINT NUM_BUCKETS = 1 << BitsPerDigit;
+        static const UINT BUFFERED_ELEMENTS_PER_BUCKET = WRITE_COMBINING_BUFFER_SIZE_IN_BYTES / sizeof(KeyType);
+
+        const UINT numSlices = taskPool.GetNumThreads();
+        const UINT sliceSize = (numElements + numSlices - 1) / numSlices;
+        const auto getSliceBegin = [&](UINT slice) { return std::min(slice * sliceSize, numElements); };
+
+        // One histogram per slice, which then turns into the slice's output offsets
+        std::vector<UINT> histograms(numSlices * NUM_BUCKETS);
+
+        const bool useWriteCombining = sliceSize >= WRITE_COMBINING_MIN_SLICE_SIZE;
+        const UINT numBufferedElements = useWriteCombining ? numSlices * NUM_BUCKETS * BUFFERED_ELEMENTS_PER_BUCKET : 0;
+        std::vector<KeyType> bufferedKeys(numBufferedElements);
+        std::vector<UINT32> bufferedValues(numBufferedElements);
+        std::vector<UINT> bufferedCounts(useWriteCombining ? numSlices * NUM_BUCKETS : 0);
+
+        KeyType *pSourceKeys = pKeys;
+        UINT32 *pSourceValues = pValues;
+        KeyType *pDestKeys = pKeysScratch;
+        UINT32 *pDestValues = pValuesScratch;
+        for (UINT shift = 0; shift < NUM_KEY_BITS; shift += BitsPerDigit)
+        {
+            const auto getDigit = [shift](KeyType key) { return (UINT)(key >> shift) & (NUM_BUCKETS - 1); };
+
+            taskPool.ParallelFor(numSlices, [&](UINT slice)
+            {
+                UINT *pHistogram = &histograms[slice * NUM_BUCKETS];
+                std::fill(pHistogram, pHistogram + NUM_BUCKETS, 0);
+
+                const UINT end = getSliceBegin(slice + 1);
+                for (UINT i = getSliceBegin(slice); i < end; i++)
+                {
+                    pHistogram[getDigit(pSourceKeys[i])]++;
+                }
+            });
+
+            // Buckets in order, and slices in order within a bucket, keep the sort stable
+            UINT offset = 0;
+            bool isSingleBucket = false;
+            for (UINT bucket = 0; bucket < NUM_BUCKETS; bucket++)
+            {
+                const UINT bucketBegin = offset;
+                for (UINT slice = 0; slice < numSlices; slice++)
+                {
+                    const UINT count = histograms[slice * NUM_BUCKETS + bucket];
+                    histograms[slice * NUM_BUCKETS + bucket] = offset;
+                    offset += count;
+                }
+                isSingleBucket |= offset - bucketBegin == numElements;
+            }
+
+            // All keys have the same digit, so this pass would not move anything
+            if (isSingleBucket)
+            {
+                continue;
+            }
+
+            taskPool.ParallelFor(numSlices, [&](UINT slice)
+            {
+                UINT *pOffsets = &histograms[slice * NUM_BUCKETS];
+                const UINT begin = getSliceBegin(slice);
+                const UINT end = getSliceBegin(slice + 1);
+
+                if (!useWriteCombining)
+                {
+                    for (UINT i = begin; i < end; i++)
+                    {
+                        const KeyType key = pSourceKeys[i];
+                        const UINT destIndex = pOffsets[getDigit(key)]++;
+                        pDestKeys[destIndex] = key;
+                        pDestValues[destIndex] = pSourceValues[i];
+                    }
+                    return;
+                }
+
+                KeyType *pBufferedKeys = &bufferedKeys[slice * NUM_BUCKETS * BUFFERED_ELEMENTS_PER_BUCKET];
+                UINT32 *pBufferedValues = &bufferedValues[slice * NUM_BUCKETS * BUFFERED_ELEMENTS_PER_BUCKET];
+                UINT *pBufferedCounts = &bufferedCounts[slice * NUM_BUCKETS];
+                std::fill(pBufferedCounts, pBufferedCounts + NUM_BUCKETS, 0);
+
+                const auto flushBucket = [&](UINT bucket, UINT count)
+                {
+                    const UINT bufferBegin = bucket * BUFFERED_ELEMENTS_PER_BUCKET;
+                    std::copy(pBufferedKeys + bufferBegin, pBufferedKeys + bufferBegin + count, pDestKeys + pOffsets[bucket]);
+                    std::copy(pBufferedValues + bufferBegin, pBufferedValues + bufferBegin + count, pDestValues + pOffsets[bucket]);
+                    pOffsets[bucket] += count;
+                };
+
+                for (UINT i = begin; i < end; i++)
+                {
+                    const KeyType key = pSourceKeys[i];
+                    const UINT bucket = getDigit(key);
+                    UINT count = pBufferedCounts[bucket];
+                    pBufferedKeys[bucket * BUFFERED_ELEMENTS_PER_BUCKET + count] = key;
+                    pBufferedValues[bucket * BUFFERED_ELEMENTS_PER_BUCKET + count] = pSourceValues[i];
+                    if (++count == BUFFERED_ELEMENTS_PER_BUCKET)
+                    {
+                        flushBucket(bucket, BUFFERED_ELEMENTS_PER_BUCKET);
+                        count = 0;
+                    }
+                    pBufferedCounts[bucket] = count;
+                }
+
+                for (UINT bucket = 0; bucket < NUM_BUCKETS; bucket++)
+                {
+                    flushBucket(bucket, pBufferedCounts[bucket]);
+                }
+            });
+
+            std::swap(pSourceKeys, pDestKeys);
+            std::swap(pSourceValues, pDestValues);
+        }
+
+        if (pSourceKeys != pKeys)
+        {
+            taskPool.ParallelFor(numSlices, [&](UINT slice)
+            {
+                const UINT begin = getSliceBegin(slice);
+                const UINT end = getSliceBegin(slice + 1);
+                std::copy(pSourceKeys + begin, pSourceKeys + end, pKeys + begin);
+                std::copy(pSourceValues + begin, pSourceValues + end, pValues + begin);
+            });
+        }
+    }
+
+    template <typename KeyType>
+    static
+        void RadixSort(
+            KeyType *pKeys,
+            UINT32 *pValues,
+            KeyType *pKeysScratch,
+            UINT32 *pValuesScratch,
+            UINT numElements,
+            CpuTaskPool &taskPool,
+            UINT bitsPerDigit)
+    {
+        switch (bitsPerDigit)
+        {
+        case 8:
+            RadixSort<KeyType, 8>(pKeys, pValues, pKeysScratch, pValuesScratch, numElements, taskPool);
+            break;
+        case 11:
+            RadixSort<KeyType, 11>(pKeys, pValues, pKeysScratch, pValuesScratch, numElements, taskPool);
+            break;
+        default:
+            ThrowFailure(E_INVALIDARG, L"Radix sort only supports 8 or 11 bits per digit");
+        }
+    }
+
+    void RadixSort(
+        UINT32 *pKeys,
+        UINT32 *pValues,
+        UINT32 *pKeysScratch,
+        UINT32 *pValuesScratch,
+        UINT numElements,
+        CpuTaskPool &taskPool,
+        UINT bitsPerDigit)
+    {
+        RadixSort<UINT32>(pKeys, pValues, pKeysScratch, pValuesScratch, numElements, taskPool, bitsPerDigit);
+    }
+
+    void RadixSort(
+        UINT64 *pKeys,
+        UINT32 *pValues,
+        UINT64 *pKeysScratch,
+        UINT32 *pValuesScratch,
+        UINT numElements,
+        CpuTaskPool &taskPool,
+        UINT bitsPerDigit)
+    {
+        RadixSort<UINT64>(pKeys, pValues, pKeysScratch, pValuesScratch, numElements, taskPool, bitsPerDigit);
+    }
+}
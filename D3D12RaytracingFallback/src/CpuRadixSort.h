@@ -0,0 +1,37 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    // Stable LSD radix sort of 32-bit or 64-bit keys with 32-bit values. Each pass
+    // sorts on bitsPerDigit bits, which must be 8 or 11. Every thread counts and
+    // scatters its own slice of the input, so the work scales with the pool. Large
+    // inputs scatter through per-thread write-combining buffers, so each bucket is
+    // written a cache line at a time. The scratch arrays must hold numElements
+    // each, and the sorted result ends up in pKeys and pValues.
+    void RadixSort(
+        UINT32 *pKeys,
+        UINT32 *pValues,
+        UINT32 *pKeysScratch,
+        UINT32 *pValuesScratch,
+        UINT numElements,
+        CpuTaskPool &taskPool,
+        UINT bitsPerDigit = 8);
+
+    void RadixSort(
+        UINT64 *pKeys,
+        UINT32 *pValues,
+        UINT64 *pKeysScratch,
+        UINT32 *pValuesScratch,
+        UINT numElements,
+        CpuTaskPool &taskPool,
+        UINT bitsPerDigit = 8);
+}
@@ -0,0 +1,105 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+
+namespace FallbackLayer
+{
+    CpuTaskPool::CpuTaskPool(UINT numThreads) :
+        m_numThreads(numThreads ? numThreads : std::max(std::thread::hardware_concurrency(), 1u)),
+        m_generation(0),
+        m_quit(false),
+        m_pFunc(nullptr),
+        m_count(0),
+        m_nextIndex(0),
+        m_numBusyWorkers(0)
+    {
+        for (UINT i = 1; i < m_numThreads; i++)
+        {
+            m_workers.emplace_back([this]() { WorkerLoop(); });
+        }
+    }
+
+    CpuTaskPool::~CpuTaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wakeWorkers.notify_all();
+
+        for (auto &worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    void CpuTaskPool::ParallelFor(UINT count, const std::function<void(UINT)> &func)
+    {
+        if (m_workers.empty() || count <= 1)
+        {
+            for (UINT i = 0; i < count; i++)
+            {
+                func(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pFunc = &func;
+            m_count = count;
+            m_nextIndex = 0;
+            m_numBusyWorkers = (UINT)m_workers.size();
+            m_generation++;
+        }
+        m_wakeWorkers.notify_all();
+
+        RunTasks();
+
+        // Workers still read m_pFunc until they are all done
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeCaller.wait(lock, [this]() { return m_numBusyWorkers == 0; });
+        m_pFunc = nullptr;
+    }
+
+    void CpuTaskPool::RunTasks()
+    {
+        for (UINT i = m_nextIndex++; i < m_count; i = m_nextIndex++)
+        {
+            (*m_pFunc)(i);
+        }
+    }
+
+    void CpuTaskPool::WorkerLoop()
+    {
+        UINT64 generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeWorkers.wait(lock, [&]() { return m_quit || m_generation != generation; });
+                if (m_quit)
+                {
+                    return;
+                }
+                generation = m_generation;
+            }
+
+            RunTasks();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_numBusyWorkers == 0)
+            {
+                m_wakeCaller.notify_one();
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    // Fixed set of worker threads for the CPU acceleration structure builders.
+    // The calling thread takes part in every loop, so a pool of one thread runs
+    // everything inline.
+    class CpuTaskPool
+    {
+    public:
+        // 0 uses all hardware threads
+        CpuTaskPool(UINT numThreads = 0);
+        ~CpuTaskPool();
+
+        // Runs func(i) for every i in [0, count) and returns when all calls are done.
+        // Threads take the next index as they become free, so tasks may be uneven.
+        // Must not be called from inside func.
+        void ParallelFor(UINT count, const std::function<void(UINT)> &func);
+
+        UINT GetNumThreads() const { return m_numThreads; }
+
+    private:
+        void WorkerLoop();
+        void RunTasks();
+
+        UINT m_numThreads;
+        std::vector<std::thread> m_workers;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wakeWorkers;
+        std::condition_variable m_wakeCaller;
+        UINT64 m_generation;
+        bool m_quit;
+
+        const std::function<void(UINT)> *m_pFunc;
+        UINT m_count;
+        std::atomic<UINT> m_nextIndex;
+        UINT m_numBusyWorkers;
+    };
+}
@@ -0,0 +1,714 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#include "pch.h"
+
+namespace FallbackLayer
+{
+    using namespace DirectX;
+
+    // Far more than the depth of any tree the builders make, with every level
+    // leaving Width - 1 children on the stack
+    static const UINT MAX_TRAVERSAL_STACK_SIZE = 1024;
+
+    struct TraversalStackEntry
+    {
+        UINT32  nodeIndex;
+        float   t;          // where the ray enters the node
+    };
+
+    CpuRay::CpuRay(const float3 &rayOrigin, const float3 &rayDirection, float rayTMin, float rayTMax) :
+        origin(rayOrigin),
+        direction(rayDirection),
+        tMin(rayTMin),
+        tMax(rayTMax)
+    {
+        inverseDirection = float3{ 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+
+        const float3 absDirection = abs(direction);
+        const int zIndex = (absDirection.x > absDirection.y && absDirection.x > absDirection.z) ? 0 :
+            (absDirection.y > absDirection.z ? 1 : 2);
+        swizzledIndices[0] = (zIndex + 1) % 3;
+        swizzledIndices[1] = (zIndex + 2) % 3;
+        swizzledIndices[2] = zIndex;
+
+        const float *pDirection = &direction.x;
+        if (pDirection[zIndex] < 0.0f)
+        {
+            std::swap(swizzledIndices[0], swizzledIndices[1]);
+        }
+
+        shear = float3{
+            pDirection[swizzledIndices[0]] / pDirection[zIndex],
+            pDirection[swizzledIndices[1]] / pDirection[zIndex],
+            1.0f / pDirection[zIndex] };
+    }
+
+    //
+    // Woop/Benthin/Wald 2013: "Watertight Ray/Triangle Intersection", as
+    // RayTriangleIntersect in TraverseFunction.hlsli without culling. Only hits
+    // closer than the current one are taken.
+    //
+
+    static
+        bool RayTriangleIntersect(
+            const CpuRay &ray,
+            const Triangle &triangle,
+            UINT32 triangleId,
+            CpuRayHit &hit)
+    {
+        float A[3], B[3], C[3];
+        const float3 a = triangle.v0 - ray.origin;
+        const float3 b = triangle.v1 - ray.origin;
+        const float3 c = triangle.v2 - ray.origin;
+        for (UINT i = 0; i < 3; ++i)
+        {
+            A[i] = (&a.x)[ray.swizzledIndices[i]];
+            B[i] = (&b.x)[ray.swizzledIndices[i]];
+            C[i] = (&c.x)[ray.swizzledIndices[i]];
+        }
+
+        A[0] = A[0] - ray.shear.x * A[2];
+        A[1] = A[1] - ray.shear.y * A[2];
+        B[0] = B[0] - ray.shear.x * B[2];
+        B[1] = B[1] - ray.shear.y * B[2];
+        C[0] = C[0] - ray.shear.x * C[2];
+        C[1] = C[1] - ray.shear.y * C[2];
+        const float U = C[0] * B[1] - C[1] * B[0];
+        const float V = A[0] * C[1] - A[1] * C[0];
+        const float W = B[0] * A[1] - B[1] * A[0];
+
+        if ((U < 0.0f || V < 0.0f || W < 0.0f) &&
+            (U > 0.0f || V > 0.0f || W > 0.0f))
+        {
+            return false;
+        }
+
+        const float det = U + V + W;
+        if (det == 0.0f)
+        {
+            return false;
+        }
+
+        const float T = U * (ray.shear.z * A[2]) + V * (ray.shear.z * B[2]) + W * (ray.shear.z * C[2]);
+        float signCorrectedT = std::abs(T);
+        if ((T > 0.0f) != (det > 0.0f))
+        {
+            signCorrectedT = -signCorrectedT;
+        }
+
+        const float absDet = std::abs(det);
+        if (signCorrectedT < ray.tMin * absDet || signCorrectedT >= hit.t * absDet)
+        {
+            return false;
+        }
+
+        const float rcpDet = 1.0f / det;
+        hit.t = T * rcpDet;
+        hit.barycentrics = float2{ V * rcpDet, W * rcpDet };
+        hit.triangleId = triangleId;
+        return true;
+    }
+
+    //
+    // Ray/AABB intersection of a binary node, as RayBoxTest in TraverseFunction.hlsli
+    //
+
+    static
+        bool RayBoxTest(
+            float &resultT,
+            float closestT,
+            const CpuRay &ray,
+            const float3 &rayOriginTimesRayInverseDirection,
+            const float3 &absRayInverseDirection,
+            const AABBNode &node)
+    {
+        const float3 boxCenter = { node.center[0], node.center[1], node.center[2] };
+        const float3 boxHalfDim = { node.halfDim[0], node.halfDim[1], node.halfDim[2] };
+        const float3 relativeMiddle = boxCenter * ray.inverseDirection - rayOriginTimesRayInverseDirection;
+        const float3 maxL = relativeMiddle + boxHalfDim * absRayInverseDirection;
+        const float3 minL = relativeMiddle - boxHalfDim * absRayInverseDirection;
+
+        const float minT = std::max(std::max(minL.x, minL.y), minL.z);
+        const float maxT = std::min(std::min(maxL.x, maxL.y), maxL.z);
+
+        resultT = std::max(minT, ray.tMin);
+        return resultT < std::min(maxT, closestT);
+    }
+
+    bool TraceBVH2OnCpu(
+        const BYTE *pData,
+        const CpuRay &ray,
+        CpuRayHit &hit)
+    {
+        const BVHOffsets &offsets = *(const BVHOffsets *)pData;
+        const AABBNode *pNodes = (const AABBNode *)(pData + offsets.offsetToBoxes);
+        const Primitive *pPrimitives = (const Primitive *)(pData + offsets.offsetToVertices);
+        const UINT32 numPrimitives = (offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive);
+
+        hit.t = ray.tMax;
+        if (numPrimitives == 0)
+        {
+            return false;
+        }
+
+        const float3 rayOriginTimesRayInverseDirection = ray.origin * ray.inverseDirection;
+        const float3 absRayInverseDirection = abs(ray.inverseDirection);
+
+        TraversalStackEntry stack[MAX_TRAVERSAL_STACK_SIZE];
+        UINT stackSize = 0;
+        float rootT;
+        if (RayBoxTest(rootT, hit.t, ray, rayOriginTimesRayInverseDirection, absRayInverseDirection, pNodes[0]))
+        {
+            stack[stackSize++] = { 0, rootT };
+        }
+
+        bool isHit = false;
+        while (stackSize > 0)
+        {
+            const TraversalStackEntry entry = stack[--stackSize];
+            if (entry.t >= hit.t)
+            {
+                continue;
+            }
+
+            const AABBNode &node = pNodes[entry.nodeIndex];
+            if (node.leaf)
+            {
+                const UINT32 firstTriangleId = node.leafNode.firstTriangleId;
+                for (UINT32 triangleId = firstTriangleId; triangleId < firstTriangleId + node.numTriangles; ++triangleId)
+                {
+                    isHit |= RayTriangleIntersect(ray, pPrimitives[triangleId].triangle, triangleId, hit);
+                }
+                continue;
+            }
+
+            const UINT32 leftNodeIndex = node.internalNode.leftNodeIndex;
+            const UINT32 rightNodeIndex = node.rightNodeIndex;
+            float leftT, rightT;
+            const bool leftTest = RayBoxTest(leftT, hit.t, ray, rayOriginTimesRayInverseDirection, absRayInverseDirection, pNodes[leftNodeIndex]);
+            const bool rightTest = RayBoxTest(rightT, hit.t, ray, rayOriginTimesRayInverseDirection, absRayInverseDirection, pNodes[rightNodeIndex]);
+            if (stackSize + 2 > MAX_TRAVERSAL_STACK_SIZE)
+            {
+                ThrowFailure(E_INVALIDARG, L"Acceleration structure too deep for the CPU traversal");
+            }
+
+            // The nearer child goes on top, and the left one if they are equal
+            if (leftTest && rightTest)
+            {
+                const bool traverseRightSideFirst = rightT < leftT;
+                stack[stackSize++] = traverseRightSideFirst ? TraversalStackEntry{ leftNodeIndex, leftT } : TraversalStackEntry{ rightNodeIndex, rightT };
+                stack[stackSize++] = traverseRightSideFirst ? TraversalStackEntry{ rightNodeIndex, rightT } : TraversalStackEntry{ leftNodeIndex, leftT };
+            }
+            else if (leftTest || rightTest)
+            {
+                stack[stackSize++] = rightTest ? TraversalStackEntry{ rightNodeIndex, rightT } : TraversalStackEntry{ leftNodeIndex, leftT };
+            }
+        }
+        return isHit;
+    }
+
+    //
+    // Surface area of a binary node, up to a constant factor
+    //
+
+    static
+        float GetNodeArea(
+            const AABBNode &node)
+    {
+        return node.halfDim[0] * node.halfDim[1] + node.halfDim[1] * node.halfDim[2] + node.halfDim[2] * node.halfDim[0];
+    }
+
+    //
+    // Ylitie et al. 2017: "Efficient Incoherent Ray Traversal on GPUs Through Compressed
+    // Wide BVHs". Every binary leaf ends up as a child of some wide node whichever way
+    // the tree is collapsed, so the SAH cost that changes is the sum of the areas of
+    // the wide nodes. Bottom-up, each binary subtree gets the cheapest way to fill
+    // 1 to Width child slots of its parent: as one child, or opened with its slots
+    // split between its two children.
+    //
+
+    template <UINT Width>
+    class WideBVHCollapse
+    {
+    public:
+        WideBVHCollapse(const AABBNode *pNodes, UINT32 numNodes) :
+            m_pNodes(pNodes),
+            m_slotCosts(numNodes * Width),
+            m_leftSlots(numNodes * Width)
+        {
+            // Children come before their parents in reversed preorder
+            std::vector<UINT32> order;
+            std::vector<UINT32> stack(1, 0);
+            while (!stack.empty())
+            {
+                const UINT32 nodeIndex = stack.back();
+                stack.pop_back();
+                order.push_back(nodeIndex);
+                if (!pNodes[nodeIndex].leaf)
+                {
+                    stack.push_back(pNodes[nodeIndex].internalNode.leftNodeIndex);
+                    stack.push_back(pNodes[nodeIndex].rightNodeIndex);
+                }
+            }
+
+            for (auto it = order.rbegin(); it != order.rend(); ++it)
+            {
+                const UINT32 nodeIndex = *it;
+                const AABBNode &node = pNodes[nodeIndex];
+                float *pSlotCosts = &m_slotCosts[nodeIndex * Width];
+                BYTE *pLeftSlots = &m_leftSlots[nodeIndex * Width];
+                if (node.leaf)
+                {
+                    std::fill(pSlotCosts, pSlotCosts + Width, 0.0f);
+                    std::fill(pLeftSlots, pLeftSlots + Width, (BYTE)0);
+                    continue;
+                }
+
+                // Opened into j slots
+                const float *pLeftCosts = &m_slotCosts[node.internalNode.leftNodeIndex * Width];
+                const float *pRightCosts = &m_slotCosts[node.rightNodeIndex * Width];
+                float openedCosts[Width];
+                pLeftSlots[0] = 0;
+                for (UINT j = 2; j <= Width; ++j)
+                {
+                    openedCosts[j - 1] = FLT_MAX;
+                    for (UINT leftSlots = 1; leftSlots < j; ++leftSlots)
+                    {
+                        const float cost = pLeftCosts[leftSlots - 1] + pRightCosts[j - leftSlots - 1];
+                        if (cost < openedCosts[j - 1])
+                        {
+                            openedCosts[j - 1] = cost;
+                            pLeftSlots[j - 1] = (BYTE)leftSlots;
+                        }
+                    }
+                }
+
+                // As one child it becomes a wide node of its own, opened into all slots
+                const float wideNodeCost = GetNodeArea(node) + openedCosts[Width - 1];
+                pSlotCosts[0] = wideNodeCost;
+                for (UINT j = 2; j <= Width; ++j)
+                {
+                    if (openedCosts[j - 1] < wideNodeCost)
+                    {
+                        pSlotCosts[j - 1] = openedCosts[j - 1];
+                    }
+                    else
+                    {
+                        pSlotCosts[j - 1] = wideNodeCost;
+                        pLeftSlots[j - 1] = 0;
+                    }
+                }
+            }
+        }
+
+        // Children of the wide node made from an inner binary node
+        UINT GetChildren(UINT32 nodeIndex, UINT32 *pChildren) const
+        {
+            const UINT32 leftSlots = m_leftSlots[nodeIndex * Width + Width - 1];
+            UINT numChildren = AddChildren(m_pNodes[nodeIndex].internalNode.leftNodeIndex, leftSlots, pChildren);
+            numChildren += AddChildren(m_pNodes[nodeIndex].rightNodeIndex, Width - leftSlots, pChildren + numChildren);
+            return numChildren;
+        }
+
+    private:
+        UINT AddChildren(UINT32 nodeIndex, UINT slots, UINT32 *pChildren) const
+        {
+            const UINT32 leftSlots = m_leftSlots[nodeIndex * Width + slots - 1];
+            if (leftSlots == 0)
+            {
+                pChildren[0] = nodeIndex;
+                return 1;
+            }
+
+            UINT numChildren = AddChildren(m_pNodes[nodeIndex].internalNode.leftNodeIndex, leftSlots, pChildren);
+            numChildren += AddChildren(m_pNodes[nodeIndex].rightNodeIndex, slots - leftSlots, pChildren + numChildren);
+            return numChildren;
+        }
+
+        const AABBNode *m_pNodes;
+        std::vector<float> m_slotCosts;     // Width per binary node
+        std::vector<BYTE> m_leftSlots;      // slots given to the left child when opened, or 0
+    };
+
+    template <UINT Width>
+    CpuWideBVH<Width>::CpuWideBVH(const BYTE *pData)
+    {
+        static_assert(Width % 4 == 0, "Children are tested 4 at a time");
+
+        const BVHOffsets &offsets = *(const BVHOffsets *)pData;
+        const AABBNode *pNodes = (const AABBNode *)(pData + offsets.offsetToBoxes);
+        const Primitive *pPrimitives = (const Primitive *)(pData + offsets.offsetToVertices);
+        const UINT32 numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+        const UINT32 numPrimitives = (offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive);
+
+        m_triangles.resize(numPrimitives);
+        for (UINT32 i = 0; i < numPrimitives; ++i)
+        {
+            m_triangles[i] = pPrimitives[i].triangle;
+        }
+
+        if (numPrimitives == 0)
+        {
+            return;
+        }
+
+        const WideBVHCollapse<Width> collapse(pNodes, numNodes);
+
+        // Binary nodes with the wide nodes they turn into
+        std::vector<std::pair<UINT32, UINT32>> stack;
+        stack.push_back({ 0, 0 });
+        m_nodes.resize(1);
+
+        while (!stack.empty())
+        {
+            const UINT32 binaryNodeIndex = stack.back().first;
+            const UINT32 wideNodeIndex = stack.back().second;
+            stack.pop_back();
+
+            // A leaf only makes a wide node at the root
+            UINT32 children[Width] = { binaryNodeIndex };
+            const UINT numChildren = pNodes[binaryNodeIndex].leaf ? 1 : collapse.GetChildren(binaryNodeIndex, children);
+
+            std::stable_sort(children, children + numChildren, [&](UINT32 a, UINT32 b)
+            {
+                return GetNodeArea(pNodes[a]) > GetNodeArea(pNodes[b]);
+            });
+
+            WideBVHNode<Width> wideNode;
+            for (UINT i = 0; i < Width; ++i)
+            {
+                if (i >= numChildren)
+                {
+                    wideNode.minX[i] = wideNode.minY[i] = wideNode.minZ[i] = FLT_MAX;
+                    wideNode.maxX[i] = wideNode.maxY[i] = wideNode.maxZ[i] = -FLT_MAX;
+                    wideNode.child[i] = 0;
+                    wideNode.numTriangles[i] = 0;
+                    continue;
+                }
+
+                const AABBNode &child = pNodes[children[i]];
+                wideNode.minX[i] = child.center[0] - child.halfDim[0];
+                wideNode.maxX[i] = child.center[0] + child.halfDim[0];
+                wideNode.minY[i] = child.center[1] - child.halfDim[1];
+                wideNode.maxY[i] = child.center[1] + child.halfDim[1];
+                wideNode.minZ[i] = child.center[2] - child.halfDim[2];
+                wideNode.maxZ[i] = child.center[2] + child.halfDim[2];
+                if (child.leaf)
+                {
+                    wideNode.child[i] = child.leafNode.firstTriangleId;
+                    wideNode.numTriangles[i] = child.numTriangles;
+                }
+                else
+                {
+                    wideNode.child[i] = (UINT32)m_nodes.size();
+                    wideNode.numTriangles[i] = 0;
+                    stack.push_back({ children[i], wideNode.child[i] });
+                    m_nodes.push_back(WideBVHNode<Width>());
+                }
+            }
+            m_nodes[wideNodeIndex] = wideNode;
+        }
+    }
+
+    //
+    // Quantization of the child boxes. The step of each axis is a power of 2, so
+    // q * step is exact and origin + q * step rounds once, the same in the encoder
+    // and in the traversal.
+    //
+
+    static
+        float GetQuantizationStep(
+            BYTE exponent)
+    {
+        const UINT bits = (UINT)exponent << 23;
+        return (const float &)bits;
+    }
+
+    static
+        BYTE GetQuantizationExponent(
+            float origin,
+            float maxBound)
+    {
+        // The smallest power of 2 that reaches the max bound in 255 steps
+        int exponent;
+        std::frexp((maxBound - origin) / 255.0f, &exponent);
+        int biasedExponent = std::min(std::max(exponent + 127, 1), 254);
+        while (biasedExponent > 1 && origin + 255.0f * GetQuantizationStep((BYTE)(biasedExponent - 1)) >= maxBound)
+        {
+            --biasedExponent;
+        }
+        while (origin + 255.0f * GetQuantizationStep((BYTE)biasedExponent) < maxBound)
+        {
+            ++biasedExponent;
+        }
+        assert(biasedExponent < 255);
+        return (BYTE)biasedExponent;
+    }
+
+    static
+        void QuantizeBounds(
+            float minBound,
+            float maxBound,
+            float origin,
+            float step,
+            BYTE &quantizedMin,
+            BYTE &quantizedMax)
+    {
+        // Rounded outward, then corrected for the rounding of origin + q * step
+        UINT q = (UINT)std::min(std::max(std::floor((minBound - origin) / step), 0.0f), 255.0f);
+        while (q > 0 && origin + q * step > minBound)
+        {
+            --q;
+        }
+        quantizedMin = (BYTE)q;
+
+        q = (UINT)std::min(std::max(std::ceil((maxBound - origin) / step), 0.0f), 255.0f);
+        while (q < 255 && origin + q * step < maxBound)
+        {
+            ++q;
+        }
+        assert(origin + q * step >= maxBound);
+        quantizedMax = (BYTE)q;
+    }
+
+    template <UINT Width>
+    CpuQuantizedWideBVH<Width>::CpuQuantizedWideBVH(const CpuWideBVH<Width> &bvh) :
+        m_nodes(bvh.m_nodes.size()),
+        m_triangles(bvh.m_triangles)
+    {
+        for (size_t nodeIndex = 0; nodeIndex < bvh.m_nodes.size(); ++nodeIndex)
+        {
+            const WideBVHNode<Width> &node = bvh.m_nodes[nodeIndex];
+            QuantizedWideBVHNode<Width> &quantizedNode = m_nodes[nodeIndex];
+
+            // Unused slots have inverted boxes and come last
+            UINT numChildren = 0;
+            while (numChildren < Width && node.minX[numChildren] <= node.maxX[numChildren])
+            {
+                ++numChildren;
+            }
+            quantizedNode.numChildren = (BYTE)numChildren;
+
+            const float *pMins[3] = { node.minX, node.minY, node.minZ };
+            const float *pMaxs[3] = { node.maxX, node.maxY, node.maxZ };
+            BYTE *pQuantizedMins[3] = { quantizedNode.minX, quantizedNode.minY, quantizedNode.minZ };
+            BYTE *pQuantizedMaxs[3] = { quantizedNode.maxX, quantizedNode.maxY, quantizedNode.maxZ };
+            for (UINT axis = 0; axis < 3; ++axis)
+            {
+                const float origin = *std::min_element(pMins[axis], pMins[axis] + numChildren);
+                const float maxBound = *std::max_element(pMaxs[axis], pMaxs[axis] + numChildren);
+                quantizedNode.origin[axis] = origin;
+                quantizedNode.exponent[axis] = GetQuantizationExponent(origin, maxBound);
+
+                const float step = GetQuantizationStep(quantizedNode.exponent[axis]);
+                for (UINT i = 0; i < Width; ++i)
+                {
+                    if (i < numChildren)
+                    {
+                        QuantizeBounds(pMins[axis][i], pMaxs[axis][i], origin, step, pQuantizedMins[axis][i], pQuantizedMaxs[axis][i]);
+                    }
+                    else
+                    {
+                        pQuantizedMins[axis][i] = 255;
+                        pQuantizedMaxs[axis][i] = 0;
+                    }
+                }
+            }
+
+            for (UINT i = 0; i < Width; ++i)
+            {
+                assert(node.numTriangles[i] < 256);
+                quantizedNode.child[i] = node.child[i];
+                quantizedNode.numTriangles[i] = (BYTE)node.numTriangles[i];
+            }
+        }
+    }
+
+    //
+    // Child boxes of a node, 4 at a time, as min and max per axis
+    //
+
+    template <UINT Width>
+    static
+        void LoadChildBounds(
+            const WideBVHNode<Width> &node,
+            UINT first,
+            XMVECTOR bounds[6])
+    {
+        bounds[0] = XMLoadFloat4A((const XMFLOAT4A *)&node.minX[first]);
+        bounds[1] = XMLoadFloat4A((const XMFLOAT4A *)&node.maxX[first]);
+        bounds[2] = XMLoadFloat4A((const XMFLOAT4A *)&node.minY[first]);
+        bounds[3] = XMLoadFloat4A((const XMFLOAT4A *)&node.maxY[first]);
+        bounds[4] = XMLoadFloat4A((const XMFLOAT4A *)&node.minZ[first]);
+        bounds[5] = XMLoadFloat4A((const XMFLOAT4A *)&node.maxZ[first]);
+    }
+
+    template <UINT Width>
+    static
+        void LoadChildBounds(
+            const QuantizedWideBVHNode<Width> &node,
+            UINT first,
+            XMVECTOR bounds[6])
+    {
+        const BYTE *pQuantizedBounds[6] = { node.minX, node.maxX, node.minY, node.maxY, node.minZ, node.maxZ };
+        for (UINT bound = 0; bound < 6; ++bound)
+        {
+            const BYTE *pQuantized = &pQuantizedBounds[bound][first];
+            const XMVECTOR quantized = XMVectorSet((float)pQuantized[0], (float)pQuantized[1], (float)pQuantized[2], (float)pQuantized[3]);
+            const UINT axis = bound / 2;
+            bounds[bound] = XMVectorMultiplyAdd(quantized,
+                XMVectorReplicate(GetQuantizationStep(node.exponent[axis])),
+                XMVectorReplicate(node.origin[axis]));
+        }
+    }
+
+    template <UINT Width>
+    static
+        UINT GetNumChildren(
+            const WideBVHNode<Width> &)
+    {
+        // Unused slots have boxes no ray hits
+        return Width;
+    }
+
+    template <UINT Width>
+    static
+        UINT GetNumChildren(
+            const QuantizedWideBVHNode<Width> &node)
+    {
+        return node.numChildren;
+    }
+
+    template <UINT Width, typename NodeType>
+    static
+        bool TraceWideBVH(
+            const std::vector<NodeType> &nodes,
+            const std::vector<Triangle> &triangles,
+            const CpuRay &ray,
+            CpuRayHit &hit)
+    {
+        hit.t = ray.tMax;
+        if (nodes.empty())
+        {
+            return false;
+        }
+
+        //
+        // Slabs are bound * inverseDirection - origin * inverseDirection, with the
+        // bounds swapped on negative axes so the near one is always first. NaN slabs
+        // from 0 * infinity are the first operand of every min and max, which drops them.
+        //
+        const XMVECTOR inverseDirectionX = XMVectorReplicate(ray.inverseDirection.x);
+        const XMVECTOR inverseDirectionY = XMVectorReplicate(ray.inverseDirection.y);
+        const XMVECTOR inverseDirectionZ = XMVectorReplicate(ray.inverseDirection.z);
+        const XMVECTOR negOriginTimesInverseDirectionX = XMVectorReplicate(-ray.origin.x * ray.inverseDirection.x);
+        const XMVECTOR negOriginTimesInverseDirectionY = XMVectorReplicate(-ray.origin.y * ray.inverseDirection.y);
+        const XMVECTOR negOriginTimesInverseDirectionZ = XMVectorReplicate(-ray.origin.z * ray.inverseDirection.z);
+        const UINT nearX = ray.inverseDirection.x < 0.0f ? 1 : 0;
+        const UINT nearY = ray.inverseDirection.y < 0.0f ? 3 : 2;
+        const UINT nearZ = ray.inverseDirection.z < 0.0f ? 5 : 4;
+        const XMVECTOR rayTMin = XMVectorReplicate(ray.tMin);
+
+        TraversalStackEntry stack[MAX_TRAVERSAL_STACK_SIZE];
+        UINT stackSize = 0;
+        stack[stackSize++] = { 0, ray.tMin };
+
+        bool isHit = false;
+        while (stackSize > 0)
+        {
+            const TraversalStackEntry entry = stack[--stackSize];
+            if (entry.t >= hit.t)
+            {
+                continue;
+            }
+
+            const NodeType &node = nodes[entry.nodeIndex];
+            XMFLOAT4A childT[Width / 4];
+            UINT32 childHit[Width];
+            for (UINT group = 0; group < Width / 4; ++group)
+            {
+                const UINT first = group * 4;
+                XMVECTOR bounds[6];
+                LoadChildBounds(node, first, bounds);
+
+                const XMVECTOR nearTX = XMVectorMultiplyAdd(bounds[nearX], inverseDirectionX, negOriginTimesInverseDirectionX);
+                const XMVECTOR farTX = XMVectorMultiplyAdd(bounds[nearX ^ 1], inverseDirectionX, negOriginTimesInverseDirectionX);
+                const XMVECTOR nearTY = XMVectorMultiplyAdd(bounds[nearY], inverseDirectionY, negOriginTimesInverseDirectionY);
+                const XMVECTOR farTY = XMVectorMultiplyAdd(bounds[nearY ^ 1], inverseDirectionY, negOriginTimesInverseDirectionY);
+                const XMVECTOR nearTZ = XMVectorMultiplyAdd(bounds[nearZ], inverseDirectionZ, negOriginTimesInverseDirectionZ);
+                const XMVECTOR farTZ = XMVectorMultiplyAdd(bounds[nearZ ^ 1], inverseDirectionZ, negOriginTimesInverseDirectionZ);
+
+                const XMVECTOR entryT = XMVectorMax(nearTX, XMVectorMax(nearTY, XMVectorMax(nearTZ, rayTMin)));
+                const XMVECTOR exitT = XMVectorMin(farTX, XMVectorMin(farTY, XMVectorMin(farTZ, XMVectorReplicate(hit.t))));
+                XMStoreFloat4A(&childT[group], entryT);
+                XMStoreInt4(&childHit[first], XMVectorLessOrEqual(entryT, exitT));
+            }
+
+            // Leaves are intersected right away, and inner nodes pushed far to near
+            TraversalStackEntry innerChildren[Width];
+            UINT numInnerChildren = 0;
+            const UINT numChildren = GetNumChildren(node);
+            for (UINT i = 0; i < numChildren; ++i)
+            {
+                if (!childHit[i])
+                {
+                    continue;
+                }
+
+                if (node.numTriangles[i] > 0)
+                {
+                    const UINT32 firstTriangleId = node.child[i];
+                    for (UINT32 triangleId = firstTriangleId; triangleId < firstTriangleId + node.numTriangles[i]; ++triangleId)
+                    {
+                        isHit |= RayTriangleIntersect(ray, triangles[triangleId], triangleId, hit);
+                    }
+                }
+                else
+                {
+                    const TraversalStackEntry child = { node.child[i], (&childT[0].x)[i] };
+                    UINT insertIndex = numInnerChildren++;
+                    for (; insertIndex > 0 && innerChildren[insertIndex - 1].t < child.t; --insertIndex)
+                    {
+                        innerChildren[insertIndex] = innerChildren[insertIndex - 1];
+                    }
+                    innerChildren[insertIndex] = child;
+                }
+            }
+
+            if (stackSize + numInnerChildren > MAX_TRAVERSAL_STACK_SIZE)
+            {
+                ThrowFailure(E_INVALIDARG, L"Acceleration structure too deep for the CPU traversal");
+            }
+            for (UINT i = 0; i < numInnerChildren; ++i)
+            {
+                stack[stackSize++] = innerChildren[i];
+            }
+        }
+        return isHit;
+    }
+
+    template <UINT Width>
+    bool CpuWideBVH<Width>::Trace(const CpuRay &ray, CpuRayHit &hit) const
+    {
+        return TraceWideBVH<Width>(m_nodes, m_triangles, ray, hit);
+    }
+
+    template <UINT Width>
+    bool CpuQuantizedWideBVH<Width>::Trace(const CpuRay &ray, CpuRayHit &hit) const
+    {
+        return TraceWideBVH<Width>(m_nodes, m_triangles, ray, hit);
+    }
+
+    template class CpuWideBVH<4>;
+    template class CpuWideBVH<8>;
+    template class CpuQuantizedWideBVH<4>;
+    template class CpuQuantizedWideBVH<8>;
+}
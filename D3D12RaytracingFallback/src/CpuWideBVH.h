@@ -0,0 +1,130 @@
+//*********************************************************
+//
+// Copyright (c) Microsoft. All rights reserved.
+// This code is licensed under the MIT License (MIT).
+// THIS CODE IS PROVIDED *AS IS* WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING ANY
+// IMPLIED WARRANTIES OF FITNESS FOR A PARTICULAR
+// PURPOSE, MERCHANTABILITY, OR NON-INFRINGEMENT.
+//
+//*********************************************************
+#pragma once
+namespace FallbackLayer
+{
+    // Ray in the space of a bottom-level structure, along with what the box and
+    // triangle tests precompute from it, as GetRayData does in TraverseFunction.hlsli
+    struct CpuRay
+    {
+        CpuRay(const float3 &rayOrigin, const float3 &rayDirection, float rayTMin, float rayTMax);
+
+        float3  origin;
+        float3  direction;
+        float3  inverseDirection;
+        float3  shear;
+        int     swizzledIndices[3];
+        float   tMin;
+        float   tMax;
+    };
+
+    struct CpuRayHit
+    {
+        float   t;
+        float2  barycentrics;
+        UINT32  triangleId;     // into the primitives and metadata of the structure
+    };
+
+    // Closest hit in a bottom-level structure as the builders write it, with one box
+    // test per node visit like the traversal shader. Triangles are never culled.
+    bool TraceBVH2OnCpu(
+        const BYTE *pData,
+        const CpuRay &ray,
+        CpuRayHit &hit);
+
+    // Node of a BVH with up to Width children. The child boxes are stored one bound
+    // at a time, so a node tests 4 children per vector. Children are leaves when they
+    // have triangles, and unused slots have inverted boxes that no ray hits.
+    template <UINT Width>
+    __declspec(align(16))
+    struct WideBVHNode
+    {
+        float   minX[Width];
+        float   maxX[Width];
+        float   minY[Width];
+        float   maxY[Width];
+        float   minZ[Width];
+        float   maxZ[Width];
+        UINT32  child[Width];           // node index, or first triangle of a leaf
+        UINT32  numTriangles[Width];    // 0 for inner nodes
+    };
+
+    // Wide node with child boxes quantized to 8 bits per bound, on a grid that starts
+    // at the lowest corner of the children and has a power-of-2 step per axis. Bounds
+    // are rounded outward, so each quantized box contains the one it came from.
+    template <UINT Width>
+    __declspec(align(16))
+    struct QuantizedWideBVHNode
+    {
+        float   origin[3];
+        BYTE    exponent[3];            // biased exponent of the step, as in a float
+        BYTE    numChildren;            // the rest of the slots are unused
+        UINT32  child[Width];           // node index, or first triangle of a leaf
+        BYTE    minX[Width];
+        BYTE    maxX[Width];
+        BYTE    minY[Width];
+        BYTE    maxY[Width];
+        BYTE    minZ[Width];
+        BYTE    maxZ[Width];
+        BYTE    numTriangles[Width];    // 0 for inner nodes
+    };
+
+    template <UINT Width>
+    class CpuQuantizedWideBVH;
+
+    // Wide BVH collapsed from the binary tree of a bottom-level structure, from any
+    // of the builders, with the lowest SAH cost the binary tree allows. Children are
+    // stored in decreasing area, which is the SAH probability of a ray entering them.
+    // Triangle ids are those of the source.
+    template <UINT Width>
+    class CpuWideBVH
+    {
+    public:
+        CpuWideBVH(const BYTE *pData);
+
+        // Closest hit, as TraceBVH2OnCpu
+        bool Trace(const CpuRay &ray, CpuRayHit &hit) const;
+
+        UINT GetNumNodes() const { return (UINT)m_nodes.size(); }
+        size_t GetSizeInBytes() const { return m_nodes.size() * sizeof(WideBVHNode<Width>) + m_triangles.size() * sizeof(Triangle); }
+
+    private:
+        friend class CpuQuantizedWideBVH<Width>;
+
+        std::vector<WideBVHNode<Width>> m_nodes;
+        std::vector<Triangle> m_triangles;
+    };
+
+    // The same tree as a CpuWideBVH with its nodes quantized, which takes less than
+    // half the memory. Traversal visits a superset of the nodes, and finds the same
+    // closest hits.
+    template <UINT Width>
+    class CpuQuantizedWideBVH
+    {
+    public:
+        CpuQuantizedWideBVH(const CpuWideBVH<Width> &bvh);
+
+        // Closest hit, as TraceBVH2OnCpu
+        bool Trace(const CpuRay &ray, CpuRayHit &hit) const;
+
+        UINT GetNumNodes() const { return (UINT)m_nodes.size(); }
+        size_t GetSizeInBytes() const { return m_nodes.size() * sizeof(QuantizedWideBVHNode<Width>) + m_triangles.size() * sizeof(Triangle); }
+
+    private:
+        std::vector<QuantizedWideBVHNode<Width>> m_nodes;
+        std::vector<Triangle> m_triangles;
+    };
+
+    typedef CpuWideBVH<4> CpuBVH4;
+    typedef CpuWideBVH<8> CpuBVH8;
+    typedef CpuQuantizedWideBVH<4> CpuQuantizedBVH4;
+    typedef CpuQuantizedWideBVH<8> CpuQuantizedBVH8;
+}
@@ -19,6 +19,80 @@ void OutputDebugLog(ID3D12RaytracingFallbackDevice *pDevice);
 void VisualizeAccelerationStructureLevel(ID3D12RaytracingFallbackDevice *pDevice, UINT level);
 #endif
 
+struct CpuBuildOptions
+{
+    UINT NumThreads; // 0 uses all hardware threads
+    UINT NumSahBins; // 8, 16, 32 or 64, and 0 uses 64. Fewer bins build faster but find worse splits
+
+    // 0 disables spatial splits. Otherwise triangles may be split across nodes until
+    // this fraction of extra triangle references is used, e.g. 0.3 for 30% more.
+    // Spatial splits help long, thin triangles but build on one thread.
+    float SpatialSplitBudget;
+
+    // Passes of treelet reordering over the finished tree, like the GPU builder does
+    // after its linear build. Each pass only revisits nodes with twice as many
+    // triangles below them as the last, so 1 to 3 passes get most of the gain.
+    UINT NumTreeletPasses;
+};
+
+// Timings and memory use of a CPU build, for benchmarks
+struct CpuBuildInfo
+{
+    double BuildTimeInSeconds;
+    UINT64 ScratchSizeInBytes; // Peak of the temporary allocations of the builder
+    UINT NumThreads; // Can be fewer than requested for small inputs
+    float SahCost; // Relative to the root box, with unit node and triangle costs
+    float NodeOverlap; // Summed overlap of sibling boxes, relative to the root box
+    UINT NumPrimitiveReferences; // Above the triangle count when spatial splits duplicate triangles
+
+    // SahCost over that of the source structure after PERFORM_UPDATE, and 1 after full builds.
+    // The product of the ratios since the last full build is how much the refits have
+    // degraded the tree, and a full build pays off again once it's well above 1.
+    float UpdateSahCostRatio;
+};
+
+// Bottom-level build. PREFER_FAST_BUILD in the inputs builds a linear BVH from sorted
+// Morton codes instead of the SAH tree. PERFORM_UPDATE refits
+// SourceAccelerationStructureData, which may be pData, to the new vertices of the
+// same triangles, keeping its tree.
 void BuildRaytracingAccelerationStructureOnCpu(
     _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
-    _Out_ void *pData);
+    _Out_ void *pData,
+    _In_opt_ const CpuBuildOptions *pOptions = nullptr,
+    _Out_opt_ CpuBuildInfo *pBuildInfo = nullptr);
+
+// Top-level build over the D3D12_RAYTRACING_FALLBACK_INSTANCE_DESCs at the CPU address
+// in InstanceDescs, or over pointers to them with ELEMENTS_LAYOUT_ARRAY_OF_POINTERS.
+// ppBottomLevelData has the CPU copy of the structure each instance points to, for its
+// bounds, and the AccelerationStructure pointers are kept for the traversal shader.
+// The output has the layout and the BVHMetadata of the GPU builder's top level, and
+// PREFER_FAST_BUILD picks the tree as for the bottom level. PERFORM_UPDATE rebuilds,
+// which is cheap enough for the instance counts of a scene.
+void BuildTopLevelAccelerationStructureOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _In_reads_(pDesc->Inputs.NumDescs) const void *const *ppBottomLevelData,
+    _Out_ void *pData,
+    _In_opt_ const CpuBuildOptions *pOptions = nullptr,
+    _Out_opt_ CpuBuildInfo *pBuildInfo = nullptr);
+
+// Largest output of BuildRaytracingAccelerationStructureOnCpu or of
+// BuildTopLevelAccelerationStructureOnCpu for these inputs, which grows with the
+// spatial split budget
+UINT64 GetRaytracingAccelerationStructureSizeOnCpu(
+    _In_  const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC *pDesc,
+    _In_opt_ const CpuBuildOptions *pOptions = nullptr);
+
+// Bytes each CPU-built structure actually uses, like the compacted size postbuild
+// query of the GPU builder. Spatial splits rarely use all the references reserved
+// for them, and compacting copies drop the rest.
+void EmitRaytracingAccelerationStructureCompactedSizesOnCpu(
+    _In_  UINT NumSourceAccelerationStructures,
+    _In_reads_(NumSourceAccelerationStructures) const void *const *ppSourceData,
+    _Out_writes_(NumSourceAccelerationStructures) UINT64 *pCompactedSizes);
+
+// CLONE and COMPACT both copy the compacted size, as on the GPU, so pDestData only
+// has to hold that much
+void CopyRaytracingAccelerationStructureOnCpu(
+    _Out_ void *pDestData,
+    _In_  const void *pSourceData,
+    _In_  D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE Mode);
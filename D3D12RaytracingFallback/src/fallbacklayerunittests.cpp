@@ -719,6 +719,1632 @@ namespace FallbackLayerUnitTests
                 testCase);
         }
 
+        TEST_METHOD(RedundantTrianglesBottomLevelCpuBVHBuilder)
+        {
+            std::vector<float> redundantTriangles;
+            const uint numTriangles = 16;
+            const uint floatsPerTriangle = 9;
+            for (UINT i = 0; i < numTriangles; i++)
+            {
+                for (UINT j = 0; j < floatsPerTriangle; j++)
+                {
+                    redundantTriangles.push_back(ReferenceVerticies0[j]);
+                }
+            }
+
+            std::vector<UINT16> indices(redundantTriangles.size() / 3);
+            for (UINT i = 0; i < indices.size(); i++)
+            {
+                indices[i] = (UINT16)i;
+            }
+
+            CpuGeometryDescriptor testCase(redundantTriangles.data(), (UINT)(redundantTriangles.size() / 3),
+                indices.data(), (UINT)indices.size());
+            TestCpuBvh2Builder(testCase);
+        }
+
+        // Heightfield tiles of 256 x 256 vertices, so that R16 indices can address them
+        void GenerateTerrain(
+            UINT numTriangles,
+            std::vector<float> &vertices,
+            std::vector<UINT16> &indices,
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> &geomDescs)
+        {
+            const UINT tileWidth = 256;
+            const UINT trianglesPerTile = (tileWidth - 1) * (tileWidth - 1) * 2;
+            const UINT numTiles = (numTriangles + trianglesPerTile - 1) / trianglesPerTile;
+            const UINT tilesPerRow = (UINT)ceil(sqrt((double)numTiles));
+
+            vertices.resize(numTiles * tileWidth * tileWidth * 3);
+            indices.resize(numTriangles * 3);
+            geomDescs.resize(numTiles);
+
+            UINT index = 0;
+            for (UINT tile = 0; tile < numTiles; tile++)
+            {
+                float *pVertices = &vertices[tile * tileWidth * tileWidth * 3];
+                for (UINT z = 0; z < tileWidth; z++)
+                {
+                    for (UINT x = 0; x < tileWidth; x++, pVertices += 3)
+                    {
+                        pVertices[0] = (float)((tile % tilesPerRow) * (tileWidth - 1) + x);
+                        pVertices[2] = (float)((tile / tilesPerRow) * (tileWidth - 1) + z);
+                        pVertices[1] = 8.0f * sin(pVertices[0] * 0.05f) * cos(pVertices[2] * 0.07f);
+                    }
+                }
+
+                const UINT firstIndex = index;
+                for (UINT quad = 0; quad < trianglesPerTile / 2 && index < indices.size(); quad++)
+                {
+                    const UINT16 i0 = (UINT16)(quad / (tileWidth - 1) * tileWidth + quad % (tileWidth - 1));
+                    const UINT16 quadIndices[] = { i0, (UINT16)(i0 + tileWidth), (UINT16)(i0 + 1),
+                        (UINT16)(i0 + 1), (UINT16)(i0 + tileWidth), (UINT16)(i0 + tileWidth + 1) };
+                    for (UINT i = 0; i < ARRAYSIZE(quadIndices) && index < indices.size(); i++)
+                    {
+                        indices[index++] = quadIndices[i];
+                    }
+                }
+
+                auto &triangleDesc = geomDescs[tile].Triangles;
+                geomDescs[tile].Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+                geomDescs[tile].Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+                triangleDesc.Transform3x4 = 0;
+                triangleDesc.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)&indices[firstIndex];
+                triangleDesc.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)&vertices[tile * tileWidth * tileWidth * 3];
+                triangleDesc.IndexFormat = DXGI_FORMAT_R16_UINT;
+                triangleDesc.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+                triangleDesc.IndexCount = index - firstIndex;
+                triangleDesc.VertexCount = tileWidth * tileWidth;
+                triangleDesc.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+            }
+        }
+
+        // Node indices limit the CPU builder to 8M triangles with one triangle per leaf
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkBottomLevelCpuBVHBuilder)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkBottomLevelCpuBVHBuilder)
+        {
+            const UINT numTriangles[] = { 10000, 100000, 1000000, 8000000 };
+            for (UINT testIndex = 0; testIndex < ARRAYSIZE(numTriangles); testIndex++)
+            {
+                std::vector<float> vertices;
+                std::vector<UINT16> indices;
+                std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+                GenerateTerrain(numTriangles[testIndex], vertices, indices, geomDescs);
+
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.NumDescs = (UINT)geomDescs.size();
+                desc.Inputs.pGeometryDescs = geomDescs.data();
+
+                const UINT numNodes = 2 * numTriangles[testIndex] - 1;
+                std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[sizeof(BVHOffsets) +
+                    numNodes * sizeof(AABBNode) + numTriangles[testIndex] * (sizeof(Primitive) + sizeof(PrimitiveMetaData))]);
+
+                // SAH and linear builds at fixed thread counts, so that runs on different machines
+                // line up; counts above the hardware threads are oversubscribed
+                const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE,
+                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+                const UINT threadCounts[] = { 1, 2, 4, 8 };
+                for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+                {
+                    desc.Inputs.Flags = buildFlags[flagIndex];
+
+                    for (UINT threadIndex = 0; threadIndex < ARRAYSIZE(threadCounts); threadIndex++)
+                    {
+                        CpuBuildOptions options = { threadCounts[threadIndex] };
+                        CpuBuildInfo buildInfo;
+                        BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+
+                        std::wstringstream message;
+                        message << numTriangles[testIndex] << L" triangles, " <<
+                            (flagIndex ? L"linear, " : L"SAH, ") << buildInfo.NumThreads << L" of " <<
+                            std::thread::hardware_concurrency() << L" hardware thread(s): " <<
+                            buildInfo.BuildTimeInSeconds * 1000.0 << L" ms, " <<
+                            buildInfo.ScratchSizeInBytes / (1024.0 * 1024.0) << L" MB peak scratch, SAH cost " <<
+                            buildInfo.SahCost << std::endl;
+                        Logger::WriteMessage(message.str().c_str());
+
+                        if (buildInfo.NumThreads < options.NumThreads)
+                        {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Build time against tree quality for each supported number of SAH bins
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkCpuBVHBuilderSahBins)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkCpuBVHBuilderSahBins)
+        {
+            const UINT numTriangles = 1000000;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT numNodes = 2 * numTriangles - 1;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[sizeof(BVHOffsets) +
+                numNodes * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData))]);
+
+            const UINT numSahBins[] = { 8, 16, 32, 64 };
+            for (UINT testIndex = 0; testIndex < ARRAYSIZE(numSahBins); testIndex++)
+            {
+                CpuBuildOptions options = { 1, numSahBins[testIndex] };
+                CpuBuildInfo buildInfo;
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+
+                std::wstringstream message;
+                message << numSahBins[testIndex] << L" SAH bins: " << buildInfo.BuildTimeInSeconds * 1000.0 << L" ms, SAH cost " <<
+                    buildInfo.SahCost << std::endl;
+                Logger::WriteMessage(message.str().c_str());
+            }
+        }
+
+        // Subtrees built on separate threads get the same node indices as in a serial build
+        TEST_METHOD(ParallelBottomLevelCpuBVHBuilderMatchesSerial)
+        {
+            const UINT numTriangles = 300000;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT numNodes = 2 * numTriangles - 1;
+            const UINT outputSize = sizeof(BVHOffsets) +
+                numNodes * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData));
+            std::unique_ptr<BYTE[]> pSerialData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pParallelData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+
+            // Both the SAH and the linear build
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                desc.Inputs.Flags = buildFlags[flagIndex];
+
+                CpuBuildOptions options = { 1 };
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pSerialData.get(), &options);
+
+                options.NumThreads = 8;
+                CpuBuildInfo buildInfo;
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pParallelData.get(), &options, &buildInfo);
+
+                Assert::AreEqual(8u, buildInfo.NumThreads);
+                Assert::IsTrue(memcmp(pSerialData.get(), pParallelData.get(), outputSize) == 0,
+                    L"Parallel CPU BVH build differs from the serial one");
+            }
+        }
+
+        // Stacked planes cut into long strips that run diagonally across every axis,
+        // so the boxes of whole triangles overlap as much as they can
+        void GenerateDiagonalStrips(
+            UINT numTriangles,
+            std::vector<float> &vertices,
+            std::vector<UINT16> &indices,
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> &geomDescs)
+        {
+            const UINT stripsPerPlane = 256;
+            const UINT verticesPerPlane = (stripsPerPlane + 1) * 2;
+            const UINT planesPerGeometry = 64;
+            const UINT numPlanes = (numTriangles + 2 * stripsPerPlane - 1) / (2 * stripsPerPlane);
+            const UINT numGeometries = (numPlanes + planesPerGeometry - 1) / planesPerGeometry;
+
+            vertices.resize(numPlanes * verticesPerPlane * 3);
+            float *pVertices = vertices.data();
+            for (UINT plane = 0; plane < numPlanes; plane++)
+            {
+                for (UINT strip = 0; strip <= stripsPerPlane; strip++)
+                {
+                    for (UINT end = 0; end < 2; end++, pVertices += 3)
+                    {
+                        const float x = strip * 200.0f / stripsPerPlane;
+                        const float z = end * 200.0f;
+                        pVertices[0] = 0.7071f * (x + z);
+                        pVertices[1] = plane * 13.0f + end * 100.0f;
+                        pVertices[2] = 0.7071f * (z - x);
+                    }
+                }
+            }
+
+            indices.resize(numTriangles * 3);
+            for (UINT triangle = 0; triangle < numTriangles; triangle++)
+            {
+                const UINT plane = triangle / (2 * stripsPerPlane);
+                const UINT16 i0 = (UINT16)((plane % planesPerGeometry) * verticesPerPlane + (triangle / 2) % stripsPerPlane * 2);
+                const UINT16 stripIndices[2][3] = { { i0, (UINT16)(i0 + 2), (UINT16)(i0 + 3) }, { i0, (UINT16)(i0 + 3), (UINT16)(i0 + 1) } };
+                memcpy(&indices[triangle * 3], stripIndices[triangle % 2], sizeof(stripIndices[0]));
+            }
+
+            geomDescs.resize(numGeometries);
+            for (UINT geometry = 0; geometry < numGeometries; geometry++)
+            {
+                const UINT firstTriangle = geometry * planesPerGeometry * 2 * stripsPerPlane;
+                auto &triangleDesc = geomDescs[geometry].Triangles;
+                geomDescs[geometry].Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
+                geomDescs[geometry].Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
+                triangleDesc.Transform3x4 = 0;
+                triangleDesc.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)&indices[firstTriangle * 3];
+                triangleDesc.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)&vertices[geometry * planesPerGeometry * verticesPerPlane * 3];
+                triangleDesc.IndexFormat = DXGI_FORMAT_R16_UINT;
+                triangleDesc.VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT;
+                triangleDesc.IndexCount = (std::min(numTriangles, firstTriangle + planesPerGeometry * 2 * stripsPerPlane) - firstTriangle) * 3;
+                triangleDesc.VertexCount = std::min(numPlanes - geometry * planesPerGeometry, planesPerGeometry) * verticesPerPlane;
+                triangleDesc.VertexBuffer.StrideInBytes = sizeof(float) * 3;
+            }
+        }
+
+        static bool IsPointInNode(const float *pPoint, const AABBNode &node)
+        {
+            const float epsilon = 1e-4f;
+            for (UINT i = 0; i < 3; i++)
+            {
+                if (pPoint[i] < node.center[i] - node.halfDim[i] - epsilon || pPoint[i] > node.center[i] + node.halfDim[i] + epsilon)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Checks the topology and boxes of a CPU-built bottom level, and that every point
+        // of a triangle is inside one of the leaves referencing it. Spatial splits leave
+        // parts of a triangle in several leaves, none of which has to hold all of it; every
+        // leaf still has to hold its whole triangle. Without them, each triangle has to be
+        // referenced by exactly one leaf.
+        void ValidateCpuBvh(const BYTE *pData, const std::vector<Triangle> &triangles, bool allowSplitReferences = false)
+        {
+            const BVHOffsets &offsets = *(const BVHOffsets *)pData;
+            const AABBNode *pNodes = (const AABBNode *)(pData + offsets.offsetToBoxes);
+            const Primitive *pPrimitives = (const Primitive *)(pData + offsets.offsetToVertices);
+            const PrimitiveMetaData *pMetaData = (const PrimitiveMetaData *)(pData + offsets.offsetToPrimitiveMetaData);
+            const UINT numReferences = (offsets.offsetToPrimitiveMetaData - offsets.offsetToVertices) / sizeof(Primitive);
+            const UINT numNodes = (offsets.offsetToVertices - offsets.offsetToBoxes) / sizeof(AABBNode);
+            Assert::AreEqual(2 * numReferences - 1, numNodes);
+            if (!allowSplitReferences)
+            {
+                Assert::AreEqual((UINT)triangles.size(), numReferences);
+            }
+
+            std::vector<std::vector<UINT>> leavesOfTriangle(triangles.size());
+            std::vector<bool> isReferenceFound(numReferences);
+            std::vector<UINT> nodeStack(1, 0);
+            while (!nodeStack.empty())
+            {
+                const AABBNode &node = pNodes[nodeStack.back()];
+                const UINT nodeIndex = nodeStack.back();
+                nodeStack.pop_back();
+
+                if (node.leaf)
+                {
+                    const UINT reference = node.leafNode.firstTriangleId;
+                    Assert::IsTrue(reference < numReferences && !isReferenceFound[reference], L"Leaves must reference distinct primitives");
+                    isReferenceFound[reference] = true;
+
+                    const UINT triangleIndex = pMetaData[reference].PrimitiveIndex;
+                    Assert::IsTrue(triangleIndex < triangles.size(), L"Invalid primitive index");
+                    Assert::IsTrue(memcmp(&pPrimitives[reference].triangle, &triangles[triangleIndex], sizeof(Triangle)) == 0,
+                        L"Split primitives must keep the whole triangle");
+                    leavesOfTriangle[triangleIndex].push_back(nodeIndex);
+                    continue;
+                }
+
+                const UINT children[] = { node.internalNode.leftNodeIndex, node.rightNodeIndex };
+                for (UINT child : children)
+                {
+                    Assert::IsTrue(child < numNodes, L"Invalid child index");
+                    AABB parentBox, childBox;
+                    FallbackLayer::DecompressAABB(parentBox, node);
+                    FallbackLayer::DecompressAABB(childBox, pNodes[child]);
+                    Assert::IsTrue(IsChildContainedByParent(parentBox, childBox), L"Child box not contained by its parent");
+                    nodeStack.push_back(child);
+                }
+            }
+
+            for (UINT triangleIndex = 0; triangleIndex < triangles.size(); triangleIndex++)
+            {
+                Assert::IsFalse(leavesOfTriangle[triangleIndex].empty(), L"Triangle missing from the BVH");
+                Assert::IsTrue(allowSplitReferences || leavesOfTriangle[triangleIndex].size() == 1,
+                    L"Triangle referenced by several leaves without spatial splits");
+
+                const float *pV0 = &triangles[triangleIndex].v0.x;
+                const float *pV1 = &triangles[triangleIndex].v1.x;
+                const float *pV2 = &triangles[triangleIndex].v2.x;
+                const UINT steps = 8;
+                for (UINT a = 0; a <= steps; a++)
+                {
+                    for (UINT b = 0; a + b <= steps; b++)
+                    {
+                        float point[3];
+                        for (UINT i = 0; i < 3; i++)
+                        {
+                            point[i] = pV0[i] + (pV1[i] - pV0[i]) * a / steps + (pV2[i] - pV0[i]) * b / steps;
+                        }
+
+                        bool isPointFound = false;
+                        for (UINT leaf : leavesOfTriangle[triangleIndex])
+                        {
+                            isPointFound = isPointFound || IsPointInNode(point, pNodes[leaf]);
+                        }
+                        Assert::IsTrue(isPointFound, L"Part of a triangle is outside of every leaf referencing it");
+                    }
+                }
+            }
+        }
+
+        TEST_METHOD(SpatialSplitBottomLevelCpuBVHBuilder)
+        {
+            const UINT numTriangles = 8192;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateDiagonalStrips(numTriangles, vertices, indices, geomDescs);
+
+            // Few enough triangles for one geometry, so the indices address the vertices directly
+            Assert::AreEqual(1u, (UINT)geomDescs.size());
+            std::vector<Triangle> triangles(numTriangles);
+            for (UINT i = 0; i < numTriangles; i++)
+            {
+                for (UINT j = 0; j < 3; j++)
+                {
+                    memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                }
+            }
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            CpuBuildOptions options = {};
+            CpuBuildInfo objectSplitInfo;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc, &options)]);
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &objectSplitInfo);
+            Assert::AreEqual(numTriangles, objectSplitInfo.NumPrimitiveReferences);
+
+            const float budgets[] = { 0.25f, 1.0f };
+            for (UINT budgetIndex = 0; budgetIndex < ARRAYSIZE(budgets); budgetIndex++)
+            {
+                options.SpatialSplitBudget = budgets[budgetIndex];
+                pData = std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc, &options)]);
+
+                CpuBuildInfo buildInfo;
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+                ValidateCpuBvh(pData.get(), triangles, true);
+
+                Assert::IsTrue(buildInfo.NumPrimitiveReferences > numTriangles, L"Expected triangles split across nodes");
+                Assert::IsTrue(buildInfo.NumPrimitiveReferences <= numTriangles * (1.0f + budgets[budgetIndex]), L"Spatial split budget exceeded");
+                Assert::IsTrue(buildInfo.SahCost < objectSplitInfo.SahCost, L"Spatial splits should lower the SAH cost");
+                Assert::IsTrue(buildInfo.NodeOverlap < objectSplitInfo.NodeOverlap, L"Spatial splits should lower the node overlap");
+            }
+
+            // Any-hit shaders may not see the same triangle twice
+            for (auto &geomDesc : geomDescs)
+            {
+                geomDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_NO_DUPLICATE_ANYHIT_INVOCATION;
+            }
+            CpuBuildInfo buildInfo;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+            ValidateCpuBvh(pData.get(), triangles);
+            Assert::AreEqual(numTriangles, buildInfo.NumPrimitiveReferences);
+        }
+
+        // Build time against tree quality as the spatial split budget grows
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkCpuBVHBuilderSpatialSplits)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkCpuBVHBuilderSpatialSplits)
+        {
+            const UINT numTriangles = 100000;
+            for (UINT sceneIndex = 0; sceneIndex < 2; sceneIndex++)
+            {
+                std::vector<float> vertices;
+                std::vector<UINT16> indices;
+                std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+                if (sceneIndex == 0)
+                {
+                    GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+                }
+                else
+                {
+                    GenerateDiagonalStrips(numTriangles, vertices, indices, geomDescs);
+                }
+
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.NumDescs = (UINT)geomDescs.size();
+                desc.Inputs.pGeometryDescs = geomDescs.data();
+
+                const float budgets[] = { 0.0f, 0.1f, 0.3f, 1.0f };
+                for (UINT budgetIndex = 0; budgetIndex < ARRAYSIZE(budgets); budgetIndex++)
+                {
+                    CpuBuildOptions options = {};
+                    options.SpatialSplitBudget = budgets[budgetIndex];
+                    std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc, &options)]);
+
+                    CpuBuildInfo buildInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+
+                    std::wstringstream message;
+                    message << (sceneIndex ? L"Diagonal strips" : L"Terrain") << L", spatial split budget " << budgets[budgetIndex] << L": " <<
+                        buildInfo.BuildTimeInSeconds * 1000.0 << L" ms, SAH cost " << buildInfo.SahCost << L", node overlap " <<
+                        buildInfo.NodeOverlap << L", " << buildInfo.NumPrimitiveReferences << L" primitive references" << std::endl;
+                    Logger::WriteMessage(message.str().c_str());
+                }
+            }
+        }
+
+        // Treelet reordering only moves internal nodes, so the tree has to stay valid
+        // while its SAH cost goes down, and threads may not change the result
+        TEST_METHOD(TreeletReorderingBottomLevelCpuBVHBuilder)
+        {
+            {
+                const UINT numTriangles = 8192;
+                std::vector<float> vertices;
+                std::vector<UINT16> indices;
+                std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+                GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+                Assert::AreEqual(1u, (UINT)geomDescs.size());
+                std::vector<Triangle> triangles(numTriangles);
+                for (UINT i = 0; i < numTriangles; i++)
+                {
+                    for (UINT j = 0; j < 3; j++)
+                    {
+                        memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                    }
+                }
+
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.NumDescs = (UINT)geomDescs.size();
+                desc.Inputs.pGeometryDescs = geomDescs.data();
+                std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc)]);
+
+                // Both the SAH and the linear build
+                const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                    D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+                for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+                {
+                    desc.Inputs.Flags = buildFlags[flagIndex];
+
+                    CpuBuildOptions options = {};
+                    CpuBuildInfo initialInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &initialInfo);
+
+                    options.NumTreeletPasses = 3;
+                    CpuBuildInfo buildInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+                    ValidateCpuBvh(pData.get(), triangles);
+                    Assert::IsTrue(buildInfo.SahCost < initialInfo.SahCost, L"Treelet reordering should lower the SAH cost");
+                }
+            }
+
+            const UINT numTriangles = 300000;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT64 outputSize = GetRaytracingAccelerationStructureSizeOnCpu(&desc);
+            std::unique_ptr<BYTE[]> pSerialData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pParallelData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+
+            CpuBuildOptions options = { 1 };
+            options.NumTreeletPasses = 2;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pSerialData.get(), &options);
+
+            options.NumThreads = 8;
+            BuildRaytracingAccelerationStructureOnCpu(&desc, pParallelData.get(), &options);
+            Assert::IsTrue(memcmp(pSerialData.get(), pParallelData.get(), (size_t)outputSize) == 0,
+                L"Parallel treelet reordering differs from the serial one");
+        }
+
+        // Build time against tree quality as treelet reordering passes are added
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkCpuBVHBuilderTreeletReordering)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkCpuBVHBuilderTreeletReordering)
+        {
+            const UINT numTriangles = 1000000;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc)]);
+
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                desc.Inputs.Flags = buildFlags[flagIndex];
+                for (UINT numPasses = 0; numPasses <= 4; numPasses++)
+                {
+                    CpuBuildOptions options = {};
+                    options.NumTreeletPasses = numPasses;
+                    CpuBuildInfo buildInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), &options, &buildInfo);
+
+                    std::wstringstream message;
+                    message << (flagIndex ? L"SAH, " : L"Linear, ") << numPasses << L" treelet pass(es): " <<
+                        buildInfo.BuildTimeInSeconds * 1000.0 << L" ms, SAH cost " << buildInfo.SahCost << L", node overlap " <<
+                        buildInfo.NodeOverlap << std::endl;
+                    Logger::WriteMessage(message.str().c_str());
+                }
+            }
+        }
+
+        // Updates keep the tree of the source and only refit its boxes, in place or into
+        // another buffer. Refits of large deformations should report a worse tree.
+        TEST_METHOD(UpdateBottomLevelCpuBVHBuilder)
+        {
+            const UINT numTriangles = 8192;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+            Assert::AreEqual(1u, (UINT)geomDescs.size());
+            const std::vector<float> initialVertices = vertices;
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT64 outputSize = GetRaytracingAccelerationStructureSizeOnCpu(&desc);
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pSourceData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pRebuiltData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            const BVHOffsets &offsets = *(const BVHOffsets *)pData.get();
+
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                // Waves of growing height, and then every vertex moved somewhere random
+                for (UINT deformation = 0; deformation < 2; deformation++)
+                {
+                    vertices = initialVertices;
+                    desc.Inputs.Flags = buildFlags[flagIndex];
+                    desc.SourceAccelerationStructureData = 0;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), nullptr);
+                    std::vector<AABBNode> initialNodes((const AABBNode *)(pData.get() + offsets.offsetToBoxes),
+                        (const AABBNode *)(pData.get() + offsets.offsetToVertices));
+
+                    srand(deformation);
+                    for (UINT i = 0; i < vertices.size(); i += 3)
+                    {
+                        if (deformation == 0)
+                        {
+                            vertices[i + 1] += 4.0f * sin(vertices[i] * 0.1f + vertices[i + 2] * 0.03f);
+                        }
+                        else
+                        {
+                            for (UINT j = 0; j < 3; j++)
+                            {
+                                vertices[i + j] = (float)(rand() % 256);
+                            }
+                        }
+                    }
+
+                    std::vector<Triangle> triangles(numTriangles);
+                    for (UINT i = 0; i < numTriangles; i++)
+                    {
+                        for (UINT j = 0; j < 3; j++)
+                        {
+                            memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                        }
+                    }
+
+                    memcpy(pSourceData.get(), pData.get(), (size_t)outputSize);
+                    desc.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+                    desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pData.get();
+                    CpuBuildInfo updateInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get(), nullptr, &updateInfo);
+                    ValidateCpuBvh(pData.get(), triangles);
+
+                    const AABBNode *pNodes = (const AABBNode *)(pData.get() + offsets.offsetToBoxes);
+                    for (UINT i = 0; i < initialNodes.size(); i++)
+                    {
+                        Assert::IsTrue(pNodes[i].leaf == initialNodes[i].leaf && pNodes[i].nodeAllBits == initialNodes[i].nodeAllBits &&
+                            pNodes[i].rightNodeIndex == initialNodes[i].rightNodeIndex, L"Updates must keep the tree of the source");
+                    }
+
+                    // Into another buffer
+                    desc.SourceAccelerationStructureData = (D3D12_GPU_VIRTUAL_ADDRESS)pSourceData.get();
+                    std::unique_ptr<BYTE[]> pUpdatedData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pUpdatedData.get(), nullptr);
+                    Assert::IsTrue(memcmp(pData.get(), pUpdatedData.get(), (size_t)outputSize) == 0,
+                        L"Updates in place differ from updates into another buffer");
+
+                    desc.Inputs.Flags = buildFlags[flagIndex];
+                    desc.SourceAccelerationStructureData = 0;
+                    CpuBuildInfo rebuildInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pRebuiltData.get(), nullptr, &rebuildInfo);
+                    Assert::AreEqual(1.0f, rebuildInfo.UpdateSahCostRatio);
+
+                    if (deformation == 0)
+                    {
+                        Assert::IsTrue(updateInfo.UpdateSahCostRatio < 1.5f, L"Small deformations should keep most of the tree quality");
+                    }
+                    else
+                    {
+                        Assert::IsTrue(updateInfo.UpdateSahCostRatio > 1.5f, L"Refitting random vertices should degrade the tree");
+                        Assert::IsTrue(rebuildInfo.SahCost < updateInfo.SahCost, L"A full build should beat a degraded refit");
+                    }
+                }
+            }
+        }
+
+        // Compacting copies keep only the bytes a structure uses, which is less than the
+        // prebuild size once spatial splits leave part of their budget unused
+        TEST_METHOD(CompactBottomLevelCpuBVHBuilder)
+        {
+            const UINT numTriangles = 8192;
+            const float budgets[] = { 0.0f, 0.5f };
+            std::vector<std::unique_ptr<BYTE[]>> builtData;
+            std::vector<UINT64> builtSizes;
+            for (UINT sceneIndex = 0; sceneIndex < 2; sceneIndex++)
+            {
+                std::vector<float> vertices;
+                std::vector<UINT16> indices;
+                std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+                if (sceneIndex == 0)
+                {
+                    GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+                }
+                else
+                {
+                    GenerateDiagonalStrips(numTriangles, vertices, indices, geomDescs);
+                }
+
+                Assert::AreEqual(1u, (UINT)geomDescs.size());
+                std::vector<Triangle> triangles(numTriangles);
+                for (UINT i = 0; i < numTriangles; i++)
+                {
+                    for (UINT j = 0; j < 3; j++)
+                    {
+                        memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                    }
+                }
+
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.NumDescs = (UINT)geomDescs.size();
+                desc.Inputs.pGeometryDescs = geomDescs.data();
+
+                for (UINT budgetIndex = 0; budgetIndex < ARRAYSIZE(budgets); budgetIndex++)
+                {
+                    CpuBuildOptions options = {};
+                    options.SpatialSplitBudget = budgets[budgetIndex];
+                    const UINT64 prebuildSize = GetRaytracingAccelerationStructureSizeOnCpu(&desc, &options);
+                    builtData.push_back(std::unique_ptr<BYTE[]>(new BYTE[prebuildSize]()));
+                    builtSizes.push_back(prebuildSize);
+
+                    CpuBuildInfo buildInfo;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, builtData.back().get(), &options, &buildInfo);
+
+                    const void *pSourceData = builtData.back().get();
+                    UINT64 compactedSize;
+                    EmitRaytracingAccelerationStructureCompactedSizesOnCpu(1, &pSourceData, &compactedSize);
+                    Assert::IsTrue(compactedSize <= prebuildSize, L"Compacted size above the prebuild size");
+                    Assert::IsTrue(compactedSize == sizeof(BVHOffsets) + (2 * buildInfo.NumPrimitiveReferences - 1) * sizeof(AABBNode) +
+                        buildInfo.NumPrimitiveReferences * (sizeof(Primitive) + sizeof(PrimitiveMetaData)), L"Incorrect compacted size");
+                    if (budgets[budgetIndex] == 0.0f)
+                    {
+                        Assert::IsTrue(compactedSize == prebuildSize, L"Builds without spatial splits should fill the prebuild size");
+                    }
+
+                    const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE copyModes[] = {
+                        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE,
+                        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_COMPACT };
+                    for (UINT modeIndex = 0; modeIndex < ARRAYSIZE(copyModes); modeIndex++)
+                    {
+                        std::unique_ptr<BYTE[]> pCopiedData = std::unique_ptr<BYTE[]>(new BYTE[(size_t)compactedSize]);
+                        CopyRaytracingAccelerationStructureOnCpu(pCopiedData.get(), pSourceData, copyModes[modeIndex]);
+                        Assert::IsTrue(memcmp(pCopiedData.get(), pSourceData, (size_t)compactedSize) == 0, L"Copy differs from its source");
+                        ValidateCpuBvh(pCopiedData.get(), triangles, budgets[budgetIndex] > 0.0f);
+                    }
+
+                    std::wstringstream message;
+                    message << (sceneIndex ? L"Diagonal strips" : L"Terrain") << L", spatial split budget " << budgets[budgetIndex] << L": " <<
+                        prebuildSize << L" bytes before compaction, " << compactedSize << L" after, " <<
+                        prebuildSize - compactedSize << L" saved" << std::endl;
+                    Logger::WriteMessage(message.str().c_str());
+                }
+            }
+
+            // All at once, as for the GPU postbuild query
+            std::vector<const void *> ppSourceData;
+            for (auto &pData : builtData)
+            {
+                ppSourceData.push_back(pData.get());
+            }
+            std::vector<UINT64> compactedSizes(ppSourceData.size());
+            EmitRaytracingAccelerationStructureCompactedSizesOnCpu((UINT)ppSourceData.size(), ppSourceData.data(), compactedSizes.data());
+            for (UINT i = 0; i < compactedSizes.size(); i++)
+            {
+                Assert::IsTrue(compactedSizes[i] == ((const BVHOffsets *)ppSourceData[i])->totalSize && compactedSizes[i] <= builtSizes[i],
+                    L"Incorrect size returned from EmitRaytracingAccelerationStructureCompactedSizesOnCpu");
+            }
+        }
+
+        // Rotation about a random axis, a uniform scale and a translation, with the
+        // translation in the last column as D3D12 expects
+        void GenerateRandomInstanceTransform(FLOAT transform[3][4])
+        {
+            const float pi = 3.14159265f;
+            const float angle = (rand() / (float)RAND_MAX) * 2.0f * pi;
+            const float axisZ = (rand() / (float)RAND_MAX) * 2.0f - 1.0f;
+            const float axisAngle = (rand() / (float)RAND_MAX) * 2.0f * pi;
+            const float axisR = sqrtf(1.0f - axisZ * axisZ);
+            const float axis[3] = { axisR * cosf(axisAngle), axisR * sinf(axisAngle), axisZ };
+            const float scale = 0.5f + (rand() / (float)RAND_MAX) * 1.5f;
+
+            const float c = cosf(angle);
+            const float s = sinf(angle);
+            for (UINT row = 0; row < 3; row++)
+            {
+                for (UINT column = 0; column < 3; column++)
+                {
+                    float value = (1.0f - c) * axis[row] * axis[column];
+                    if (row == column)
+                    {
+                        value += c;
+                    }
+                    else
+                    {
+                        const UINT other = 3 - row - column;
+                        const float sign = ((column + 3 - row) % 3 == 1) ? -1.0f : 1.0f;
+                        value += sign * s * axis[other];
+                    }
+                    transform[row][column] = scale * value;
+                }
+                transform[row][3] = (rand() / (float)RAND_MAX) * 1000.0f - 500.0f;
+            }
+        }
+
+        // The top level over a few CPU-built bottom levels has the GPU builder's layout,
+        // with one leaf per instance boxing its bottom-level root in world space, and an
+        // ARRAY_OF_POINTERS layout builds the same bytes as an ARRAY
+        TEST_METHOD(TopLevelCpuBVHBuilder)
+        {
+            const UINT numBottomLevels = 3;
+            const UINT numInstances = 3000;
+            const UINT bottomLevelTriangles[numBottomLevels] = { 8192, 8192, 2000 };
+
+            std::vector<std::unique_ptr<BYTE[]>> bottomLevelData;
+            for (UINT level = 0; level < numBottomLevels; level++)
+            {
+                std::vector<float> vertices;
+                std::vector<UINT16> indices;
+                std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+                if (level == 1)
+                {
+                    GenerateDiagonalStrips(bottomLevelTriangles[level], vertices, indices, geomDescs);
+                }
+                else
+                {
+                    GenerateTerrain(bottomLevelTriangles[level], vertices, indices, geomDescs);
+                }
+
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.NumDescs = (UINT)geomDescs.size();
+                desc.Inputs.pGeometryDescs = geomDescs.data();
+                bottomLevelData.push_back(std::unique_ptr<BYTE[]>(new BYTE[GetRaytracingAccelerationStructureSizeOnCpu(&desc)]()));
+                BuildRaytracingAccelerationStructureOnCpu(&desc, bottomLevelData.back().get());
+            }
+
+            srand(25);
+            std::vector<D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC> instanceDescs(numInstances);
+            std::vector<const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC *> instanceDescPointers(numInstances);
+            std::vector<const void *> ppBottomLevelData(numInstances);
+            for (UINT i = 0; i < numInstances; i++)
+            {
+                const UINT level = i % numBottomLevels;
+                D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC &instanceDesc = instanceDescs[i];
+                GenerateRandomInstanceTransform(instanceDesc.Transform);
+                instanceDesc.InstanceID = i * 7;
+                instanceDesc.InstanceMask = i & 0xff;
+                instanceDesc.InstanceContributionToHitGroupIndex = i * 3;
+                instanceDesc.Flags = i & 0xf;
+                // Only carried through, so any value that tells them apart will do
+                instanceDesc.AccelerationStructure.EmulatedGpuPtr[0] = level + 1;
+                instanceDesc.AccelerationStructure.EmulatedGpuPtr[1] = i;
+
+                instanceDescPointers[i] = &instanceDesc;
+                ppBottomLevelData[i] = bottomLevelData[level].get();
+            }
+
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagsIndex = 0; flagsIndex < ARRAYSIZE(buildFlags); flagsIndex++)
+            {
+                D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+                desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+                desc.Inputs.Flags = buildFlags[flagsIndex];
+                desc.Inputs.NumDescs = numInstances;
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+                desc.Inputs.InstanceDescs = (D3D12_GPU_VIRTUAL_ADDRESS)instanceDescs.data();
+
+                const UINT64 prebuildSize = GetRaytracingAccelerationStructureSizeOnCpu(&desc);
+                std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[prebuildSize]());
+                CpuBuildInfo buildInfo;
+                BuildTopLevelAccelerationStructureOnCpu(&desc, ppBottomLevelData.data(), pData.get(), nullptr, &buildInfo);
+
+                desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY_OF_POINTERS;
+                desc.Inputs.InstanceDescs = (D3D12_GPU_VIRTUAL_ADDRESS)instanceDescPointers.data();
+                Assert::IsTrue(GetRaytracingAccelerationStructureSizeOnCpu(&desc) == prebuildSize, L"Prebuild size depends on the layout");
+                std::unique_ptr<BYTE[]> pPointerData = std::unique_ptr<BYTE[]>(new BYTE[prebuildSize]());
+                BuildTopLevelAccelerationStructureOnCpu(&desc, ppBottomLevelData.data(), pPointerData.get());
+                Assert::IsTrue(memcmp(pData.get(), pPointerData.get(), (size_t)prebuildSize) == 0,
+                    L"ARRAY_OF_POINTERS layout built a different structure");
+
+                const BVHOffsets &offsets = *(const BVHOffsets *)pData.get();
+                const UINT numNodes = 2 * numInstances - 1;
+                Assert::IsTrue(offsets.offsetToBoxes == sizeof(BVHOffsets), L"Incorrect offset to the boxes");
+                Assert::IsTrue(offsets.offsetToVertices == offsets.offsetToBoxes + numNodes * sizeof(AABBNode) &&
+                    offsets.offsetToPrimitiveMetaData == offsets.offsetToVertices, L"Instances must follow the boxes");
+                Assert::IsTrue(offsets.totalSize == prebuildSize &&
+                    offsets.totalSize == offsets.offsetToVertices + numInstances * sizeof(BVHMetadata), L"Incorrect total size");
+
+                const AABBNode *pNodes = (const AABBNode *)(pData.get() + offsets.offsetToBoxes);
+                const BVHMetadata *pMetadata = (const BVHMetadata *)(pData.get() + offsets.offsetToVertices);
+                std::vector<bool> isLeafFound(numInstances);
+                std::vector<bool> isInstanceFound(numInstances);
+                UINT numNodesFound = 0;
+                std::vector<UINT> nodeStack(1, 0);
+                while (!nodeStack.empty())
+                {
+                    const AABBNode &node = pNodes[nodeStack.back()];
+                    nodeStack.pop_back();
+                    numNodesFound++;
+
+                    if (!node.leaf)
+                    {
+                        const UINT children[] = { node.internalNode.leftNodeIndex, node.rightNodeIndex };
+                        for (UINT child : children)
+                        {
+                            Assert::IsTrue(child < numNodes, L"Invalid child index");
+                            AABB parentBox, childBox;
+                            FallbackLayer::DecompressAABB(parentBox, node);
+                            FallbackLayer::DecompressAABB(childBox, pNodes[child]);
+                            Assert::IsTrue(IsChildContainedByParent(parentBox, childBox), L"Child box not contained by its parent");
+                            nodeStack.push_back(child);
+                        }
+                        continue;
+                    }
+
+                    const UINT leafIndex = node.leafNode.firstTriangleId;
+                    Assert::IsTrue(node.leafNode.numTriangleIds == 0 && node.numTriangles == 1, L"Leaves must be written as the GPU builder does");
+                    Assert::IsTrue(leafIndex < numInstances && !isLeafFound[leafIndex], L"Leaves must reference distinct instances");
+                    isLeafFound[leafIndex] = true;
+
+                    const BVHMetadata &metadata = pMetadata[leafIndex];
+                    const UINT instanceIndex = metadata.InstanceIndex;
+                    Assert::IsTrue(instanceIndex < numInstances && !isInstanceFound[instanceIndex], L"Every instance must have one leaf");
+                    isInstanceFound[instanceIndex] = true;
+
+                    const D3D12_RAYTRACING_FALLBACK_INSTANCE_DESC &instanceDesc = instanceDescs[instanceIndex];
+                    Assert::IsTrue(metadata.instanceDesc.InstanceID == instanceDesc.InstanceID &&
+                        metadata.instanceDesc.InstanceMask == instanceDesc.InstanceMask &&
+                        metadata.instanceDesc.InstanceContributionToHitGroupIndex == instanceDesc.InstanceContributionToHitGroupIndex &&
+                        metadata.instanceDesc.Flags == instanceDesc.Flags &&
+                        memcmp(&metadata.instanceDesc.AccelerationStructure, &instanceDesc.AccelerationStructure, sizeof(instanceDesc.AccelerationStructure)) == 0,
+                        L"Instance desc not carried through");
+                    Assert::IsTrue(memcmp(metadata.ObjectToWorld, instanceDesc.Transform, sizeof(instanceDesc.Transform)) == 0,
+                        L"ObjectToWorld must be the instance transform");
+
+                    // WorldToObject in the desc undoes ObjectToWorld
+                    const float(*worldToObject)[4] = metadata.instanceDesc.Transform;
+                    const float(*objectToWorld)[4] = instanceDesc.Transform;
+                    for (UINT row = 0; row < 3; row++)
+                    {
+                        for (UINT column = 0; column < 4; column++)
+                        {
+                            float value = column == 3 ? worldToObject[row][3] : 0.0f;
+                            for (UINT k = 0; k < 3; k++)
+                            {
+                                value += worldToObject[row][k] * objectToWorld[k][column];
+                            }
+                            const float expected = row == column ? 1.0f : 0.0f;
+                            Assert::IsTrue(fabs(value - expected) < 1e-3f, L"WorldToObject is not the inverse of the instance transform");
+                        }
+                    }
+
+                    // The leaf box holds every corner of the bottom-level root in world space
+                    const BYTE *pBottomLevel = (const BYTE *)ppBottomLevelData[instanceIndex];
+                    const AABBNode &root = *(const AABBNode *)(pBottomLevel + ((const BVHOffsets *)pBottomLevel)->offsetToBoxes);
+                    for (UINT corner = 0; corner < 8; corner++)
+                    {
+                        float objectCorner[3];
+                        for (UINT axis = 0; axis < 3; axis++)
+                        {
+                            objectCorner[axis] = root.center[axis] + ((corner >> axis) & 1 ? root.halfDim[axis] : -root.halfDim[axis]);
+                        }
+                        for (UINT axis = 0; axis < 3; axis++)
+                        {
+                            float worldCorner = objectToWorld[axis][3];
+                            for (UINT k = 0; k < 3; k++)
+                            {
+                                worldCorner += objectToWorld[axis][k] * objectCorner[k];
+                            }
+                            const float tolerance = 1e-5f * (1.0f + fabs(worldCorner));
+                            Assert::IsTrue(fabs(worldCorner - node.center[axis]) <= node.halfDim[axis] + tolerance,
+                                L"Instance box does not contain its bottom level");
+                        }
+                    }
+                }
+                Assert::IsTrue(numNodesFound == numNodes, L"Nodes unreachable from the root");
+
+                std::wstringstream message;
+                message << (buildFlags[flagsIndex] ? L"Fast build" : L"SAH build") << L" over " << numInstances << L" instances: " <<
+                    buildInfo.BuildTimeInSeconds * 1000.0 << L" ms, SAH cost " << buildInfo.SahCost << std::endl;
+                Logger::WriteMessage(message.str().c_str());
+            }
+
+            // No instances still write a root node for the traversal to miss
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            const UINT64 emptySize = GetRaytracingAccelerationStructureSizeOnCpu(&desc);
+            Assert::IsTrue(emptySize == sizeof(BVHOffsets) + sizeof(AABBNode), L"Incorrect size without instances");
+            std::unique_ptr<BYTE[]> pEmptyData = std::unique_ptr<BYTE[]>(new BYTE[emptySize]);
+            memset(pEmptyData.get(), 0xff, (size_t)emptySize);
+            BuildTopLevelAccelerationStructureOnCpu(&desc, nullptr, pEmptyData.get());
+            Assert::IsTrue(((const BVHOffsets *)pEmptyData.get())->totalSize == emptySize, L"Incorrect total size without instances");
+
+            // Rays through the origin and elsewhere, including axis-aligned ones with infinite inverse directions
+            const AABBNode &emptyRoot = *(const AABBNode *)(pEmptyData.get() + sizeof(BVHOffsets));
+            const float rayOrigins[][3] = { { 0.0f, 0.0f, 0.0f }, { -10.0f, 0.0f, 0.0f }, { 3.0f, -2.0f, 5.0f } };
+            const float rayDirections[][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f },
+                { 1.0f, 1.0f, 1.0f }, { -0.001f, 1000.0f, 0.5f } };
+            for (UINT originIndex = 0; originIndex < ARRAYSIZE(rayOrigins); originIndex++)
+            {
+                for (UINT directionIndex = 0; directionIndex < ARRAYSIZE(rayDirections); directionIndex++)
+                {
+                    Assert::IsFalse(RayBoxTest(emptyRoot, rayOrigins[originIndex], rayDirections[directionIndex], FLT_MAX),
+                        L"A ray hits the root without instances");
+                }
+            }
+        }
+
+        // Mirrors RayBoxTest of the traversal shader, with its NaN-discarding min and max
+        static bool RayBoxTest(const AABBNode &node, const float origin[3], const float direction[3], float closestT)
+        {
+            float minT = -FLT_MAX;
+            float maxT = FLT_MAX;
+            for (UINT axis = 0; axis < 3; axis++)
+            {
+                const float inverseDirection = 1.0f / direction[axis];
+                const float relativeMiddle = node.center[axis] * inverseDirection - origin[axis] * inverseDirection;
+                minT = fmaxf(minT, relativeMiddle - node.halfDim[axis] * fabsf(inverseDirection));
+                maxT = fminf(maxT, relativeMiddle + node.halfDim[axis] * fabsf(inverseDirection));
+            }
+            return fmaxf(minT, 0.0f) < fminf(maxT, closestT);
+        }
+
+        // Half of a float that fp16 represents exactly, with no rounding or denormals
+        static USHORT ExactFloatToHalf(float value)
+        {
+            UINT bits;
+            memcpy(&bits, &value, sizeof(bits));
+            return value == 0.0f ? 0 : (USHORT)(((bits >> 16) & 0x8000) | ((((bits >> 23) & 0xff) - 112) << 10) | ((bits >> 13) & 0x3ff));
+        }
+
+        // R32 indices, no indices, padded and fp16 vertices all gather the same triangles
+        // as R16 indices with R32G32B32 vertices, so the structures are byte for byte the
+        // same. 2D vertices match the same triangles flattened onto z = 0.
+        TEST_METHOD(BottomLevelCpuBVHBuilderIndexAndVertexFormats)
+        {
+            const UINT numTriangles = 8192;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+            Assert::AreEqual(1u, (UINT)geomDescs.size());
+
+            // Heights in eighths keep every coordinate exact in fp16
+            const UINT numVertices = geomDescs[0].Triangles.VertexCount;
+            for (UINT i = 0; i < numVertices; i++)
+            {
+                vertices[i * 3 + 1] = floor(vertices[i * 3 + 1] * 8.0f) / 8.0f;
+            }
+
+            std::vector<float> flatVertices(vertices);
+            std::vector<UINT32> indices32(indices.begin(), indices.end());
+            std::vector<float> listVertices(numTriangles * 3 * 3);
+            std::vector<float> paddedVertices(numVertices * 4);
+            std::vector<USHORT> halfVertices(numVertices * 4);
+            std::vector<float> vertices2D(numVertices * 2);
+            for (UINT i = 0; i < numVertices; i++)
+            {
+                flatVertices[i * 3 + 2] = 0.0f;
+                for (UINT j = 0; j < 3; j++)
+                {
+                    paddedVertices[i * 4 + j] = vertices[i * 3 + j];
+                    halfVertices[i * 4 + j] = ExactFloatToHalf(vertices[i * 3 + j]);
+                }
+                paddedVertices[i * 4 + 3] = 1.0f;
+                halfVertices[i * 4 + 3] = ExactFloatToHalf(1.0f);
+                vertices2D[i * 2 + 0] = vertices[i * 3 + 0];
+                vertices2D[i * 2 + 1] = vertices[i * 3 + 1];
+            }
+            for (UINT i = 0; i < numTriangles * 3; i++)
+            {
+                memcpy(&listVertices[i * 3], &vertices[indices[i] * 3], sizeof(float) * 3);
+            }
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = 1;
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT outputSize = sizeof(BVHOffsets) +
+                (2 * numTriangles - 1) * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData));
+            std::unique_ptr<BYTE[]> pExpectedData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pExpectedFlatData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[outputSize]());
+
+            struct FormatTest
+            {
+                const wchar_t *pName;
+                DXGI_FORMAT indexFormat;
+                const void *pIndices;
+                DXGI_FORMAT vertexFormat;
+                const void *pVertices;
+                UINT vertexStride;
+                UINT vertexCount;
+                bool bFlat;
+            };
+            const FormatTest formatTests[] = {
+                { L"R32 indices", DXGI_FORMAT_R32_UINT, indices32.data(), DXGI_FORMAT_R32G32B32_FLOAT, vertices.data(), sizeof(float) * 3, numVertices, false },
+                { L"No indices", DXGI_FORMAT_UNKNOWN, nullptr, DXGI_FORMAT_R32G32B32_FLOAT, listVertices.data(), sizeof(float) * 3, numTriangles * 3, false },
+                { L"R32G32B32A32 vertices", DXGI_FORMAT_R16_UINT, indices.data(), DXGI_FORMAT_R32G32B32A32_FLOAT, paddedVertices.data(), sizeof(float) * 4, numVertices, false },
+                { L"R16G16B16A16 vertices", DXGI_FORMAT_R32_UINT, indices32.data(), DXGI_FORMAT_R16G16B16A16_FLOAT, halfVertices.data(), sizeof(USHORT) * 4, numVertices, false },
+                { L"R32G32 vertices", DXGI_FORMAT_R16_UINT, indices.data(), DXGI_FORMAT_R32G32_FLOAT, vertices2D.data(), sizeof(float) * 2, numVertices, true },
+            };
+
+            // Both the SAH and the linear build
+            const D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC r16Desc = geomDescs[0].Triangles;
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                desc.Inputs.Flags = buildFlags[flagIndex];
+
+                auto &triangleDesc = geomDescs[0].Triangles;
+                triangleDesc = r16Desc;
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pExpectedData.get());
+                triangleDesc.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)flatVertices.data();
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pExpectedFlatData.get());
+
+                for (UINT testIndex = 0; testIndex < ARRAYSIZE(formatTests); testIndex++)
+                {
+                    const FormatTest &test = formatTests[testIndex];
+                    triangleDesc.IndexFormat = test.indexFormat;
+                    triangleDesc.IndexBuffer = (D3D12_GPU_VIRTUAL_ADDRESS)test.pIndices;
+                    triangleDesc.IndexCount = test.pIndices ? numTriangles * 3 : 0;
+                    triangleDesc.VertexFormat = test.vertexFormat;
+                    triangleDesc.VertexBuffer.StartAddress = (D3D12_GPU_VIRTUAL_ADDRESS)test.pVertices;
+                    triangleDesc.VertexBuffer.StrideInBytes = test.vertexStride;
+                    triangleDesc.VertexCount = test.vertexCount;
+                    BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+
+                    const BYTE *pExpected = test.bFlat ? pExpectedFlatData.get() : pExpectedData.get();
+                    Assert::IsTrue(memcmp(pData.get(), pExpected, outputSize) == 0, test.pName);
+                }
+            }
+        }
+
+        // Rays from above the terrain toward random points on its triangles, steeper
+        // than any slope of the terrain so nothing is in the way. Every eighth ray is
+        // turned around, so it may miss.
+        void GenerateTerrainRays(UINT numRays, const std::vector<Triangle> &triangles, std::vector<CpuRay> &rays, std::vector<bool> &isAimed)
+        {
+            srand(numRays);
+            const auto random = []() { return (float)rand() / RAND_MAX; };
+            for (UINT i = 0; i < numRays; i++)
+            {
+                const Triangle &triangle = triangles[((UINT)rand() * (RAND_MAX + 1u) + (UINT)rand()) % triangles.size()];
+                float u = random();
+                float v = random();
+                if (u + v > 1.0f)
+                {
+                    u = 1.0f - u;
+                    v = 1.0f - v;
+                }
+
+                const float3 target = triangle.v0 + (triangle.v1 - triangle.v0) * u + (triangle.v2 - triangle.v0) * v;
+                const float3 origin = target + float3{ random() * 20.0f - 10.0f, 20.0f + random() * 50.0f, random() * 20.0f - 10.0f };
+                const bool bAimed = i % 8 != 0;
+                rays.push_back(CpuRay(origin, bAimed ? target - origin : origin - target, 0.0f, FLT_MAX));
+                isAimed.push_back(bAimed);
+            }
+        }
+
+        // Collapsed trees find the same closest hits as the binary trees they come from
+        TEST_METHOD(WideCpuBVHTraversalMatchesBVH2)
+        {
+            const UINT numTriangles = 8192;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            std::vector<Triangle> triangles(numTriangles);
+            for (UINT i = 0; i < numTriangles; i++)
+            {
+                for (UINT j = 0; j < 3; j++)
+                {
+                    memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                }
+            }
+
+            std::vector<CpuRay> rays;
+            std::vector<bool> isAimed;
+            GenerateTerrainRays(4096, triangles, rays, isAimed);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT numNodes = 2 * numTriangles - 1;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[sizeof(BVHOffsets) +
+                numNodes * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData))]);
+
+            // Both the SAH and the linear build
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                desc.Inputs.Flags = buildFlags[flagIndex];
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+
+                const CpuBVH4 bvh4(pData.get());
+                const CpuBVH8 bvh8(pData.get());
+                Assert::IsTrue(bvh4.GetNumNodes() <= (numNodes + 2) / 3 && bvh8.GetNumNodes() <= (numNodes + 6) / 7,
+                    L"Wide nodes should have more than two children on average");
+
+                for (UINT i = 0; i < rays.size(); i++)
+                {
+                    CpuRayHit hit, hit4, hit8;
+                    const bool bHit = TraceBVH2OnCpu(pData.get(), rays[i], hit);
+                    Assert::IsTrue(bHit || !isAimed[i], L"Ray missed the triangle it was aimed at");
+                    Assert::IsTrue(!isAimed[i] || hit.t <= 1.0001f, L"Ray hit behind the triangle it was aimed at");
+
+                    Assert::IsTrue(bvh4.Trace(rays[i], hit4) == bHit && (!bHit || hit4.t == hit.t), L"BVH4 hit differs from BVH2");
+                    Assert::IsTrue(bvh8.Trace(rays[i], hit8) == bHit && (!bHit || hit8.t == hit.t), L"BVH8 hit differs from BVH2");
+                }
+            }
+        }
+
+        // Quantized boxes contain the boxes they come from, so every ray that hits the
+        // terrain still finds its closest hit, including rays through shared vertices
+        // and edges, and far from the origin where the grid is coarse
+        TEST_METHOD(QuantizedCpuBVHIsWatertight)
+        {
+            const UINT numTriangles = 8192;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+            const std::vector<float> terrainVertices = vertices;
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT numNodes = 2 * numTriangles - 1;
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[sizeof(BVHOffsets) +
+                numNodes * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData))]);
+
+            const float offsets[] = { 0.0f, 3.0e5f };
+            for (UINT offsetIndex = 0; offsetIndex < ARRAYSIZE(offsets); offsetIndex++)
+            {
+                for (UINT i = 0; i < vertices.size(); i++)
+                {
+                    vertices[i] = terrainVertices[i] + offsets[offsetIndex];
+                }
+
+                std::vector<Triangle> triangles(numTriangles);
+                for (UINT i = 0; i < numTriangles; i++)
+                {
+                    for (UINT j = 0; j < 3; j++)
+                    {
+                        memcpy(&triangles[i].v[j], &vertices[indices[i * 3 + j] * 3], sizeof(float) * 3);
+                    }
+                }
+
+                // Rays go to triangles away from the border of the terrain, where rays
+                // aimed at it can pass just outside
+                const UINT quadsPerRow = 255;
+                const UINT numFullRows = numTriangles / (quadsPerRow * 2);
+                std::vector<Triangle> innerTriangles;
+                for (UINT i = 0; i < numTriangles; i++)
+                {
+                    const UINT row = i / 2 / quadsPerRow;
+                    const UINT column = i / 2 % quadsPerRow;
+                    if (row > 0 && row + 1 < numFullRows && column > 0 && column + 1 < quadsPerRow)
+                    {
+                        innerTriangles.push_back(triangles[i]);
+                    }
+                }
+
+                // Random points, then every vertex and the middle of every edge
+                std::vector<CpuRay> rays;
+                std::vector<bool> isAimed;
+                GenerateTerrainRays(4096, innerTriangles, rays, isAimed);
+                for (UINT i = 0; i < innerTriangles.size(); i++)
+                {
+                    const Triangle &triangle = innerTriangles[i];
+                    const float3 targets[] = { triangle.v0, (triangle.v0 + triangle.v1) * 0.5f, (triangle.v1 + triangle.v2) * 0.5f, (triangle.v2 + triangle.v0) * 0.5f };
+                    for (UINT j = 0; j < ARRAYSIZE(targets); j++)
+                    {
+                        const float3 origin = targets[j] + float3{ (float)(i % 7) - 3.0f, 40.0f, (float)(i % 5) - 2.0f };
+                        rays.push_back(CpuRay(origin, targets[j] - origin, 0.0f, FLT_MAX));
+                        isAimed.push_back(true);
+                    }
+                }
+
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+                const CpuBVH4 bvh4(pData.get());
+                const CpuBVH8 bvh8(pData.get());
+                const CpuQuantizedBVH4 quantizedBvh4(bvh4);
+                const CpuQuantizedBVH8 quantizedBvh8(bvh8);
+                Assert::IsTrue(quantizedBvh4.GetSizeInBytes() < bvh4.GetSizeInBytes() && quantizedBvh8.GetSizeInBytes() < bvh8.GetSizeInBytes(),
+                    L"Quantized nodes should be smaller");
+
+                // Far from the origin the rays are only aimed to within the float spacing
+                const float maxAimedT = 1.0001f + offsets[offsetIndex] * 1.0e-8f;
+                for (UINT i = 0; i < rays.size(); i++)
+                {
+                    CpuRayHit hit, hit4, hit8;
+                    const bool bHit = bvh4.Trace(rays[i], hit);
+                    Assert::IsTrue(bHit || !isAimed[i], L"Ray missed the point it was aimed at");
+                    Assert::IsTrue(!isAimed[i] || hit.t <= maxAimedT, L"Ray hit behind the point it was aimed at");
+
+                    // Triangles that share the point a ray hits can put it an ulp apart,
+                    // and the one visited first is kept
+                    const float tolerance = hit.t * 1.0e-6f;
+                    Assert::IsTrue(quantizedBvh4.Trace(rays[i], hit4) == bHit && (!bHit || std::abs(hit4.t - hit.t) <= tolerance), L"Quantized BVH4 hit differs");
+                    Assert::IsTrue(quantizedBvh8.Trace(rays[i], hit8) == bHit && (!bHit || std::abs(hit8.t - hit.t) <= tolerance), L"Quantized BVH8 hit differs");
+                }
+            }
+        }
+
+        // Single-threaded rays per second and memory of the binary layout against the
+        // wide and quantized ones
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkCpuWideBVHTraversal)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkCpuWideBVHTraversal)
+        {
+            const UINT numTriangles = 1000000;
+            std::vector<float> vertices;
+            std::vector<UINT16> indices;
+            std::vector<D3D12_RAYTRACING_GEOMETRY_DESC> geomDescs;
+            GenerateTerrain(numTriangles, vertices, indices, geomDescs);
+
+            UINT index = 0;
+            std::vector<Triangle> triangles(numTriangles);
+            for (UINT geometry = 0; geometry < geomDescs.size(); geometry++)
+            {
+                const float *pVertices = (const float *)geomDescs[geometry].Triangles.VertexBuffer.StartAddress;
+                for (UINT i = 0; i < geomDescs[geometry].Triangles.IndexCount; i++, index++)
+                {
+                    memcpy(&triangles[index / 3].v[index % 3], &pVertices[indices[index] * 3], sizeof(float) * 3);
+                }
+            }
+
+            std::vector<CpuRay> rays;
+            std::vector<bool> isAimed;
+            GenerateTerrainRays(1000000, triangles, rays, isAimed);
+
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc{};
+            desc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+            desc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+            desc.Inputs.NumDescs = (UINT)geomDescs.size();
+            desc.Inputs.pGeometryDescs = geomDescs.data();
+
+            const UINT numNodes = 2 * numTriangles - 1;
+            const UINT bvh2Size = sizeof(BVHOffsets) + numNodes * sizeof(AABBNode) + numTriangles * (sizeof(Primitive) + sizeof(PrimitiveMetaData));
+            std::unique_ptr<BYTE[]> pData = std::unique_ptr<BYTE[]>(new BYTE[bvh2Size]);
+
+            const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags[] = {
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE,
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_BUILD };
+            for (UINT flagIndex = 0; flagIndex < ARRAYSIZE(buildFlags); flagIndex++)
+            {
+                desc.Inputs.Flags = buildFlags[flagIndex];
+                BuildRaytracingAccelerationStructureOnCpu(&desc, pData.get());
+
+                auto start = std::chrono::high_resolution_clock::now();
+                const CpuBVH4 bvh4(pData.get());
+                const double bvh4CollapseTime = GetMillisecondsSince(start);
+                start = std::chrono::high_resolution_clock::now();
+                const CpuBVH8 bvh8(pData.get());
+                const double bvh8CollapseTime = GetMillisecondsSince(start);
+                start = std::chrono::high_resolution_clock::now();
+                const CpuQuantizedBVH4 quantizedBvh4(bvh4);
+                const double quantizedBvh4Time = bvh4CollapseTime + GetMillisecondsSince(start);
+                start = std::chrono::high_resolution_clock::now();
+                const CpuQuantizedBVH8 quantizedBvh8(bvh8);
+                const double quantizedBvh8Time = bvh8CollapseTime + GetMillisecondsSince(start);
+
+                const std::function<bool(const CpuRay &, CpuRayHit &)> layouts[] = {
+                    [&](const CpuRay &ray, CpuRayHit &hit) { return TraceBVH2OnCpu(pData.get(), ray, hit); },
+                    [&](const CpuRay &ray, CpuRayHit &hit) { return bvh4.Trace(ray, hit); },
+                    [&](const CpuRay &ray, CpuRayHit &hit) { return bvh8.Trace(ray, hit); },
+                    [&](const CpuRay &ray, CpuRayHit &hit) { return quantizedBvh4.Trace(ray, hit); },
+                    [&](const CpuRay &ray, CpuRayHit &hit) { return quantizedBvh8.Trace(ray, hit); } };
+                const wchar_t *layoutNames[] = { L"BVH2", L"BVH4", L"BVH8", L"Quantized BVH4", L"Quantized BVH8" };
+                const size_t layoutSizes[] = { bvh2Size, bvh4.GetSizeInBytes(), bvh8.GetSizeInBytes(), quantizedBvh4.GetSizeInBytes(), quantizedBvh8.GetSizeInBytes() };
+                const double collapseTimes[] = { 0.0, bvh4CollapseTime, bvh8CollapseTime, quantizedBvh4Time, quantizedBvh8Time };
+                for (UINT layout = 0; layout < ARRAYSIZE(layouts); layout++)
+                {
+                    UINT numHits = 0;
+                    start = std::chrono::high_resolution_clock::now();
+                    for (const CpuRay &ray : rays)
+                    {
+                        CpuRayHit hit;
+                        numHits += layouts[layout](ray, hit);
+                    }
+                    const double traceTime = GetMillisecondsSince(start);
+
+                    std::wstringstream message;
+                    message << (flagIndex ? L"Linear, " : L"SAH, ") << layoutNames[layout] << L": " <<
+                        rays.size() / (traceTime * 1000.0) << L" Mrays/s, " << numHits << L" hits, " <<
+                        layoutSizes[layout] / (1024.0 * 1024.0) << L" MB, collapsed in " << collapseTimes[layout] << L" ms" << std::endl;
+                    Logger::WriteMessage(message.str().c_str());
+                }
+            }
+        }
+
+        template <typename KeyType>
+        void GenerateSortKeys(UINT numElements, KeyType keyMask, std::vector<KeyType> &keys, std::vector<UINT32> &values)
+        {
+            srand(numElements);
+            keys.resize(numElements);
+            values.resize(numElements);
+            for (UINT i = 0; i < numElements; i++)
+            {
+                // rand() may only give 15 bits
+                UINT64 key = 0;
+                for (UINT shift = 0; shift < 64; shift += 15)
+                {
+                    key ^= (UINT64)rand() << shift;
+                }
+                keys[i] = (KeyType)key & keyMask;
+                values[i] = i;
+            }
+        }
+
+        template <typename KeyType>
+        void TestCpuRadixSort(UINT numElements, KeyType keyMask, UINT bitsPerDigit, UINT numThreads)
+        {
+            std::vector<KeyType> keys;
+            std::vector<UINT32> values;
+            GenerateSortKeys(numElements, keyMask, keys, values);
+
+            std::vector<std::pair<KeyType, UINT32>> expected(numElements);
+            for (UINT i = 0; i < numElements; i++)
+            {
+                expected[i] = std::make_pair(keys[i], values[i]);
+            }
+            std::stable_sort(expected.begin(), expected.end(),
+                [](const std::pair<KeyType, UINT32> &a, const std::pair<KeyType, UINT32> &b) { return a.first < b.first; });
+
+            std::vector<KeyType> keysScratch(numElements);
+            std::vector<UINT32> valuesScratch(numElements);
+            CpuTaskPool taskPool(numThreads);
+            RadixSort(keys.data(), values.data(), keysScratch.data(), valuesScratch.data(), numElements, taskPool, bitsPerDigit);
+
+            for (UINT i = 0; i < numElements; i++)
+            {
+                Assert::IsTrue(keys[i] == expected[i].first && values[i] == expected[i].second, L"Radix sort output incorrect");
+            }
+        }
+
+        // Small inputs scatter directly, large ones through the write-combining buffers.
+        // Narrow keys leave most passes with a single bucket, which get skipped.
+        TEST_METHOD(CpuRadixSortMatchesStableSort)
+        {
+            const UINT numElements[] = { 1, 1000, 300000 };
+            const UINT numThreads[] = { 1, 3, 8 };
+            for (UINT sizeIndex = 0; sizeIndex < ARRAYSIZE(numElements); sizeIndex++)
+            {
+                for (UINT threadIndex = 0; threadIndex < ARRAYSIZE(numThreads); threadIndex++)
+                {
+                    for (UINT bitsPerDigit = 8; bitsPerDigit <= 11; bitsPerDigit += 3)
+                    {
+                        TestCpuRadixSort<UINT32>(numElements[sizeIndex], 0xffffffff, bitsPerDigit, numThreads[threadIndex]);
+                        TestCpuRadixSort<UINT32>(numElements[sizeIndex], 0x0000ff00, bitsPerDigit, numThreads[threadIndex]);
+                        TestCpuRadixSort<UINT64>(numElements[sizeIndex], ~(UINT64)0, bitsPerDigit, numThreads[threadIndex]);
+                    }
+                }
+            }
+        }
+
+        static UINT InsertOneBit(UINT value, UINT oneBitMask)
+        {
+            const UINT mask = oneBitMask - 1;
+            return (value & ~mask) << 1 | (value & mask) | oneBitMask;
+        }
+
+        // CPU port of the network that BitonicSort runs on the GPU, sorting ascending.
+        // Every group of k is sorted in the same direction, so the list only needs
+        // padding with null items up to a power of two.
+        static void CpuBitonicSort(std::vector<UINT32> &keys, std::vector<UINT32> &values, CpuTaskPool &taskPool)
+        {
+            const UINT32 nullItem = 0xffffffff;
+            const UINT numElements = (UINT)keys.size();
+            UINT paddedSize = 1;
+            while (paddedSize < numElements)
+            {
+                paddedSize *= 2;
+            }
+            keys.resize(paddedSize, nullItem);
+            values.resize(paddedSize, nullItem);
+
+            const UINT numPairs = paddedSize / 2;
+            const UINT pairsPerTask = 16 * 1024;
+            const UINT numTasks = (numPairs + pairsPerTask - 1) / pairsPerTask;
+            for (UINT k = 2; k <= paddedSize; k *= 2)
+            {
+                for (UINT j = k / 2; j > 0; j /= 2)
+                {
+                    taskPool.ParallelFor(numTasks, [&](UINT task)
+                    {
+                        const UINT end = std::min((task + 1) * pairsPerTask, numPairs);
+                        for (UINT pair = task * pairsPerTask; pair < end; pair++)
+                        {
+                            const UINT index2 = InsertOneBit(pair, j);
+                            const UINT index1 = index2 ^ (k == 2 * j ? k - 1 : j);
+
+                            const UINT32 a = keys[index1];
+                            const UINT32 b = keys[index2];
+                            if (a > b || (a == b && values[index1] > values[index2]))
+                            {
+                                keys[index1] = b;
+                                keys[index2] = a;
+                                std::swap(values[index1], values[index2]);
+                            }
+                        }
+                    });
+                }
+            }
+
+            keys.resize(numElements);
+            values.resize(numElements);
+        }
+
+        static double GetMillisecondsSince(const std::chrono::high_resolution_clock::time_point &start)
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+
+        // Radix sort against std::sort and the bitonic network, on 30-bit Morton-sized keys
+        // and on full 64-bit keys. The bitonic network only sorts 32-bit keys.
+        BEGIN_TEST_METHOD_ATTRIBUTE(BenchmarkCpuRadixSort)
+            TEST_IGNORE()
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(BenchmarkCpuRadixSort)
+        {
+            const UINT numElements[] = { 100000, 1000000, 8000000 };
+            const UINT maxNumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+            for (UINT sizeIndex = 0; sizeIndex < ARRAYSIZE(numElements); sizeIndex++)
+            {
+                const UINT count = numElements[sizeIndex];
+                std::vector<UINT32> keys32, values32, keysScratch32(count), valuesScratch32(count);
+                std::vector<UINT64> keys64, keysScratch64(count);
+                std::vector<UINT32> values64, valuesScratch64(count);
+
+                std::vector<std::pair<UINT32, UINT32>> pairs32;
+                std::vector<std::pair<UINT64, UINT32>> pairs64;
+                GenerateSortKeys(count, 0x3fffffffu, keys32, values32);
+                GenerateSortKeys(count, ~(UINT64)0, keys64, values64);
+                for (UINT i = 0; i < count; i++)
+                {
+                    pairs32.push_back(std::make_pair(keys32[i], values32[i]));
+                    pairs64.push_back(std::make_pair(keys64[i], values64[i]));
+                }
+
+                auto start = std::chrono::high_resolution_clock::now();
+                std::sort(pairs32.begin(), pairs32.end());
+                const double sortTime32 = GetMillisecondsSince(start);
+
+                start = std::chrono::high_resolution_clock::now();
+                std::sort(pairs64.begin(), pairs64.end());
+                const double sortTime64 = GetMillisecondsSince(start);
+
+                std::wstringstream message;
+                message << count << L" elements, std::sort: " << sortTime32 << L" ms (32-bit keys), " <<
+                    sortTime64 << L" ms (64-bit keys)" << std::endl;
+
+                for (UINT numThreads = 1; numThreads < 2 * maxNumThreads; numThreads *= 2)
+                {
+                    CpuTaskPool taskPool(std::min(numThreads, maxNumThreads));
+                    message << L"  " << taskPool.GetNumThreads() << L" thread(s):";
+
+                    for (UINT bitsPerDigit = 8; bitsPerDigit <= 11; bitsPerDigit += 3)
+                    {
+                        std::vector<UINT32> keys = keys32, values = values32;
+                        start = std::chrono::high_resolution_clock::now();
+                        RadixSort(keys.data(), values.data(), keysScratch32.data(), valuesScratch32.data(), count, taskPool, bitsPerDigit);
+                        message << L" radix " << bitsPerDigit << L"-bit " << GetMillisecondsSince(start) << L" ms";
+
+                        std::vector<UINT64> keysWide = keys64;
+                        values = values64;
+                        start = std::chrono::high_resolution_clock::now();
+                        RadixSort(keysWide.data(), values.data(), keysScratch64.data(), valuesScratch64.data(), count, taskPool, bitsPerDigit);
+                        message << L" (" << GetMillisecondsSince(start) << L" ms 64-bit),";
+                    }
+
+                    std::vector<UINT32> keys = keys32, values = values32;
+                    start = std::chrono::high_resolution_clock::now();
+                    CpuBitonicSort(keys, values, taskPool);
+                    message << L" bitonic " << GetMillisecondsSince(start) << L" ms" << std::endl;
+
+                    for (UINT i = 0; i < count; i++)
+                    {
+                        Assert::IsTrue(keys[i] == pairs32[i].first && values[i] == pairs32[i].second, L"Bitonic sort output incorrect");
+                    }
+                }
+                Logger::WriteMessage(message.str().c_str());
+            }
+        }
+
         void GenerateRandomTranformation(float *pMatrix)
         {
             // Identity matrix
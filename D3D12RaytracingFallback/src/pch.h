@@ -25,6 +25,12 @@
 #include <unordered_set>
 #include <map>
 #include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
 #include <string>
 #include <strsafe.h>
 #include "d3d12_1.h"
@@ -86,6 +92,9 @@
 #include "GpuBvh2Copy.h"
 #include "TreeletReorder.h"
 #include "GpuBvh2Builder.h"
+#include "CpuTaskPool.h"
+#include "CpuRadixSort.h"
+#include "CpuWideBVH.h"
 
 // Dispatchers
 #include "UberShaderBindings.h"
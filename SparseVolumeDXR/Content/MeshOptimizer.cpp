@@ -0,0 +1,328 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#include "MeshOptimizer.h"
+
+using namespace std;
+
+static const auto invalid = UINT32_MAX;
+
+//--------------------------------------------------------------------------------------
+// Post-transform cache simulators
+//--------------------------------------------------------------------------------------
+
+// FIFO cache tracked by the insertion stamp of each vertex
+class FifoCache
+{
+public:
+	FifoCache(uint32_t numVertices, uint32_t cacheSize) :
+		m_stamps(numVertices, 0),
+		m_time(cacheSize + 1),
+		m_cacheSize(cacheSize)
+	{
+	}
+
+	// Returns true on a hit.
+	bool Access(uint32_t v)
+	{
+		if (m_time - m_stamps[v] <= m_cacheSize) return true;
+		m_stamps[v] = m_time++;
+
+		return false;
+	}
+
+	void Flush()
+	{
+		m_time += m_cacheSize + 1;
+	}
+
+protected:
+	vector<uint32_t> m_stamps;
+	uint32_t m_time;
+	uint32_t m_cacheSize;
+};
+
+// LRU cache as a short most-recent-first list
+class LruCache
+{
+public:
+	LruCache(uint32_t cacheSize) :
+		m_cacheSize(cacheSize)
+	{
+		m_entries.reserve(cacheSize + 1);
+	}
+
+	// Returns true on a hit.
+	bool Access(uint32_t v)
+	{
+		const auto it = find(m_entries.begin(), m_entries.end(), v);
+		const auto bHit = it != m_entries.end();
+		if (bHit) rotate(m_entries.begin(), it, it + 1);
+		else
+		{
+			m_entries.insert(m_entries.begin(), v);
+			if (m_entries.size() > m_cacheSize) m_entries.pop_back();
+		}
+
+		return bHit;
+	}
+
+protected:
+	vector<uint32_t> m_entries;
+	uint32_t m_cacheSize;
+};
+
+//--------------------------------------------------------------------------------------
+// Mesh optimizer
+//--------------------------------------------------------------------------------------
+
+void MeshOptimizer::OptimizeVertexCache(uint32_t *pIndices, uint32_t numIndices,
+	uint32_t numVertices, uint32_t cacheSize)
+{
+	const auto numTri = numIndices / 3;
+	if (numTri == 0) return;
+
+	// Vertex-to-triangle adjacency (CSR); the valences double as live triangle counts.
+	vector<uint32_t> liveTriangles(numVertices);
+	for (auto i = 0u; i < numTri * 3; ++i) ++liveTriangles[pIndices[i]];
+
+	vector<uint32_t> offsets(numVertices + 1);
+	for (auto i = 0u; i < numVertices; ++i) offsets[i + 1] = offsets[i] + liveTriangles[i];
+
+	vector<uint32_t> adjacency(numTri * 3);
+	{
+		vector<uint32_t> cursors(offsets.cbegin(), offsets.cend() - 1);
+		for (auto i = 0u; i < numTri * 3; ++i) adjacency[cursors[pIndices[i]]++] = i / 3;
+	}
+
+	vector<uint32_t> cacheTimes(numVertices);
+	vector<uint8_t> emitted(numTri);
+	vector<uint32_t> deadEnds;
+	vector<uint32_t> candidates;
+	vector<uint32_t> output;
+	deadEnds.reserve(numTri * 3);
+	output.reserve(numTri * 3);
+
+	auto time = cacheSize + 1;
+	auto cursor = 0u;
+	const auto nextLiveVertex = [&]()
+	{
+		for (; cursor < numVertices; ++cursor)
+			if (liveTriangles[cursor] > 0) return cursor;
+
+		return invalid;
+	};
+
+	for (auto fanning = nextLiveVertex(); fanning != invalid;)
+	{
+		// Emit all the remaining triangles around the fanning vertex.
+		candidates.clear();
+		for (auto i = offsets[fanning]; i < offsets[fanning + 1]; ++i)
+		{
+			const auto t = adjacency[i];
+			if (emitted[t]) continue;
+
+			for (auto j = 0u; j < 3; ++j)
+			{
+				const auto v = pIndices[t * 3 + j];
+				output.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				--liveTriangles[v];
+				if (time - cacheTimes[v] > cacheSize) cacheTimes[v] = time++;
+			}
+			emitted[t] = 1;
+		}
+
+		// Prefer the oldest candidate that stays in the cache while its own
+		// remaining triangles are emitted.
+		auto next = invalid;
+		auto bestPriority = -1;
+		for (const auto v : candidates)
+		{
+			if (liveTriangles[v] == 0) continue;
+
+			auto priority = 0;
+			if (time - cacheTimes[v] + 2 * liveTriangles[v] <= cacheSize)
+				priority = static_cast<int>(time - cacheTimes[v]);
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				next = v;
+			}
+		}
+
+		// At a dead end, fall back to recently referenced vertices, then to any.
+		while (next == invalid && !deadEnds.empty())
+		{
+			const auto v = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveTriangles[v] > 0) next = v;
+		}
+		fanning = next != invalid ? next : nextLiveVertex();
+	}
+
+	copy(output.cbegin(), output.cend(), pIndices);
+}
+
+void MeshOptimizer::OptimizeOverdraw(uint32_t *pIndices, uint32_t numIndices, const float *pPositions,
+	uint32_t numVertices, uint32_t vertexStride, uint32_t cacheSize, float threshold)
+{
+	const auto numTri = numIndices / 3;
+	if (numTri == 0) return;
+
+	const auto position = [pPositions, vertexStride](uint32_t v)
+	{ return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) + vertexStride * v); };
+
+	// Hard boundaries are where the cache is effectively flushed, i.e. where all
+	// three vertices of a triangle miss, as after a Tipsify dead end.
+	vector<uint32_t> hardBoundaries;
+	FifoCache cache(numVertices, cacheSize);
+	for (auto i = 0u; i < numTri; ++i)
+	{
+		auto misses = 0u;
+		for (auto j = 0u; j < 3; ++j) misses += cache.Access(pIndices[i * 3 + j]) ? 0 : 1;
+		if (misses == 3 || i == 0) hardBoundaries.push_back(i);
+	}
+	hardBoundaries.push_back(numTri);
+
+	// Soft boundaries split each hard cluster wherever the ACMR so far is already
+	// within the threshold of the cluster's own, starting with a cold cache.
+	vector<uint32_t> clusters;
+	for (auto c = 0u; c + 1 < hardBoundaries.size(); ++c)
+	{
+		const auto begin = hardBoundaries[c];
+		const auto end = hardBoundaries[c + 1];
+
+		cache.Flush();
+		auto misses = 0u;
+		for (auto i = begin * 3; i < end * 3; ++i) misses += cache.Access(pIndices[i]) ? 0 : 1;
+		const auto clusterACMR = static_cast<float>(misses) / (end - begin);
+
+		cache.Flush();
+		clusters.push_back(begin);
+		misses = 0;
+		for (auto i = begin; i < end; ++i)
+		{
+			for (auto j = 0u; j < 3; ++j) misses += cache.Access(pIndices[i * 3 + j]) ? 0 : 1;
+			if (i + 1 < end && misses <= threshold * clusterACMR * (i + 1 - clusters.back()))
+			{
+				clusters.push_back(i + 1);
+				cache.Flush();
+				misses = 0;
+			}
+		}
+	}
+	const auto numClusters = static_cast<uint32_t>(clusters.size());
+	clusters.push_back(numTri);
+
+	// Area-weighted centroid and normal of each cluster, and of the whole mesh
+	vector<float> clusterData(numClusters * 6);
+	float meshCentroid[3] = {};
+	auto meshArea = 0.0f;
+	for (auto c = 0u; c < numClusters; ++c)
+	{
+		const auto pData = &clusterData[c * 6];
+		auto area = 0.0f;
+		for (auto i = clusters[c]; i < clusters[c + 1]; ++i)
+		{
+			const auto p0 = position(pIndices[i * 3]);
+			const auto p1 = position(pIndices[i * 3 + 1]);
+			const auto p2 = position(pIndices[i * 3 + 2]);
+			const float e1[] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			const float e2[] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			const float n[] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+			const auto a = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (auto k = 0u; k < 3; ++k)
+			{
+				pData[k] += (p0[k] + p1[k] + p2[k]) / 3.0f * a;
+				pData[k + 3] += n[k];
+			}
+			area += a;
+		}
+
+		for (auto k = 0u; k < 3; ++k) meshCentroid[k] += pData[k];
+		meshArea += area;
+		if (area > 0.0f) for (auto k = 0u; k < 3; ++k) pData[k] /= area;
+	}
+	if (meshArea > 0.0f) for (auto &f : meshCentroid) f /= meshArea;
+
+	// Clusters facing away from the center are likely to occlude the others.
+	vector<float> sortKeys(numClusters);
+	for (auto c = 0u; c < numClusters; ++c)
+	{
+		const auto pData = &clusterData[c * 6];
+		const auto l = sqrt(pData[3] * pData[3] + pData[4] * pData[4] + pData[5] * pData[5]);
+		auto dp = 0.0f;
+		for (auto k = 0u; k < 3; ++k) dp += (pData[k] - meshCentroid[k]) * pData[k + 3];
+		sortKeys[c] = l > 0.0f ? dp / l : 0.0f;
+	}
+
+	vector<uint32_t> order(numClusters);
+	for (auto c = 0u; c < numClusters; ++c) order[c] = c;
+	stable_sort(order.begin(), order.end(), [&sortKeys](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+	vector<uint32_t> output;
+	output.reserve(numTri * 3);
+	for (const auto c : order)
+		output.insert(output.end(), pIndices + clusters[c] * 3, pIndices + clusters[c + 1] * 3);
+
+	copy(output.cbegin(), output.cend(), pIndices);
+}
+
+uint32_t MeshOptimizer::OptimizeVertexFetch(uint8_t *pVertices, uint32_t *pIndices, uint32_t numIndices,
+	uint32_t numVertices, uint32_t vertexStride)
+{
+	vector<uint32_t> remap(numVertices, invalid);
+	auto numUsed = 0u;
+	for (auto i = 0u; i < numIndices; ++i)
+	{
+		auto &v = pIndices[i];
+		if (remap[v] == invalid) remap[v] = numUsed++;
+		v = remap[v];
+	}
+
+	vector<uint8_t> vertices(static_cast<size_t>(vertexStride) * numUsed);
+	for (auto i = 0u; i < numVertices; ++i)
+		if (remap[i] != invalid)
+			memcpy(&vertices[static_cast<size_t>(vertexStride) * remap[i]],
+				&pVertices[static_cast<size_t>(vertexStride) * i], vertexStride);
+	memcpy(pVertices, vertices.data(), vertices.size());
+
+	return numUsed;
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::AnalyzeVertexCache(const uint32_t *pIndices, uint32_t numIndices,
+	uint32_t numVertices, uint32_t cacheSize, CachePolicy policy)
+{
+	CacheStats stats = {};
+	const auto numTri = numIndices / 3;
+	if (numTri == 0) return stats;
+
+	auto misses = 0u;
+	if (policy == CACHE_LRU)
+	{
+		LruCache cache(cacheSize);
+		for (auto i = 0u; i < numTri * 3; ++i) misses += cache.Access(pIndices[i]) ? 0 : 1;
+	}
+	else
+	{
+		FifoCache cache(numVertices, cacheSize);
+		for (auto i = 0u; i < numTri * 3; ++i) misses += cache.Access(pIndices[i]) ? 0 : 1;
+	}
+
+	vector<uint8_t> referenced(numVertices);
+	auto numReferenced = 0u;
+	for (auto i = 0u; i < numTri * 3; ++i)
+	{
+		numReferenced += referenced[pIndices[i]] ? 0 : 1;
+		referenced[pIndices[i]] = 1;
+	}
+
+	stats.ACMR = static_cast<float>(misses) / numTri;
+	stats.ATVR = static_cast<float>(misses) / numReferenced;
+
+	return stats;
+}
@@ -0,0 +1,43 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+// Reorders indexed triangle lists for the post-transform vertex cache, overdraw
+// and vertex fetch. It only depends on the standard library, so that the cache
+// simulator can also be run off-target.
+class MeshOptimizer
+{
+public:
+	enum CachePolicy : uint8_t
+	{
+		CACHE_FIFO,
+		CACHE_LRU,
+
+		NUM_CACHE_POLICY
+	};
+
+	struct CacheStats
+	{
+		float ACMR;	// Average cache miss ratio: transformed vertices per triangle
+		float ATVR;	// Average transformed vertex ratio: transformed vertices per referenced vertex
+	};
+
+	// Tipsify [Sander et al. 2007]: reorders the triangles for a cache of the given size.
+	static void OptimizeVertexCache(uint32_t *pIndices, uint32_t numIndices, uint32_t numVertices,
+		uint32_t cacheSize = 16);
+
+	// Splits a cache-optimized triangle list into clusters that barely change the
+	// ACMR, and draws the outward-facing clusters first.
+	static void OptimizeOverdraw(uint32_t *pIndices, uint32_t numIndices, const float *pPositions,
+		uint32_t numVertices, uint32_t vertexStride, uint32_t cacheSize = 16, float threshold = 1.05f);
+
+	// Renumbers the vertices in the order of first use, dropping the unreferenced
+	// ones; returns the number of vertices kept.
+	static uint32_t OptimizeVertexFetch(uint8_t *pVertices, uint32_t *pIndices, uint32_t numIndices,
+		uint32_t numVertices, uint32_t vertexStride);
+
+	static CacheStats AnalyzeVertexCache(const uint32_t *pIndices, uint32_t numIndices, uint32_t numVertices,
+		uint32_t cacheSize = 16, CachePolicy policy = CACHE_FIFO);
+};
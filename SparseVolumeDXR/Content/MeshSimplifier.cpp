@@ -0,0 +1,351 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#include <queue>
+#include "MeshSimplifier.h"
+
+using namespace std;
+
+// Symmetric 4x4 matrix accumulating squared distances to planes
+struct Quadric
+{
+	double A[10];
+
+	void AddPlane(const double n[3], double d)
+	{
+		const double p[] = { n[0], n[1], n[2], d };
+		for (auto i = 0u, k = 0u; i < 4; ++i)
+			for (auto j = i; j < 4; ++j) A[k++] += p[i] * p[j];
+	}
+
+	void Add(const Quadric &q)
+	{
+		for (auto k = 0u; k < 10; ++k) A[k] += q.A[k];
+	}
+
+	double Evaluate(const double p[3]) const
+	{
+		const auto x = p[0], y = p[1], z = p[2];
+
+		return x * x * A[0] + 2.0 * x * y * A[1] + 2.0 * x * z * A[2] + 2.0 * x * A[3] +
+			y * y * A[4] + 2.0 * y * z * A[5] + 2.0 * y * A[6] +
+			z * z * A[7] + 2.0 * z * A[8] + A[9];
+	}
+};
+
+struct Collapse
+{
+	double		Cost;
+	uint32_t	From;
+	uint32_t	To;
+	uint32_t	FromVersion;
+	uint32_t	ToVersion;
+
+	bool operator>(const Collapse &collapse) const { return Cost > collapse.Cost; }
+};
+
+static inline void cross(double n[3], const double e1[3], const double e2[3])
+{
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+static inline double dot(const double a[3], const double b[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Unnormalized normal of the triangle (p0, p1, p2)
+static inline void triangleNormal(double n[3], const double *p0, const double *p1, const double *p2)
+{
+	const double e1[] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	const double e2[] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+	cross(n, e1, e2);
+}
+
+//--------------------------------------------------------------------------------------
+// Mesh simplifier
+//--------------------------------------------------------------------------------------
+
+uint32_t MeshSimplifier::Simplify(uint32_t *pDstIndices, const uint32_t *pIndices, uint32_t numIndices,
+	const float *pPositions, uint32_t numVertices, uint32_t vertexStride, uint32_t targetIndices, float *pError)
+{
+	const auto numTri = numIndices / 3;
+	vector<uint32_t> triangles(pIndices, pIndices + numTri * 3);
+	vector<double> positions(numVertices * 3);
+	for (auto i = 0u; i < numVertices; ++i)
+	{
+		const auto p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) +
+			static_cast<size_t>(vertexStride) * i);
+		for (auto k = 0u; k < 3; ++k) positions[i * 3 + k] = p[k];
+	}
+	const auto position = [&positions](uint32_t v) { return &positions[v * 3]; };
+
+	// Triangle adjacency, and plane quadrics of the triangles around each vertex
+	vector<uint8_t> removed(numTri);
+	vector<vector<uint32_t>> vertexTriangles(numVertices);
+	vector<Quadric> quadrics(numVertices, Quadric());
+	vector<uint64_t> edges;
+	edges.reserve(numTri * 3);
+	auto numLive = 0u;
+	for (auto i = 0u; i < numTri; ++i)
+	{
+		const auto pTri = &triangles[i * 3];
+		if (pTri[0] == pTri[1] || pTri[1] == pTri[2] || pTri[2] == pTri[0])
+		{
+			removed[i] = 1;
+			continue;
+		}
+
+		double n[3];
+		triangleNormal(n, position(pTri[0]), position(pTri[1]), position(pTri[2]));
+		const auto l = sqrt(dot(n, n));
+		if (l > 0.0) for (auto &c : n) c /= l;
+		for (auto j = 0u; j < 3; ++j)
+		{
+			const auto v = pTri[j], w = pTri[(j + 1) % 3];
+			vertexTriangles[v].push_back(i);
+			if (l > 0.0) quadrics[v].AddPlane(n, -dot(n, position(pTri[0])));
+			edges.push_back(static_cast<uint64_t>((min)(v, w)) << 32 | (max)(v, w));
+		}
+		++numLive;
+	}
+
+	// Vertices on open or non-manifold edges are locked.
+	vector<uint8_t> locked(numVertices);
+	sort(edges.begin(), edges.end());
+	for (size_t i = 0, j; i < edges.size(); i = j)
+	{
+		for (j = i + 1; j < edges.size() && edges[j] == edges[i];) ++j;
+		if (j - i != 2)
+		{
+			locked[edges[i] >> 32] = 1;
+			locked[edges[i] & 0xffffffff] = 1;
+		}
+	}
+	vector<uint64_t>().swap(edges);
+
+	// Vertices are marked with a fresh stamp for each neighborhood query.
+	vector<uint32_t> marks(numVertices);
+	auto mark = 0u;
+	const auto forEachNeighbor = [&](uint32_t v, const auto &func)
+	{
+		++mark;
+		for (const auto t : vertexTriangles[v])
+			for (auto j = 0u; j < 3; ++j)
+			{
+				const auto w = triangles[t * 3 + j];
+				if (w != v && marks[w] != mark)
+				{
+					marks[w] = mark;
+					func(w);
+				}
+			}
+	};
+
+	vector<uint32_t> versions(numVertices);
+	vector<uint8_t> collapsed(numVertices);
+	priority_queue<Collapse, vector<Collapse>, greater<Collapse>> queue;
+	const auto pushCollapse = [&](uint32_t u, uint32_t v)
+	{
+		if (locked[u]) return;
+		auto quadric = quadrics[u];
+		quadric.Add(quadrics[v]);
+		queue.push({ quadric.Evaluate(position(v)), u, v, versions[u], versions[v] });
+	};
+	for (auto v = 0u; v < numVertices; ++v) forEachNeighbor(v, [&](uint32_t w) { pushCollapse(v, w); });
+
+	vector<uint32_t> neighbors;
+	const auto canCollapse = [&](uint32_t u, uint32_t v)
+	{
+		// Link condition: the only common neighbors are the apexes of the two
+		// triangles on the edge.
+		auto numEdgeTriangles = 0u;
+		for (const auto t : vertexTriangles[u])
+		{
+			const auto pTri = &triangles[t * 3];
+			numEdgeTriangles += pTri[0] == v || pTri[1] == v || pTri[2] == v ? 1 : 0;
+		}
+		if (numEdgeTriangles != 2) return false;
+
+		neighbors.clear();
+		forEachNeighbor(u, [&](uint32_t w) { neighbors.push_back(w); });
+		auto numCommon = 0u;
+		forEachNeighbor(v, [](uint32_t) {});
+		for (const auto w : neighbors) numCommon += marks[w] == mark ? 1 : 0;
+		if (numCommon != 2) return false;
+
+		// No triangle moving with u may flip or degenerate.
+		for (const auto t : vertexTriangles[u])
+		{
+			const auto pTri = &triangles[t * 3];
+			if (pTri[0] == v || pTri[1] == v || pTri[2] == v) continue;
+
+			const double *p[3], *q[3];
+			for (auto j = 0u; j < 3; ++j)
+			{
+				p[j] = position(pTri[j]);
+				q[j] = pTri[j] == u ? position(v) : p[j];
+			}
+			double n0[3], n1[3];
+			triangleNormal(n0, p[0], p[1], p[2]);
+			triangleNormal(n1, q[0], q[1], q[2]);
+			if (dot(n0, n1) <= 0.0) return false;
+		}
+
+		return true;
+	};
+
+	const auto removeTriangle = [&](uint32_t v, uint32_t t)
+	{
+		auto &vTriangles = vertexTriangles[v];
+		const auto it = find(vTriangles.begin(), vTriangles.end(), t);
+		*it = vTriangles.back();
+		vTriangles.pop_back();
+	};
+
+	auto maxCost = 0.0;
+	while (numLive * 3 > targetIndices && !queue.empty())
+	{
+		const auto collapse = queue.top();
+		queue.pop();
+
+		const auto u = collapse.From, v = collapse.To;
+		if (collapsed[u] || collapsed[v] || versions[u] != collapse.FromVersion ||
+			versions[v] != collapse.ToVersion || !canCollapse(u, v)) continue;
+
+		// Remove the triangles on the edge, and move the others to v.
+		for (const auto t : vertexTriangles[u])
+		{
+			const auto pTri = &triangles[t * 3];
+			if (pTri[0] == v || pTri[1] == v || pTri[2] == v)
+			{
+				removed[t] = 1;
+				--numLive;
+				for (auto j = 0u; j < 3; ++j) if (pTri[j] != u) removeTriangle(pTri[j], t);
+			}
+			else
+			{
+				for (auto j = 0u; j < 3; ++j) if (pTri[j] == u) pTri[j] = v;
+				vertexTriangles[v].push_back(t);
+			}
+		}
+		vector<uint32_t>().swap(vertexTriangles[u]);
+		collapsed[u] = 1;
+		quadrics[v].Add(quadrics[u]);
+		++versions[v];
+		maxCost = (max)(maxCost, collapse.Cost);
+
+		forEachNeighbor(v, [&](uint32_t w)
+		{
+			pushCollapse(v, w);
+			pushCollapse(w, v);
+		});
+	}
+
+	// Keep the surviving triangles in their original order.
+	auto numDstIndices = 0u;
+	for (auto i = 0u; i < numTri; ++i)
+		if (!removed[i])
+			for (auto j = 0u; j < 3; ++j) pDstIndices[numDstIndices++] = triangles[i * 3 + j];
+
+	if (pError) *pError = static_cast<float>(sqrt((max)(maxCost, 0.0)));
+
+	return numDstIndices;
+}
+
+void MeshSimplifier::ComputeThickness(float *pThickness, uint32_t gridSize, const uint32_t *pIndices,
+	uint32_t numIndices, const float *pPositions, uint32_t vertexStride, const float *pCenter, float radius)
+{
+	const auto numTri = numIndices / 3;
+	const auto numRays = gridSize * gridSize;
+	const auto rayStep = 2.0 * radius / gridSize;
+	const auto position = [pPositions, vertexStride](uint32_t v)
+	{ return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) + static_cast<size_t>(vertexStride) * v); };
+
+	vector<uint32_t> offsets(numRays + 1), cursors, binned;
+	for (auto axis = 0u; axis < 3; ++axis)
+	{
+		// Rays run along the axis; x and y are the other two axes in cyclic order,
+		// so that the signed area in xy is the axis component of the normal.
+		const auto ax = (axis + 1) % 3, ay = (axis + 2) % 3;
+		const auto rayRange = [&](const float *p[3], uint32_t k, uint32_t &first, uint32_t &last)
+		{
+			const auto lo = (min)((min)(p[0][k], p[1][k]), p[2][k]);
+			const auto hi = (max)((max)(p[0][k], p[1][k]), p[2][k]);
+			const auto origin = pCenter[k] - radius;
+			first = static_cast<uint32_t>((max)(ceil((lo - origin) / rayStep - 0.5), 0.0));
+			last = static_cast<uint32_t>((min)(floor((hi - origin) / rayStep - 0.5), gridSize - 1.0));
+			return (hi - origin) / rayStep - 0.5 >= 0.0 && first <= last;
+		};
+
+		// Bin the triangles by the rays that may hit them (CSR)
+		const auto binTriangles = [&](const auto &func)
+		{
+			for (auto i = 0u; i < numTri; ++i)
+			{
+				const float *p[] = { position(pIndices[i * 3]), position(pIndices[i * 3 + 1]), position(pIndices[i * 3 + 2]) };
+				uint32_t x0, x1, y0, y1;
+				if (!rayRange(p, ax, x0, x1) || !rayRange(p, ay, y0, y1)) continue;
+				for (auto y = y0; y <= y1; ++y)
+					for (auto x = x0; x <= x1; ++x) func(gridSize * y + x, i);
+			}
+		};
+		fill(offsets.begin(), offsets.end(), 0);
+		binTriangles([&offsets](uint32_t ray, uint32_t) { ++offsets[ray + 1]; });
+		for (auto i = 0u; i < numRays; ++i) offsets[i + 1] += offsets[i];
+		cursors.assign(offsets.cbegin(), offsets.cend() - 1);
+		binned.resize(offsets[numRays]);
+		binTriangles([&](uint32_t ray, uint32_t i) { binned[cursors[ray]++] = i; });
+
+		for (auto ray = 0u; ray < numRays; ++ray)
+		{
+			const auto px = pCenter[ax] - radius + (ray % gridSize + 0.5) * rayStep;
+			const auto py = pCenter[ay] - radius + (ray / gridSize + 0.5) * rayStep;
+
+			auto thickness = 0.0;
+			for (auto k = offsets[ray]; k < offsets[ray + 1]; ++k)
+			{
+				const auto i = binned[k];
+				double x[3], y[3], z[3];
+				for (auto j = 0u; j < 3; ++j)
+				{
+					const auto p = position(pIndices[i * 3 + j]);
+					x[j] = p[ax];
+					y[j] = p[ay];
+					z[j] = p[axis];
+				}
+
+				// Counter-clockwise in xy; the winding gives the facing along the ray.
+				const auto area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+				if (area == 0.0) continue;
+				const auto sign = area > 0.0 ? 1.0 : -1.0;
+				if (area < 0.0)
+				{
+					swap(x[1], x[2]);
+					swap(y[1], y[2]);
+					swap(z[1], z[2]);
+				}
+
+				// Edge functions with a consistent tie rule, so that a ray through a
+				// shared edge hits exactly one of the triangles.
+				double w[3];
+				auto bInside = true;
+				for (auto j = 0u; j < 3 && bInside; ++j)
+				{
+					const auto a = (j + 1) % 3, b = (j + 2) % 3;
+					const auto dx = x[b] - x[a], dy = y[b] - y[a];
+					w[j] = dx * (py - y[a]) - dy * (px - x[a]);
+					bInside = w[j] > 0.0 || (w[j] == 0.0 && (dy > 0.0 || (dy == 0.0 && dx < 0.0)));
+				}
+				if (!bInside) continue;
+
+				// Exits add their depth, and entries subtract theirs.
+				thickness += sign * (w[0] * z[0] + w[1] * z[1] + w[2] * z[2]) / fabs(area);
+			}
+			pThickness[numRays * axis + ray] = static_cast<float>(fabs(thickness));
+		}
+	}
+}
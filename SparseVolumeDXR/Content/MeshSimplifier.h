@@ -0,0 +1,28 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+// Simplifies indexed triangle lists by quadric error [Garland and Heckbert 1997].
+// Edges collapse onto one of their vertices, so that all the levels of detail
+// share the vertex buffer. Like the mesh optimizer, it only depends on the
+// standard library.
+class MeshSimplifier
+{
+public:
+	// Collapses edges until at most targetIndices are left, or until no valid
+	// collapse remains. Open boundaries are locked, and collapses that would pinch
+	// the surface or flip a triangle are rejected, so that closed meshes stay
+	// closed. Returns the number of indices written to pDstIndices, and the square
+	// root of the largest collapse error in pError.
+	static uint32_t Simplify(uint32_t *pDstIndices, const uint32_t *pIndices, uint32_t numIndices,
+		const float *pPositions, uint32_t numVertices, uint32_t vertexStride, uint32_t targetIndices,
+		float *pError = nullptr);
+
+	// Thickness along gridSize x gridSize parallel rays per axis through the cube
+	// around the given center and radius, as the depth peeling integrates it:
+	// exits minus entries. Fills 3 * gridSize * gridSize values.
+	static void ComputeThickness(float *pThickness, uint32_t gridSize, const uint32_t *pIndices,
+		uint32_t numIndices, const float *pPositions, uint32_t vertexStride, const float *pCenter, float radius);
+};
@@ -0,0 +1,359 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#include <chrono>
+#include <thread>
+#include "MeshletBuilder.h"
+
+using namespace std;
+using namespace DirectX;
+
+static const auto invalid = UINT32_MAX;
+
+// Runs func(i) for each thread index i in [0, numThreads).
+template<typename Func>
+static void runOnThreads(uint32_t numThreads, const Func &func)
+{
+	if (numThreads > 1)
+	{
+		vector<thread> workers;
+		workers.reserve(numThreads);
+		for (auto i = 0u; i < numThreads; ++i) workers.emplace_back([&func, i]() { func(i); });
+		for (auto &worker : workers) worker.join();
+	}
+	else func(0);
+}
+
+static inline XMVECTOR loadPosition(const float *pPositions, uint32_t vertexStride, uint32_t v)
+{
+	return XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(reinterpret_cast<const uint8_t*>(pPositions) +
+		static_cast<size_t>(vertexStride) * v));
+}
+
+// Local indices of the vertices in the open meshlet, keyed by source vertex with
+// linear probing. Twice the vertex limit of a meshlet keeps the probes short, and
+// the table stays the same size however large the mesh is.
+class MeshletVertexMap
+{
+public:
+	MeshletVertexMap() { Clear(); }
+
+	void Clear() { fill(begin(m_keys), end(m_keys), invalid); }
+
+	uint32_t Find(uint32_t v) const
+	{
+		auto slot = hash(v);
+		while (m_keys[slot] != v && m_keys[slot] != invalid) slot = (slot + 1) & (TableSize - 1);
+
+		return m_keys[slot] == v ? m_values[slot] : invalid;
+	}
+
+	// The local index of the vertex, invalid until set when the vertex is new
+	uint32_t &operator[](uint32_t v)
+	{
+		auto slot = hash(v);
+		while (m_keys[slot] != v && m_keys[slot] != invalid) slot = (slot + 1) & (TableSize - 1);
+		if (m_keys[slot] != v)
+		{
+			m_keys[slot] = v;
+			m_values[slot] = invalid;
+		}
+
+		return m_values[slot];
+	}
+
+protected:
+	static const uint32_t TableSize = 2 * MeshletBuilder::MaxVertices;
+	static_assert((TableSize & (TableSize - 1)) == 0, "The table size must be a power of 2");
+
+	// An odd multiplier maps consecutive indices to distinct slots.
+	static uint32_t hash(uint32_t v) { return (v * 2654435761u) & (TableSize - 1); }
+
+	uint32_t m_keys[TableSize];
+	uint32_t m_values[TableSize];
+};
+
+//--------------------------------------------------------------------------------------
+// Meshlet builder
+//--------------------------------------------------------------------------------------
+
+MeshletBuilder::MeshletBuilder()
+{
+}
+
+MeshletBuilder::~MeshletBuilder()
+{
+}
+
+void MeshletBuilder::Build(const float *pPositions, uint32_t vertexStride, const uint32_t *pIndices,
+	uint32_t numIndices, uint32_t numThreads)
+{
+	// Fixed-size segments of triangles always end a meshlet, which keeps the
+	// result independent of the thread count.
+	static const uint32_t segmentSize = 1 << 12;
+
+	const auto numTri = numIndices / 3;
+	const auto numSegments = (numTri + segmentSize - 1) / segmentSize;
+	numThreads = numThreads > 0 ? numThreads : thread::hardware_concurrency();
+	numThreads = (min)((max)(numThreads, 1u), (max)(numSegments, 1u));
+
+	// Each packed triangle is stored at its source position, so only the
+	// meshlets and their vertex tables need merging.
+	m_triangles.resize(numTri);
+	vector<vector<Meshlet>> segmentMeshlets(numSegments);
+	vector<vector<uint32_t>> segmentVertices(numSegments);
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		MeshletVertexMap localIndices;
+
+		for (auto s = t; s < numSegments; s += numThreads)
+		{
+			auto &meshlets = segmentMeshlets[s];
+			auto &vertices = segmentVertices[s];
+			const auto end = (min)(segmentSize * (s + 1), numTri);
+
+			Meshlet meshlet = { 0, segmentSize * s, 0, 0 };
+			const auto closeMeshlet = [&]()
+			{
+				localIndices.Clear();
+				meshlets.push_back(meshlet);
+				meshlet.VertexOffset += meshlet.VertexCount;
+				meshlet.TriangleOffset += meshlet.TriangleCount;
+				meshlet.VertexCount = 0;
+				meshlet.TriangleCount = 0;
+			};
+
+			for (auto i = segmentSize * s; i < end; ++i)
+			{
+				const auto pTri = &pIndices[i * 3];
+				auto newVertices = 0u;
+				for (auto j = 0u; j < 3; ++j)
+				{
+					const auto bRepeated = (j > 0 && pTri[j] == pTri[0]) || (j > 1 && pTri[j] == pTri[1]);
+					if (localIndices.Find(pTri[j]) == invalid && !bRepeated) ++newVertices;
+				}
+
+				if (meshlet.VertexCount + newVertices > MaxVertices || meshlet.TriangleCount + 1 > MaxTriangles)
+					closeMeshlet();
+
+				auto packed = 0u;
+				for (auto j = 0u; j < 3; ++j)
+				{
+					auto &local = localIndices[pTri[j]];
+					if (local == invalid)
+					{
+						local = meshlet.VertexCount++;
+						vertices.push_back(pTri[j]);
+					}
+					packed |= local << (8 * j);
+				}
+				m_triangles[i] = packed;
+				++meshlet.TriangleCount;
+			}
+			if (meshlet.TriangleCount > 0) closeMeshlet();
+		}
+	});
+
+	// Merge the segments.
+	vector<uint32_t> meshletBases(numSegments + 1), vertexBases(numSegments + 1);
+	for (auto s = 0u; s < numSegments; ++s)
+	{
+		meshletBases[s + 1] = meshletBases[s] + static_cast<uint32_t>(segmentMeshlets[s].size());
+		vertexBases[s + 1] = vertexBases[s] + static_cast<uint32_t>(segmentVertices[s].size());
+	}
+	m_meshlets.resize(meshletBases[numSegments]);
+	m_bounds.resize(meshletBases[numSegments]);
+	m_vertexIndices.resize(vertexBases[numSegments]);
+
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		for (auto s = t; s < numSegments; s += numThreads)
+		{
+			copy(segmentVertices[s].cbegin(), segmentVertices[s].cend(), m_vertexIndices.begin() + vertexBases[s]);
+			for (auto i = 0u; i < segmentMeshlets[s].size(); ++i)
+			{
+				auto &meshlet = m_meshlets[meshletBases[s] + i];
+				meshlet = segmentMeshlets[s][i];
+				meshlet.VertexOffset += vertexBases[s];
+			}
+			computeBounds(pPositions, vertexStride, meshletBases[s], meshletBases[s + 1]);
+		}
+	});
+}
+
+uint32_t MeshletBuilder::CullFrustum(CXMMATRIX viewProj, vector<uint32_t> &visible) const
+{
+	// Clip planes from the columns of the view-projection matrix [Gribb and Hartmann 2001]
+	const auto m = XMMatrixTranspose(viewProj);
+	const XMVECTOR planes[] =
+	{
+		XMPlaneNormalize(XMVectorAdd(m.r[3], m.r[0])),
+		XMPlaneNormalize(XMVectorSubtract(m.r[3], m.r[0])),
+		XMPlaneNormalize(XMVectorAdd(m.r[3], m.r[1])),
+		XMPlaneNormalize(XMVectorSubtract(m.r[3], m.r[1])),
+		XMPlaneNormalize(m.r[2]),
+		XMPlaneNormalize(XMVectorSubtract(m.r[3], m.r[2]))
+	};
+
+	visible.clear();
+	const auto numMeshlets = static_cast<uint32_t>(m_bounds.size());
+	for (auto i = 0u; i < numMeshlets; ++i)
+	{
+		const auto &bounds = m_bounds[i];
+		const auto center = XMLoadFloat3(&bounds.Center);
+		const auto negRadius = XMVectorReplicate(-bounds.Radius);
+
+		auto bOutside = false;
+		for (const auto &plane : planes) bOutside = bOutside || XMVector4Less(XMPlaneDotCoord(plane, center), negRadius);
+		if (!bOutside) visible.push_back(i);
+	}
+
+	return static_cast<uint32_t>(visible.size());
+}
+
+uint32_t MeshletBuilder::CullBackfaces(FXMVECTOR eyePt, vector<uint32_t> &visible) const
+{
+	// A meshlet faces away when the whole cone, widened by the bounding sphere,
+	// faces away [Kubisch 2018].
+	auto numVisible = 0u;
+	for (const auto i : visible)
+	{
+		const auto &bounds = m_bounds[i];
+		const auto d = XMVectorSubtract(XMLoadFloat3(&bounds.Center), eyePt);
+		const auto dp = XMVectorGetX(XMVector3Dot(d, XMLoadFloat3(&bounds.ConeAxis)));
+		if (dp < bounds.ConeCutoff * XMVectorGetX(XMVector3Length(d)) + bounds.Radius) visible[numVisible++] = i;
+	}
+	visible.resize(numVisible);
+
+	return numVisible;
+}
+
+MeshletBuilder::CullBenchmark MeshletBuilder::BenchmarkCulling(FXMVECTOR center, float radius,
+	uint32_t numIterations) const
+{
+	static const uint32_t numViews = 8;
+
+	CullBenchmark benchmark = {};
+	benchmark.NumViews = numViews;
+	numIterations = (max)(numIterations, 1u);
+	const auto numMeshlets = (max)(GetNumMeshlets(), 1u);
+
+	// Close enough for the frustum to clip the mesh
+	const auto proj = XMMatrixPerspectiveFovLH(XM_PIDIV4, 1.0f, radius * 0.1f, radius * 10.0f);
+	vector<uint32_t> visible;
+	visible.reserve(m_meshlets.size());
+	for (auto i = 0u; i < numViews; ++i)
+	{
+		const auto angle = XM_2PI * i / numViews;
+		const auto offset = XMVectorSet(sinf(angle), i % 2 ? 0.5f : -0.5f, cosf(angle), 0.0f);
+		const auto eyePt = XMVectorAdd(center, XMVectorScale(offset, radius * 2.0f));
+		const auto viewProj = XMMatrixLookAtLH(eyePt, center, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f)) * proj;
+
+		auto numInFrustum = 0u, numFrontFacing = 0u;
+		auto tStart = chrono::high_resolution_clock::now();
+		for (auto j = 0u; j < numIterations; ++j) numInFrustum = CullFrustum(viewProj, visible);
+		benchmark.FrustumTime += chrono::duration<double>(chrono::high_resolution_clock::now() - tStart).count();
+
+		// Each run restarts from the frustum result.
+		const auto inFrustum = visible;
+		tStart = chrono::high_resolution_clock::now();
+		for (auto j = 0u; j < numIterations; ++j)
+		{
+			visible = inFrustum;
+			numFrontFacing = CullBackfaces(eyePt, visible);
+		}
+		benchmark.BackfaceTime += chrono::duration<double>(chrono::high_resolution_clock::now() - tStart).count();
+
+		benchmark.FrustumCulled += static_cast<float>(numMeshlets - numInFrustum) / numMeshlets;
+		benchmark.BackfaceCulled += static_cast<float>(numInFrustum - numFrontFacing) / numMeshlets;
+	}
+
+	benchmark.FrustumTime /= numViews * numIterations;
+	benchmark.BackfaceTime /= numViews * numIterations;
+	benchmark.FrustumCulled /= numViews;
+	benchmark.BackfaceCulled /= numViews;
+
+	return benchmark;
+}
+
+uint32_t MeshletBuilder::GetNumMeshlets() const
+{
+	return static_cast<uint32_t>(m_meshlets.size());
+}
+
+const MeshletBuilder::Meshlet *MeshletBuilder::GetMeshlets() const
+{
+	return m_meshlets.data();
+}
+
+const MeshletBuilder::Bounds *MeshletBuilder::GetBounds() const
+{
+	return m_bounds.data();
+}
+
+const uint32_t *MeshletBuilder::GetVertexIndices() const
+{
+	return m_vertexIndices.data();
+}
+
+const uint32_t *MeshletBuilder::GetTriangles() const
+{
+	return m_triangles.data();
+}
+
+void MeshletBuilder::computeBounds(const float *pPositions, uint32_t vertexStride, uint32_t first, uint32_t last)
+{
+	const auto zero = XMVectorZero();
+	for (auto i = first; i < last; ++i)
+	{
+		const auto &meshlet = m_meshlets[i];
+		const auto pVertices = &m_vertexIndices[meshlet.VertexOffset];
+		const auto position = [&](uint32_t local) { return loadPosition(pPositions, vertexStride, pVertices[local]); };
+
+		// Bounding sphere around the center of the box
+		auto vMin = position(0), vMax = vMin;
+		for (auto j = 1u; j < meshlet.VertexCount; ++j)
+		{
+			vMin = XMVectorMin(vMin, position(j));
+			vMax = XMVectorMax(vMax, position(j));
+		}
+		const auto center = XMVectorScale(XMVectorAdd(vMin, vMax), 0.5f);
+		auto radiusSq = zero;
+		for (auto j = 0u; j < meshlet.VertexCount; ++j)
+			radiusSq = XMVectorMax(radiusSq, XMVector3LengthSq(XMVectorSubtract(position(j), center)));
+
+		// Normal cone from the unit face normals; degenerate triangles face nowhere.
+		XMVECTOR faceNormals[MaxTriangles];
+		auto axis = zero;
+		for (auto j = 0u; j < meshlet.TriangleCount; ++j)
+		{
+			const auto packed = m_triangles[meshlet.TriangleOffset + j];
+			const auto v0 = position(packed & 0xff);
+			const auto v1 = position((packed >> 8) & 0xff);
+			const auto v2 = position((packed >> 16) & 0xff);
+			const auto n = XMVector3Cross(XMVectorSubtract(v1, v0), XMVectorSubtract(v2, v1));
+			const auto l = XMVector3Length(n);
+			faceNormals[j] = XMVector3Greater(l, zero) ? XMVectorDivide(n, l) : zero;
+			axis = XMVectorAdd(axis, faceNormals[j]);
+		}
+
+		auto minDot = 1.0f;
+		const auto l = XMVector3Length(axis);
+		if (XMVector3Greater(l, zero))
+		{
+			axis = XMVectorDivide(axis, l);
+			for (auto j = 0u; j < meshlet.TriangleCount; ++j)
+				if (!XMVector3Equal(faceNormals[j], zero))
+					minDot = (min)(minDot, XMVectorGetX(XMVector3Dot(axis, faceNormals[j])));
+		}
+		else minDot = -1.0f;
+
+		// Cones of 90 degrees or wider never cull.
+		auto &bounds = m_bounds[i];
+		XMStoreFloat3(&bounds.Center, center);
+		bounds.Radius = XMVectorGetX(XMVectorSqrt(radiusSq));
+		XMStoreFloat3(&bounds.ConeAxis, minDot > 0.0f ? axis : zero);
+		bounds.ConeCutoff = minDot > 0.0f ? sqrt(1.0f - minDot * minDot) : 1.0f;
+	}
+}
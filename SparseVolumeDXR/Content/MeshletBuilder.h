@@ -0,0 +1,70 @@
+//--------------------------------------------------------------------------------------
+// By Stars XU Tianchen
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+// Splits an indexed triangle list into meshlets in the order of the triangles, so
+// that each meshlet is also a contiguous range of the source index buffer.
+class MeshletBuilder
+{
+public:
+	static const uint32_t MaxVertices = 64;
+	static const uint32_t MaxTriangles = 124;
+
+	struct Meshlet
+	{
+		uint32_t	VertexOffset;	// First entry in the vertex table
+		uint32_t	TriangleOffset;	// First packed triangle, and first triangle of the source
+		uint32_t	VertexCount;
+		uint32_t	TriangleCount;
+	};
+
+	struct Bounds
+	{
+		DirectX::XMFLOAT3	Center;
+		float				Radius;
+		DirectX::XMFLOAT3	ConeAxis;	// Average facing of the triangles
+		float				ConeCutoff;	// Sine of the cone's half-angle; 1 to never cull
+	};
+
+	struct CullBenchmark
+	{
+		uint32_t	NumViews;
+		double		FrustumTime;	// Per view
+		double		BackfaceTime;	// Per view, over the meshlets inside the frustum
+		float		FrustumCulled;	// Average fraction of the meshlets culled
+		float		BackfaceCulled;
+	};
+
+	MeshletBuilder();
+	virtual ~MeshletBuilder();
+
+	void Build(const float *pPositions, uint32_t vertexStride, const uint32_t *pIndices,
+		uint32_t numIndices, uint32_t numThreads = 0);
+
+	// Fills the visible list with the meshlets that intersect the frustum of a
+	// view-projection matrix.
+	uint32_t CullFrustum(DirectX::CXMMATRIX viewProj, std::vector<uint32_t> &visible) const;
+
+	// Removes the meshlets whose triangles all face away from the eye from the
+	// visible list. Only valid for passes that cull back faces.
+	uint32_t CullBackfaces(DirectX::FXMVECTOR eyePt, std::vector<uint32_t> &visible) const;
+
+	// Culls from views orbiting the bounding sphere of the mesh.
+	CullBenchmark BenchmarkCulling(DirectX::FXMVECTOR center, float radius, uint32_t numIterations = 100) const;
+
+	uint32_t GetNumMeshlets() const;
+	const Meshlet *GetMeshlets() const;
+	const Bounds *GetBounds() const;
+	const uint32_t *GetVertexIndices() const;	// Source vertex indices of the meshlets
+	const uint32_t *GetTriangles() const;		// Local indices packed in 8 bits each
+
+protected:
+	void computeBounds(const float *pPositions, uint32_t vertexStride, uint32_t first, uint32_t last);
+
+	std::vector<Meshlet>	m_meshlets;
+	std::vector<Bounds>		m_bounds;
+	std::vector<uint32_t>	m_vertexIndices;
+	std::vector<uint32_t>	m_triangles;
+};
@@ -2,13 +2,333 @@
 // By Stars XU Tianchen
 //--------------------------------------------------------------------------------------
 
+#include <cfloat>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
 #include "ObjLoader.h"
 
 #define VEC_ALLOC(v, i)			{ v.resize(i); v.shrink_to_fit(); }
 
 using namespace std;
+using namespace DirectX;
 
-ObjLoader::ObjLoader()
+//--------------------------------------------------------------------------------------
+// Tokenizer helpers for the memory-mapped reader
+//--------------------------------------------------------------------------------------
+
+static inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c)
+{
+	return static_cast<uint8_t>(c - '0') < 10;
+}
+
+static inline const char *skipSpaces(const char *pCur, const char *pEnd)
+{
+	while (pCur < pEnd && isSpace(*pCur)) ++pCur;
+
+	return pCur;
+}
+
+static inline const char *skipLine(const char *pCur, const char *pEnd)
+{
+	pCur = static_cast<const char*>(memchr(pCur, '\n', pEnd - pCur));
+
+	return pCur ? pCur + 1 : pEnd;
+}
+
+static inline const char *parseInt(const char *pCur, const char *pEnd, int32_t &i)
+{
+	auto bNegative = false;
+	if (pCur < pEnd && (*pCur == '-' || *pCur == '+')) bNegative = *pCur++ == '-';
+
+	auto u = 0u;
+	for (; pCur < pEnd && isDigit(*pCur); ++pCur) u = u * 10 + (*pCur - '0');
+	i = bNegative ? -static_cast<int32_t>(u) : static_cast<int32_t>(u);
+
+	return pCur;
+}
+
+static inline const char *parseFloat(const char *pCur, const char *pEnd, float &f)
+{
+	// Exactly representable powers of 10 in double precision
+	static const double powersOf10[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	static const int32_t maxPower = static_cast<int32_t>(size(powersOf10)) - 1;
+
+	auto bNegative = false;
+	if (pCur < pEnd && (*pCur == '-' || *pCur == '+')) bNegative = *pCur++ == '-';
+
+	// Accumulate up to 19 significant digits in the mantissa.
+	auto mantissa = 0ull;
+	auto numDigits = 0;
+	auto exponent = 0;
+	for (; pCur < pEnd && isDigit(*pCur); ++pCur)
+	{
+		if (numDigits < 19)
+		{
+			mantissa = mantissa * 10 + (*pCur - '0');
+			numDigits += mantissa > 0 ? 1 : 0;
+		}
+		else ++exponent;
+	}
+
+	if (pCur < pEnd && *pCur == '.')
+	{
+		for (++pCur; pCur < pEnd && isDigit(*pCur); ++pCur)
+		{
+			if (numDigits < 19)
+			{
+				mantissa = mantissa * 10 + (*pCur - '0');
+				numDigits += mantissa > 0 ? 1 : 0;
+				--exponent;
+			}
+		}
+	}
+
+	if (pCur < pEnd && (*pCur == 'e' || *pCur == 'E'))
+	{
+		auto e = 0;
+		pCur = parseInt(pCur + 1, pEnd, e);
+		exponent += e;
+	}
+
+	auto d = static_cast<double>(mantissa);
+	if (exponent < 0) d = exponent >= -maxPower ? d / powersOf10[-exponent] : d / pow(10.0, -exponent);
+	else if (exponent > 0) d = exponent <= maxPower ? d * powersOf10[exponent] : d * pow(10.0, exponent);
+	f = static_cast<float>(bNegative ? -d : d);
+
+	// Skip the unparsable remainder of the token, e.g. "nan" or "inf".
+	while (pCur < pEnd && !isSpace(*pCur) && *pCur != '\n') ++pCur;
+
+	return pCur;
+}
+
+static inline uint32_t resolveIndex(int32_t i, uint32_t uNumElements)
+{
+	// Negative indices are relative to the current end of the element list.
+	return i < 0 ? uNumElements + i : i - 1;
+}
+
+// Runs func(i) for each thread index i in [0, numThreads).
+template<typename Func>
+static void runOnThreads(uint32_t numThreads, const Func &func)
+{
+	if (numThreads > 1)
+	{
+		vector<thread> workers;
+		workers.reserve(numThreads);
+		for (auto i = 0u; i < numThreads; ++i) workers.emplace_back([&func, i]() { func(i); });
+		for (auto &worker : workers) worker.join();
+	}
+	else func(0);
+}
+
+//--------------------------------------------------------------------------------------
+// Vertex quantization helpers
+//--------------------------------------------------------------------------------------
+
+static const float snormScale = 32767.0f;
+
+static inline float snormToFloat(int16_t q)
+{
+	// Both -32768 and -32767 map to -1.
+	return (max)(q / snormScale, -1.0f);
+}
+
+//--------------------------------------------------------------------------------------
+// Binary mesh cache helpers
+//--------------------------------------------------------------------------------------
+
+static const uint32_t cacheMagic = 0x48534d53;	// "SMSH"
+static const uint32_t cacheVersion = 2;
+static const uint32_t chunkMagic = 0x4b484353;	// "SCHK"
+static const uint32_t chunkVersion = 1;
+
+static inline uint64_t rotateLeft(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// Non-cryptographic 64-bit hash over four independent lanes; it only has to
+// detect a changed source file, and must keep up with the memory bandwidth.
+static uint64_t hashBytes(const uint8_t *pData, uint64_t size, uint64_t seed)
+{
+	static const uint64_t prime1 = 0x9e3779b185ebca87ull;
+	static const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+
+	uint64_t lanes[] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+	const auto pEnd = pData + size;
+	for (; pEnd - pData >= 32; pData += 32)
+	{
+		for (auto i = 0u; i < 4; ++i)
+		{
+			uint64_t word;
+			memcpy(&word, pData + sizeof(uint64_t) * i, sizeof(uint64_t));
+			lanes[i] = rotateLeft(lanes[i] + word * prime2, 31) * prime1;
+		}
+	}
+
+	auto h = size * prime1;
+	for (const auto &lane : lanes) h = rotateLeft(h ^ lane, 27) * prime1 + prime2;
+	for (; pData < pEnd; ++pData) h = rotateLeft(h ^ (*pData * prime1), 11) * prime2;
+
+	// Final avalanche
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime1;
+	h ^= h >> 32;
+
+	return h;
+}
+
+//--------------------------------------------------------------------------------------
+// Read-only file mapping
+//--------------------------------------------------------------------------------------
+
+ObjLoader::MappedFile::MappedFile() :
+	m_hFile(INVALID_HANDLE_VALUE),
+	m_hMapping(nullptr),
+	m_pData(nullptr),
+	m_size(0),
+	m_writeTime(0)
+{
+}
+
+ObjLoader::MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool ObjLoader::MappedFile::Open(const char *pszFilename, bool bMapView)
+{
+	Close();
+
+	m_hFile = CreateFileA(pszFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_hFile == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_hFile, &size))
+	{
+		Close();
+		return false;
+	}
+	m_size = static_cast<uint64_t>(size.QuadPart);
+
+	FILETIME writeTime;
+	if (GetFileTime(m_hFile, nullptr, nullptr, &writeTime))
+		m_writeTime = static_cast<uint64_t>(writeTime.dwHighDateTime) << 32 | writeTime.dwLowDateTime;
+
+	// An empty file cannot be mapped, but it is still a valid (empty) view.
+	if (m_size == 0) return true;
+
+	m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_hMapping && bMapView) m_pData = static_cast<char*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_hMapping || (bMapView && !m_pData))
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool ObjLoader::MappedFile::Create(const char *pszFilename, uint64_t size)
+{
+	Close();
+
+	m_hFile = CreateFileA(pszFilename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY, nullptr);
+	if (m_hFile == INVALID_HANDLE_VALUE) return false;
+	m_size = size;
+	if (m_size == 0) return true;
+
+	// Mapping beyond the end of the file extends it with zeros.
+	m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+	if (m_hMapping) m_pData = static_cast<char*>(MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0));
+	if (!m_pData)
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void ObjLoader::MappedFile::Close()
+{
+	if (m_pData) UnmapViewOfFile(m_pData);
+	if (m_hMapping) CloseHandle(m_hMapping);
+	if (m_hFile != INVALID_HANDLE_VALUE) CloseHandle(m_hFile);
+
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = nullptr;
+	m_pData = nullptr;
+	m_size = 0;
+	m_writeTime = 0;
+}
+
+const char *ObjLoader::MappedFile::MapWindow(uint64_t offset, uint64_t size)
+{
+	if (m_pData) UnmapViewOfFile(m_pData);
+	m_pData = nullptr;
+	if (!m_hMapping || size == 0 || offset + size > m_size) return nullptr;
+
+	// Views start at a multiple of the allocation granularity.
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	const auto viewOffset = offset / systemInfo.dwAllocationGranularity * systemInfo.dwAllocationGranularity;
+	m_pData = static_cast<char*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, static_cast<DWORD>(viewOffset >> 32),
+		static_cast<DWORD>(viewOffset), static_cast<SIZE_T>(offset + size - viewOffset)));
+
+	return m_pData ? m_pData + (offset - viewOffset) : nullptr;
+}
+
+const char *ObjLoader::MappedFile::GetData() const
+{
+	return m_pData;
+}
+
+char *ObjLoader::MappedFile::GetData()
+{
+	return m_pData;
+}
+
+uint64_t ObjLoader::MappedFile::GetSize() const
+{
+	return m_size;
+}
+
+uint64_t ObjLoader::MappedFile::GetWriteTime() const
+{
+	return m_writeTime;
+}
+
+//--------------------------------------------------------------------------------------
+// OBJ loader
+//--------------------------------------------------------------------------------------
+
+ObjLoader::ObjLoader() :
+	m_pVertexData(nullptr),
+	m_pIndices(nullptr),
+	m_numVertices(0),
+	m_numIndices(0),
+	m_vertexLayout(LAYOUT_INTERLEAVED),
+	m_weldEpsilon(-1.0f),
+	m_bOptimize(false),
+	m_pChunks(nullptr),
+	m_numChunks(0),
+	m_importStats()
 {
 }
 
@@ -16,49 +336,145 @@ ObjLoader::~ObjLoader()
 {
 }
 
-bool ObjLoader::Import(const char *pszFilename, const bool bRecomputeNorm, const bool bNeedBound)
+bool ObjLoader::Import(const char *pszFilename, const bool bRecomputeNorm,
+	const bool bNeedBound, const ImportMode mode, const uint32_t numThreads,
+	const bool bUseCache, const float weldEpsilon, const bool bOptimize, const VertexLayout layout)
 {
-	FILE *pFile;
-	fopen_s(&pFile, pszFilename, "r");
+	const auto tStart = chrono::high_resolution_clock::now();
+	m_importStats = ImportStats();
+	m_cacheFile.Close();
+	m_chunkFile.Close();
+	m_pChunks = nullptr;
+	m_numChunks = 0;
+	m_vertexLayout = layout;
+	m_weldEpsilon = weldEpsilon;
+	m_bOptimize = bOptimize;
 
-	if (!pFile) return false;
+	auto uNumThreads = mode == IMPORT_MAPPED_PARALLEL ? (numThreads > 0 ? numThreads : thread::hardware_concurrency()) : 1;
+	uNumThreads = (max)(uNumThreads, 1u);
+
+	// The source is mapped once, and shared by hashing and parsing; the streamed
+	// import maps a window at a time instead.
+	MappedFile file;
+	if ((mode != IMPORT_FSCANF || bUseCache) && !file.Open(pszFilename, mode != IMPORT_STREAMED)) return false;
+
+	// Try the binary cache, keyed by the source size and content hash.
+	CacheKey key = {};
+	key.SourceSize = file.GetSize();
+	key.Options = (bRecomputeNorm ? CACHE_NORMAL : 0) | (bNeedBound ? CACHE_BOUND : 0);
+	key.Options |= (weldEpsilon >= 0.0f ? CACHE_WELD : 0) | (bOptimize ? CACHE_OPTIMIZE : 0);
+	key.Options |= layout == LAYOUT_SPLIT ? CACHE_SPLIT : (layout == LAYOUT_QUANTIZED ? CACHE_QUANTIZE : 0);
+	key.WeldEpsilon = weldEpsilon >= 0.0f ? weldEpsilon : 0.0f;
+	const auto bUseMeshCache = bUseCache && mode != IMPORT_STREAMED;
+	const auto cacheName = bUseMeshCache ? getCacheName(pszFilename) : string();
+	if (bUseMeshCache)
+	{
+		key.SourceHash = hashFile(file, uNumThreads);
+		if (loadCache(cacheName.c_str(), key))
+		{
+			m_importStats.FileSize = file.GetSize();
+			m_importStats.NumThreads = uNumThreads;
+			m_importStats.FromCache = true;
+			m_importStats.CacheTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tStart).count();
+
+			return true;
+		}
+	}
+	const auto tParse = chrono::high_resolution_clock::now();
 
 	// Import the OBJ file.
-	importGeometryFirstPass(pFile);
-	rewind(pFile);
-	importGeometrySecondPass(pFile);
-	fclose(pFile);
+	if (mode == IMPORT_STREAMED)
+	{
+		// The chunk file takes the place of the mesh cache. Only the chunk table is
+		// read here; the caller picks the chunks to load, and LoadChunks post-processes them.
+		if (!importStreamed(file, pszFilename, bRecomputeNorm, bUseCache, uNumThreads)) return false;
+
+		// Release any arrays left by a previous import.
+		vVertex().swap(m_vVertices);
+		vfloat3().swap(m_vStreams);
+		vQVertex().swap(m_vQVertices);
+		vuint().swap(m_vIndices);
+		vuint().swap(m_vTIndices);
+		vuint().swap(m_vNIndices);
+		bindArrays();
+		m_importStats.ParseTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tParse).count();
+
+		return true;
+	}
+	else if (mode == IMPORT_FSCANF)
+	{
+		if (!importFscanf(pszFilename)) return false;
+	}
+	else importMapped(file, uNumThreads);
+	const auto tParsed = chrono::high_resolution_clock::now();
+
+	// Perform post import tasks
+	if (weldEpsilon >= 0.0f) weldVertices(weldEpsilon);
+	if (bRecomputeNorm) computeNormalParallel(uNumThreads);
+	if (bOptimize) optimizeMesh();
+	if (bNeedBound || layout == LAYOUT_QUANTIZED) computeBound();
+	if (layout == LAYOUT_SPLIT) splitStreams();
+	else if (layout == LAYOUT_QUANTIZED) quantizeVertices(uNumThreads);
+	bindArrays();
+	const auto tPost = chrono::high_resolution_clock::now();
+
+	// A cache that cannot be written only costs the next run a full import.
+	if (bUseMeshCache) saveCache(cacheName.c_str(), key);
+	const auto tEnd = chrono::high_resolution_clock::now();
 
-	// Perform post import tasks.
-	if (bRecomputeNorm) computeNormal();
-	if (bNeedBound) computeBound();
+	m_importStats.ParseTime = chrono::duration<double>(tParsed - tParse).count();
+	m_importStats.PostTime = chrono::duration<double>(tPost - tParsed).count();
+	m_importStats.CacheTime = chrono::duration<double>((tParse - tStart) + (tEnd - tPost)).count();
 
 	return true;
 }
 
 const uint32_t ObjLoader::GetNumVertices() const
 {
-	return static_cast<uint32_t>(m_vVertices.size());
+	return m_numVertices;
 }
 
 const uint32_t ObjLoader::GetNumIndices() const
 {
-	return static_cast<uint32_t>(m_vIndices.size());
+	return m_numIndices;
+}
+
+const ObjLoader::VertexLayout ObjLoader::GetVertexLayout() const
+{
+	return m_vertexLayout;
 }
 
 const uint32_t ObjLoader::GetVertexStride() const
 {
-	return static_cast<uint32_t>(sizeof(Vertex));
+	switch (m_vertexLayout)
+	{
+	case LAYOUT_SPLIT:
+		return static_cast<uint32_t>(sizeof(float3));
+	case LAYOUT_QUANTIZED:
+		return static_cast<uint32_t>(sizeof(QuantizedVertex));
+	default:
+		return static_cast<uint32_t>(sizeof(Vertex));
+	}
 }
 
 const uint8_t *ObjLoader::GetVertices() const
 {
-	return reinterpret_cast<const uint8_t*>(m_vVertices.data());
+	return m_pVertexData;
+}
+
+const ObjLoader::float3 *ObjLoader::GetPositions() const
+{
+	return m_vertexLayout == LAYOUT_SPLIT ? reinterpret_cast<const float3*>(m_pVertexData) : nullptr;
+}
+
+const ObjLoader::float3 *ObjLoader::GetNormals() const
+{
+	return m_vertexLayout == LAYOUT_SPLIT ? GetPositions() + m_numVertices : nullptr;
 }
 
 const uint32_t *ObjLoader::GetIndices() const
 {
-	return m_vIndices.data();
+	return m_pIndices;
 }
 
 const ObjLoader::float3 &ObjLoader::GetCenter() const
@@ -66,9 +482,681 @@ const ObjLoader::float3 &ObjLoader::GetCenter() const
 	return m_vCenter;
 }
 
-const float ObjLoader::GetRadius() const
-{
-	return m_fRadius;
+const float ObjLoader::GetRadius() const
+{
+	return m_fRadius;
+}
+
+const ObjLoader::ImportStats &ObjLoader::GetImportStats() const
+{
+	return m_importStats;
+}
+
+uint32_t ObjLoader::GetNumChunks() const
+{
+	return m_numChunks;
+}
+
+const ObjLoader::ChunkInfo *ObjLoader::GetChunks() const
+{
+	return m_pChunks;
+}
+
+bool ObjLoader::LoadChunks(const uint32_t *pChunkIndices, uint32_t numChunks)
+{
+	if (!gatherChunks(pChunkIndices, numChunks)) return false;
+
+	// The chunks already carry their normals, and the bounds are the ones of the whole mesh.
+	if (m_weldEpsilon >= 0.0f) weldVertices(m_weldEpsilon);
+	if (m_bOptimize) optimizeMesh();
+	if (m_vertexLayout == LAYOUT_SPLIT) splitStreams();
+	else if (m_vertexLayout == LAYOUT_QUANTIZED) quantizeVertices(m_importStats.NumThreads);
+	bindArrays();
+
+	return true;
+}
+
+ObjLoader::NormalBenchmark ObjLoader::BenchmarkNormals(uint32_t numThreads, uint32_t numIterations) const
+{
+	NormalBenchmark benchmark = {};
+	numThreads = numThreads > 0 ? numThreads : thread::hardware_concurrency();
+	benchmark.NumThreads = (max)(numThreads, 1u);
+	numIterations = (max)(numIterations, 1u);
+
+	// Run both generators on private copies, so that the imported mesh is untouched.
+	ObjLoader scatter, gather;
+	copyVertices(scatter.m_vVertices);
+	scatter.m_vIndices.assign(m_pIndices, m_pIndices + m_numIndices);
+	gather.m_vVertices = scatter.m_vVertices;
+	gather.m_vIndices = scatter.m_vIndices;
+
+	for (auto i = 0u; i < numIterations; ++i)
+	{
+		// The scatter-add accumulates into the existing normals.
+		for (auto &vertex : scatter.m_vVertices) vertex.m_vNormal = float3(0.0f, 0.0f, 0.0f);
+		const auto tStart = chrono::high_resolution_clock::now();
+		scatter.computeNormal();
+		benchmark.ScatterTime += chrono::duration<double>(chrono::high_resolution_clock::now() - tStart).count();
+	}
+
+	for (auto i = 0u; i < numIterations; ++i)
+	{
+		const auto tStart = chrono::high_resolution_clock::now();
+		gather.computeNormalParallel(benchmark.NumThreads);
+		benchmark.GatherTime += chrono::duration<double>(chrono::high_resolution_clock::now() - tStart).count();
+	}
+
+	benchmark.ScatterTime /= numIterations;
+	benchmark.GatherTime /= numIterations;
+
+	// Compare the results
+	for (auto i = 0u; i < m_numVertices; ++i)
+	{
+		const auto &n0 = scatter.m_vVertices[i].m_vNormal;
+		const auto &n1 = gather.m_vVertices[i].m_vNormal;
+		if (isnan(n0.x) || isnan(n0.y) || isnan(n0.z)) ++benchmark.NumNaNScatter;
+		else benchmark.MaxDeviation = (max)(benchmark.MaxDeviation,
+			(max)((max)(fabs(n0.x - n1.x), fabs(n0.y - n1.y)), fabs(n0.z - n1.z)));
+	}
+
+	return benchmark;
+}
+
+ObjLoader::ImportBenchmark ObjLoader::BenchmarkImport(uint32_t numTriangles, uint32_t numThreads,
+	uint32_t numIterations)
+{
+	static const ImportMode modes[] = { IMPORT_MAPPED, IMPORT_MAPPED_PARALLEL, IMPORT_FSCANF };
+
+	ImportBenchmark benchmark = {};
+	numThreads = numThreads > 0 ? numThreads : thread::hardware_concurrency();
+	benchmark.NumThreads = (max)(numThreads, 1u);
+	numIterations = (max)(numIterations, 1u);
+
+	// Square grid of cells, 2 triangles each, over a fixed height field
+	const auto gridSize = (max)(static_cast<uint32_t>(sqrt(numTriangles / 2.0)), 1u);
+	const auto numSide = gridSize + 1;
+	char tempPath[MAX_PATH], pszFilename[MAX_PATH];
+	if (!GetTempPathA(MAX_PATH, tempPath) || !GetTempFileNameA(tempPath, "obj", 0, pszFilename)) return benchmark;
+	{
+		FILE *pFile;
+		fopen_s(&pFile, pszFilename, "w");
+		if (!pFile)
+		{
+			DeleteFileA(pszFilename);
+
+			return benchmark;
+		}
+
+		const auto scale = 20.0f / gridSize;
+		for (auto i = 0u; i < numSide; ++i)
+			for (auto j = 0u; j < numSide; ++j)
+				fprintf(pFile, "v %.6f %.6f %.6f\n", j * scale - 10.0f,
+					sinf(j * 0.37f) * cosf(i * 0.23f), i * scale - 10.0f);
+		for (auto i = 0u; i < gridSize; ++i)
+		{
+			for (auto j = 0u; j < gridSize; ++j)
+			{
+				// One-based indices
+				const auto v = i * numSide + j + 1;
+				fprintf(pFile, "f %u %u %u\nf %u %u %u\n", v, v + numSide, v + 1, v + 1, v + numSide, v + numSide + 1);
+			}
+		}
+		fclose(pFile);
+	}
+	benchmark.NumTriangles = gridSize * gridSize * 2;
+
+	// The first mode is the reference for the others.
+	ObjLoader reference;
+	benchmark.bIndicesMatch = true;
+	for (auto m = 0u; m < size(modes); ++m)
+	{
+		ObjLoader current;
+		auto &objLoader = m > 0 ? current : reference;
+		benchmark.ParseTimes[m] = DBL_MAX;
+		for (auto i = 0u; i < numIterations; ++i)
+		{
+			if (!objLoader.Import(pszFilename, false, false, modes[m], benchmark.NumThreads)) break;
+			const auto &stats = objLoader.GetImportStats();
+			benchmark.FileSize = stats.FileSize;
+			benchmark.ParseTimes[m] = (min)(benchmark.ParseTimes[m], stats.ParseTime);
+		}
+		if (m == 0) continue;
+
+		// Compare the results
+		if (objLoader.m_vVertices.size() != reference.m_vVertices.size() ||
+			objLoader.m_vIndices != reference.m_vIndices)
+		{
+			benchmark.bIndicesMatch = false;
+			continue;
+		}
+		for (auto i = 0u; i < objLoader.m_vVertices.size(); ++i)
+		{
+			const auto &p0 = reference.m_vVertices[i].m_vPosition;
+			const auto &p1 = objLoader.m_vVertices[i].m_vPosition;
+			benchmark.MaxDeviation = (max)(benchmark.MaxDeviation,
+				(max)((max)(fabs(p0.x - p1.x), fabs(p0.y - p1.y)), fabs(p0.z - p1.z)));
+		}
+	}
+	DeleteFileA(pszFilename);
+
+	return benchmark;
+}
+
+ObjLoader::QuantizationError ObjLoader::ValidateQuantization(uint32_t numThreads) const
+{
+	// The reference has to be the float vertices.
+	QuantizationError error = {};
+	if (m_vertexLayout == LAYOUT_QUANTIZED || m_numVertices == 0) return error;
+	numThreads = numThreads > 0 ? numThreads : thread::hardware_concurrency();
+
+	// Quantize a private copy, so that the imported mesh is untouched.
+	ObjLoader quantizer;
+	copyVertices(quantizer.m_vVertices);
+	quantizer.computeBound();
+	quantizer.quantizeVertices((max)(numThreads, 1u));
+	const auto &center = quantizer.m_vCenter;
+	const auto radius = quantizer.m_fRadius;
+
+	// Half an SNORM step, plus the float rounding of the offset and scale.
+	// Normals are bounded by the worst-case stretch of the octahedral map,
+	// 3 * sqrt(2) radians per unit of the encoded coordinates.
+	const auto maxCenter = (max)((max)(fabs(center.x), fabs(center.y)), fabs(center.z));
+	error.NumVertices = m_numVertices;
+	error.PositionBound = radius * 0.5f / snormScale + 4.0f * FLT_EPSILON * (maxCenter + radius);
+	error.NormalBound = 3.0f * sqrt(2.0f) * 0.5f / snormScale + 4.0f * FLT_EPSILON;
+
+	vVertex vertices;
+	copyVertices(vertices);
+	for (auto i = 0u; i < m_numVertices; ++i)
+	{
+		const auto &vertex = vertices[i];
+		const auto &qVertex = quantizer.m_vQVertices[i];
+
+		const auto p = DecodePosition(qVertex, center, radius);
+		const auto positionError = (max)((max)(fabs(p.x - vertex.m_vPosition.x),
+			fabs(p.y - vertex.m_vPosition.y)), fabs(p.z - vertex.m_vPosition.z));
+
+		// Angles from atan2 stay accurate for nearly parallel vectors.
+		auto normalError = 0.0f;
+		const auto n0 = XMVector3Normalize(XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&vertex.m_vNormal)));
+		if (XMVector3Greater(XMVector3LengthSq(n0), XMVectorZero()))
+		{
+			const auto n = DecodeNormal(qVertex);
+			const auto n1 = XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&n));
+			normalError = atan2(XMVectorGetX(XMVector3Length(XMVector3Cross(n0, n1))),
+				XMVectorGetX(XMVector3Dot(n0, n1)));
+		}
+
+		error.MaxPositionError = (max)(error.MaxPositionError, positionError);
+		error.MaxNormalError = (max)(error.MaxNormalError, normalError);
+		if (!(positionError <= error.PositionBound && normalError <= error.NormalBound)) ++error.NumViolations;
+	}
+
+	return error;
+}
+
+void ObjLoader::QuantizePositions(int16_t *pPositions, uint32_t numThreads) const
+{
+	// Vertices are encoded in blocks gathered from either float layout.
+	static const uint32_t blockSize = 1 << 12;
+
+	if (m_vertexLayout == LAYOUT_QUANTIZED)
+	{
+		const auto pQVertices = reinterpret_cast<const QuantizedVertex*>(m_pVertexData);
+		for (auto i = 0u; i < m_numVertices; ++i)
+			memcpy(&pPositions[4 * i], pQVertices[i].m_position, sizeof(QuantizedVertex::m_position));
+
+		return;
+	}
+
+	const auto numBlocks = (m_numVertices + blockSize - 1) / blockSize;
+	numThreads = numThreads > 0 ? numThreads : thread::hardware_concurrency();
+	numThreads = (min)((max)(numThreads, 1u), (max)(numBlocks, 1u));
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		vVertex vertices(blockSize);
+		vQVertex qVertices(blockSize);
+		for (auto b = t; b < numBlocks; b += numThreads)
+		{
+			const auto begin = b * blockSize;
+			const auto numVertices = (min)(blockSize, m_numVertices - begin);
+			if (m_vertexLayout == LAYOUT_SPLIT)
+			{
+				const auto pSrcPositions = GetPositions();
+				const auto pSrcNormals = GetNormals();
+				for (auto i = 0u; i < numVertices; ++i)
+					vertices[i] = { pSrcPositions[begin + i], pSrcNormals[begin + i] };
+			}
+			else memcpy(vertices.data(), reinterpret_cast<const Vertex*>(m_pVertexData) + begin,
+				sizeof(Vertex) * numVertices);
+
+			encodeVertices(vertices.data(), qVertices.data(), numVertices, m_vCenter, m_fRadius);
+			for (auto i = 0u; i < numVertices; ++i)
+				memcpy(&pPositions[4 * (begin + i)], qVertices[i].m_position, sizeof(QuantizedVertex::m_position));
+		}
+	});
+}
+
+ObjLoader::float3 ObjLoader::DecodePosition(const QuantizedVertex &vertex, const float3 &center, float radius)
+{
+	return float3(center.x + snormToFloat(vertex.m_position[0]) * radius,
+		center.y + snormToFloat(vertex.m_position[1]) * radius,
+		center.z + snormToFloat(vertex.m_position[2]) * radius);
+}
+
+ObjLoader::float3 ObjLoader::DecodeNormal(const QuantizedVertex &vertex)
+{
+	auto x = snormToFloat(vertex.m_normal[0]);
+	auto y = snormToFloat(vertex.m_normal[1]);
+	const auto z = 1.0f - fabs(x) - fabs(y);
+
+	// Unfold the lower hemisphere.
+	const auto t = (max)(-z, 0.0f);
+	x += x >= 0.0f ? -t : t;
+	y += y >= 0.0f ? -t : t;
+
+	const auto l = sqrt(x * x + y * y + z * z);
+
+	return float3(x / l, y / l, z / l);
+}
+
+void ObjLoader::importMapped(const MappedFile &file, uint32_t numThreads)
+{
+	m_importStats.FileSize = file.GetSize();
+
+	vector<Chunk> chunks;
+	m_importStats.NumThreads = parseChunks(file.GetData(), file.GetData() + file.GetSize(), numThreads, chunks);
+	mergeChunks(chunks);
+}
+
+uint32_t ObjLoader::parseChunks(const char *pBegin, const char *pEnd, uint32_t numThreads, vector<Chunk> &chunks)
+{
+	// Chunks smaller than this are not worth a thread.
+	static const uint64_t minChunkSize = 1 << 16;
+
+	const auto size = static_cast<uint64_t>(pEnd - pBegin);
+	const auto maxThreads = size / minChunkSize + 1;
+	numThreads = static_cast<uint32_t>((min<uint64_t>)((max)(numThreads, 1u), maxThreads));
+
+	// Split the range at newline boundaries, so that no record straddles two chunks.
+	vector<const char*> bounds(numThreads + 1, pEnd);
+	bounds[0] = pBegin;
+	for (auto i = 1u; i < numThreads; ++i)
+	{
+		const auto pSplit = (max)(pBegin + size * i / numThreads, bounds[i - 1]);
+		bounds[i] = pSplit < pEnd ? skipLine(pSplit, pEnd) : pEnd;
+	}
+
+	chunks.clear();
+	chunks.resize(numThreads);
+	if (numThreads > 1)
+	{
+		vector<thread> workers;
+		workers.reserve(numThreads);
+		for (auto i = 0u; i < numThreads; ++i)
+			workers.emplace_back(&ObjLoader::parseChunk, this, bounds[i], bounds[i + 1], ref(chunks[i]));
+		for (auto &worker : workers) worker.join();
+	}
+	else parseChunk(bounds[0], bounds[1], chunks[0]);
+
+	return numThreads;
+}
+
+bool ObjLoader::importStreamed(MappedFile &file, const char *pszFilename, bool bRecomputeNorm,
+	bool bUseCache, uint32_t numThreads)
+{
+	// Hashing would read the whole source up front, so the chunk file is keyed by
+	// the size and the write time of the source instead.
+	CacheKey key = {};
+	key.SourceSize = file.GetSize();
+	key.SourceHash = file.GetWriteTime();
+	key.Options = bRecomputeNorm ? CACHE_NORMAL : 0;
+	m_importStats.FileSize = file.GetSize();
+	m_importStats.NumThreads = numThreads;
+
+	const auto chunkName = getCacheName(pszFilename, ".svchunks");
+	if (!bUseCache || !openChunks(chunkName.c_str(), key))
+	{
+		if (!streamChunks(file, chunkName.c_str(), key, bRecomputeNorm, numThreads)) return false;
+		if (!openChunks(chunkName.c_str(), key)) return false;
+	}
+
+	return true;
+}
+
+bool ObjLoader::streamChunks(MappedFile &file, const char *pszFilename, const CacheKey &key,
+	bool bRecomputeNorm, uint32_t numThreads)
+{
+	// Triangles are read back from the intermediate files in blocks of this size.
+	static const uint32_t blockTriangles = 1 << 16;
+
+	// Intermediate files, and the chunk file before it is complete
+	enum StreamFile : uint8_t
+	{
+		POSITION_FILE,
+		TRIANGLE_FILE,
+		PARTITION_FILE,
+		NORMAL_FILE,
+		CHUNK_FILE,
+
+		NUM_STREAM_FILE
+	};
+	static const char *extensions[] = { ".pos.tmp", ".tri.tmp", ".part.tmp", ".nrm.tmp", ".tmp" };
+	string fileNames[NUM_STREAM_FILE];
+	FILE *pFiles[NUM_STREAM_FILE] = {};
+	for (auto i = 0u; i < NUM_STREAM_FILE; ++i) fileNames[i] = string(pszFilename) + extensions[i];
+
+	MappedFile positionFile, normalFile;
+	const auto finish = [&](bool bSucceeded)
+	{
+		for (auto &pFile : pFiles)
+		{
+			bSucceeded = (!pFile || fclose(pFile) == 0) && bSucceeded;
+			pFile = nullptr;
+		}
+		positionFile.Close();
+		normalFile.Close();
+		for (auto i = 0u; i < CHUNK_FILE; ++i) DeleteFileA(fileNames[i].c_str());
+
+		bSucceeded = bSucceeded && MoveFileExA(fileNames[CHUNK_FILE].c_str(), pszFilename, MOVEFILE_REPLACE_EXISTING);
+		if (!bSucceeded) DeleteFileA(fileNames[CHUNK_FILE].c_str());
+
+		return bSucceeded;
+	};
+
+	// Pass 1: parse the source a window at a time into flat position and triangle files.
+	fopen_s(&pFiles[POSITION_FILE], fileNames[POSITION_FILE].c_str(), "wb");
+	fopen_s(&pFiles[TRIANGLE_FILE], fileNames[TRIANGLE_FILE].c_str(), "wb");
+	if (!pFiles[POSITION_FILE] || !pFiles[TRIANGLE_FILE]) return finish(false);
+
+	const auto fileSize = file.GetSize();
+	auto numVertices = 0ull, numTriangles = 0ull;
+	float3 vMin(FLT_MAX, FLT_MAX, FLT_MAX), vMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	vector<Chunk> chunks;
+	vfloat3 positions;
+	for (auto offset = 0ull; offset < fileSize; ++m_importStats.NumWindows)
+	{
+		const auto windowSize = (min<uint64_t>)(StreamWindowSize, fileSize - offset);
+		const auto pBegin = file.MapWindow(offset, windowSize);
+		if (!pBegin) return finish(false);
+
+		// The window ends after its last complete line; a single line longer than
+		// a window is not supported.
+		auto pEnd = pBegin + windowSize;
+		if (offset + windowSize < fileSize)
+		{
+			while (pEnd > pBegin && pEnd[-1] != '\n') --pEnd;
+			if (pEnd == pBegin) return finish(false);
+		}
+
+		parseChunks(pBegin, pEnd, numThreads, chunks);
+		for (auto &chunk : chunks)
+		{
+			// Relative indices are resolved against the vertices parsed so far.
+			const auto uBase = static_cast<uint32_t>(numVertices);
+			for (const auto &k : chunk.RelIndices[0]) chunk.Indices[k] += uBase;
+
+			positions.resize(chunk.Vertices.size());
+			for (size_t i = 0; i < positions.size(); ++i)
+			{
+				const auto &p = chunk.Vertices[i].m_vPosition;
+				positions[i] = p;
+				vMin = float3((min)(vMin.x, p.x), (min)(vMin.y, p.y), (min)(vMin.z, p.z));
+				vMax = float3((max)(vMax.x, p.x), (max)(vMax.y, p.y), (max)(vMax.z, p.z));
+			}
+
+			if (fwrite(positions.data(), sizeof(float3), positions.size(), pFiles[POSITION_FILE]) != positions.size() ||
+				fwrite(chunk.Indices.data(), sizeof(uint32_t), chunk.Indices.size(), pFiles[TRIANGLE_FILE]) != chunk.Indices.size())
+				return finish(false);
+			numVertices += positions.size();
+			numTriangles += chunk.Indices.size() / 3;
+		}
+		offset += pEnd - pBegin;
+	}
+	vector<Chunk>().swap(chunks);
+	vfloat3().swap(positions);
+	file.Close();
+	if (fclose(pFiles[POSITION_FILE]) != 0 || fclose(pFiles[TRIANGLE_FILE]) != 0) return finish(false);
+	pFiles[POSITION_FILE] = pFiles[TRIANGLE_FILE] = nullptr;
+	if (numVertices == 0 || numVertices >= UINT32_MAX) return finish(false);
+
+	// The positions are mapped, so that the OS pages them in and out as needed.
+	if (!positionFile.Open(fileNames[POSITION_FILE].c_str())) return finish(false);
+	const auto pPositions = reinterpret_cast<const float3*>(positionFile.GetData());
+	float3 *pNormals = nullptr;
+	if (bRecomputeNorm)
+	{
+		if (!normalFile.Create(fileNames[NORMAL_FILE].c_str(), sizeof(float3) * numVertices)) return finish(false);
+		pNormals = reinterpret_cast<float3*>(normalFile.GetData());
+	}
+
+	vuint block(blockTriangles * 3);
+	const auto streamTriangles = [&](const auto &func)
+	{
+		FILE *pFile;
+		fopen_s(&pFile, fileNames[TRIANGLE_FILE].c_str(), "rb");
+		if (!pFile) return false;
+
+		// Triangles with out-of-range indices are dropped.
+		auto bRead = true;
+		for (auto first = 0ull; bRead && first < numTriangles; first += blockTriangles)
+		{
+			const auto n = static_cast<uint32_t>((min<uint64_t>)(blockTriangles, numTriangles - first));
+			bRead = fread(block.data(), sizeof(uint32_t) * 3, n, pFile) == n;
+			for (auto i = 0u; bRead && i < n; ++i)
+			{
+				const auto pTri = &block[i * 3];
+				if (pTri[0] < numVertices && pTri[1] < numVertices && pTri[2] < numVertices) func(pTri);
+			}
+		}
+
+		return fclose(pFile) == 0 && bRead;
+	};
+
+	// Triangles are binned by their centroids into a grid of about MaxChunkTriangles
+	// triangles per cell, and the cells are ordered along a Morton curve.
+	const auto targetCells = static_cast<double>(numTriangles) / MaxChunkTriangles;
+	const auto gridSize = static_cast<uint32_t>((min)((max)(ceil(cbrt(targetCells)), 1.0), 64.0));
+	const auto numCells = gridSize * gridSize * gridSize;
+	const float3 vExtent(vMax.x - vMin.x, vMax.y - vMin.y, vMax.z - vMin.z);
+	const auto cellCoord = [gridSize](float c, float minC, float extent)
+	{
+		const auto x = extent > 0.0f ? (c - minC) / extent * gridSize : 0.0f;
+
+		return static_cast<uint32_t>((min)((max)(x, 0.0f), gridSize - 1.0f));
+	};
+	const auto cellOf = [&](const uint32_t *pTri)
+	{
+		const auto &p0 = pPositions[pTri[0]], &p1 = pPositions[pTri[1]], &p2 = pPositions[pTri[2]];
+		const auto x = cellCoord((p0.x + p1.x + p2.x) / 3.0f, vMin.x, vExtent.x);
+		const auto y = cellCoord((p0.y + p1.y + p2.y) / 3.0f, vMin.y, vExtent.y);
+		const auto z = cellCoord((p0.z + p1.z + p2.z) / 3.0f, vMin.z, vExtent.z);
+
+		return (gridSize * z + y) * gridSize + x;
+	};
+
+	// Pass 2: count the triangles per cell, and accumulate unit face normals into
+	// the mapped normal file, in triangle order like the in-memory import.
+	vuint cellCounts(numCells);
+	if (!streamTriangles([&](const uint32_t *pTri)
+	{
+		++cellCounts[cellOf(pTri)];
+		if (!pNormals) return;
+
+		const auto &p0 = pPositions[pTri[0]], &p1 = pPositions[pTri[1]], &p2 = pPositions[pTri[2]];
+		const float3 e1(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
+		const float3 e2(p2.x - p1.x, p2.y - p1.y, p2.z - p1.z);
+		const float3 n(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+		const auto l = sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+		if (!(l > 0.0f)) return;
+		for (auto j = 0u; j < 3; ++j)
+		{
+			auto &vn = pNormals[pTri[j]];
+			vn = float3(vn.x + n.x / l, vn.y + n.y / l, vn.z + n.z / l);
+		}
+	})) return finish(false);
+
+	const auto spreadBits = [](uint32_t x)
+	{
+		x = (x | x << 16) & 0x030000ff;
+		x = (x | x << 8) & 0x0300f00f;
+		x = (x | x << 4) & 0x030c30c3;
+		x = (x | x << 2) & 0x09249249;
+
+		return x;
+	};
+	const auto morton = [&](uint32_t cell)
+	{
+		const auto x = cell % gridSize, y = cell / gridSize % gridSize, z = cell / (gridSize * gridSize);
+
+		return spreadBits(x) | spreadBits(y) << 1 | spreadBits(z) << 2;
+	};
+	vuint cellOrder(numCells);
+	for (auto i = 0u; i < numCells; ++i) cellOrder[i] = i;
+	sort(cellOrder.begin(), cellOrder.end(), [&](uint32_t a, uint32_t b) { return morton(a) < morton(b); });
+	vector<uint64_t> cellOffsets(numCells);
+	auto numBinned = 0ull;
+	for (const auto cell : cellOrder)
+	{
+		cellOffsets[cell] = numBinned;
+		numBinned += cellCounts[cell];
+	}
+
+	// Pass 3: scatter the triangles into the partition file, in cell order, through
+	// per-cell buffers that are flushed whenever they hold a window in total.
+	fopen_s(&pFiles[PARTITION_FILE], fileNames[PARTITION_FILE].c_str(), "w+b");
+	if (!pFiles[PARTITION_FILE]) return finish(false);
+	{
+		const auto maxBuffered = StreamWindowSize / sizeof(uint32_t);
+		vector<vuint> buffers(numCells);
+		auto cursors = cellOffsets;
+		auto numBuffered = 0ull;
+		auto bWritten = true;
+		const auto flush = [&]()
+		{
+			for (auto i = 0u; i < numCells; ++i)
+			{
+				auto &buffer = buffers[i];
+				if (buffer.empty()) continue;
+				bWritten = bWritten && _fseeki64(pFiles[PARTITION_FILE], sizeof(uint32_t) * 3 * cursors[i], SEEK_SET) == 0;
+				bWritten = bWritten && fwrite(buffer.data(), sizeof(uint32_t), buffer.size(), pFiles[PARTITION_FILE]) == buffer.size();
+				cursors[i] += buffer.size() / 3;
+				vuint().swap(buffer);
+			}
+			numBuffered = 0;
+		};
+
+		if (!streamTriangles([&](const uint32_t *pTri)
+		{
+			auto &buffer = buffers[cellOf(pTri)];
+			buffer.insert(buffer.end(), pTri, pTri + 3);
+			if ((numBuffered += 3) >= maxBuffered) flush();
+		})) return finish(false);
+		flush();
+		if (!bWritten) return finish(false);
+	}
+
+	// Pass 4: cut each cell into chunks of at most MaxChunkTriangles triangles, with
+	// their own vertices, local indices and bounds.
+	fopen_s(&pFiles[CHUNK_FILE], fileNames[CHUNK_FILE].c_str(), "wb");
+	if (!pFiles[CHUNK_FILE]) return finish(false);
+
+	ChunkHeader header = {};
+	header.Magic = chunkMagic;
+	header.Version = chunkVersion;
+	header.Key = key;
+	header.Center = float3((vMin.x + vMax.x) / 2.0f, (vMin.y + vMax.y) / 2.0f, (vMin.z + vMax.z) / 2.0f);
+	header.Radius = (max)((max)(vExtent.x, vExtent.y), vExtent.z) * 0.5f;
+	if (fwrite(&header, sizeof(ChunkHeader), 1, pFiles[CHUNK_FILE]) != 1) return finish(false);
+
+	vector<ChunkInfo> chunkInfos;
+	unordered_map<uint32_t, uint32_t> localIndices;
+	vVertex vertices;
+	vuint indices;
+	auto dataOffset = static_cast<uint64_t>(sizeof(ChunkHeader));
+	for (const auto cell : cellOrder)
+	{
+		const auto cellEnd = cellOffsets[cell] + cellCounts[cell];
+		for (auto first = cellOffsets[cell]; first < cellEnd; first += MaxChunkTriangles)
+		{
+			const auto n = static_cast<uint32_t>((min<uint64_t>)(MaxChunkTriangles, cellEnd - first));
+			indices.resize(n * 3);
+			if (_fseeki64(pFiles[PARTITION_FILE], sizeof(uint32_t) * 3 * first, SEEK_SET) != 0 ||
+				fread(indices.data(), sizeof(uint32_t) * 3, n, pFiles[PARTITION_FILE]) != n)
+				return finish(false);
+
+			ChunkInfo info = {};
+			info.Min = float3(FLT_MAX, FLT_MAX, FLT_MAX);
+			info.Max = float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			localIndices.clear();
+			vertices.clear();
+			for (auto &index : indices)
+			{
+				const auto result = localIndices.emplace(index, static_cast<uint32_t>(vertices.size()));
+				if (result.second)
+				{
+					// Vertices touched only by degenerate triangles fall back to +Y.
+					Vertex vertex = {};
+					const auto &p = pPositions[index];
+					vertex.m_vPosition = p;
+					if (pNormals)
+					{
+						const auto &vn = pNormals[index];
+						const auto l = sqrt(vn.x * vn.x + vn.y * vn.y + vn.z * vn.z);
+						vertex.m_vNormal = l > 0.0f ? float3(vn.x / l, vn.y / l, vn.z / l) : float3(0.0f, 1.0f, 0.0f);
+					}
+					vertices.push_back(vertex);
+					info.Min = float3((min)(info.Min.x, p.x), (min)(info.Min.y, p.y), (min)(info.Min.z, p.z));
+					info.Max = float3((max)(info.Max.x, p.x), (max)(info.Max.y, p.y), (max)(info.Max.z, p.z));
+				}
+				index = result.first->second;
+			}
+
+			info.VertexOffset = dataOffset;
+			info.IndexOffset = dataOffset + sizeof(Vertex) * vertices.size();
+			info.NumVertices = static_cast<uint32_t>(vertices.size());
+			info.NumIndices = static_cast<uint32_t>(indices.size());
+			if (fwrite(vertices.data(), sizeof(Vertex), vertices.size(), pFiles[CHUNK_FILE]) != vertices.size() ||
+				fwrite(indices.data(), sizeof(uint32_t), indices.size(), pFiles[CHUNK_FILE]) != indices.size())
+				return finish(false);
+			dataOffset = info.IndexOffset + sizeof(uint32_t) * indices.size();
+			header.NumVertices += info.NumVertices;
+			header.NumIndices += info.NumIndices;
+			chunkInfos.push_back(info);
+		}
+	}
+
+	// The chunk table follows the data, and the header is rewritten once it is known.
+	const uint8_t padding[alignof(ChunkInfo)] = {};
+	const auto paddingSize = static_cast<size_t>((alignof(ChunkInfo) - dataOffset % alignof(ChunkInfo)) % alignof(ChunkInfo));
+	header.NumChunks = static_cast<uint32_t>(chunkInfos.size());
+	header.TableOffset = dataOffset + paddingSize;
+	auto bWritten = fwrite(padding, 1, paddingSize, pFiles[CHUNK_FILE]) == paddingSize;
+	bWritten = bWritten && fwrite(chunkInfos.data(), sizeof(ChunkInfo), chunkInfos.size(), pFiles[CHUNK_FILE]) == chunkInfos.size();
+	bWritten = bWritten && _fseeki64(pFiles[CHUNK_FILE], 0, SEEK_SET) == 0;
+	bWritten = bWritten && fwrite(&header, sizeof(ChunkHeader), 1, pFiles[CHUNK_FILE]) == 1;
+
+	return finish(bWritten);
+}
+
+bool ObjLoader::importFscanf(const char *pszFilename)
+{
+	FILE *pFile;
+	fopen_s(&pFile, pszFilename, "r");
+
+	if (!pFile) return false;
+
+	_fseeki64(pFile, 0, SEEK_END);
+	m_importStats.FileSize = static_cast<uint64_t>(_ftelli64(pFile));
+	m_importStats.NumThreads = 1;
+	rewind(pFile);
+
+	importGeometryFirstPass(pFile);
+	rewind(pFile);
+	importGeometrySecondPass(pFile);
+	fclose(pFile);
+
+	return true;
 }
 
 void ObjLoader::importGeometryFirstPass(FILE *pFile)
@@ -262,6 +1350,277 @@ void ObjLoader::loadIndex(FILE *pFile, uint32_t &uNumTri)
 	}
 }
 
+void ObjLoader::parseChunk(const char *pBegin, const char *pEnd, Chunk &chunk)
+{
+	chunk.NumTexcoords = 0;
+	chunk.NumNormals = 0;
+
+	// The arrays grow geometrically, so no counting pass is needed.
+	auto pCur = pBegin;
+	while (pCur < pEnd)
+	{
+		pCur = skipSpaces(pCur, pEnd);
+		if (pCur + 1 >= pEnd) break;
+
+		if (pCur[0] == 'v' && isSpace(pCur[1])) // v
+		{
+			Vertex vertex = {};
+			pCur = parseFloat(skipSpaces(pCur + 2, pEnd), pEnd, vertex.m_vPosition.x);
+			pCur = parseFloat(skipSpaces(pCur, pEnd), pEnd, vertex.m_vPosition.y);
+			pCur = parseFloat(skipSpaces(pCur, pEnd), pEnd, vertex.m_vPosition.z);
+			chunk.Vertices.push_back(vertex);
+		}
+		else if (pCur[0] == 'v' && pCur[1] == 't') ++chunk.NumTexcoords;	// vt
+		else if (pCur[0] == 'v' && pCur[1] == 'n') ++chunk.NumNormals;		// vn
+		else if (pCur[0] == 'f' && isSpace(pCur[1])) // v, v//vn, v/vt, or v/vt/vn.
+			pCur = parseIndices(pCur + 2, pEnd, chunk);
+
+		pCur = skipLine(pCur, pEnd);
+	}
+}
+
+const char *ObjLoader::parseIndices(const char *pCur, const char *pEnd, Chunk &chunk)
+{
+	uint32_t v[3] = { 0 };
+	uint32_t vt[3] = { 0 };
+	uint32_t vn[3] = { 0 };
+	bool rel[3][3] = {};
+
+	const auto uNumVert = static_cast<uint32_t>(chunk.Vertices.size());
+
+	// Triangulate the polygon as a fan around its first corner.
+	for (auto i = 0u; ; ++i)
+	{
+		pCur = skipSpaces(pCur, pEnd);
+		if (pCur >= pEnd || !(isDigit(*pCur) || *pCur == '-' || *pCur == '+')) break;
+
+		auto iv = 0, ivt = 0, ivn = 0;
+		pCur = parseInt(pCur, pEnd, iv);
+		if (pCur < pEnd && *pCur == '/')
+		{
+			if (++pCur < pEnd && *pCur != '/') pCur = parseInt(pCur, pEnd, ivt);
+			if (pCur < pEnd && *pCur == '/') pCur = parseInt(pCur + 1, pEnd, ivn);
+		}
+
+		// Relative indices are resolved against this chunk only; mergeChunks()
+		// later offsets them by the element counts of the preceding chunks.
+		const auto k = i < 2 ? i : 2;
+		v[k] = resolveIndex(iv, uNumVert);
+		vt[k] = resolveIndex(ivt, chunk.NumTexcoords);
+		vn[k] = resolveIndex(ivn, chunk.NumNormals);
+		rel[0][k] = iv < 0;
+		rel[1][k] = ivt < 0;
+		rel[2][k] = ivn < 0;
+		if (i < 2) continue;
+
+		const auto uBase = static_cast<uint32_t>(chunk.Indices.size());
+		chunk.Indices.insert(chunk.Indices.end(), v, v + 3);
+
+		if (ivt)
+		{
+			chunk.TIndices.resize(uBase);
+			chunk.TIndices.insert(chunk.TIndices.end(), vt, vt + 3);
+		}
+
+		if (ivn)
+		{
+			chunk.NIndices.resize(uBase);
+			chunk.NIndices.insert(chunk.NIndices.end(), vn, vn + 3);
+		}
+
+		for (auto j = 0u; j < 3; ++j)
+		{
+			if (j == 1 && !ivt) continue;
+			if (j == 2 && !ivn) continue;
+			for (auto c = 0u; c < 3; ++c)
+				if (rel[j][c]) chunk.RelIndices[j].push_back(uBase + c);
+		}
+
+		v[1] = v[2];
+		vt[1] = vt[2];
+		vn[1] = vn[2];
+		for (auto &r : rel) r[1] = r[2];
+	}
+
+	return pCur;
+}
+
+void ObjLoader::mergeChunks(vector<Chunk> &chunks)
+{
+	const auto numChunks = static_cast<uint32_t>(chunks.size());
+
+	// A single chunk needs no relocation.
+	if (numChunks == 1)
+	{
+		auto &chunk = chunks[0];
+		m_vVertices.swap(chunk.Vertices);
+		m_vIndices.swap(chunk.Indices);
+		m_vTIndices.swap(chunk.TIndices);
+		m_vNIndices.swap(chunk.NIndices);
+	}
+	else
+	{
+		// Exclusive prefix sums of the per-chunk element counts
+		struct ChunkBase
+		{
+			size_t Vertex;
+			size_t Index;
+			uint32_t Texcoord;
+			uint32_t Normal;
+		};
+
+		vector<ChunkBase> bases(numChunks + 1);
+		bases[0] = {};
+		auto bHasTexcoord = false, bHasNormal = false;
+		for (auto i = 0u; i < numChunks; ++i)
+		{
+			bases[i + 1].Vertex = bases[i].Vertex + chunks[i].Vertices.size();
+			bases[i + 1].Index = bases[i].Index + chunks[i].Indices.size();
+			bases[i + 1].Texcoord = bases[i].Texcoord + chunks[i].NumTexcoords;
+			bases[i + 1].Normal = bases[i].Normal + chunks[i].NumNormals;
+			bHasTexcoord = bHasTexcoord || !chunks[i].TIndices.empty();
+			bHasNormal = bHasNormal || !chunks[i].NIndices.empty();
+		}
+
+		VEC_ALLOC(m_vVertices, bases[numChunks].Vertex);
+		VEC_ALLOC(m_vIndices, bases[numChunks].Index);
+		VEC_ALLOC(m_vTIndices, bHasTexcoord ? bases[numChunks].Index : 0);
+		VEC_ALLOC(m_vNIndices, bHasNormal ? bases[numChunks].Index : 0);
+
+		const auto merge = [&](uint32_t i)
+		{
+			auto &chunk = chunks[i];
+			const auto &base = bases[i];
+			copy(chunk.Vertices.cbegin(), chunk.Vertices.cend(), m_vVertices.begin() + base.Vertex);
+			copy(chunk.Indices.cbegin(), chunk.Indices.cend(), m_vIndices.begin() + base.Index);
+			copy(chunk.TIndices.cbegin(), chunk.TIndices.cend(), m_vTIndices.begin() + (!chunk.TIndices.empty() ? base.Index : 0));
+			copy(chunk.NIndices.cbegin(), chunk.NIndices.cend(), m_vNIndices.begin() + (!chunk.NIndices.empty() ? base.Index : 0));
+
+			// Offset the relative indices by the elements of the preceding chunks.
+			const uint32_t offsets[] = { static_cast<uint32_t>(base.Vertex), base.Texcoord, base.Normal };
+			vuint *const pIndices[] = { &m_vIndices, &m_vTIndices, &m_vNIndices };
+			for (auto j = 0u; j < 3; ++j)
+				for (const auto &k : chunk.RelIndices[j])
+					(*pIndices[j])[base.Index + k] += offsets[j];
+
+			chunk = Chunk();
+		};
+
+		vector<thread> workers;
+		workers.reserve(numChunks);
+		for (auto i = 0u; i < numChunks; ++i) workers.emplace_back(merge, i);
+		for (auto &worker : workers) worker.join();
+	}
+
+	// Keep the optional attribute indices aligned with the position indices.
+	if (!m_vTIndices.empty()) m_vTIndices.resize(m_vIndices.size());
+	if (!m_vNIndices.empty()) m_vNIndices.resize(m_vIndices.size());
+}
+
+void ObjLoader::weldVertices(float epsilon)
+{
+	static const auto invalid = UINT32_MAX;
+
+	const auto uNumVert = static_cast<uint32_t>(m_vVertices.size());
+	const auto uNumTri = static_cast<uint32_t>(m_vIndices.size()) / 3;
+	if (uNumVert == 0) return;
+
+	// Spatial hash grid with cells of the epsilon size, so that any vertex within
+	// epsilon lies in one of the 27 cells around a vertex. Different cells may
+	// share a bucket, since the candidates are verified by distance anyway.
+	auto uNumBuckets = 1u;
+	while (uNumBuckets < uNumVert * 2) uNumBuckets <<= 1;
+	vuint heads(uNumBuckets, invalid);
+	vuint next(uNumVert);
+
+	const auto cellSize = static_cast<double>(epsilon);
+	const auto cellRange = epsilon > 0.0f ? 1 : 0;
+	const auto epsilonSq = epsilon * epsilon;
+	const auto cellOf = [cellSize](float f)
+	{
+		// Exact welding keys on the value itself; -0 and +0 share a cell.
+		if (cellSize <= 0.0)
+		{
+			uint32_t bits;
+			f += 0.0f;
+			memcpy(&bits, &f, sizeof(bits));
+
+			return static_cast<int64_t>(bits);
+		}
+
+		return static_cast<int64_t>((max)((min)(floor(f / cellSize), 1e18), -1e18));
+	};
+	const auto bucketOf = [uNumBuckets](int64_t x, int64_t y, int64_t z)
+	{
+		auto h = static_cast<uint64_t>(x) * 0x9e3779b185ebca87ull;
+		h ^= static_cast<uint64_t>(y) * 0xc2b2ae3d27d4eb4full;
+		h ^= static_cast<uint64_t>(z) * 0x165667b19e3779f9ull;
+
+		return static_cast<uint32_t>(h ^ (h >> 32)) & (uNumBuckets - 1);
+	};
+
+	// Each vertex maps to the first kept vertex within epsilon, or is kept itself.
+	vVertex vertices;
+	vuint remap(uNumVert);
+	vertices.reserve(uNumVert);
+	for (auto i = 0u; i < uNumVert; ++i)
+	{
+		const auto &p = m_vVertices[i].m_vPosition;
+		const int64_t cell[] = { cellOf(p.x), cellOf(p.y), cellOf(p.z) };
+
+		auto k = invalid;
+		for (auto z = -cellRange; z <= cellRange && k == invalid; ++z)
+			for (auto y = -cellRange; y <= cellRange && k == invalid; ++y)
+				for (auto x = -cellRange; x <= cellRange && k == invalid; ++x)
+				{
+					k = heads[bucketOf(cell[0] + x, cell[1] + y, cell[2] + z)];
+					for (; k != invalid; k = next[k])
+					{
+						const auto &q = vertices[k].m_vPosition;
+						const auto dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+						if (dx * dx + dy * dy + dz * dz <= epsilonSq) break;
+					}
+				}
+
+		if (k == invalid)
+		{
+			k = static_cast<uint32_t>(vertices.size());
+			const auto bucket = bucketOf(cell[0], cell[1], cell[2]);
+			next[k] = heads[bucket];
+			heads[bucket] = k;
+			vertices.push_back(m_vVertices[i]);
+		}
+		remap[i] = k;
+	}
+
+	// Remap the triangles, and drop those collapsed by welding.
+	const auto bTexcoord = m_vTIndices.size() == m_vIndices.size();
+	const auto bNormal = m_vNIndices.size() == m_vIndices.size();
+	auto uNumIdx = 0u;
+	for (auto i = 0u; i < uNumTri; ++i)
+	{
+		const uint32_t tri[] = { remap[m_vIndices[i * 3]], remap[m_vIndices[i * 3 + 1]], remap[m_vIndices[i * 3 + 2]] };
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) continue;
+
+		for (auto j = 0u; j < 3; ++j)
+		{
+			m_vIndices[uNumIdx + j] = tri[j];
+			if (bTexcoord) m_vTIndices[uNumIdx + j] = m_vTIndices[i * 3 + j];
+			if (bNormal) m_vNIndices[uNumIdx + j] = m_vNIndices[i * 3 + j];
+		}
+		uNumIdx += 3;
+	}
+
+	m_importStats.NumWeldedVertices = uNumVert - static_cast<uint32_t>(vertices.size());
+	m_importStats.NumDroppedTriangles = uNumTri - uNumIdx / 3;
+
+	m_vVertices.swap(vertices);
+	m_vVertices.shrink_to_fit();
+	VEC_ALLOC(m_vIndices, uNumIdx);
+	if (bTexcoord) VEC_ALLOC(m_vTIndices, uNumIdx);
+	if (bNormal) VEC_ALLOC(m_vNIndices, uNumIdx);
+}
+
 void ObjLoader::computeNormal()
 {
 	float3 e1, e2, n;
@@ -317,6 +1676,195 @@ void ObjLoader::computeNormal()
 	}
 }
 
+void ObjLoader::computeNormalParallel(uint32_t numThreads)
+{
+	// Ranges smaller than this are not worth a thread.
+	static const uint32_t minRangeSize = 1 << 12;
+
+	const auto uNumTri = static_cast<uint32_t>(m_vIndices.size()) / 3;
+	const auto uNumVert = static_cast<uint32_t>(m_vVertices.size());
+	const auto pIndices = m_vIndices.data();
+	if (uNumVert == 0) return;
+
+	// Thread t computes the face normals of triangle range t, and gathers the
+	// vertex normals of vertex range t.
+	numThreads = (min)((max)(numThreads, 1u), uNumTri / minRangeSize + 1);
+	const auto triBegin = [uNumTri, numThreads](uint32_t t)
+	{ return static_cast<uint32_t>(static_cast<uint64_t>(uNumTri) * t / numThreads); };
+
+	// The owning vertex range is found with a 32.32 fixed-point reciprocal rather
+	// than a division per corner; range t begins at the first vertex it owns.
+	const auto scale = (static_cast<uint64_t>(numThreads) << 32) / uNumVert;
+	const auto owner = [scale](uint32_t v) { return static_cast<uint32_t>((v * scale) >> 32); };
+	const auto vertBegin = [uNumVert, scale](uint32_t t)
+	{ return static_cast<uint32_t>((min)(((static_cast<uint64_t>(t) << 32) + scale - 1) / scale, static_cast<uint64_t>(uNumVert))); };
+	const auto position = [this, pIndices](uint32_t i)
+	{ return XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&m_vVertices[pIndices[i]].m_vPosition)); };
+
+	// Unit face normals; degenerate triangles get a zero normal, so that they
+	// do not contribute to their vertices. Corners are counted per owning range.
+	vector<XMFLOAT4A> faceNormals(uNumTri);
+	vuint histograms(numThreads * numThreads);
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		const auto zero = XMVectorZero();
+		const auto end = triBegin(t + 1);
+		auto i = triBegin(t);
+
+		// Four triangles at a time, transposed into x, y and z lanes
+		for (; i + 4 <= end; i += 4)
+		{
+			XMVECTOR p[3][3];
+			for (auto j = 0u; j < 3; ++j)
+			{
+				const auto m = XMMatrixTranspose(XMMATRIX(position(i * 3 + j), position(i * 3 + 3 + j),
+					position(i * 3 + 6 + j), position(i * 3 + 9 + j)));
+				for (auto k = 0u; k < 3; ++k) p[j][k] = m.r[k];
+			}
+
+			XMVECTOR e1[3], e2[3];
+			for (auto k = 0u; k < 3; ++k)
+			{
+				e1[k] = XMVectorSubtract(p[1][k], p[0][k]);
+				e2[k] = XMVectorSubtract(p[2][k], p[1][k]);
+			}
+
+			XMVECTOR n[3];
+			n[0] = XMVectorSubtract(XMVectorMultiply(e1[1], e2[2]), XMVectorMultiply(e1[2], e2[1]));
+			n[1] = XMVectorSubtract(XMVectorMultiply(e1[2], e2[0]), XMVectorMultiply(e1[0], e2[2]));
+			n[2] = XMVectorSubtract(XMVectorMultiply(e1[0], e2[1]), XMVectorMultiply(e1[1], e2[0]));
+			auto l = XMVectorMultiply(n[0], n[0]);
+			l = XMVectorAdd(l, XMVectorMultiply(n[1], n[1]));
+			l = XMVectorAdd(l, XMVectorMultiply(n[2], n[2]));
+			l = XMVectorSqrt(l);
+
+			// Zero-area and non-finite triangles fail the comparison.
+			const auto valid = XMVectorGreater(l, zero);
+			for (auto &c : n) c = XMVectorSelect(zero, XMVectorDivide(c, l), valid);
+
+			const auto m = XMMatrixTranspose(XMMATRIX(n[0], n[1], n[2], zero));
+			for (auto j = 0u; j < 4; ++j) XMStoreFloat4A(&faceNormals[i + j], m.r[j]);
+		}
+
+		for (; i < end; ++i)
+		{
+			const auto v0 = position(i * 3), v1 = position(i * 3 + 1), v2 = position(i * 3 + 2);
+			const auto n = XMVector3Cross(XMVectorSubtract(v1, v0), XMVectorSubtract(v2, v1));
+			const auto l = XMVector3Length(n);
+			XMStoreFloat4A(&faceNormals[i], XMVector3Greater(l, zero) ? XMVectorDivide(n, l) : zero);
+		}
+
+		const auto pHistogram = &histograms[numThreads * t];
+		if (numThreads > 1) for (auto j = triBegin(t) * 3; j < end * 3; ++j) ++pHistogram[owner(pIndices[j])];
+	});
+
+	const auto zero = XMVectorZero();
+	const auto fallback = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+	const auto storeNormal = [&](uint32_t i, XMVECTOR n)
+	{
+		// Vertices touched only by degenerate triangles fall back to +Y.
+		const auto l = XMVector3Length(n);
+		n = XMVector3Greater(l, zero) ? XMVectorDivide(n, l) : fallback;
+		XMStoreFloat3(reinterpret_cast<XMFLOAT3*>(&m_vVertices[i].m_vNormal), n);
+	};
+
+	// A single thread simply accumulates in triangle order, which yields the same
+	// sums as the gather below without building the adjacency.
+	if (numThreads <= 1)
+	{
+		vector<XMFLOAT4A> sums(uNumVert);
+		for (auto j = 0u; j < uNumTri * 3; ++j)
+		{
+			const auto n = XMVectorAdd(XMLoadFloat4A(&sums[pIndices[j]]), XMLoadFloat4A(&faceNormals[j / 3]));
+			XMStoreFloat4A(&sums[pIndices[j]], n);
+		}
+		for (auto i = 0u; i < uNumVert; ++i) storeNormal(i, XMLoadFloat4A(&sums[i]));
+
+		return;
+	}
+
+	// Partition the corners into one bucket per vertex range. Each bucket keeps
+	// its corners in triangle order, so that the summation order, and hence the
+	// result, does not depend on the thread count.
+	vuint bucketOffsets(numThreads + 1);
+	for (auto r = 0u; r < numThreads; ++r)
+	{
+		auto offset = bucketOffsets[r];
+		for (auto t = 0u; t < numThreads; ++t)
+		{
+			const auto count = histograms[numThreads * t + r];
+			histograms[numThreads * t + r] = offset;
+			offset += count;
+		}
+		bucketOffsets[r + 1] = offset;
+	}
+
+	vuint corners(uNumTri * 3);
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		const auto pCursors = &histograms[numThreads * t];
+		for (auto j = triBegin(t) * 3; j < triBegin(t + 1) * 3; ++j)
+			corners[pCursors[owner(pIndices[j])]++] = j;
+	});
+
+	// Build the vertex-to-triangle adjacency (CSR) of each vertex range from its
+	// bucket, and gather; no two threads touch the same vertex.
+	vuint adjacency(uNumTri * 3);
+	runOnThreads(numThreads, [&](uint32_t r)
+	{
+		const auto begin = vertBegin(r);
+		const auto end = vertBegin(r + 1);
+		const auto first = bucketOffsets[r];
+		const auto last = bucketOffsets[r + 1];
+
+		vuint offsets(end - begin + 1);
+		for (auto k = first; k < last; ++k) ++offsets[pIndices[corners[k]] - begin + 1];
+		offsets[0] = first;
+		for (auto i = begin; i < end; ++i) offsets[i - begin + 1] += offsets[i - begin];
+		for (auto k = first; k < last; ++k) adjacency[offsets[pIndices[corners[k]] - begin]++] = corners[k] / 3;
+
+		// The fill has shifted the offsets by one vertex.
+		for (auto i = begin; i < end; ++i)
+		{
+			const auto pEnd = &adjacency[0] + offsets[i - begin];
+			auto n = zero;
+			for (auto p = &adjacency[0] + (i > begin ? offsets[i - begin - 1] : first); p < pEnd; ++p)
+				n = XMVectorAdd(n, XMLoadFloat4A(&faceNormals[*p]));
+			storeNormal(i, n);
+		}
+	});
+}
+
+void ObjLoader::optimizeMesh()
+{
+	static const uint32_t cacheSize = 16;
+
+	const auto analyze = [this](MeshOptimizer::CacheStats *pStats)
+	{
+		for (auto i = 0u; i < MeshOptimizer::NUM_CACHE_POLICY; ++i)
+			pStats[i] = MeshOptimizer::AnalyzeVertexCache(m_vIndices.data(), static_cast<uint32_t>(m_vIndices.size()),
+				static_cast<uint32_t>(m_vVertices.size()), cacheSize, static_cast<MeshOptimizer::CachePolicy>(i));
+	};
+
+	if (m_vVertices.empty()) return;
+	analyze(m_importStats.VertexCache[0]);
+
+	const auto uNumIdx = static_cast<uint32_t>(m_vIndices.size());
+	const auto uNumVert = static_cast<uint32_t>(m_vVertices.size());
+	MeshOptimizer::OptimizeVertexCache(m_vIndices.data(), uNumIdx, uNumVert, cacheSize);
+	MeshOptimizer::OptimizeOverdraw(m_vIndices.data(), uNumIdx, &m_vVertices[0].m_vPosition.x, uNumVert,
+		sizeof(Vertex), cacheSize);
+	const auto uNumUsed = MeshOptimizer::OptimizeVertexFetch(reinterpret_cast<uint8_t*>(m_vVertices.data()),
+		m_vIndices.data(), uNumIdx, uNumVert, sizeof(Vertex));
+	VEC_ALLOC(m_vVertices, uNumUsed);
+
+	// The texcoord and normal index streams no longer match the reordered triangles.
+	vuint().swap(m_vTIndices);
+	vuint().swap(m_vNIndices);
+
+	analyze(m_importStats.VertexCache[1]);
+}
+
 void ObjLoader::computeBound()
 {
 	float xMax, xMin, yMax, yMin, zMax, zMin;
@@ -352,3 +1900,342 @@ void ObjLoader::computeBound()
 
 	m_fRadius = max(max(fWidth, fHeight), fLength) * 0.5f;
 }
+
+void ObjLoader::splitStreams()
+{
+	// One block keeps both streams in a single upload and a single cache array.
+	const auto numVertices = m_vVertices.size();
+	m_vStreams.resize(numVertices * 2);
+	for (size_t i = 0; i < numVertices; ++i)
+	{
+		m_vStreams[i] = m_vVertices[i].m_vPosition;
+		m_vStreams[numVertices + i] = m_vVertices[i].m_vNormal;
+	}
+	vVertex().swap(m_vVertices);
+}
+
+void ObjLoader::quantizeVertices(uint32_t numThreads)
+{
+	// Ranges smaller than this are not worth a thread.
+	static const uint32_t minRangeSize = 1 << 12;
+
+	const auto numVertices = static_cast<uint32_t>(m_vVertices.size());
+	m_vQVertices.resize(numVertices);
+
+	numThreads = (min)((max)(numThreads, 1u), numVertices / minRangeSize + 1);
+	runOnThreads(numThreads, [&](uint32_t t)
+	{
+		const auto begin = static_cast<uint32_t>(static_cast<uint64_t>(numVertices) * t / numThreads);
+		const auto end = static_cast<uint32_t>(static_cast<uint64_t>(numVertices) * (t + 1) / numThreads);
+		encodeVertices(m_vVertices.data() + begin, m_vQVertices.data() + begin, end - begin, m_vCenter, m_fRadius);
+	});
+	vVertex().swap(m_vVertices);
+}
+
+void ObjLoader::bindArrays()
+{
+	switch (m_vertexLayout)
+	{
+	case LAYOUT_SPLIT:
+		m_pVertexData = reinterpret_cast<const uint8_t*>(m_vStreams.data());
+		m_numVertices = static_cast<uint32_t>(m_vStreams.size() / 2);
+		break;
+	case LAYOUT_QUANTIZED:
+		m_pVertexData = reinterpret_cast<const uint8_t*>(m_vQVertices.data());
+		m_numVertices = static_cast<uint32_t>(m_vQVertices.size());
+		break;
+	default:
+		m_pVertexData = reinterpret_cast<const uint8_t*>(m_vVertices.data());
+		m_numVertices = static_cast<uint32_t>(m_vVertices.size());
+	}
+	m_pIndices = m_vIndices.data();
+	m_numIndices = static_cast<uint32_t>(m_vIndices.size());
+}
+
+void ObjLoader::copyVertices(vVertex &vertices) const
+{
+	switch (m_vertexLayout)
+	{
+	case LAYOUT_SPLIT:
+	{
+		const auto pPositions = GetPositions();
+		const auto pNormals = GetNormals();
+		vertices.resize(m_numVertices);
+		for (auto i = 0u; i < m_numVertices; ++i) vertices[i] = { pPositions[i], pNormals[i] };
+		break;
+	}
+	case LAYOUT_QUANTIZED:
+	{
+		const auto pQVertices = reinterpret_cast<const QuantizedVertex*>(m_pVertexData);
+		vertices.resize(m_numVertices);
+		for (auto i = 0u; i < m_numVertices; ++i)
+			vertices[i] = { DecodePosition(pQVertices[i], m_vCenter, m_fRadius), DecodeNormal(pQVertices[i]) };
+		break;
+	}
+	default:
+	{
+		const auto pVertices = reinterpret_cast<const Vertex*>(m_pVertexData);
+		vertices.assign(pVertices, pVertices + m_numVertices);
+	}
+	}
+}
+
+uint64_t ObjLoader::getVertexDataSize(uint32_t numVertices) const
+{
+	return static_cast<uint64_t>(GetVertexStride()) * numVertices * (m_vertexLayout == LAYOUT_SPLIT ? 2 : 1);
+}
+
+bool ObjLoader::loadCache(const char *pszFilename, const CacheKey &key)
+{
+	if (!m_cacheFile.Open(pszFilename)) return false;
+
+	// Validate the header against the source file and the requested post import tasks.
+	const auto pData = m_cacheFile.GetData();
+	const auto cacheSize = m_cacheFile.GetSize();
+	const auto pHeader = reinterpret_cast<const CacheHeader*>(pData);
+	auto bValid = cacheSize >= sizeof(CacheHeader);
+	bValid = bValid && pHeader->Magic == cacheMagic && pHeader->Version == cacheVersion;
+	bValid = bValid && pHeader->Key.SourceSize == key.SourceSize && pHeader->Key.SourceHash == key.SourceHash;
+	bValid = bValid && pHeader->Key.Options == key.Options && pHeader->Key.WeldEpsilon == key.WeldEpsilon;
+	bValid = bValid && pHeader->VertexStride == GetVertexStride();
+	bValid = bValid && pHeader->VertexOffset % alignof(Vertex) == 0 && pHeader->IndexOffset % sizeof(uint32_t) == 0;
+	bValid = bValid && pHeader->VertexOffset + getVertexDataSize(pHeader->NumVertices) <= cacheSize;
+	bValid = bValid && pHeader->IndexOffset + sizeof(uint32_t) * pHeader->NumIndices <= cacheSize;
+	if (!bValid)
+	{
+		m_cacheFile.Close();
+		return false;
+	}
+
+	// Expose the arrays straight from the mapping; nothing is copied.
+	m_pVertexData = reinterpret_cast<const uint8_t*>(pData + pHeader->VertexOffset);
+	m_pIndices = reinterpret_cast<const uint32_t*>(pData + pHeader->IndexOffset);
+	m_numVertices = pHeader->NumVertices;
+	m_numIndices = pHeader->NumIndices;
+	m_vCenter = pHeader->Center;
+	m_fRadius = pHeader->Radius;
+
+	// Release any arrays left by a previous import.
+	vVertex().swap(m_vVertices);
+	vfloat3().swap(m_vStreams);
+	vQVertex().swap(m_vQVertices);
+	vuint().swap(m_vIndices);
+	vuint().swap(m_vTIndices);
+	vuint().swap(m_vNIndices);
+
+	return true;
+}
+
+bool ObjLoader::saveCache(const char *pszFilename, const CacheKey &key) const
+{
+	static const uint64_t alignment = 16;
+
+	CacheHeader header = {};
+	header.Magic = cacheMagic;
+	header.Version = cacheVersion;
+	header.Key = key;
+	header.VertexStride = GetVertexStride();
+	header.NumVertices = m_numVertices;
+	header.NumIndices = m_numIndices;
+	header.VertexOffset = (sizeof(CacheHeader) + alignment - 1) / alignment * alignment;
+	header.IndexOffset = header.VertexOffset + getVertexDataSize(m_numVertices);
+	header.Center = m_vCenter;
+	header.Radius = m_fRadius;
+
+	// Write to a temporary file first, so that an interrupted write never leaves a
+	// truncated cache behind under the final name.
+	const auto tempName = string(pszFilename) + ".tmp";
+	FILE *pFile;
+	fopen_s(&pFile, tempName.c_str(), "wb");
+	if (!pFile) return false;
+
+	const uint8_t padding[alignment] = {};
+	auto bWritten = fwrite(&header, sizeof(CacheHeader), 1, pFile) == 1;
+	bWritten = bWritten && fwrite(padding, 1, header.VertexOffset - sizeof(CacheHeader), pFile) == header.VertexOffset - sizeof(CacheHeader);
+	const auto vertexDataSize = static_cast<size_t>(getVertexDataSize(m_numVertices));
+	bWritten = bWritten && fwrite(m_pVertexData, 1, vertexDataSize, pFile) == vertexDataSize;
+	bWritten = bWritten && fwrite(m_pIndices, sizeof(uint32_t), m_numIndices, pFile) == m_numIndices;
+	bWritten = fclose(pFile) == 0 && bWritten;
+
+	if (!bWritten || !MoveFileExA(tempName.c_str(), pszFilename, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileA(tempName.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool ObjLoader::openChunks(const char *pszFilename, const CacheKey &key)
+{
+	if (!m_chunkFile.Open(pszFilename)) return false;
+
+	// Validate the header against the source file, and the chunk table against the file size.
+	const char *const pData = m_chunkFile.GetData();
+	const auto fileSize = m_chunkFile.GetSize();
+	const auto pHeader = reinterpret_cast<const ChunkHeader*>(pData);
+	auto bValid = fileSize >= sizeof(ChunkHeader);
+	bValid = bValid && pHeader->Magic == chunkMagic && pHeader->Version == chunkVersion;
+	bValid = bValid && pHeader->Key.SourceSize == key.SourceSize && pHeader->Key.SourceHash == key.SourceHash;
+	bValid = bValid && pHeader->Key.Options == key.Options;
+	bValid = bValid && pHeader->TableOffset % alignof(ChunkInfo) == 0;
+	bValid = bValid && pHeader->TableOffset + sizeof(ChunkInfo) * pHeader->NumChunks <= fileSize;
+	const auto pChunks = bValid ? reinterpret_cast<const ChunkInfo*>(pData + pHeader->TableOffset) : nullptr;
+	for (auto i = 0u; bValid && i < pHeader->NumChunks; ++i)
+	{
+		const auto &chunk = pChunks[i];
+		bValid = chunk.VertexOffset % alignof(Vertex) == 0 && chunk.IndexOffset % sizeof(uint32_t) == 0;
+		bValid = bValid && chunk.VertexOffset + sizeof(Vertex) * chunk.NumVertices <= fileSize;
+		bValid = bValid && chunk.IndexOffset + sizeof(uint32_t) * chunk.NumIndices <= fileSize;
+	}
+	if (!bValid)
+	{
+		m_chunkFile.Close();
+		return false;
+	}
+
+	m_pChunks = pChunks;
+	m_numChunks = pHeader->NumChunks;
+	m_vCenter = pHeader->Center;
+	m_fRadius = pHeader->Radius;
+	m_importStats.NumChunks = m_numChunks;
+
+	return true;
+}
+
+bool ObjLoader::gatherChunks(const uint32_t *pChunkIndices, uint32_t numChunks)
+{
+	if (!m_pChunks) return false;
+
+	auto numVertices = 0ull, numIndices = 0ull;
+	for (auto i = 0u; i < numChunks; ++i)
+	{
+		if (pChunkIndices[i] >= m_numChunks) return false;
+		numVertices += m_pChunks[pChunkIndices[i]].NumVertices;
+		numIndices += m_pChunks[pChunkIndices[i]].NumIndices;
+	}
+	if (numVertices > UINT32_MAX || numIndices > UINT32_MAX) return false;
+
+	VEC_ALLOC(m_vVertices, numVertices);
+	VEC_ALLOC(m_vIndices, numIndices);
+	vuint().swap(m_vTIndices);
+	vuint().swap(m_vNIndices);
+
+	// Offset the local indices by the vertices of the preceding chunks.
+	const char *const pData = m_chunkFile.GetData();
+	auto vertexBase = 0u, indexBase = 0u;
+	for (auto i = 0u; i < numChunks; ++i)
+	{
+		const auto &chunk = m_pChunks[pChunkIndices[i]];
+		const auto pVertices = reinterpret_cast<const Vertex*>(pData + chunk.VertexOffset);
+		const auto pIndices = reinterpret_cast<const uint32_t*>(pData + chunk.IndexOffset);
+		copy(pVertices, pVertices + chunk.NumVertices, m_vVertices.begin() + vertexBase);
+		for (auto j = 0u; j < chunk.NumIndices; ++j) m_vIndices[indexBase + j] = pIndices[j] + vertexBase;
+		vertexBase += chunk.NumVertices;
+		indexBase += chunk.NumIndices;
+	}
+
+	return true;
+}
+
+uint64_t ObjLoader::hashFile(const MappedFile &file, uint32_t numThreads)
+{
+	// Fixed-size segments keep the hash independent of the thread count.
+	static const uint64_t segmentSize = 1 << 22;
+
+	const auto pData = reinterpret_cast<const uint8_t*>(file.GetData());
+	const auto size = file.GetSize();
+	const auto numSegments = static_cast<uint32_t>((size + segmentSize - 1) / segmentSize);
+
+	vector<uint64_t> segmentHashes(numSegments);
+	const auto hashSegments = [&](uint32_t first, uint32_t stride)
+	{
+		for (auto i = first; i < numSegments; i += stride)
+		{
+			const auto offset = segmentSize * i;
+			segmentHashes[i] = hashBytes(pData + offset, (min)(segmentSize, size - offset), i);
+		}
+	};
+
+	numThreads = (min)(numThreads, numSegments);
+	if (numThreads > 1)
+	{
+		vector<thread> workers;
+		workers.reserve(numThreads);
+		for (auto i = 0u; i < numThreads; ++i) workers.emplace_back(hashSegments, i, numThreads);
+		for (auto &worker : workers) worker.join();
+	}
+	else hashSegments(0, 1);
+
+	return hashBytes(reinterpret_cast<const uint8_t*>(segmentHashes.data()),
+		sizeof(uint64_t) * segmentHashes.size(), size);
+}
+
+string ObjLoader::getCacheName(const char *pszFilename, const char *pszExtension)
+{
+	// Replace the extension of the source file, e.g. "Media/bunny.obj" -> "Media/bunny.svmesh".
+	string name = pszFilename;
+	const auto dot = name.find_last_of('.');
+	const auto slash = name.find_last_of("/\\");
+	if (dot != string::npos && (slash == string::npos || dot > slash)) name.resize(dot);
+
+	return name + pszExtension;
+}
+
+void ObjLoader::encodeVertices(const Vertex *pVertices, QuantizedVertex *pQVertices, uint32_t numVertices,
+	const float3 &center, float radius)
+{
+	const auto zero = XMVectorZero();
+	const auto one = XMVectorSplatOne();
+	const auto negOne = XMVectorReplicate(-1.0f);
+	const auto scale = XMVectorReplicate(snormScale);
+	const auto invRadius = XMVectorReplicate(radius > 0.0f ? 1.0f / radius : 0.0f);
+	const XMVECTOR centers[] = { XMVectorReplicate(center.x), XMVectorReplicate(center.y), XMVectorReplicate(center.z) };
+	const auto toSnorm = [&](FXMVECTOR v)
+	{ return XMConvertVectorFloatToInt(XMVectorRound(XMVectorMultiply(XMVectorClamp(v, negOne, one), scale)), 0); };
+
+	// Four vertices at a time, transposed into x, y and z lanes; the tail
+	// repeats the last vertex.
+	for (auto i = 0u; i < numVertices; i += 4)
+	{
+		XMVECTOR p[4], n[4];
+		for (auto j = 0u; j < 4; ++j)
+		{
+			const auto &vertex = pVertices[(min)(i + j, numVertices - 1)];
+			p[j] = XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&vertex.m_vPosition));
+			n[j] = XMLoadFloat3(reinterpret_cast<const XMFLOAT3*>(&vertex.m_vNormal));
+		}
+		const auto pm = XMMatrixTranspose(XMMATRIX(p[0], p[1], p[2], p[3]));
+		const auto nm = XMMatrixTranspose(XMMATRIX(n[0], n[1], n[2], n[3]));
+
+		// Positions relative to the bounds
+		XMVECTOR q[5];
+		for (auto k = 0u; k < 3; ++k) q[k] = toSnorm(XMVectorMultiply(XMVectorSubtract(pm.r[k], centers[k]), invRadius));
+
+		// Octahedral normals [Cigolle et al. 2014]; zero normals encode +Z.
+		auto l1 = XMVectorAdd(XMVectorAdd(XMVectorAbs(nm.r[0]), XMVectorAbs(nm.r[1])), XMVectorAbs(nm.r[2]));
+		l1 = XMVectorSelect(one, l1, XMVectorGreater(l1, zero));
+		const auto u = XMVectorDivide(nm.r[0], l1);
+		const auto v = XMVectorDivide(nm.r[1], l1);
+
+		// The lower hemisphere folds over the diagonals.
+		const auto lower = XMVectorLess(nm.r[2], zero);
+		const auto signU = XMVectorSelect(one, negOne, XMVectorLess(u, zero));
+		const auto signV = XMVectorSelect(one, negOne, XMVectorLess(v, zero));
+		q[3] = toSnorm(XMVectorSelect(u, XMVectorMultiply(XMVectorSubtract(one, XMVectorAbs(v)), signU), lower));
+		q[4] = toSnorm(XMVectorSelect(v, XMVectorMultiply(XMVectorSubtract(one, XMVectorAbs(u)), signV), lower));
+
+		int32_t lanes[5][4];
+		for (auto k = 0u; k < 5; ++k) XMStoreInt4(reinterpret_cast<uint32_t*>(lanes[k]), q[k]);
+
+		const auto count = (min)(numVertices - i, 4u);
+		for (auto j = 0u; j < count; ++j)
+		{
+			auto &qVertex = pQVertices[i + j];
+			for (auto k = 0u; k < 3; ++k) qVertex.m_position[k] = static_cast<int16_t>(lanes[k][j]);
+			qVertex.m_position[3] = static_cast<int16_t>(snormScale);
+			qVertex.m_normal[0] = static_cast<int16_t>(lanes[3][j]);
+			qVertex.m_normal[1] = static_cast<int16_t>(lanes[4][j]);
+		}
+	}
+}
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include "MeshOptimizer.h"
+
 class ObjLoader
 {
 public:
@@ -26,35 +28,296 @@ public:
 		float3	m_vNormal;
 	};
 
+	// Positions are SNORM relative to the bounds: p = GetCenter() + q * GetRadius(),
+	// with w = 1. Normals are octahedral-encoded SNORM pairs.
+	struct QuantizedVertex
+	{
+		int16_t	m_position[4];
+		int16_t	m_normal[2];
+	};
+
+	enum ImportMode : uint8_t
+	{
+		IMPORT_MAPPED,			// Single pass over a memory-mapped file
+		IMPORT_MAPPED_PARALLEL,	// Memory-mapped file parsed in chunks on worker threads
+		IMPORT_FSCANF,			// Legacy two-pass fscanf_s reader
+		IMPORT_STREAMED			// Bounded windows of the file into a chunk file; see LoadChunks
+	};
+
+	enum VertexLayout : uint8_t
+	{
+		LAYOUT_INTERLEAVED,	// Array of Vertex structures
+		LAYOUT_SPLIT,		// Position stream followed by the normal stream, in one block
+		LAYOUT_QUANTIZED	// Array of QuantizedVertex structures
+	};
+
+	struct ImportStats
+	{
+		uint64_t	FileSize;
+		uint32_t	NumThreads;
+		bool		FromCache;
+		uint32_t	NumWeldedVertices;
+		uint32_t	NumDroppedTriangles;
+		uint32_t	NumWindows;		// Streamed import only; zero when the chunk file was reused
+		uint32_t	NumChunks;
+		MeshOptimizer::CacheStats VertexCache[2][MeshOptimizer::NUM_CACHE_POLICY];	// Before and after optimization
+		double		ParseTime;
+		double		PostTime;
+		double		CacheTime;
+	};
+
+	struct NormalBenchmark
+	{
+		uint32_t	NumThreads;
+		double		ScatterTime;	// Serial scatter-add, per run
+		double		GatherTime;		// Parallel adjacency gather, per run
+		float		MaxDeviation;	// Largest component difference over finite scatter results
+		uint32_t	NumNaNScatter;	// Vertices left with a NaN normal by the scatter-add
+	};
+
+	struct ImportBenchmark
+	{
+		uint64_t	FileSize;			// Of the synthetic OBJ file
+		uint32_t	NumTriangles;
+		uint32_t	NumThreads;			// Of the parallel mapped import
+		double		ParseTimes[3];		// Best per run, by IMPORT_MAPPED, IMPORT_MAPPED_PARALLEL and IMPORT_FSCANF
+		float		MaxDeviation;		// Largest position difference from the sequential mapped import
+		bool		bIndicesMatch;		// All the imports read the same indices
+	};
+
+	struct QuantizationError
+	{
+		uint32_t	NumVertices;		// Zero for a mesh imported in the quantized layout
+		float		MaxPositionError;	// Largest component difference
+		float		PositionBound;
+		float		MaxNormalError;		// Largest angle in radians
+		float		NormalBound;
+		uint32_t	NumViolations;		// Vertices exceeding either bound
+	};
+
+	// Spatially coherent piece of a streamed import, stored as an array of Vertex
+	// structures followed by indices local to the chunk
+	struct ChunkInfo
+	{
+		uint64_t	VertexOffset;
+		uint64_t	IndexOffset;
+		uint32_t	NumVertices;
+		uint32_t	NumIndices;
+		float3		Min;
+		float3		Max;
+	};
+
+	// Parsed text per window of a streamed import, and the largest number of
+	// triangles per chunk
+	static const uint64_t StreamWindowSize = 1 << 26;
+	static const uint32_t MaxChunkTriangles = 1 << 16;
+
 	using vVertex	= std::vector<Vertex>;
+	using vQVertex	= std::vector<QuantizedVertex>;
+	using vfloat3	= std::vector<float3>;
 	using vuint		= std::vector<uint32_t>;
 
 	ObjLoader();
 	virtual ~ObjLoader();
 
-	bool Import(const char *pszFilename, const bool bRecomputeNorm = true, const bool bNeedBound = true);
+	bool Import(const char *pszFilename, const bool bRecomputeNorm = true,
+		const bool bNeedBound = true, const ImportMode mode = IMPORT_MAPPED,
+		const uint32_t numThreads = 0, const bool bUseCache = false,
+		const float weldEpsilon = -1.0f,	// Negative to keep all vertices
+		const bool bOptimize = false, const VertexLayout layout = LAYOUT_INTERLEAVED);
 
 	const uint32_t GetNumVertices() const;
 	const uint32_t GetNumIndices() const;
-	const uint32_t GetVertexStride() const;
-	const uint8_t *GetVertices() const;
+	const VertexLayout GetVertexLayout() const;
+	const uint32_t GetVertexStride() const;	// Per stream in the split layout
+	const uint8_t *GetVertices() const;		// All the vertex data, in either layout
+	const float3 *GetPositions() const;		// Split layout only
+	const float3 *GetNormals() const;		// Split layout only
 	const uint32_t *GetIndices() const;
 
 	const float3& GetCenter() const;
 	const float GetRadius() const;
 
+	const ImportStats &GetImportStats() const;
+
+	// Chunks of the streamed import, e.g. for culling their bounds against a frustum.
+	// A streamed import only reads the chunk table and the bounds of the whole mesh,
+	// and leaves the mesh empty until LoadChunks.
+	uint32_t GetNumChunks() const;
+	const ChunkInfo *GetChunks() const;
+
+	// Replaces the mesh with the given chunks of the streamed import, welded and
+	// optimized as the import asked; the bounds stay the ones of the whole mesh.
+	// Without welding, vertices shared by several chunks are duplicated.
+	bool LoadChunks(const uint32_t *pChunkIndices, uint32_t numChunks);
+
+	NormalBenchmark BenchmarkNormals(uint32_t numThreads = 0, uint32_t numIterations = 10) const;
+
+	// Writes a height-field grid of about the given triangles to a temporary OBJ file,
+	// which is deleted afterwards, and times the mapped, parallel mapped and fscanf
+	// parsers on it without the cache. The grid is deterministic, so runs are comparable.
+	static ImportBenchmark BenchmarkImport(uint32_t numTriangles, uint32_t numThreads = 0,
+		uint32_t numIterations = 3);
+
+	// Quantizes the float vertices and checks the decoded results against the error bounds.
+	QuantizationError ValidateQuantization(uint32_t numThreads = 0) const;
+
+	// Writes the positions quantized as in QuantizedVertex, 4 SNORM components per
+	// vertex, e.g. for a compact vertex stream; the mesh itself is left as it is.
+	void QuantizePositions(int16_t *pPositions, uint32_t numThreads = 0) const;
+
+	static float3 DecodePosition(const QuantizedVertex &vertex, const float3 &center, float radius);
+	static float3 DecodeNormal(const QuantizedVertex &vertex);
+
 protected:
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		MappedFile(const MappedFile&) = delete;
+		virtual ~MappedFile();
+
+		MappedFile &operator=(const MappedFile&) = delete;
+
+		bool Open(const char *pszFilename, bool bMapView = true);
+		bool Create(const char *pszFilename, uint64_t size);	// Zero-filled, and writable
+		void Close();
+
+		// Maps [offset, offset + size) of a file opened without a view, replacing
+		// the previous window.
+		const char *MapWindow(uint64_t offset, uint64_t size);
+
+		const char *GetData() const;
+		char *GetData();
+		uint64_t GetSize() const;
+		uint64_t GetWriteTime() const;
+
+	protected:
+		HANDLE		m_hFile;
+		HANDLE		m_hMapping;
+		char		*m_pData;
+		uint64_t	m_size;
+		uint64_t	m_writeTime;
+	};
+
+	// Geometry parsed from a newline-aligned range of the mapped file
+	struct Chunk
+	{
+		vVertex		Vertices;
+		vuint		Indices;
+		vuint		TIndices;
+		vuint		NIndices;
+		vuint		RelIndices[3];	// Positions of relative v, vt and vn indices
+		uint32_t	NumTexcoords;
+		uint32_t	NumNormals;
+	};
+
+	// Identifies the source file and the post import tasks baked into a cache.
+	struct CacheKey
+	{
+		uint64_t	SourceSize;
+		uint64_t	SourceHash;
+		uint32_t	Options;
+		float		WeldEpsilon;
+	};
+
+	// Header of the binary mesh cache (.svmesh); the arrays follow at the given offsets.
+	struct CacheHeader
+	{
+		uint32_t	Magic;
+		uint32_t	Version;
+		CacheKey	Key;
+		uint32_t	VertexStride;
+		uint32_t	NumVertices;
+		uint32_t	NumIndices;
+		uint64_t	VertexOffset;
+		uint64_t	IndexOffset;
+		float3		Center;
+		float		Radius;
+	};
+
+	// Header of the chunk file (.svchunks) of a streamed import; the chunk table is
+	// at the given offset, after the chunk data.
+	struct ChunkHeader
+	{
+		uint32_t	Magic;
+		uint32_t	Version;
+		CacheKey	Key;
+		uint32_t	NumChunks;
+		uint32_t	NumVertices;
+		uint32_t	NumIndices;
+		uint64_t	TableOffset;
+		float3		Center;
+		float		Radius;
+	};
+
+	enum CacheOption : uint32_t
+	{
+		CACHE_NORMAL	= (1 << 0),
+		CACHE_BOUND		= (1 << 1),
+		CACHE_WELD		= (1 << 2),
+		CACHE_OPTIMIZE	= (1 << 3),
+		CACHE_SPLIT		= (1 << 4),
+		CACHE_QUANTIZE	= (1 << 5)
+	};
+
+	void importMapped(const MappedFile &file, uint32_t numThreads);
+	bool importStreamed(MappedFile &file, const char *pszFilename, bool bRecomputeNorm,
+		bool bUseCache, uint32_t numThreads);
+	bool streamChunks(MappedFile &file, const char *pszFilename, const CacheKey &key,
+		bool bRecomputeNorm, uint32_t numThreads);
+	uint32_t parseChunks(const char *pBegin, const char *pEnd, uint32_t numThreads, std::vector<Chunk> &chunks);
+	bool importFscanf(const char *pszFilename);
 	void importGeometryFirstPass(FILE *pFile);
 	void importGeometrySecondPass(FILE *pFile);
 	void loadIndex(FILE *pFile, uint32_t &uNumTri);
+	void parseChunk(const char *pBegin, const char *pEnd, Chunk &chunk);
+	const char *parseIndices(const char *pCur, const char *pEnd, Chunk &chunk);
+	void mergeChunks(std::vector<Chunk> &chunks);
+	void weldVertices(float epsilon);
 	void computeNormal();
+	void computeNormalParallel(uint32_t numThreads);
+	void optimizeMesh();
 	void computeBound();
+	void splitStreams();
+	void quantizeVertices(uint32_t numThreads);
+	void bindArrays();
+	void copyVertices(vVertex &vertices) const;
+	uint64_t getVertexDataSize(uint32_t numVertices) const;
+
+	bool loadCache(const char *pszFilename, const CacheKey &key);
+	bool saveCache(const char *pszFilename, const CacheKey &key) const;
+	bool openChunks(const char *pszFilename, const CacheKey &key);
+	bool gatherChunks(const uint32_t *pChunkIndices, uint32_t numChunks);
+
+	static uint64_t hashFile(const MappedFile &file, uint32_t numThreads);
+	static std::string getCacheName(const char *pszFilename, const char *pszExtension = ".svmesh");
+	static void encodeVertices(const Vertex *pVertices, QuantizedVertex *pQVertices, uint32_t numVertices,
+		const float3 &center, float radius);
 
 	vVertex		m_vVertices;
+	vfloat3		m_vStreams;
+	vQVertex	m_vQVertices;
 	vuint		m_vIndices;
 	vuint		m_vTIndices;
 	vuint		m_vNIndices;
 
 	float3		m_vCenter;
 	float		m_fRadius;
+
+	// Arrays exposed to the renderer; they point either into the vectors
+	// above or straight into the mapped cache file.
+	const uint8_t	*m_pVertexData;
+	const uint32_t	*m_pIndices;
+	uint32_t		m_numVertices;
+	uint32_t		m_numIndices;
+	VertexLayout	m_vertexLayout;
+	float			m_weldEpsilon;
+	bool			m_bOptimize;
+	MappedFile		m_cacheFile;
+	MappedFile		m_chunkFile;
+	const ChunkInfo	*m_pChunks;
+	uint32_t		m_numChunks;
+
+	ImportStats	m_importStats;
 };
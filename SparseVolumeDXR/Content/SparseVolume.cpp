@@ -2,6 +2,8 @@
 // By Stars XU Tianchen
 //--------------------------------------------------------------------------------------
 
+#include <chrono>
+#include <future>
 #include "DXFrameworkHelper.h"
 #include "SharedConst.h"
 #include "ObjLoader.h"
@@ -23,7 +25,9 @@ const wchar_t *SparseVolume::MissShaderName = L"missMain";
 SparseVolume::SparseVolume(const RayTracing::Device &device, const RayTracing::CommandList &commandList) :
 	m_device(device),
 	m_commandList(commandList),
-	m_instances()
+	m_instances(),
+	m_cullMeshlets(true),
+	m_lods()
 {
 	m_rayTracingPipelineCache.SetDevice(device);
 	m_graphicsPipelineCache.SetDevice(device.Common);
@@ -39,69 +43,318 @@ SparseVolume::~SparseVolume()
 }
 
 bool SparseVolume::Init(uint32_t width, uint32_t height,Format rtFormat, Format dsFormat,
-	Resource &vbUpload, Resource &ibUpload, Geometry &geometry, const char *fileName)
+	Resource *vbUploads, Resource &ibUpload, Geometry &geometry, const char *fileName,
+	const InitDesc &desc)
 {
 	m_viewport.x = static_cast<float>(width);
 	m_viewport.y = static_cast<float>(height);
 
+	// The mesh and the shaders load on worker threads while the pipeline layouts,
+	// pipelines and output grids are created here; everything joins before the
+	// command list records the uploads and the acceleration structure build.
+	const auto tInit = chrono::high_resolution_clock::now();
+	InitStage stages[NUM_INIT_STAGE] = {};
+	const auto runStage = [&stages, &tInit](InitStageID stage, const function<bool()> &func)
+	{
+		stages[stage].Start = chrono::duration<double>(chrono::high_resolution_clock::now() - tInit).count();
+		const auto result = func();
+		stages[stage].End = chrono::duration<double>(chrono::high_resolution_clock::now() - tInit).count();
+
+		return result;
+	};
+
 	// Load inputs
 	ObjLoader objLoader;
-	if (!objLoader.Import(fileName, true, true)) return false;
-	N_RETURN(createVB(objLoader.GetNumVertices(), objLoader.GetVertexStride(), objLoader.GetVertices(), vbUpload), false);
-	N_RETURN(createIB(objLoader.GetNumIndices(), objLoader.GetIndices(), ibUpload), false);
+	vector<uint32_t> indices;
+	vector<int16_t> qPositions;
+	auto meshTask = async(launch::async, runStage, STAGE_MESH, [&]()
+	{
+		const auto tLoad = chrono::high_resolution_clock::now();
+		if (!objLoader.Import(fileName, true, true, desc.ImportMode, desc.ImportThreads, desc.UseMeshCache,
+			desc.WeldEpsilon, desc.OptimizeMesh, ObjLoader::LAYOUT_SPLIT)) return false;
+
+		// Extract boundary; a streamed import already has the bounds of the whole mesh.
+		const auto &center = objLoader.GetCenter();
+		m_bound = XMFLOAT4(center.x, center.y, center.z, objLoader.GetRadius());
+
+		// A streamed import only reads the chunk table; load the chunks in the initial
+		// camera view or in the light view, which the shadow depth passes need. The
+		// selection is made once, and not revisited as the camera moves.
+		auto numLoadedChunks = 0u;
+		if (desc.ImportMode == ObjLoader::IMPORT_STREAMED)
+		{
+			vector<uint32_t> chunkIndices;
+			if (desc.pStreamViewProj)
+			{
+				const XMMATRIX viewProjs[] = { XMLoadFloat4x4(desc.pStreamViewProj), getViewProjLS() };
+				numLoadedChunks = selectChunks(objLoader, viewProjs, static_cast<uint32_t>(size(viewProjs)), chunkIndices);
+			}
+			else
+			{
+				numLoadedChunks = objLoader.GetNumChunks();
+				chunkIndices.resize(numLoadedChunks);
+				for (auto i = 0u; i < numLoadedChunks; ++i) chunkIndices[i] = i;
+			}
+			N_RETURN(numLoadedChunks > 0 && objLoader.LoadChunks(chunkIndices.data(), numLoadedChunks), false);
+		}
+
+		{
+			const auto &stats = objLoader.GetImportStats();
+			const auto loadTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tLoad).count();
+			const auto sizeMB = stats.FileSize / (1024.0 * 1024.0);
+			stringstream report;
+			report << "ObjLoader: " << fileName << " (" << fixed << setprecision(2) << sizeMB << " MB) ";
+			if (stats.FromCache) report << "mapped from cache in " << stats.CacheTime * 1000.0 << " ms";
+			else report << "parsed in " << stats.ParseTime * 1000.0 << " ms on " << stats.NumThreads << " thread(s) ("
+				<< sizeMB / stats.ParseTime << " MB/s), post-processed in " << stats.PostTime * 1000.0
+				<< " ms, cache lookup and write " << stats.CacheTime * 1000.0 << " ms";
+			if (desc.ImportMode == ObjLoader::IMPORT_STREAMED)
+			{
+				if (stats.NumWindows > 0) report << endl << "ObjLoader: streamed in " << stats.NumWindows
+					<< " window(s) of " << (ObjLoader::StreamWindowSize >> 20) << " MB into " << stats.NumChunks << " chunk(s)";
+				else report << endl << "ObjLoader: reused " << stats.NumChunks << " chunk(s)";
+				report << ", loaded " << numLoadedChunks << " of " << objLoader.GetNumChunks() << " chunk(s) ("
+					<< objLoader.GetNumVertices() << " vertices, " << objLoader.GetNumIndices() / 3 << " triangles)";
+			}
+			if (!stats.FromCache && desc.WeldEpsilon >= 0.0f)
+				report << endl << "ObjLoader: welding within " << scientific << desc.WeldEpsilon << fixed << " removed "
+				<< stats.NumWeldedVertices << " vertices (" << objLoader.GetNumVertices() << " left) and "
+				<< stats.NumDroppedTriangles << " degenerate triangles (" << objLoader.GetNumIndices() / 3 << " left)";
+			if (!stats.FromCache && desc.OptimizeMesh)
+			{
+				static const char *policyNames[] = { "FIFO", "LRU" };
+				for (auto i = 0u; i < MeshOptimizer::NUM_CACHE_POLICY; ++i)
+					report << endl << "ObjLoader: vertex cache (" << policyNames[i] << " 16) ACMR "
+					<< setprecision(3) << stats.VertexCache[0][i].ACMR << " -> " << stats.VertexCache[1][i].ACMR
+					<< ", ATVR " << stats.VertexCache[0][i].ATVR << " -> " << stats.VertexCache[1][i].ATVR;
+				report << setprecision(2);
+			}
+			report << endl << "ObjLoader: mesh startup (" << (stats.FromCache ? "warm" : "cold") << ") "
+				<< loadTime * 1000.0 << " ms" << endl;
+			OutputDebugStringA(report.str().c_str());
+		}
+		if (desc.NormalBenchIterations > 0)
+		{
+			const auto benchmark = objLoader.BenchmarkNormals(desc.ImportThreads, desc.NormalBenchIterations);
+			stringstream report;
+			report << "ObjLoader: normals over " << desc.NormalBenchIterations << " run(s), scatter-add "
+				<< fixed << setprecision(3) << benchmark.ScatterTime * 1000.0 << " ms, gather on "
+				<< benchmark.NumThreads << " thread(s) " << benchmark.GatherTime * 1000.0 << " ms ("
+				<< benchmark.ScatterTime / benchmark.GatherTime << "x), max deviation " << scientific
+				<< benchmark.MaxDeviation << ", NaN normals from scatter-add " << benchmark.NumNaNScatter << endl;
+			OutputDebugStringA(report.str().c_str());
+		}
+		if (desc.CheckQuantization)
+		{
+			const auto error = objLoader.ValidateQuantization(desc.ImportThreads);
+			stringstream report;
+			report << "ObjLoader: quantized vertices " << sizeof(ObjLoader::Vertex) << " -> "
+				<< sizeof(ObjLoader::QuantizedVertex) << " bytes, max position error " << scientific
+				<< error.MaxPositionError << " (bound " << error.PositionBound << "), max normal error "
+				<< error.MaxNormalError << " rad (bound " << error.NormalBound << "), "
+				<< error.NumViolations << " of " << error.NumVertices << " vertices out of bounds" << endl;
+			OutputDebugStringA(report.str().c_str());
+		}
+
+		// The depth passes draw from the quantized positions, which the bound dequantizes.
+		qPositions.resize(4 * objLoader.GetNumVertices());
+		objLoader.QuantizePositions(qPositions.data(), desc.ImportThreads);
+
+		// Build meshlets for culling the depth passes
+		m_cullMeshlets = desc.CullMeshlets;
+		if (desc.CullMeshlets || desc.CullBenchIterations > 0)
+		{
+			const auto tBuild = chrono::high_resolution_clock::now();
+			m_meshlets.Build(&objLoader.GetPositions()->x, objLoader.GetVertexStride(),
+				objLoader.GetIndices(), objLoader.GetNumIndices(), desc.ImportThreads);
+			const auto buildTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tBuild).count();
+
+			const auto numMeshlets = m_meshlets.GetNumMeshlets();
+			stringstream report;
+			report << "Meshlets: " << numMeshlets << " meshlets (" << fixed << setprecision(1)
+				<< static_cast<float>(objLoader.GetNumIndices() / 3) / (max)(numMeshlets, 1u)
+				<< " triangles on average) built in " << setprecision(2) << buildTime * 1000.0 << " ms" << endl;
+			if (desc.CullBenchIterations > 0)
+			{
+				const auto benchmark = m_meshlets.BenchmarkCulling(XMVectorSet(center.x, center.y, center.z, 0.0f),
+					objLoader.GetRadius(), desc.CullBenchIterations);
+				report << "Meshlets: culling over " << benchmark.NumViews << " views, frustum " << setprecision(3)
+					<< benchmark.FrustumTime * 1000.0 << " ms (" << setprecision(1) << benchmark.FrustumCulled * 100.0f
+					<< "% culled), normal cone " << setprecision(3) << benchmark.BackfaceTime * 1000.0 << " ms ("
+					<< setprecision(1) << benchmark.BackfaceCulled * 100.0f << "% culled)" << endl;
+			}
+			OutputDebugStringA(report.str().c_str());
+		}
+
+		// Simplify into levels of detail, each from the previous one, at decreasing
+		// ratios of the source triangles. The levels are appended to a copy of the
+		// source indices, which are uploaded straight from the loader otherwise.
+		const auto numIndices = objLoader.GetNumIndices();
+		m_lodNumIndices.assign(1, numIndices);
+		m_lodErrors.assign(1, 0.0f);
+		if (!desc.LODRatios.empty())
+		{
+			static const uint32_t thicknessGridSize = 64;
+			indices.assign(objLoader.GetIndices(), objLoader.GetIndices() + numIndices);
+			const auto pPositions = &objLoader.GetPositions()->x;
+			const auto vertexStride = objLoader.GetVertexStride();
+			const auto numVertices = objLoader.GetNumVertices();
+			const auto radius = objLoader.GetRadius();
+			const auto numRays = 3 * thicknessGridSize * thicknessGridSize;
+			vector<float> refThicknesses(numRays), thicknesses(numRays);
+			MeshSimplifier::ComputeThickness(refThicknesses.data(), thicknessGridSize, indices.data(),
+				numIndices, pPositions, vertexStride, &center.x, radius);
+
+			stringstream report;
+			for (const auto ratio : desc.LODRatios)
+			{
+				const auto srcNumIndices = m_lodNumIndices.back();
+				const auto targetIndices = static_cast<uint32_t>(numIndices / 3 * ratio) * 3;
+				if (targetIndices >= srcNumIndices || targetIndices == 0) continue;
+
+				const auto srcOffset = indices.size() - srcNumIndices;
+				indices.resize(indices.size() + srcNumIndices);
+				const auto pDstIndices = &indices[srcOffset + srcNumIndices];
+				auto error = 0.0f;
+				const auto tSimplify = chrono::high_resolution_clock::now();
+				const auto lodNumIndices = MeshSimplifier::Simplify(pDstIndices, &indices[srcOffset], srcNumIndices,
+					pPositions, numVertices, vertexStride, targetIndices, &error);
+				const auto simplifyTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tSimplify).count();
+				if (lodNumIndices >= srcNumIndices)
+				{
+					indices.resize(srcOffset + srcNumIndices);
+					break;
+				}
+				if (desc.OptimizeMesh) MeshOptimizer::OptimizeVertexCache(pDstIndices, lodNumIndices, numVertices);
+				indices.resize(srcOffset + srcNumIndices + lodNumIndices);
+				m_lodNumIndices.push_back(lodNumIndices);
+				m_lodErrors.push_back(m_lodErrors.back() + error);
+
+				// Thickness error against the full mesh, relative to its diameter
+				MeshSimplifier::ComputeThickness(thicknesses.data(), thicknessGridSize, &indices[srcOffset + srcNumIndices],
+					lodNumIndices, pPositions, vertexStride, &center.x, radius);
+				auto meanError = 0.0, maxError = 0.0;
+				for (auto j = 0u; j < numRays; ++j)
+				{
+					const auto thicknessError = fabs(thicknesses[j] - refThicknesses[j]) / (2.0 * radius);
+					meanError += thicknessError;
+					maxError = (max)(maxError, thicknessError);
+				}
+				meanError /= numRays;
+
+				report << "MeshSimplifier: LOD " << m_lodNumIndices.size() - 1 << " at " << fixed << setprecision(3)
+					<< ratio << ", " << lodNumIndices / 3 << " triangles simplified in " << setprecision(2)
+					<< simplifyTime * 1000.0 << " ms (" << srcNumIndices / 3 / simplifyTime / 1000000.0
+					<< " Mtri/s), error " << scientific << m_lodErrors.back() << ", thickness error mean "
+					<< meanError << " max " << maxError << " of the diameter" << endl;
+			}
+			OutputDebugStringA(report.str().c_str());
+		}
+
+		return true;
+	});
+
+	auto shaderTask = async(launch::async, runStage, STAGE_SHADERS, [this]() { return createShaders(); });
 
 	// Create pipelines
-	N_RETURN(createInputLayout(), false);
-	N_RETURN(createPipelineLayouts(), false);
-	N_RETURN(createPipelines(rtFormat, dsFormat), false);
-
-	// Extract boundary
-	const auto center = objLoader.GetCenter();
-	m_bound = XMFLOAT4(center.x, center.y, center.z, objLoader.GetRadius());
-
-	// Create output grids and build acceleration structures
-	for (auto &kBuffer : m_depthKBuffers)
-		N_RETURN(kBuffer.Create(m_device.Common, width, height, DXGI_FORMAT_R32_UINT, NUM_K_LAYERS,
-			D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
-	for (auto &kBuffer : m_lsDepthKBuffers)
-		N_RETURN(kBuffer.Create(m_device.Common, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, DXGI_FORMAT_R32_UINT, NUM_K_LAYERS,
-			D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
-	for (auto &outView : m_outputViews)
-		N_RETURN(outView.Create(m_device.Common, width, height, rtFormat, 1,
-			D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
-	for (auto &thickness : m_thicknesses)
-		N_RETURN(thickness.Create(m_device.Common, width, height, DXGI_FORMAT_R32_FLOAT, 1,
-			D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
+	N_RETURN(runStage(STAGE_LAYOUTS, [this]() { return createInputLayout() && createPipelineLayouts(); }), false);
+
+	// Create output grids
+	N_RETURN(runStage(STAGE_TEXTURES, [&]()
+	{
+		for (auto &kBuffer : m_depthKBuffers)
+			N_RETURN(kBuffer.Create(m_device.Common, width, height, DXGI_FORMAT_R32_UINT, NUM_K_LAYERS,
+				D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
+		for (auto &kBuffer : m_lsDepthKBuffers)
+			N_RETURN(kBuffer.Create(m_device.Common, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, DXGI_FORMAT_R32_UINT, NUM_K_LAYERS,
+				D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
+		for (auto &outView : m_outputViews)
+			N_RETURN(outView.Create(m_device.Common, width, height, rtFormat, 1,
+				D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
+		for (auto &thickness : m_thicknesses)
+			N_RETURN(thickness.Create(m_device.Common, width, height, DXGI_FORMAT_R32_FLOAT, 1,
+				D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS), false);
+
+		return true;
+	}), false);
+
+	N_RETURN(shaderTask.get(), false);
+	N_RETURN(runStage(STAGE_PIPELINES, [&]() { return createPipelines(rtFormat, dsFormat); }), false);
+
+	// Upload the mesh and build acceleration structures
+	N_RETURN(meshTask.get(), false);
+	N_RETURN(runStage(STAGE_UPLOAD, [&]()
+	{
+		// Only the positions of the split layout are uploaded; no shader reads the normals.
+		const auto numVertices = objLoader.GetNumVertices();
+		N_RETURN(createVB(POSITION_STREAM, numVertices, objLoader.GetVertexStride(), objLoader.GetPositions(),
+			vbUploads[POSITION_STREAM]), false);
+		N_RETURN(createVB(QUANTIZED_STREAM, numVertices, sizeof(int16_t[4]), qPositions.data(),
+			vbUploads[QUANTIZED_STREAM]), false);
+
+		if (indices.empty()) return createIB(objLoader.GetNumIndices(), objLoader.GetIndices(), ibUpload);
+
+		return createIB(static_cast<uint32_t>(indices.size()), indices.data(), ibUpload);
+	}), false);
+	for (auto &drawRanges : m_drawRanges) drawRanges.assign(1, { 0, m_numIndices });
 
 	// Initialize world transform
 	const auto world = XMMatrixIdentity();
 	XMStoreFloat4x4(&m_world, XMMatrixTranspose(world));
 
-	N_RETURN(buildAccelerationStructures(&geometry), false);
-	N_RETURN(buildShaderTables(), false);
+	N_RETURN(runStage(STAGE_ACCELERATION_STRUCTURES, [&]() { return buildAccelerationStructures(&geometry); }), false);
+	N_RETURN(runStage(STAGE_SHADER_TABLES, [this]() { return buildShaderTables(); }), false);
+
+	// Stage timings; the mesh and shader stages overlap the ones on this thread.
+	{
+		static const char *stageNames[] =
+		{
+			"mesh import", "shader loading", "pipeline layouts", "output grids",
+			"pipelines", "upload", "acceleration structures", "shader tables"
+		};
+		const auto initTime = chrono::duration<double>(chrono::high_resolution_clock::now() - tInit).count();
+		auto serialTime = 0.0;
+		stringstream report;
+		report << fixed << setprecision(2);
+		for (auto i = 0u; i < NUM_INIT_STAGE; ++i)
+		{
+			serialTime += stages[i].End - stages[i].Start;
+			report << "SparseVolume: " << stageNames[i] << " " << stages[i].Start * 1000.0 << " - "
+				<< stages[i].End * 1000.0 << " ms (" << (stages[i].End - stages[i].Start) * 1000.0 << " ms)" << endl;
+		}
+		report << "SparseVolume: init " << initTime * 1000.0 << " ms, " << serialTime * 1000.0
+			<< " ms in stages run serially" << endl;
+		OutputDebugStringA(report.str().c_str());
+	}
 
 	return true;
 }
 
 void SparseVolume::UpdateFrame(uint32_t frameIndex, CXMVECTOR eyePt, CXMMATRIX viewProj)
 {
-	// General matrices
-	//const auto world = XMMatrixScaling(m_bound.w, m_bound.w, m_bound.w) *
-		//XMMatrixTranslation(m_bound.x, m_bound.y, m_bound.z);
+	// General matrices; the depth passes dequantize the positions by the bound.
+	const auto dequant = XMMatrixScaling(m_bound.w, m_bound.w, m_bound.w) *
+		XMMatrixTranslation(m_bound.x, m_bound.y, m_bound.z);
 	const auto world = XMMatrixIdentity();
 	const auto worldViewProj = world * viewProj;
 	XMStoreFloat4x4(&m_world, XMMatrixTranspose(world));
-	XMStoreFloat4x4(&m_worldViewProj, XMMatrixTranspose(worldViewProj));
+	XMStoreFloat4x4(&m_worldViewProj, XMMatrixTranspose(dequant * worldViewProj));
 
 	// Light-space matrices
-	const auto focusPt = XMLoadFloat4(&m_bound);
-	const auto lightPt = XMVectorSet(10.0f, 45.0f, 75.0f, 0.0f) + focusPt;
-	const auto viewLS = XMMatrixLookAtLH(lightPt, focusPt, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
-	const auto projLS = XMMatrixOrthographicLH(m_bound.w * 3.0f, m_bound.w * 3.0f, g_zNearLS, g_zFarLS);
-	const auto viewProjLS = viewLS * projLS;
+	const auto viewProjLS = getViewProjLS();
 	const auto worldViewProjLS = world * viewProjLS;
 	XMStoreFloat4x4(&m_cbPerObject.ViewProjLS, XMMatrixTranspose(viewProjLS));
-	XMStoreFloat4x4(&m_worldViewProjLS, XMMatrixTranspose(worldViewProjLS));
+	XMStoreFloat4x4(&m_worldViewProjLS, XMMatrixTranspose(dequant * worldViewProjLS));
+
+	// Both depth passes draw back faces too, so only frustum culling applies.
+	// The meshlets only cover the full-resolution level.
+	selectLOD(CAMERA_PASS, worldViewProj, m_viewport.x);
+	selectLOD(LIGHT_PASS, worldViewProjLS, static_cast<float>(SHADOW_MAP_SIZE));
+	if (m_cullMeshlets)
+	{
+		if (m_lods[CAMERA_PASS] == 0) cullMeshlets(CAMERA_PASS, worldViewProj);
+		if (m_lods[LIGHT_PASS] == 0) cullMeshlets(LIGHT_PASS, worldViewProjLS);
+	}
 	
 	// Screen space matrices
 	const auto toScreen = XMMATRIX
@@ -154,21 +407,31 @@ void SparseVolume::RenderDXR(uint32_t frameIndex, RenderTarget &dst, const Descr
 	dst.Barrier(m_commandList, D3D12_RESOURCE_STATE_PRESENT);
 }
 
-bool SparseVolume::createVB(uint32_t numVert, uint32_t stride, const uint8_t *pData, Resource &vbUpload)
+bool SparseVolume::createVB(VertexStream stream, uint32_t numVert, uint32_t stride, const void *pData, Resource &vbUpload)
 {
-	N_RETURN(m_vertexBuffer.Create(m_device.Common, numVert, stride, D3D12_RESOURCE_FLAG_NONE,
+	static_assert(NUM_VERTEX_STREAM == VertexStreamCount, "Init takes an upload resource for each vertex stream");
+
+	// The streams differ in stride, so each has its own buffer.
+	auto &vertexBuffer = m_vertexBuffers[stream];
+	N_RETURN(vertexBuffer.Create(m_device.Common, numVert, stride, D3D12_RESOURCE_FLAG_NONE,
 		D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COPY_DEST), false);
 
-	return m_vertexBuffer.Upload(m_commandList, vbUpload, pData,
+	return vertexBuffer.Upload(m_commandList, vbUpload, pData,
 		D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
 }
 
 bool SparseVolume::createIB(uint32_t numIndices, const uint32_t *pData, Resource &ibUpload)
 {
-	m_numIndices = numIndices;
+	m_numIndices = m_lodNumIndices[0];
 
+	// The levels of detail are laid out back to back in one buffer, with an IBV for each.
+	const auto numLODs = static_cast<uint32_t>(m_lodNumIndices.size());
+	vector<uint32_t> offsets(numLODs);
+	for (auto i = 1u; i < numLODs; ++i)
+		offsets[i] = offsets[i - 1] + static_cast<uint32_t>(sizeof(uint32_t)) * m_lodNumIndices[i - 1];
 	N_RETURN(m_indexBuffer.Create(m_device.Common, sizeof(uint32_t) * numIndices, DXGI_FORMAT_R32_UINT,
-		D3D12_RESOURCE_FLAG_NONE, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COPY_DEST), false);
+		D3D12_RESOURCE_FLAG_NONE, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COPY_DEST,
+		numLODs, offsets.data()), false);
 
 	return m_indexBuffer.Upload(m_commandList, ibUpload, pData,
 		D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
@@ -176,13 +439,10 @@ bool SparseVolume::createIB(uint32_t numIndices, const uint32_t *pData, Resource
 
 bool SparseVolume::createInputLayout()
 {
-	const auto offset = D3D12_APPEND_ALIGNED_ELEMENT;
-
-	// Define the vertex input layout.
+	// Define the vertex input layout; the depth passes only fetch the quantized positions.
 	InputElementTable inputElementDescs =
 	{
-		{ "POSITION",	0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,		D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
-		{ "NORMAL",		0, DXGI_FORMAT_R32G32B32_FLOAT, 0, offset,	D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 }
+		{ "POSITION",	0, DXGI_FORMAT_R16G16B16A16_SNORM, 0, 0,	D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 }
 	};
 
 	X_RETURN(m_inputLayout, m_graphicsPipelineCache.CreateInputLayout(inputElementDescs), false);
@@ -239,12 +499,20 @@ bool SparseVolume::createPipelineLayouts()
 	return true;
 }
 
+bool SparseVolume::createShaders()
+{
+	N_RETURN(m_shaderPool.CreateShader(Shader::Stage::VS, VS_BASE_PASS, L"VSBasePass.cso"), false);
+	N_RETURN(m_shaderPool.CreateShader(Shader::Stage::PS, PS_DEPTH_PEEL, L"PSDepthPeel.cso"), false);
+	N_RETURN(m_shaderPool.CreateShader(Shader::Stage::VS, VS_SCREEN_QUAD, L"VSScreenQuad.cso"), false);
+	N_RETURN(m_shaderPool.CreateShader(Shader::Stage::PS, PS_SPARSE_RAYCAST, L"PSSparseRayCast.cso"), false);
+	V_RETURN(D3DReadFileToBlob(L"SparseRayCast.cso", &m_shaderLib), cerr, false);
+
+	return true;
+}
+
 bool SparseVolume::createPipelines(Format rtFormat, Format dsFormat)
 {
 	{
-		N_RETURN(m_shaderPool.CreateShader(Shader::Stage::VS, VS_BASE_PASS, L"VSBasePass.cso"), false);
-		N_RETURN(m_shaderPool.CreateShader(Shader::Stage::PS, PS_DEPTH_PEEL, L"PSDepthPeel.cso"), false);
-
 		Graphics::State state;
 		state.SetPipelineLayout(m_pipelineLayouts[DEPTH_PEEL_LAYOUT]);
 		state.SetShader(Shader::Stage::VS, m_shaderPool.GetShader(Shader::Stage::VS, VS_BASE_PASS));
@@ -259,9 +527,6 @@ bool SparseVolume::createPipelines(Format rtFormat, Format dsFormat)
 	}
 
 	{
-		N_RETURN(m_shaderPool.CreateShader(Shader::Stage::VS, VS_SCREEN_QUAD, L"VSScreenQuad.cso"), false);
-		N_RETURN(m_shaderPool.CreateShader(Shader::Stage::PS, PS_SPARSE_RAYCAST, L"PSSparseRayCast.cso"), false);
-
 		Graphics::State state;
 		state.SetPipelineLayout(m_pipelineLayouts[SPARSE_RAYCAST_LAYOUT]);
 		state.SetShader(Shader::Stage::VS, m_shaderPool.GetShader(Shader::Stage::VS, VS_SCREEN_QUAD));
@@ -275,11 +540,8 @@ bool SparseVolume::createPipelines(Format rtFormat, Format dsFormat)
 	}
 
 	{
-		Blob shaderLib;
-		V_RETURN(D3DReadFileToBlob(L"SparseRayCast.cso", &shaderLib), cerr, false);
-
 		RayTracing::State state;
-		state.SetShaderLibrary(shaderLib);
+		state.SetShaderLibrary(m_shaderLib);
 		state.SetHitGroup(0, HitGroupName, ClosestHitShaderName, AnyHitShaderName);
 		state.SetShaderConfig(sizeof(XMFLOAT4), sizeof(XMFLOAT2));
 		state.SetLocalPipelineLayout(0, m_pipelineLayouts[RAY_GEN_LAYOUT],
@@ -365,7 +627,7 @@ bool SparseVolume::buildAccelerationStructures(Geometry *geometries)
 	// Set geometries
 	const auto geometryFlags = D3D12_RAYTRACING_GEOMETRY_FLAG_NONE;
 	BottomLevelAS::SetGeometries(geometries, 1, DXGI_FORMAT_R32G32B32_FLOAT,
-		&m_vertexBuffer.GetVBV(), &m_indexBuffer.GetIBV(), &geometryFlags);
+		&m_vertexBuffers[POSITION_STREAM].GetVBV(), &m_indexBuffer.GetIBV(), &geometryFlags);
 
 	// Descriptor index in descriptor pool
 	const uint32_t bottomLevelASIndex = 0;
@@ -395,7 +657,8 @@ bool SparseVolume::buildAccelerationStructures(Geometry *geometries)
 	// Build top level AS
 	m_topLevelAS.Build(m_commandList, m_scratch, m_instances, descriptorPool, NumUAVs);
 
-	m_vertexBuffer.Barrier(m_commandList, D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER);
+	for (auto &vertexBuffer : m_vertexBuffers)
+		vertexBuffer.Barrier(m_commandList, D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER);
 	m_indexBuffer.Barrier(m_commandList, D3D12_RESOURCE_STATE_INDEX_BUFFER);
 
 	return true;
@@ -426,6 +689,102 @@ bool SparseVolume::buildShaderTables()
 	return true;
 }
 
+uint32_t SparseVolume::selectChunks(const ObjLoader &objLoader, const XMMATRIX *pWorldViewProjs,
+	uint32_t numViews, vector<uint32_t> &chunkIndices) const
+{
+	// Clip planes from the columns of the view-projection matrices [Gribb and Hartmann 2001]
+	vector<XMVECTOR> planes;
+	planes.reserve(6 * numViews);
+	for (auto i = 0u; i < numViews; ++i)
+	{
+		const auto m = XMMatrixTranspose(pWorldViewProjs[i]);
+		planes.push_back(XMVectorAdd(m.r[3], m.r[0]));
+		planes.push_back(XMVectorSubtract(m.r[3], m.r[0]));
+		planes.push_back(XMVectorAdd(m.r[3], m.r[1]));
+		planes.push_back(XMVectorSubtract(m.r[3], m.r[1]));
+		planes.push_back(m.r[2]);
+		planes.push_back(XMVectorSubtract(m.r[3], m.r[2]));
+	}
+
+	// A chunk is outside a frustum when the corner of its box furthest along the
+	// normal of one of its planes is behind that plane; it is loaded when inside any.
+	chunkIndices.clear();
+	const auto pChunks = objLoader.GetChunks();
+	const auto numChunks = objLoader.GetNumChunks();
+	for (auto i = 0u; i < numChunks; ++i)
+	{
+		const auto &chunk = pChunks[i];
+		const auto boxMin = XMVectorSet(chunk.Min.x, chunk.Min.y, chunk.Min.z, 1.0f);
+		const auto boxMax = XMVectorSet(chunk.Max.x, chunk.Max.y, chunk.Max.z, 1.0f);
+
+		auto bInside = false;
+		for (auto j = 0u; j < numViews && !bInside; ++j)
+		{
+			auto bOutside = false;
+			for (auto k = 6 * j; k < 6 * j + 6; ++k)
+			{
+				const auto corner = XMVectorSelect(boxMin, boxMax, XMVectorGreaterOrEqual(planes[k], XMVectorZero()));
+				bOutside = bOutside || XMVectorGetX(XMPlaneDotCoord(planes[k], corner)) < 0.0f;
+			}
+			bInside = !bOutside;
+		}
+		if (bInside) chunkIndices.push_back(i);
+	}
+
+	return static_cast<uint32_t>(chunkIndices.size());
+}
+
+XMMATRIX SparseVolume::getViewProjLS() const
+{
+	// Orthographic light view around the bound of the whole mesh
+	const auto focusPt = XMLoadFloat4(&m_bound);
+	const auto lightPt = XMVectorSet(10.0f, 45.0f, 75.0f, 0.0f) + focusPt;
+	const auto viewLS = XMMatrixLookAtLH(lightPt, focusPt, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	const auto projLS = XMMatrixOrthographicLH(m_bound.w * 3.0f, m_bound.w * 3.0f, g_zNearLS, g_zFarLS);
+
+	return viewLS * projLS;
+}
+
+void SparseVolume::cullMeshlets(DepthPass pass, CXMMATRIX worldViewProj)
+{
+	m_meshlets.CullFrustum(worldViewProj, m_visibleMeshlets);
+
+	// Merge the visible meshlets that are adjacent in the index buffer.
+	const auto pMeshlets = m_meshlets.GetMeshlets();
+	auto &drawRanges = m_drawRanges[pass];
+	drawRanges.clear();
+	for (const auto i : m_visibleMeshlets)
+	{
+		const auto startIndex = pMeshlets[i].TriangleOffset * 3;
+		const auto numIndices = pMeshlets[i].TriangleCount * 3;
+		if (!drawRanges.empty() && drawRanges.back().StartIndex + drawRanges.back().NumIndices == startIndex)
+			drawRanges.back().NumIndices += numIndices;
+		else drawRanges.push_back({ startIndex, numIndices });
+	}
+}
+
+void SparseVolume::selectLOD(DepthPass pass, CXMMATRIX worldViewProj, float viewportSize)
+{
+	// Pixels per unit of the simplification error, at the nearest point of the bounding sphere
+	XMFLOAT4X4 m;
+	XMStoreFloat4x4(&m, worldViewProj);
+	const auto center = XMVectorSetW(XMLoadFloat4(&m_bound), 1.0f);
+	const auto wAxis = XMVectorSet(m._14, m._24, m._34, m._44);
+	const auto w = XMVectorGetX(XMVector4Dot(center, wAxis)) - m_bound.w * XMVectorGetX(XMVector3Length(wAxis));
+	const auto scale = XMVectorGetX(XMVector3Length(XMVectorSet(m._11, m._21, m._31, 0.0f)));
+
+	auto &lod = m_lods[pass];
+	lod = 0;
+	if (w > 0.0f)
+	{
+		const auto pixelsPerUnit = scale / w * viewportSize * 0.5f;
+		const auto numLODs = static_cast<uint32_t>(m_lodNumIndices.size());
+		while (lod + 1 < numLODs && m_lodErrors[lod + 1] * pixelsPerUnit < 1.0f) ++lod;
+	}
+
+	if (lod > 0 || !m_cullMeshlets) m_drawRanges[pass].assign(1, { 0, m_lodNumIndices[lod] });
+}
+
 void SparseVolume::depthPeel(uint32_t frameIndex, const Descriptor &dsv)
 {
 	// Set descriptor tables
@@ -449,10 +808,11 @@ void SparseVolume::depthPeel(uint32_t frameIndex, const Descriptor &dsv)
 		m_depthKBuffers[frameIndex].GetResource(), XMVECTORU32{ reinterpret_cast<const uint32_t&>(maxDepth) }.u);
 
 	// Record commands.
-	m_commandList.IASetVertexBuffers(0, 1, &m_vertexBuffer.GetVBV());
-	m_commandList.IASetIndexBuffer(m_indexBuffer.GetIBV());
+	m_commandList.IASetVertexBuffers(0, 1, &m_vertexBuffers[QUANTIZED_STREAM].GetVBV());
+	m_commandList.IASetIndexBuffer(m_indexBuffer.GetIBV(m_lods[CAMERA_PASS]));
 	m_commandList.IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	m_commandList.DrawIndexed(m_numIndices, 1, 0, 0, 0);
+	for (const auto &range : m_drawRanges[CAMERA_PASS])
+		m_commandList.DrawIndexed(range.NumIndices, 1, range.StartIndex, 0, 0);
 }
 
 void SparseVolume::depthPeelLightSpace(uint32_t frameIndex, const Descriptor &dsv)
@@ -478,10 +838,11 @@ void SparseVolume::depthPeelLightSpace(uint32_t frameIndex, const Descriptor &ds
 		m_lsDepthKBuffers[frameIndex].GetResource(), XMVECTORU32{ reinterpret_cast<const uint32_t&>(maxDepth) }.u);
 
 	// Record commands.
-	m_commandList.IASetVertexBuffers(0, 1, &m_vertexBuffer.GetVBV());
-	m_commandList.IASetIndexBuffer(m_indexBuffer.GetIBV());
+	m_commandList.IASetVertexBuffers(0, 1, &m_vertexBuffers[QUANTIZED_STREAM].GetVBV());
+	m_commandList.IASetIndexBuffer(m_indexBuffer.GetIBV(m_lods[LIGHT_PASS]));
 	m_commandList.IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	m_commandList.DrawIndexed(m_numIndices, 1, 0, 0, 0);
+	for (const auto &range : m_drawRanges[LIGHT_PASS])
+		m_commandList.DrawIndexed(range.NumIndices, 1, range.StartIndex, 0, 0);
 }
 
 void SparseVolume::render(uint32_t frameIndex, const RenderTargetTable &rtvs)
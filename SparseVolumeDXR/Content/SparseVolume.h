@@ -6,16 +6,36 @@
 
 #include "Core/XUSG.h"
 #include "RayTracing/XUSGRayTracing.h"
+#include "ObjLoader.h"
+#include "MeshletBuilder.h"
+#include "MeshSimplifier.h"
 
 class SparseVolume
 {
 public:
+	// How Init imports and preprocesses the mesh
+	struct InitDesc
+	{
+		ObjLoader::ImportMode	ImportMode = ObjLoader::IMPORT_MAPPED_PARALLEL;
+		uint32_t				ImportThreads = 0;			// 0 for all hardware threads
+		bool					UseMeshCache = true;
+		float					WeldEpsilon = -1.0f;		// Negative to keep all vertices
+		bool					OptimizeMesh = true;
+		uint32_t				NormalBenchIterations = 0;	// 0 to skip the benchmark
+		bool					CheckQuantization = false;
+		bool					CullMeshlets = true;
+		uint32_t				CullBenchIterations = 0;	// 0 to skip the benchmark
+		std::vector<float>		LODRatios;					// Triangle ratios of the levels of detail
+		const DirectX::XMFLOAT4X4 *pStreamViewProj = nullptr;	// Streamed import only: loads the chunks in this
+															// or the light frustum once, or all chunks if null
+	};
+
 	SparseVolume(const XUSG::RayTracing::Device &device, const XUSG::RayTracing::CommandList &commandList);
 	virtual ~SparseVolume();
 
 	bool Init(uint32_t width, uint32_t height, XUSG::Format rtFormat, XUSG::Format dsFormat,
-		XUSG::Resource &vbUpload, XUSG::Resource &ibUpload, XUSG::RayTracing::Geometry &geometry,
-		const char *fileName);
+		XUSG::Resource *vbUploads, XUSG::Resource &ibUpload, XUSG::RayTracing::Geometry &geometry,
+		const char *fileName, const InitDesc &desc);
 
 	void UpdateFrame(uint32_t frameIndex, DirectX::CXMVECTOR eyePt, DirectX::CXMMATRIX viewProj);
 	void Render(uint32_t frameIndex, const XUSG::RenderTargetTable &rtvs,
@@ -23,6 +43,7 @@ public:
 	void RenderDXR(uint32_t frameIndex, XUSG::RenderTarget &dst, const XUSG::Descriptor &dsv);
 
 	static const uint32_t FrameCount = 3;
+	static const uint32_t VertexStreamCount = 2;	// Upload resources Init takes for the vertex streams
 
 protected:
 	enum PipelineLayoutIndex : uint8_t
@@ -72,12 +93,48 @@ protected:
 		VS_SCREEN_QUAD
 	};
 
+	enum VertexStream : uint8_t
+	{
+		POSITION_STREAM,	// Float positions for the BLAS
+		QUANTIZED_STREAM,	// SNORM16 positions relative to the bound for the depth passes
+
+		NUM_VERTEX_STREAM
+	};
+
+	enum DepthPass : uint8_t
+	{
+		CAMERA_PASS,
+		LIGHT_PASS,
+
+		NUM_DEPTH_PASS
+	};
+
 	enum PixelShaderID : uint8_t
 	{
 		PS_DEPTH_PEEL,
 		PS_SPARSE_RAYCAST
 	};
 
+	enum InitStageID : uint8_t
+	{
+		STAGE_MESH,
+		STAGE_SHADERS,
+		STAGE_LAYOUTS,
+		STAGE_TEXTURES,
+		STAGE_PIPELINES,
+		STAGE_UPLOAD,
+		STAGE_ACCELERATION_STRUCTURES,
+		STAGE_SHADER_TABLES,
+
+		NUM_INIT_STAGE
+	};
+
+	struct InitStage
+	{
+		double		Start;	// Seconds since the start of Init
+		double		End;
+	};
+
 	struct PerObjConstants
 	{
 		DirectX::XMFLOAT4X4	ScreenToWorld;
@@ -90,15 +147,27 @@ protected:
 		DirectX::XMFLOAT4	LightDir;
 	};
 
-	bool createVB(uint32_t numVert, uint32_t stride, const uint8_t *pData, XUSG::Resource &vbUpload);
+	struct DrawRange
+	{
+		uint32_t	StartIndex;
+		uint32_t	NumIndices;
+	};
+
+	bool createVB(VertexStream stream, uint32_t numVert, uint32_t stride, const void *pData, XUSG::Resource &vbUpload);
 	bool createIB(uint32_t numIndices, const uint32_t *pData, XUSG::Resource &ibUpload);
 	bool createInputLayout();
+	bool createShaders();
 	bool createPipelineLayouts();
 	bool createPipelines(XUSG::Format rtFormat, XUSG::Format dsFormat);
 	bool createDescriptorTables();
 	bool buildAccelerationStructures(XUSG::RayTracing::Geometry *geometries);
 	bool buildShaderTables();
 
+	uint32_t selectChunks(const ObjLoader &objLoader, const DirectX::XMMATRIX *pWorldViewProjs,
+		uint32_t numViews, std::vector<uint32_t> &chunkIndices) const;
+	DirectX::XMMATRIX getViewProjLS() const;
+	void cullMeshlets(DepthPass pass, DirectX::CXMMATRIX worldViewProj);
+	void selectLOD(DepthPass pass, DirectX::CXMMATRIX worldViewProj, float viewportSize);
 	void depthPeel(uint32_t frameIndex, const XUSG::Descriptor &dsv);
 	void depthPeelLightSpace(uint32_t frameIndex, const XUSG::Descriptor &dsv);
 	void render(uint32_t frameIndex, const XUSG::RenderTargetTable &rtvs);
@@ -119,7 +188,7 @@ protected:
 	XUSG::DescriptorTable		m_srvTables[FrameCount];
 	XUSG::DescriptorTable		m_uavTables[NUM_UAV_TABLE][FrameCount];
 
-	XUSG::VertexBuffer			m_vertexBuffer;
+	XUSG::VertexBuffer			m_vertexBuffers[NUM_VERTEX_STREAM];
 	XUSG::IndexBuffer			m_indexBuffer;
 
 	XUSG::Texture2D				m_depthKBuffers[FrameCount];
@@ -135,6 +204,19 @@ protected:
 	DirectX::XMFLOAT4X4			m_worldViewProjLS;
 	PerObjConstants				m_cbPerObject;
 
+	// Meshlets are contiguous in the index buffer, so that the ones surviving
+	// the culling merge into a few draw ranges.
+	MeshletBuilder				m_meshlets;
+	bool						m_cullMeshlets;
+	std::vector<uint32_t>		m_visibleMeshlets;
+	std::vector<DrawRange>		m_drawRanges[NUM_DEPTH_PASS];
+
+	// The levels of detail are back to back in the index buffer with an IBV each,
+	// and each pass picks the coarsest level whose error stays under a pixel.
+	std::vector<uint32_t>		m_lodNumIndices;
+	std::vector<float>			m_lodErrors;
+	uint32_t					m_lods[NUM_DEPTH_PASS];
+
 	// Shader tables
 	static const wchar_t *HitGroupName;
 	static const wchar_t *RaygenShaderName;
@@ -146,6 +228,7 @@ protected:
 	XUSG::RayTracing::ShaderTable	m_rayGenShaderTables[FrameCount];
 
 	XUSG::ShaderPool				m_shaderPool;
+	XUSG::Blob						m_shaderLib;
 	XUSG::RayTracing::PipelineCache	m_rayTracingPipelineCache;
 	XUSG::Graphics::PipelineCache	m_graphicsPipelineCache;
 	XUSG::Compute::PipelineCache	m_computePipelineCache;
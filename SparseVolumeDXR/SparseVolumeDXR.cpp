@@ -30,12 +30,14 @@ SparseVolumeDXR::SparseVolumeDXR(uint32_t width, uint32_t height, std::wstring n
 	m_pausing(false),
 	m_tracking(false),
 	m_meshFileName("Media/bunny.obj"),
-	m_meshPosScale(0.0f, 0.0f, 0.0f, 1.0f)
+	m_meshPosScale(0.0f, 0.0f, 0.0f, 1.0f),
+	m_importBenchTriangles(0)
 {
 }
 
 void SparseVolumeDXR::OnInit()
 {
+	if (m_importBenchTriangles > 0) BenchmarkImport();
 	LoadPipeline();
 	LoadAssets();
 }
@@ -158,10 +160,30 @@ void SparseVolumeDXR::LoadAssets()
 	m_sparseVolume = make_unique<SparseVolume>(m_device, m_commandList);
 	if (!m_sparseVolume) ThrowIfFailed(E_FAIL);
 
-	Resource vbUpload, ibUpload;
+	// Projection
+	const auto aspectRatio = m_width / static_cast<float>(m_height);
+	const auto proj = XMMatrixPerspectiveFovLH(g_fovAngleY, aspectRatio, g_zNear, g_zFar);
+	XMStoreFloat4x4(&m_proj, proj);
+
+	// View initialization
+	m_focusPt = XMFLOAT3(0.0f, 4.0f, 0.0f);
+	m_eyePt = XMFLOAT3(-8.0f, 12.0f, 14.0f);
+	const auto focusPt = XMLoadFloat3(&m_focusPt);
+	const auto eyePt = XMLoadFloat3(&m_eyePt);
+	const auto view = XMMatrixLookAtLH(eyePt, focusPt, XMVectorSet(0.0f, 1.0f, 0.0f, 1.0f));
+	XMStoreFloat4x4(&m_view, view);
+
+	// A streamed import loads only the chunks in the initial view.
+	XMFLOAT4X4 viewProj;
+	XMStoreFloat4x4(&viewProj, view * proj);
+	auto volumeDesc = m_volumeDesc;
+	volumeDesc.pStreamViewProj = &viewProj;
+
+	Resource vbUploads[SparseVolume::VertexStreamCount], ibUpload;
 	Geometry geometry;
 	if (!m_sparseVolume->Init(m_width, m_height, m_renderTargets[0].GetResource()->GetDesc().Format,
-		m_depth.GetResource()->GetDesc().Format, vbUpload, ibUpload, geometry, m_meshFileName.c_str()))
+		m_depth.GetResource()->GetDesc().Format, vbUploads, ibUpload, geometry, m_meshFileName.c_str(),
+		volumeDesc))
 		ThrowIfFailed(E_FAIL);
 
 	// Close the command list and execute it to begin the initial GPU setup.
@@ -185,19 +207,21 @@ void SparseVolumeDXR::LoadAssets()
 		// complete before continuing.
 		WaitForGpu();
 	}
+}
 
-	// Projection
-	const auto aspectRatio = m_width / static_cast<float>(m_height);
-	const auto proj = XMMatrixPerspectiveFovLH(g_fovAngleY, aspectRatio, g_zNear, g_zFar);
-	XMStoreFloat4x4(&m_proj, proj);
-
-	// View initialization
-	m_focusPt = XMFLOAT3(0.0f, 4.0f, 0.0f);
-	m_eyePt = XMFLOAT3(-8.0f, 12.0f, 14.0f);
-	const auto focusPt = XMLoadFloat3(&m_focusPt);
-	const auto eyePt = XMLoadFloat3(&m_eyePt);
-	const auto view = XMMatrixLookAtLH(eyePt, focusPt, XMVectorSet(0.0f, 1.0f, 0.0f, 1.0f));
-	XMStoreFloat4x4(&m_view, view);
+// Time the OBJ parsers on a synthetic mesh, apart from loading the scene mesh.
+void SparseVolumeDXR::BenchmarkImport()
+{
+	const auto benchmark = ObjLoader::BenchmarkImport(m_importBenchTriangles, m_volumeDesc.ImportThreads);
+	const auto sizeMB = benchmark.FileSize / (1024.0 * 1024.0);
+	stringstream report;
+	report << "ObjLoader: synthetic grid of " << benchmark.NumTriangles << " triangles (" << fixed << setprecision(2)
+		<< sizeMB << " MB), mapped " << benchmark.ParseTimes[0] * 1000.0 << " ms (" << sizeMB / benchmark.ParseTimes[0]
+		<< " MB/s), mapped on " << benchmark.NumThreads << " thread(s) " << benchmark.ParseTimes[1] * 1000.0 << " ms ("
+		<< sizeMB / benchmark.ParseTimes[1] << " MB/s), fscanf " << benchmark.ParseTimes[2] * 1000.0 << " ms ("
+		<< sizeMB / benchmark.ParseTimes[2] << " MB/s), indices " << (benchmark.bIndicesMatch ? "match" : "differ")
+		<< ", max position deviation " << scientific << benchmark.MaxDeviation << endl;
+	OutputDebugStringA(report.str().c_str());
 }
 
 // Update frame-based values.
@@ -337,7 +361,73 @@ void SparseVolumeDXR::ParseCommandLineArgs(wchar_t *argv[], int argc)
 			m_meshPosScale.y = i + 3 < argc ? static_cast<float>(_wtof(argv[i + 3])) : m_meshPosScale.y;
 			m_meshPosScale.z = i + 4 < argc ? static_cast<float>(_wtof(argv[i + 4])) : m_meshPosScale.z;
 			m_meshPosScale.w = i + 5 < argc ? static_cast<float>(_wtof(argv[i + 5])) : m_meshPosScale.w;
-			break;
+
+			// Skip the file name and the position and scale, so that they are not parsed as options.
+			i = (min)(i + 5, argc);
+		}
+		else if (_wcsnicmp(argv[i], L"-fscanf", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/fscanf", wcslen(argv[i])) == 0)
+			m_volumeDesc.ImportMode = ObjLoader::IMPORT_FSCANF;
+		else if (_wcsnicmp(argv[i], L"-stream", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/stream", wcslen(argv[i])) == 0)
+			m_volumeDesc.ImportMode = ObjLoader::IMPORT_STREAMED;
+		else if (_wcsnicmp(argv[i], L"-threads", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/threads", wcslen(argv[i])) == 0)
+		{
+			// 1 thread selects the sequential reader, 0 uses all hardware threads.
+			const auto numThreads = i + 1 < argc ? _wtoi(argv[i + 1]) : 0;
+			m_volumeDesc.ImportMode = numThreads == 1 ? ObjLoader::IMPORT_MAPPED : ObjLoader::IMPORT_MAPPED_PARALLEL;
+			m_volumeDesc.ImportThreads = static_cast<uint32_t>((max)(numThreads, 0));
+		}
+		else if (_wcsnicmp(argv[i], L"-nocache", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/nocache", wcslen(argv[i])) == 0)
+			m_volumeDesc.UseMeshCache = false;
+		else if (_wcsnicmp(argv[i], L"-weld", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/weld", wcslen(argv[i])) == 0)
+		{
+			// Without a (non-negative) epsilon, only exact duplicates are welded.
+			const auto epsilon = i + 1 < argc ? static_cast<float>(_wtof(argv[i + 1])) : 0.0f;
+			m_volumeDesc.WeldEpsilon = (max)(epsilon, 0.0f);
+		}
+		else if (_wcsnicmp(argv[i], L"-nooptimize", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/nooptimize", wcslen(argv[i])) == 0)
+			m_volumeDesc.OptimizeMesh = false;
+		else if (_wcsnicmp(argv[i], L"-benchimport", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/benchimport", wcslen(argv[i])) == 0)
+		{
+			// Triangles of the synthetic OBJ file, 4M by default
+			const auto numTriangles = i + 1 < argc ? _wtoi(argv[i + 1]) : 0;
+			m_importBenchTriangles = numTriangles > 0 ? numTriangles : (1 << 22);
+		}
+		else if (_wcsnicmp(argv[i], L"-benchnormals", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/benchnormals", wcslen(argv[i])) == 0)
+		{
+			const auto numIterations = i + 1 < argc ? _wtoi(argv[i + 1]) : 0;
+			m_volumeDesc.NormalBenchIterations = numIterations > 0 ? numIterations : 10;
+		}
+		else if (_wcsnicmp(argv[i], L"-checkquantize", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/checkquantize", wcslen(argv[i])) == 0)
+			m_volumeDesc.CheckQuantization = true;
+		else if (_wcsnicmp(argv[i], L"-nocull", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/nocull", wcslen(argv[i])) == 0)
+			m_volumeDesc.CullMeshlets = false;
+		else if (_wcsnicmp(argv[i], L"-benchcull", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/benchcull", wcslen(argv[i])) == 0)
+		{
+			const auto numIterations = i + 1 < argc ? _wtoi(argv[i + 1]) : 0;
+			m_volumeDesc.CullBenchIterations = numIterations > 0 ? numIterations : 100;
+		}
+		else if (_wcsnicmp(argv[i], L"-lods", wcslen(argv[i])) == 0 ||
+			_wcsnicmp(argv[i], L"/lods", wcslen(argv[i])) == 0)
+		{
+			// Triangle ratios of the levels of detail, e.g. -lods 0.5 0.25 0.1
+			m_volumeDesc.LODRatios.clear();
+			for (; i + 1 < argc; ++i)
+			{
+				const auto ratio = static_cast<float>(_wtof(argv[i + 1]));
+				if (ratio <= 0.0f || ratio >= 1.0f) break;
+				m_volumeDesc.LODRatios.push_back(ratio);
+			}
 		}
 	}
 }
@@ -89,9 +89,12 @@ private:
 	// User external settings
 	std::string m_meshFileName;
 	XMFLOAT4 m_meshPosScale;
+	SparseVolume::InitDesc m_volumeDesc;
+	uint32_t m_importBenchTriangles;	// Of the synthetic OBJ file; 0 to skip the benchmark
 
 	void LoadPipeline();
 	void LoadAssets();
+	void BenchmarkImport();
 	void PopulateCommandList();
 	void WaitForGpu();
 	void MoveToNextFrame();